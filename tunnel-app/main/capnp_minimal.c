@@ -11,6 +11,9 @@
  */
 
 #include "capnp_minimal.h"
+#include "capnp_schema.h"
+#include "cf_metadata.h"
+#include "mem_pool.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -28,68 +31,171 @@ static inline size_t align8(size_t n)
     return (n + 7) & ~(size_t)7;
 }
 
-static inline uint16_t read_le16(const uint8_t *p)
+/* ────────────────────────────────────────────────────────────────
+ *  Builder
+ * ──────────────────────────────────────────────────────────────── */
+
+/* First chained segment; later ones double, as far as needed. */
+#define CAPNP_CHAIN_SEG_MIN 1024
+
+#define SEG_OFF_MASK (((size_t)1 << CAPNP_SEG_SHIFT) - 1)
+
+static inline size_t pos_seg(size_t pos) { return pos >> CAPNP_SEG_SHIFT; }
+static inline size_t pos_off(size_t pos) { return pos & SEG_OFF_MASK; }
+static inline size_t make_pos(size_t seg, size_t off) { return (seg << CAPNP_SEG_SHIFT) | off; }
+
+void capnp_builder_init(capnp_builder_t *b, uint8_t *buf, size_t cap)
 {
-    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+    b->segs[0].data = buf;
+    b->segs[0].cap = cap;
+    b->segs[0].used = 0;
+    b->seg_count = 1;
+    b->chain = false;
+    b->failed = false;
+    b->mem = NULL;
 }
 
-static inline uint32_t read_le32(const uint8_t *p)
+void capnp_builder_chain(capnp_builder_t *b, struct mem_pool *mem)
 {
-    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
-           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    b->chain = true;
+    b->mem = mem;
 }
 
-static inline void write_le16(uint8_t *p, uint16_t v)
+void capnp_builder_free(capnp_builder_t *b)
 {
-    p[0] = (uint8_t)(v);
-    p[1] = (uint8_t)(v >> 8);
+    for (size_t i = 1; i < b->seg_count; i++) {
+        mem_pool_put(b->mem, b->segs[i].data);
+    }
+    b->seg_count = 1;
 }
 
-static inline void write_le32(uint8_t *p, uint32_t v)
+uint8_t *capnp_at(const capnp_builder_t *b, size_t pos)
 {
-    p[0] = (uint8_t)(v);
-    p[1] = (uint8_t)(v >> 8);
-    p[2] = (uint8_t)(v >> 16);
-    p[3] = (uint8_t)(v >> 24);
+    return b->segs[pos_seg(pos)].data + pos_off(pos);
 }
 
-static inline void write_le64(uint8_t *p, uint64_t v)
+/* Take `words` words from segment `s` without zeroing; -1 if full. */
+static inline int seg_take(capnp_builder_t *b, size_t s, size_t words)
 {
-    for (int i = 0; i < 8; i++) {
-        p[i] = (uint8_t)(v >> (i * 8));
+    capnp_segment_t *seg = &b->segs[s];
+    if (words > (seg->cap - seg->used) / 8) {
+        return -1;
     }
+    size_t off = seg->used;
+    seg->used += words * 8;
+    return (int)make_pos(s, off);
 }
 
-/* ────────────────────────────────────────────────────────────────
- *  Builder
- * ──────────────────────────────────────────────────────────────── */
+/* Open a new segment with room for at least `words` words. */
+static int seg_open(capnp_builder_t *b, size_t words)
+{
+    if (!b->chain || b->seg_count == CAPNP_MAX_SEGMENTS ||
+        words > (SEG_OFF_MASK + 1) / 8) {
+        return -1;
+    }
+    size_t cap = b->segs[b->seg_count - 1].cap * 2;
+    if (cap < CAPNP_CHAIN_SEG_MIN) cap = CAPNP_CHAIN_SEG_MIN;
+    if (cap < words * 8) cap = words * 8;
+    if (cap > SEG_OFF_MASK + 1) cap = SEG_OFF_MASK + 1;
+
+    uint8_t *data = mem_pool_get(b->mem, cap);
+    if (!data) {
+        ESP_LOGE(TAG, "out of memory for a %zu-byte segment", cap);
+        return -1;
+    }
+    capnp_segment_t *seg = &b->segs[b->seg_count];
+    seg->data = data;
+    seg->cap = cap & ~(size_t)7;
+    seg->used = 0;
+    return (int)b->seg_count++;
+}
 
-void capnp_builder_init(capnp_builder_t *b, uint8_t *buf, size_t cap)
+/* alloc_raw() once the last segment is full. */
+static int alloc_chained(capnp_builder_t *b, size_t words)
+{
+    int s = seg_open(b, words);
+    if (s < 0) {
+        ESP_LOGE(TAG, "alloc overflow: need %zu words", words);
+        return -1;
+    }
+    return seg_take(b, (size_t)s, words);
+}
+
+/* Allocate without zeroing; the caller overwrites every byte. */
+static inline int alloc_raw(capnp_builder_t *b, size_t words)
 {
-    b->buf = buf;
-    b->cap = cap;
-    b->pos = 0;
-    memset(buf, 0, cap);
+    int pos = seg_take(b, b->seg_count - 1, words);
+    return pos >= 0 ? pos : alloc_chained(b, words);
 }
 
 int capnp_alloc(capnp_builder_t *b, size_t words)
 {
-    size_t aligned = align8(b->pos);
-    size_t need = aligned + words * 8;
-    if (need > b->cap) {
-        ESP_LOGE(TAG, "alloc overflow: need %zu, cap %zu", need, b->cap);
-        return -1;
+    int pos = alloc_raw(b, words);
+    if (pos >= 0) {
+        /* Zero the new words: nothing else is zeroed */
+        memset(capnp_at(b, (size_t)pos), 0, words * 8);
+    }
+    return pos;
+}
+
+/* Far pointer to the landing pad at word `pad_words` of segment `seg`. */
+static void write_far(uint8_t *p, bool double_far, size_t pad_words, size_t seg)
+{
+    capnp_write_le32(p, 2 | (double_far ? 4 : 0) | (uint32_t)(pad_words << 3));
+    capnp_write_le32(p + 4, (uint32_t)seg);
+}
+
+/* Pointer of type `type` (0 struct, 1 list) with upper word `hi` at
+ * `ptr` to `target` in the same segment: a plain word offset. */
+static inline void write_near(capnp_builder_t *b, size_t ptr, size_t target,
+                              uint32_t type, uint32_t hi)
+{
+    uint8_t *p = capnp_at(b, ptr);
+    int32_t off_words = (int32_t)(((int64_t)pos_off(target) -
+                                   (int64_t)pos_off(ptr) - 8) / 8);
+    capnp_write_le32(p, ((uint32_t)off_words << 2) | type);
+    capnp_write_le32(p + 4, hi);
+}
+
+/*
+ * The same across segments, through a landing pad: one word next to the
+ * target if its segment has room, or else two words (far pointer to the
+ * content + tag) wherever there is room.
+ */
+static void write_far_pointer(capnp_builder_t *b, size_t ptr, size_t target,
+                              uint32_t type, uint32_t hi)
+{
+    uint8_t *p = capnp_at(b, ptr);
+    int pad = seg_take(b, pos_seg(target), 1);
+    if (pad >= 0) {
+        write_near(b, (size_t)pad, target, type, hi);
+        write_far(p, false, pos_off((size_t)pad) / 8, pos_seg((size_t)pad));
+        return;
     }
-    /* Zero any padding gap between pos and aligned */
-    if (aligned > b->pos) {
-        memset(b->buf + b->pos, 0, aligned - b->pos);
+
+    pad = alloc_raw(b, 2);
+    if (pad < 0) {
+        b->failed = true;
+        return;
     }
-    int offset = (int)aligned;
-    b->pos = need;
-    return offset;
+    uint8_t *w = capnp_at(b, (size_t)pad);
+    write_far(w, false, pos_off(target) / 8, pos_seg(target));
+    capnp_write_le32(w + 8, type);                /* Tag: offset 0 */
+    capnp_write_le32(w + 12, hi);
+    write_far(p, true, pos_off((size_t)pad) / 8, pos_seg((size_t)pad));
 }
 
-void capnp_write_struct_ptr(uint8_t *buf, size_t ptr_offset,
+static inline void write_pointer(capnp_builder_t *b, size_t ptr, size_t target,
+                                 uint32_t type, uint32_t hi)
+{
+    if (pos_seg(ptr) == pos_seg(target)) {
+        write_near(b, ptr, target, type, hi);
+    } else {
+        write_far_pointer(b, ptr, target, type, hi);
+    }
+}
+
+void capnp_write_struct_ptr(capnp_builder_t *b, size_t ptr_offset,
                             size_t struct_offset,
                             uint16_t data_words, uint16_t ptr_count)
 {
@@ -100,16 +206,11 @@ void capnp_write_struct_ptr(uint8_t *buf, size_t ptr_offset,
      *   bits [32..47] = data section size in words
      *   bits [48..63] = pointer section size in words
      */
-    int32_t off_words = (int32_t)((struct_offset - ptr_offset - 8) / 8);
-
-    uint32_t lo = ((uint32_t)(off_words << 2)) | 0x00; /* type = 0 */
-    uint32_t hi = (uint32_t)data_words | ((uint32_t)ptr_count << 16);
-
-    write_le32(buf + ptr_offset, lo);
-    write_le32(buf + ptr_offset + 4, hi);
+    write_pointer(b, ptr_offset, struct_offset, 0,
+                  (uint32_t)data_words | ((uint32_t)ptr_count << 16));
 }
 
-void capnp_write_list_ptr(uint8_t *buf, size_t ptr_offset,
+void capnp_write_list_ptr(capnp_builder_t *b, size_t ptr_offset,
                           size_t list_offset,
                           uint8_t elem_size, uint32_t count)
 {
@@ -120,34 +221,73 @@ void capnp_write_list_ptr(uint8_t *buf, size_t ptr_offset,
      *   bits [32..34] = element size tag
      *   bits [35..63] = element count (or total words for composite)
      */
-    int32_t off_words = (int32_t)((list_offset - ptr_offset - 8) / 8);
+    write_pointer(b, ptr_offset, list_offset, 1,
+                  (uint32_t)elem_size | (count << 3));
+}
 
-    uint32_t lo = ((uint32_t)(off_words << 2)) | 0x01; /* type = 1 */
-    uint32_t hi = (uint32_t)elem_size | (count << 3);
+int capnp_new_struct(capnp_builder_t *b, size_t ptr_offset,
+                     uint16_t data_words, uint16_t ptr_count)
+{
+    int pos = capnp_alloc(b, (size_t)data_words + ptr_count);
+    if (pos >= 0) {
+        capnp_write_struct_ptr(b, ptr_offset, (size_t)pos, data_words, ptr_count);
+    }
+    return pos;
+}
 
-    write_le32(buf + ptr_offset, lo);
-    write_le32(buf + ptr_offset + 4, hi);
+int capnp_new_struct_list(capnp_builder_t *b, size_t ptr_offset,
+                          uint32_t count,
+                          uint16_t data_words, uint16_t ptr_count)
+{
+    size_t words = (size_t)count * ((size_t)data_words + ptr_count);
+    int tag = capnp_alloc(b, 1 + words);
+    if (tag < 0) return -1;
+
+    /* Composite list: the tag word is a struct pointer whose offset is
+     * the element count; the list pointer counts words, tag excluded. */
+    uint8_t *t = capnp_at(b, (size_t)tag);
+    capnp_write_le32(t, count << 2);
+    capnp_write_le16(t + 4, data_words);
+    capnp_write_le16(t + 6, ptr_count);
+    capnp_write_list_ptr(b, ptr_offset, (size_t)tag, 7, (uint32_t)words);
+    return tag + 8;
+}
+
+void capnp_write_cap_ptr(capnp_builder_t *b, size_t ptr_offset, uint32_t index)
+{
+    /* "Other" pointer (type 3, B = 0): capability table index in the
+     * upper word */
+    uint8_t *p = capnp_at(b, ptr_offset);
+    capnp_write_le32(p, 3);
+    capnp_write_le32(p + 4, index);
 }
 
 int capnp_write_text(capnp_builder_t *b, size_t ptr_offset, const char *text)
 {
-    if (!text || !text[0]) {
-        /* Null pointer (all zeros) — already zeroed by init */
-        memset(b->buf + ptr_offset, 0, 8);
+    return capnp_write_text_n(b, ptr_offset, text, text ? strlen(text) : 0);
+}
+
+int capnp_write_text_n(capnp_builder_t *b, size_t ptr_offset,
+                       const char *text, size_t slen)
+{
+    if (slen == 0) {
+        /* Null pointer (all zeros) */
+        memset(capnp_at(b, ptr_offset), 0, 8);
         return 0;
     }
-    size_t slen = strlen(text);
     size_t byte_count = slen + 1; /* include NUL */
     size_t words = (byte_count + 7) / 8;
 
-    int data_off = capnp_alloc(b, words);
+    int data_off = alloc_raw(b, words);
     if (data_off < 0) return -1;
 
-    memcpy(b->buf + data_off, text, slen);
-    b->buf[data_off + slen] = '\0'; /* NUL terminator */
+    /* Zero the last word for the NUL and padding, then copy over it */
+    uint8_t *d = capnp_at(b, (size_t)data_off);
+    memset(d + (words - 1) * 8, 0, 8);
+    memcpy(d, text, slen);
 
     /* Text = byte list (elem_size=2) with count including NUL */
-    capnp_write_list_ptr(b->buf, ptr_offset, (size_t)data_off, 2, (uint32_t)byte_count);
+    capnp_write_list_ptr(b, ptr_offset, (size_t)data_off, 2, (uint32_t)byte_count);
     return 0;
 }
 
@@ -155,7 +295,7 @@ int capnp_write_data(capnp_builder_t *b, size_t ptr_offset,
                      const uint8_t *data, size_t len)
 {
     if (!data || len == 0) {
-        memset(b->buf + ptr_offset, 0, 8);
+        memset(capnp_at(b, ptr_offset), 0, 8);
         return 0;
     }
     size_t words = (len + 7) / 8;
@@ -163,37 +303,57 @@ int capnp_write_data(capnp_builder_t *b, size_t ptr_offset,
     int data_off = capnp_alloc(b, words);
     if (data_off < 0) return -1;
 
-    memcpy(b->buf + data_off, data, len);
+    memcpy(capnp_at(b, (size_t)data_off), data, len);
 
     /* Data = byte list (elem_size=2) without NUL */
-    capnp_write_list_ptr(b->buf, ptr_offset, (size_t)data_off, 2, (uint32_t)len);
+    capnp_write_list_ptr(b, ptr_offset, (size_t)data_off, 2, (uint32_t)len);
     return 0;
 }
 
+/* Bytes taken by the segment table for `n` segments. */
+static size_t seg_table_size(size_t n)
+{
+    return align8(4 + 4 * n);
+}
+
+size_t capnp_message_size(const capnp_builder_t *b)
+{
+    size_t total = seg_table_size(b->seg_count);
+    for (size_t i = 0; i < b->seg_count; i++) {
+        total += b->segs[i].used;
+    }
+    return total;
+}
+
 size_t capnp_finalize(const capnp_builder_t *b, uint8_t *out, size_t out_cap)
 {
     /*
      * Wire format:
-     *   uint32  segment_count - 1   (= 0 for single segment)
-     *   uint32  segment_0_size      (in words)
-     *   [padding to 8-byte boundary — already satisfied for 1 segment: 4+4=8]
-     *   byte[]  segment_0_data
+     *   uint32  segment_count - 1
+     *   uint32  segment_i_size      (in words, for each segment)
+     *   [padding to 8-byte boundary]
+     *   byte[]  segment_i_data      (back to back)
      */
-    size_t seg_words = align8(b->pos) / 8;
-    size_t seg_bytes = seg_words * 8;
-    size_t header_bytes = 8; /* 4 (count-1) + 4 (size) = 8 */
-    size_t total = header_bytes + seg_bytes;
+    if (b->failed) {
+        ESP_LOGE(TAG, "finalize: message has an unwritten pointer");
+        return 0;
+    }
+    size_t header_bytes = seg_table_size(b->seg_count);
+    size_t total = capnp_message_size(b);
 
     if (total > out_cap) {
         ESP_LOGE(TAG, "finalize overflow: need %zu, cap %zu", total, out_cap);
         return 0;
     }
 
-    memset(out, 0, total);
-    write_le32(out, 0);                    /* segment_count - 1 */
-    write_le32(out + 4, (uint32_t)seg_words); /* segment 0 size in words */
-    memcpy(out + header_bytes, b->buf, b->pos);
-
+    capnp_write_le32(out, (uint32_t)(b->seg_count - 1));  /* segment_count - 1 */
+    memset(out + 4, 0, header_bytes - 4);
+    uint8_t *p = out + header_bytes;
+    for (size_t i = 0; i < b->seg_count; i++) {
+        capnp_write_le32(out + 4 + 4 * i, (uint32_t)(b->segs[i].used / 8));
+        memcpy(p, b->segs[i].data, b->segs[i].used);
+        p += b->segs[i].used;
+    }
     return total;
 }
 
@@ -201,54 +361,138 @@ size_t capnp_finalize(const capnp_builder_t *b, uint8_t *out, size_t out_cap)
  *  Reader
  * ──────────────────────────────────────────────────────────────── */
 
-int capnp_read_message(const uint8_t *data, size_t len, capnp_reader_t *r)
+/* Check that `bytes` bytes at `t` lie inside the message. */
+static inline int in_message(const capnp_reader_t *r, int64_t t, uint64_t bytes,
+                      size_t *out)
 {
-    if (len < 8) {
-        ESP_LOGE(TAG, "message too short: %zu bytes", len);
+    if (t < 0 || (uint64_t)t > r->seg_len || bytes > r->seg_len - (uint64_t)t) {
         return -1;
     }
+    *out = (size_t)t;
+    return 0;
+}
 
-    uint32_t num_segs_minus1 = read_le32(data);
-    if (num_segs_minus1 != 0) {
-        /* We only support single-segment messages */
-        ESP_LOGE(TAG, "multi-segment messages not supported (got %u+1 segments)",
-                 num_segs_minus1);
+/* Offset of word `words` of segment `seg`, which must leave room for
+ * `need` bytes inside that segment. */
+static int64_t seg_word(const capnp_reader_t *r, uint32_t seg, uint32_t words,
+                        size_t need)
+{
+    if (seg >= r->seg_count) {
+        return -1;
+    }
+    uint64_t t = r->seg_start[seg] + (uint64_t)words * 8;
+    if (t + need > r->seg_start[seg + 1]) {
         return -1;
     }
+    return (int64_t)t;
+}
 
-    uint32_t seg0_words = read_le32(data + 4);
-    size_t seg0_bytes = (size_t)seg0_words * 8;
+/* Resolve a far pointer (lo, hi) found at `ptr_off` through its landing
+ * pad; see deref(). */
+static int deref_far(const capnp_reader_t *r, size_t ptr_off,
+                     uint32_t *lo, uint32_t *hi, int64_t *target)
+{
+    bool double_far = (*lo & 4) != 0;
+    int64_t pad = seg_word(r, *hi, *lo >> 3, double_far ? 16 : 8);
+    if (pad < 0) {
+        ESP_LOGE(TAG, "far pointer at %zu out of bounds", ptr_off);
+        return -1;
+    }
+    const uint8_t *p = r->seg + pad;
+    *lo = capnp_read_le32(p);
+    *hi = capnp_read_le32(p + 4);
 
-    /* Header is 8 bytes (4 for count-1, 4 for seg0 size).
-     * For an odd number of segment-size entries we'd need 4 bytes padding,
-     * but for single-segment it's already aligned. */
-    size_t header_size = 8;
+    if (!double_far) {
+        /* The pad is an ordinary pointer, relative to itself */
+        if ((*lo & 3) == 2) {
+            return -1;
+        }
+        *target = pad + 8 + (int64_t)((int32_t)*lo >> 2) * 8;
+        return 0;
+    }
 
-    if (header_size + seg0_bytes > len) {
-        ESP_LOGE(TAG, "segment overflows message: header %zu + seg %zu > %zu",
-                 header_size, seg0_bytes, len);
+    /* Double-far: a far pointer to the content, then the tag */
+    if ((*lo & 7) != 2) {
         return -1;
     }
+    *target = seg_word(r, *hi, *lo >> 3, 0);
+    *lo = capnp_read_le32(p + 8);
+    *hi = capnp_read_le32(p + 12);
+    if (*target < 0 || (*lo & 3) == 2) {
+        return -1;
+    }
+    return 0;
+}
 
-    r->seg = data + header_size;
-    r->seg_len = seg0_bytes;
+/*
+ * Follow the pointer at `ptr_off` to its object, through a landing pad
+ * if it is a far pointer.  Sets *lo and *hi to the words describing the
+ * object (struct or list) and *target to where its content starts, which
+ * the caller checks against the object's size.
+ * Returns 1 for a null pointer, 0 on success, -1 if malformed.
+ */
+static inline int deref(const capnp_reader_t *r, size_t ptr_off,
+                        uint32_t *lo, uint32_t *hi, int64_t *target)
+{
+    if (ptr_off > r->seg_len || r->seg_len - ptr_off < 8) {
+        return -1;
+    }
+    *lo = capnp_read_le32(r->seg + ptr_off);
+    *hi = capnp_read_le32(r->seg + ptr_off + 4);
+    if ((*lo & 3) == 2) {
+        return deref_far(r, ptr_off, lo, hi, target);
+    }
+    if (*lo == 0 && *hi == 0) {
+        return 1;
+    }
+    *target = (int64_t)ptr_off + 8 + (int64_t)((int32_t)*lo >> 2) * 8;
     return 0;
 }
 
-int capnp_read_struct_ptr(const capnp_reader_t *r, size_t ptr_offset,
-                          size_t *struct_offset,
-                          uint16_t *data_words, uint16_t *ptr_count)
+int capnp_read_message(const uint8_t *data, size_t len, capnp_reader_t *r)
 {
-    if (ptr_offset + 8 > r->seg_len) {
-        ESP_LOGE(TAG, "struct ptr out of bounds at %zu", ptr_offset);
+    /* Nearly every message is a single segment */
+    if (len >= 8 && capnp_read_le32(data) == 0 &&
+        (uint64_t)capnp_read_le32(data + 4) * 8 <= len - 8) {
+        r->seg = data + 8;
+        r->seg_len = (size_t)capnp_read_le32(data + 4) * 8;
+        r->seg_count = 1;
+        r->seg_start[0] = 0;
+        r->seg_start[1] = r->seg_len;
+        return 0;
+    }
+
+    size_t total = capnp_wire_message_size(data, len);
+    if (total == 0 || total == CAPNP_WIRE_INVALID) {
+        ESP_LOGE(TAG, "bad or incomplete message: %zu bytes", len);
         return -1;
     }
 
-    uint32_t lo = read_le32(r->seg + ptr_offset);
-    uint32_t hi = read_le32(r->seg + ptr_offset + 4);
+    r->seg_count = capnp_read_le32(data) + 1;
+    size_t header_size = seg_table_size(r->seg_count);
+    size_t at = 0;
+    for (uint32_t i = 0; i < r->seg_count; i++) {
+        r->seg_start[i] = at;
+        at += (size_t)capnp_read_le32(data + 4 + 4 * i) * 8;
+    }
+    r->seg_start[r->seg_count] = at;
 
-    /* Check for null pointer */
-    if (lo == 0 && hi == 0) {
+    r->seg = data + header_size;
+    r->seg_len = at;
+    return 0;
+}
+
+int capnp_read_struct_ptr(const capnp_reader_t *r, size_t ptr_offset,
+                          size_t *struct_offset,
+                          uint16_t *data_words, uint16_t *ptr_count)
+{
+    uint32_t lo, hi;
+    int64_t target;
+    int ret = deref(r, ptr_offset, &lo, &hi, &target);
+    if (ret != 0) {
+        if (ret < 0) {
+            ESP_LOGE(TAG, "struct ptr at %zu is invalid", ptr_offset);
+        }
         return -1;
     }
 
@@ -259,353 +503,501 @@ int capnp_read_struct_ptr(const capnp_reader_t *r, size_t ptr_offset,
         return -1;
     }
 
-    /* Offset in words (signed 30-bit field at bits [2..31]) */
-    int32_t off_words = (int32_t)lo >> 2;
-
     *data_words = (uint16_t)(hi & 0xFFFF);
     *ptr_count  = (uint16_t)(hi >> 16);
 
-    /* Absolute byte offset = ptr_offset + 8 (past this pointer) + off_words * 8 */
-    *struct_offset = ptr_offset + 8 + (size_t)((int64_t)off_words * 8);
-
+    if (in_message(r, target, ((uint64_t)*data_words + *ptr_count) * 8,
+                   struct_offset) != 0) {
+        ESP_LOGE(TAG, "struct at %zu out of bounds", ptr_offset);
+        return -1;
+    }
     return 0;
 }
 
-const char *capnp_read_text(const capnp_reader_t *r, size_t ptr_offset,
-                            size_t *out_len)
+int capnp_read_struct_list(const capnp_reader_t *r, size_t ptr_offset,
+                           size_t *first, uint32_t *count, size_t *stride,
+                           uint16_t *data_words, uint16_t *ptr_count)
 {
-    if (ptr_offset + 8 > r->seg_len) return NULL;
-
-    uint32_t lo = read_le32(r->seg + ptr_offset);
-    uint32_t hi = read_le32(r->seg + ptr_offset + 4);
-
-    if (lo == 0 && hi == 0) {
-        if (out_len) *out_len = 0;
-        return NULL;
+    *count = 0;
+    uint32_t lo, hi;
+    int64_t target;
+    int ret = deref(r, ptr_offset, &lo, &hi, &target);
+    if (ret != 0) {
+        return ret > 0 ? 0 : -1;
     }
-
-    /* Must be list pointer (type = 1) */
-    if ((lo & 3) != 1) {
-        ESP_LOGE(TAG, "expected list pointer for text at %zu, got type %u",
-                 ptr_offset, lo & 3);
-        return NULL;
+    if ((lo & 3) != 1 || (hi & 7) != 7) {
+        ESP_LOGE(TAG, "expected composite list pointer at %zu", ptr_offset);
+        return -1;
     }
 
-    int32_t off_words = (int32_t)lo >> 2;
-    uint8_t elem_sz = hi & 7;
-    uint32_t count = hi >> 3;
-
-    if (elem_sz != 2) { /* byte list */
-        ESP_LOGE(TAG, "expected byte list (elem_size=2) for text, got %u", elem_sz);
-        return NULL;
+    uint32_t list_words = hi >> 3;
+    size_t list_off;
+    if (in_message(r, target, ((uint64_t)list_words + 1) * 8, &list_off) != 0) {
+        ESP_LOGE(TAG, "list at %zu out of bounds", ptr_offset);
+        return -1;
     }
-
-    size_t data_offset = ptr_offset + 8 + (size_t)((int64_t)off_words * 8);
-    if (data_offset + count > r->seg_len) {
-        ESP_LOGE(TAG, "text data out of bounds");
-        return NULL;
+    uint32_t tag_lo = capnp_read_le32(r->seg + list_off);
+    uint32_t tag_hi = capnp_read_le32(r->seg + list_off + 4);
+    uint32_t n = tag_lo >> 2;
+    *data_words = (uint16_t)(tag_hi & 0xFFFF);
+    *ptr_count = (uint16_t)(tag_hi >> 16);
+    uint64_t elem_words = (uint64_t)*data_words + *ptr_count;
+    if ((uint64_t)n * elem_words > list_words) {
+        ESP_LOGE(TAG, "list of %u elements at %zu does not fit", n, ptr_offset);
+        return -1;
     }
 
-    /* Text includes a NUL terminator in the count */
-    if (out_len) {
-        *out_len = (count > 0) ? count - 1 : 0;
-    }
-    return (const char *)(r->seg + data_offset);
+    *count = n;
+    *first = list_off + 8;
+    *stride = (size_t)elem_words * 8;
+    return 0;
 }
 
-const uint8_t *capnp_read_data(const capnp_reader_t *r, size_t ptr_offset,
-                               size_t *out_len)
+int capnp_read_cap_ptr(const capnp_reader_t *r, size_t ptr_offset,
+                       uint32_t *index)
 {
-    if (ptr_offset + 8 > r->seg_len) return NULL;
-
-    uint32_t lo = read_le32(r->seg + ptr_offset);
-    uint32_t hi = read_le32(r->seg + ptr_offset + 4);
-
+    if (ptr_offset > r->seg_len || r->seg_len - ptr_offset < 8) {
+        return -1;
+    }
+    uint32_t lo = capnp_read_le32(r->seg + ptr_offset);
+    uint32_t hi = capnp_read_le32(r->seg + ptr_offset + 4);
     if (lo == 0 && hi == 0) {
-        if (out_len) *out_len = 0;
-        return NULL;
+        return 1;
     }
+    if (lo != 3) {
+        return -1;
+    }
+    *index = hi;
+    return 0;
+}
 
-    if ((lo & 3) != 1) {
-        ESP_LOGE(TAG, "expected list pointer for data at %zu", ptr_offset);
+/* Byte list (Text or Data) at `ptr_offset`: NULL if null or invalid. */
+static const uint8_t *read_bytes(const capnp_reader_t *r, size_t ptr_offset,
+                                 uint32_t *count)
+{
+    uint32_t lo, hi;
+    int64_t target;
+    *count = 0;
+    int ret = deref(r, ptr_offset, &lo, &hi, &target);
+    if (ret != 0) {
         return NULL;
     }
 
-    int32_t off_words = (int32_t)lo >> 2;
-    uint8_t elem_sz = hi & 7;
-    uint32_t count = hi >> 3;
-
-    if (elem_sz != 2) {
-        ESP_LOGE(TAG, "expected byte list (elem_size=2) for data, got %u", elem_sz);
+    /* Must be list pointer (type = 1) of bytes (elem_size = 2) */
+    if ((lo & 3) != 1 || (hi & 7) != 2) {
+        ESP_LOGE(TAG, "expected byte list at %zu", ptr_offset);
         return NULL;
     }
 
-    size_t data_offset = ptr_offset + 8 + (size_t)((int64_t)off_words * 8);
-    if (data_offset + count > r->seg_len) {
-        ESP_LOGE(TAG, "data out of bounds");
+    size_t data_offset;
+    if (in_message(r, target, hi >> 3, &data_offset) != 0) {
+        ESP_LOGE(TAG, "byte list at %zu out of bounds", ptr_offset);
         return NULL;
     }
-
-    if (out_len) *out_len = count;
+    *count = hi >> 3;
     return r->seg + data_offset;
 }
 
-uint16_t capnp_read_uint16(const capnp_reader_t *r,
-                           size_t struct_data_offset, size_t byte_offset)
-{
-    size_t off = struct_data_offset + byte_offset;
-    if (off + 2 > r->seg_len) return 0;
-    return read_le16(r->seg + off);
-}
-
-uint8_t capnp_read_uint8(const capnp_reader_t *r,
-                         size_t struct_data_offset, size_t byte_offset)
+const char *capnp_read_text(const capnp_reader_t *r, size_t ptr_offset,
+                            size_t *out_len)
 {
-    size_t off = struct_data_offset + byte_offset;
-    if (off + 1 > r->seg_len) return 0;
-    return r->seg[off];
+    uint32_t count;
+    const uint8_t *p = read_bytes(r, ptr_offset, &count);
+    /* Text includes a NUL terminator in the count */
+    if (out_len) {
+        *out_len = (count > 0) ? count - 1 : 0;
+    }
+    return (const char *)p;
 }
 
-bool capnp_read_bool(const capnp_reader_t *r,
-                     size_t struct_data_offset, size_t byte_offset, int bit)
+const uint8_t *capnp_read_data(const capnp_reader_t *r, size_t ptr_offset,
+                               size_t *out_len)
 {
-    size_t off = struct_data_offset + byte_offset;
-    if (off + 1 > r->seg_len) return false;
-    return (r->seg[off] >> bit) & 1;
+    uint32_t count;
+    const uint8_t *p = read_bytes(r, ptr_offset, &count);
+    if (out_len) *out_len = count;
+    return p;
 }
 
 /* ────────────────────────────────────────────────────────────────
  *  Wire message size helper
  * ──────────────────────────────────────────────────────────────── */
 
+size_t capnp_wire_declared_size(const uint8_t *data, size_t len)
+{
+    if (len < 4) return 0;
+    uint64_t segs = (uint64_t)capnp_read_le32(data) + 1;
+    if (segs > CAPNP_MAX_SEGMENTS) {
+        return CAPNP_WIRE_INVALID;
+    }
+    size_t header = seg_table_size((size_t)segs);
+    if (len < header) return 0;
+
+    uint64_t total = header;
+    for (uint32_t i = 0; i < segs; i++) {
+        total += (uint64_t)capnp_read_le32(data + 4 + 4 * i) * 8;
+    }
+    if (total >= CAPNP_WIRE_INVALID) {
+        return CAPNP_WIRE_INVALID;
+    }
+    return (size_t)total;
+}
+
 size_t capnp_wire_message_size(const uint8_t *data, size_t len)
 {
-    if (len < 8) return 0;
-    uint32_t num_segs_minus1 = read_le32(data);
-    if (num_segs_minus1 != 0) return 0; /* single-segment only */
-    uint32_t seg0_words = read_le32(data + 4);
-    size_t total = 8 + (size_t)seg0_words * 8;
-    if (total > len) return 0;
-    return total;
+    size_t total = capnp_wire_declared_size(data, len);
+    if (total == CAPNP_WIRE_INVALID || total <= len) {
+        return total;
+    }
+    return 0;
 }
 
 /* ────────────────────────────────────────────────────────────────
  *  High-level: Decode ConnectRequest
  *
- *  Cap'n Proto schema (from tunnelrpc.capnp):
+ *  schema/quic_metadata_protocol.capnp:
  *    struct ConnectRequest {
- *        dest     @0 :Text;             # pointer[0]
- *        type     @1 :ConnectionType;   # data[0..2] uint16 enum
- *        metadata @2 :List(Metadata);   # pointer[1]
+ *        dest     @0 :Text;
+ *        type     @1 :ConnectionType;
+ *        metadata @2 :List(Metadata);
  *    }
  *    struct Metadata {
- *        key @0 :Text;   # pointer[0]
- *        val @1 :Text;   # pointer[1]
+ *        key @0 :Text;
+ *        val @1 :Text;
  *    }
- *
- *  ConnectRequest layout: data_words=1, ptr_count=2
  * ──────────────────────────────────────────────────────────────── */
 
-int capnp_decode_connect_request(const uint8_t *data, size_t len,
-                                 cf_connect_request_t *req)
+/* Check that the pointer words (lo, hi) at `ptr_off`, resolved to
+ * `target`, are a byte list inside the message, and take it as Text. */
+static inline int text_span(const capnp_reader_t *r, size_t ptr_off,
+                     uint32_t lo, uint32_t hi, int64_t target,
+                     capnp_text_t *out)
 {
-    capnp_reader_t reader;
-    memset(req, 0, sizeof(*req));
+    if ((lo & 3) != 1 || (hi & 7) != 2) {
+        ESP_LOGE(TAG, "expected text at %zu", ptr_off);
+        return -1;
+    }
+
+    uint32_t count = hi >> 3;
+    size_t off;
+    if (in_message(r, target, count, &off) != 0) {
+        ESP_LOGE(TAG, "text at %zu out of bounds", ptr_off);
+        return -1;
+    }
+    /* The count includes the NUL terminator */
+    out->ptr = (const char *)(r->seg + off);
+    out->len = count > 0 ? count - 1 : 0;
+    return 0;
+}
+
+/* view_text() for a far pointer, kept out of line so that the common
+ * near case needs no stack frame. */
+__attribute__((noinline))
+static int view_text_far(const capnp_reader_t *r, size_t ptr_off,
+                         capnp_text_t *out)
+{
+    uint32_t lo, hi;
+    int64_t target;
+    if (deref(r, ptr_off, &lo, &hi, &target) != 0) {
+        return -1;
+    }
+    return text_span(r, ptr_off, lo, hi, target, out);
+}
+
+/* Strict Text reader for the view: a null pointer is an empty text, any
+ * other pointer must be a byte list that lies inside the message. */
+static int view_text(const capnp_reader_t *r, size_t ptr_off, capnp_text_t *out)
+{
+    out->ptr = "";
+    out->len = 0;
+    if (ptr_off > r->seg_len || r->seg_len - ptr_off < 8) {
+        return -1;
+    }
+
+    uint32_t lo = capnp_read_le32(r->seg + ptr_off);
+    uint32_t hi = capnp_read_le32(r->seg + ptr_off + 4);
+    if ((lo & 3) == 2) {
+        return view_text_far(r, ptr_off, out);
+    }
+    if (lo == 0 && hi == 0) {
+        return 0;
+    }
+    return text_span(r, ptr_off, lo, hi,
+                     (int64_t)ptr_off + 8 + (int64_t)((int32_t)lo >> 2) * 8, out);
+}
 
-    if (capnp_read_message(data, len, &reader) != 0) {
+int capnp_view_connect_request(const uint8_t *data, size_t len,
+                               capnp_connect_request_view_t *v)
+{
+    /* Not a memset: the reader's segment table is filled on demand */
+    v->dest.ptr = "";
+    v->dest.len = 0;
+    v->type = CF_CONN_TYPE_HTTP;
+    v->metadata_count = 0;
+    v->metadata_base = 0;
+    v->metadata_stride = 0;
+    v->text_bytes = 0;
+
+    if (capnp_read_message(data, len, &v->reader) != 0) {
         ESP_LOGE(TAG, "failed to parse ConnectRequest message");
         return -1;
     }
+    const capnp_reader_t *r = &v->reader;
 
     /* Root struct pointer is at segment offset 0 */
     size_t root_off;
     uint16_t root_dw, root_pc;
-    if (capnp_read_struct_ptr(&reader, 0, &root_off, &root_dw, &root_pc) != 0) {
+    if (capnp_read_struct_ptr(r, 0, &root_off, &root_dw, &root_pc) != 0) {
         ESP_LOGE(TAG, "failed to read ConnectRequest root pointer");
         return -1;
     }
 
     ESP_LOGD(TAG, "ConnectRequest root: off=%zu dw=%u pc=%u", root_off, root_dw, root_pc);
 
-    /* Read type (uint16 enum at data offset 0) */
-    if (root_dw >= 1) {
-        uint16_t conn_type = capnp_read_uint16(&reader, root_off, 0);
-        req->type = (cf_connection_type_t)conn_type;
+    if (CAPNP_HAS_DATA(root_dw, STREAM_CONNECT_REQUEST_TYPE, 2)) {
+        v->type = (cf_connection_type_t)capnp_read_uint16(
+            r, root_off, STREAM_CONNECT_REQUEST_TYPE);
     }
 
-    /* Pointer section starts after data section */
-    size_t ptr_section = root_off + (size_t)root_dw * 8;
+    if (root_pc > STREAM_CONNECT_REQUEST_DEST_PTR &&
+        view_text(r, root_off + CAPNP_PTR(root_dw, STREAM_CONNECT_REQUEST_DEST_PTR),
+                  &v->dest) != 0) {
+        return -1;
+    }
+    v->text_bytes = v->dest.len + 1;
 
-    /* pointer[0] = dest (Text) */
-    if (root_pc >= 1) {
-        size_t dest_len = 0;
-        const char *dest = capnp_read_text(&reader, ptr_section + 0, &dest_len);
-        if (dest && dest_len > 0) {
-            size_t copy_len = dest_len < sizeof(req->dest) - 1 ? dest_len : sizeof(req->dest) - 1;
-            memcpy(req->dest, dest, copy_len);
-            req->dest[copy_len] = '\0';
-        }
-        ESP_LOGD(TAG, "ConnectRequest dest: %s", req->dest);
+    if (root_pc <= STREAM_CONNECT_REQUEST_METADATA_PTR) {
+        return 0;
+    }
+    uint32_t lo, hi;
+    int64_t target;
+    int ret = deref(r, root_off + CAPNP_PTR(root_dw, STREAM_CONNECT_REQUEST_METADATA_PTR),
+                    &lo, &hi, &target);
+    if (ret != 0) {
+        return ret > 0 ? 0 : -1;            /* No metadata, or invalid */
+    }
+    if ((lo & 3) != 1 || (hi & 7) != 7) {
+        ESP_LOGE(TAG, "metadata: expected composite list pointer");
+        return -1;
     }
 
-    /* pointer[1] = metadata (List(Metadata)) */
-    if (root_pc >= 2) {
-        size_t meta_ptr_off = ptr_section + 8;
+    /* Composite list: a tag word (struct pointer format, offset =
+     * element count) followed by `list_words` words of elements. */
+    uint32_t list_words = hi >> 3;
+    size_t list_off;
+    if (in_message(r, target, ((uint64_t)list_words + 1) * 8, &list_off) != 0) {
+        ESP_LOGE(TAG, "metadata list out of bounds");
+        return -1;
+    }
 
-        if (meta_ptr_off + 8 > reader.seg_len) {
-            ESP_LOGW(TAG, "metadata pointer out of bounds");
-            return 0;
-        }
+    uint32_t tag_lo = capnp_read_le32(r->seg + list_off);
+    uint32_t tag_hi = capnp_read_le32(r->seg + list_off + 4);
+    uint32_t elem_count = tag_lo >> 2;
+    uint16_t elem_dw = (uint16_t)(tag_hi & 0xFFFF);
+    uint16_t elem_pc = (uint16_t)(tag_hi >> 16);
+    uint64_t elem_words = (uint64_t)elem_dw + elem_pc;
 
-        uint32_t lo = read_le32(reader.seg + meta_ptr_off);
-        uint32_t hi = read_le32(reader.seg + meta_ptr_off + 4);
+    ESP_LOGD(TAG, "metadata: %u elements, dw=%u pc=%u",
+             elem_count, elem_dw, elem_pc);
 
-        if (lo == 0 && hi == 0) {
-            /* No metadata */
-            return 0;
-        }
+    /* Every element must be inside the list and have both Text pointers */
+    if (elem_pc < STREAM_METADATA_PTR_COUNT ||
+        elem_count * elem_words > list_words) {
+        ESP_LOGE(TAG, "metadata list of %u elements does not fit", elem_count);
+        return -1;
+    }
 
-        if ((lo & 3) != 1) {
-            ESP_LOGE(TAG, "metadata: expected list pointer, got type %u", lo & 3);
+    v->metadata_count = elem_count;
+    v->metadata_stride = (size_t)elem_words * 8;
+    v->metadata_base = list_off + 8 + (size_t)elem_dw * 8;
+
+    /* Validate every key and value up front so that iteration cannot
+     * fail, and total them so a copy can size its arena exactly. */
+    for (uint32_t i = 0; i < elem_count; i++) {
+        capnp_text_t key, val;
+        size_t e_ptrs = v->metadata_base + (size_t)i * v->metadata_stride;
+        if (view_text(r, e_ptrs + 8 * STREAM_METADATA_KEY_PTR, &key) != 0 ||
+            view_text(r, e_ptrs + 8 * STREAM_METADATA_VAL_PTR, &val) != 0) {
+            ESP_LOGE(TAG, "metadata[%u]: bad key or value", i);
             return -1;
         }
+        v->text_bytes += key.len + val.len + 2;
+    }
+    return 0;
+}
 
-        int32_t off_words = (int32_t)lo >> 2;
-        uint8_t elem_sz = hi & 7;
-        uint32_t total_words_or_count = hi >> 3;
+/* Text at a pointer that capnp_view_connect_request() already checked. */
+__attribute__((noinline))
+static void checked_text_far(const capnp_reader_t *r, size_t ptr_off,
+                             capnp_text_t *out)
+{
+    uint32_t lo = 0, hi = 0;
+    int64_t target = 0;
+    deref(r, ptr_off, &lo, &hi, &target);
+    out->ptr = (const char *)r->seg + target;
+    out->len = (hi >> 3) > 0 ? (hi >> 3) - 1 : 0;
+}
+
+static void checked_text(const capnp_reader_t *r, const uint8_t *seg,
+                         size_t ptr_off, capnp_text_t *out)
+{
+    uint32_t lo = capnp_read_le32(seg + ptr_off);
+    uint32_t count = capnp_read_le32(seg + ptr_off + 4) >> 3;
+    if ((lo & 3) == 2) {
+        checked_text_far(r, ptr_off, out);  /* Via the landing pad */
+        return;
+    }
+    if (lo == 0) {
+        out->ptr = "";                      /* Null pointer */
+        out->len = 0;
+        return;
+    }
+    out->ptr = (const char *)seg + ptr_off + 8 + (int64_t)((int32_t)lo >> 2) * 8;
+    out->len = count > 0 ? count - 1 : 0;
+}
 
-        size_t list_data_off = meta_ptr_off + 8 + (size_t)((int64_t)off_words * 8);
+void capnp_connect_request_metadata(const capnp_connect_request_view_t *v,
+                                    uint32_t i,
+                                    capnp_text_t *key, capnp_text_t *val)
+{
+    size_t e_ptrs = v->metadata_base + (size_t)i * v->metadata_stride;
+    checked_text(&v->reader, v->reader.seg,
+                 e_ptrs + 8 * STREAM_METADATA_KEY_PTR, key);
+    checked_text(&v->reader, v->reader.seg,
+                 e_ptrs + 8 * STREAM_METADATA_VAL_PTR, val);
+}
 
-        if (elem_sz == 7) {
-            /* Composite list: first word is tag word */
-            if (list_data_off + 8 > reader.seg_len) {
-                ESP_LOGE(TAG, "metadata composite tag out of bounds");
-                return -1;
-            }
-
-            uint32_t tag_lo = read_le32(reader.seg + list_data_off);
-            uint32_t tag_hi = read_le32(reader.seg + list_data_off + 4);
-
-            /* Tag word has struct pointer format: offset=element_count */
-            uint32_t elem_count = (uint32_t)((int32_t)tag_lo >> 2);
-            uint16_t elem_dw = (uint16_t)(tag_hi & 0xFFFF);
-            uint16_t elem_pc = (uint16_t)(tag_hi >> 16);
-            size_t elem_stride = ((size_t)elem_dw + (size_t)elem_pc) * 8;
-
-            ESP_LOGD(TAG, "metadata: %u elements, dw=%u pc=%u stride=%zu",
-                     elem_count, elem_dw, elem_pc, elem_stride);
-
-            /* Elements start after the tag word */
-            size_t elem_base = list_data_off + 8;
-
-            for (uint32_t i = 0; i < elem_count && i < CF_MAX_METADATA; i++) {
-                size_t e_off = elem_base + i * elem_stride;
-                /* Metadata struct: data_words=0, ptr_count=2
-                 * pointer[0] = key (text)
-                 * pointer[1] = val (text) */
-                size_t e_ptr_section = e_off + (size_t)elem_dw * 8;
-
-                if (e_ptr_section + 16 > reader.seg_len) break;
-
-                size_t key_len = 0, val_len = 0;
-                const char *key = capnp_read_text(&reader, e_ptr_section + 0, &key_len);
-                const char *val = capnp_read_text(&reader, e_ptr_section + 8, &val_len);
-
-                if (key && key_len > 0) {
-                    size_t kl = key_len < sizeof(req->metadata[i].key) - 1
-                                    ? key_len : sizeof(req->metadata[i].key) - 1;
-                    memcpy(req->metadata[i].key, key, kl);
-                    req->metadata[i].key[kl] = '\0';
-                }
-                if (val && val_len > 0) {
-                    size_t vl = val_len < sizeof(req->metadata[i].val) - 1
-                                    ? val_len : sizeof(req->metadata[i].val) - 1;
-                    memcpy(req->metadata[i].val, val, vl);
-                    req->metadata[i].val[vl] = '\0';
-                }
-
-                req->metadata_count++;
-                ESP_LOGD(TAG, "  meta[%u]: %s = %s",
-                         i, req->metadata[i].key, req->metadata[i].val);
-            }
-        } else {
-            ESP_LOGW(TAG, "metadata list has elem_size=%u, expected 7 (composite)",
-                     elem_sz);
+int capnp_connect_request_copy(const capnp_connect_request_view_t *v,
+                               cf_connect_request_t *req)
+{
+    req->dest.len = 0;
+    req->type = v->type;
+    cf_metadata_clear(&req->metadata);
+
+    if (cf_metadata_reserve(&req->metadata, v->text_bytes,
+                            v->metadata_count) != 0 ||
+        cf_metadata_intern(&req->metadata, NULL, v->dest.ptr, v->dest.len,
+                           &req->dest) != 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < v->metadata_count; i++) {
+        capnp_text_t key, val;
+        capnp_connect_request_metadata(v, i, &key, &val);
+        if (cf_metadata_add(&req->metadata, NULL, key.ptr, key.len,
+                            val.ptr, val.len) != 0) {
+            return -1;
         }
     }
-
     return 0;
 }
 
+int capnp_decode_connect_request(const uint8_t *data, size_t len,
+                                 cf_connect_request_t *req)
+{
+    capnp_connect_request_view_t v;
+    if (capnp_view_connect_request(data, len, &v) != 0) {
+        return -1;
+    }
+    return capnp_connect_request_copy(&v, req);
+}
+
 /* ────────────────────────────────────────────────────────────────
  *  High-level: Encode ConnectResponse
  *
- *  Cap'n Proto schema:
+ *  schema/quic_metadata_protocol.capnp:
  *    struct ConnectResponse {
- *        error    @0 :Text;             # pointer[0]
- *        metadata @1 :List(Metadata);   # pointer[1]
- *    }
- *    struct Metadata {
- *        key @0 :Text;   # pointer[0]
- *        val @1 :Text;   # pointer[1]
+ *        error    @0 :Text;
+ *        metadata @1 :List(Metadata);
  *    }
- *
- *  ConnectResponse layout: data_words=0, ptr_count=2
  * ──────────────────────────────────────────────────────────────── */
 
+/* Words taken by a Text of `len` bytes (0 = null pointer, no data). */
+static size_t text_words(size_t len)
+{
+    return len > 0 ? (len + 1 + 7) / 8 : 0;
+}
+
+/* Preamble (signature + version) plus the single-segment table */
+#define RESPONSE_HEADER_LEN (6 + 2 + 8)
+
+#define RESPONSE_WORDS \
+    (STREAM_CONNECT_RESPONSE_DATA_WORDS + STREAM_CONNECT_RESPONSE_PTR_COUNT)
+#define METADATA_WORDS \
+    (STREAM_METADATA_DATA_WORDS + STREAM_METADATA_PTR_COUNT)
+
+/* Segment words for `resp`: root pointer, the struct, the error text and
+ * the composite list of Metadata. */
+static size_t connect_response_words(const cf_connect_response_t *resp)
+{
+    size_t words = 1 + RESPONSE_WORDS + text_words(strlen(resp->error));
+    const cf_metadata_list_t *md = &resp->metadata;
+    if (md->count > 0) {
+        words += 1 + md->count * METADATA_WORDS;
+        for (size_t i = 0; i < md->count; i++) {
+            words += text_words(md->items[i].key.len) +
+                     text_words(md->items[i].val.len);
+        }
+    }
+    return words;
+}
+
+size_t capnp_connect_response_size(const cf_connect_response_t *resp)
+{
+    return RESPONSE_HEADER_LEN + connect_response_words(resp) * 8;
+}
+
 int capnp_encode_connect_response(const cf_connect_response_t *resp,
                                   uint8_t *buf, size_t buf_cap,
                                   size_t *out_len)
 {
-    /* Preamble: signature + version */
-    const size_t preamble_len = 6 + 2; /* signature + "01" */
-    if (buf_cap < preamble_len + 64) {
-        ESP_LOGE(TAG, "buffer too small for ConnectResponse");
+    /* First pass: exact size, so the message is built in place */
+    size_t seg_words = connect_response_words(resp);
+    size_t total = RESPONSE_HEADER_LEN + seg_words * 8;
+    if (total > buf_cap || seg_words > UINT32_MAX) {
+        ESP_LOGE(TAG, "buffer too small for ConnectResponse: need %zu, have %zu",
+                 total, buf_cap);
         return -1;
     }
 
+    /* Preamble: signature + version, then the segment table */
     memcpy(buf, CF_DATA_STREAM_SIGNATURE, 6);
     buf[6] = '0';
     buf[7] = '1';
+    capnp_write_le32(buf + 8, 0);                         /* segment_count - 1 */
+    capnp_write_le32(buf + 12, (uint32_t)seg_words);      /* segment 0 size */
 
-    /* Build Cap'n Proto message */
-    uint8_t work[2048];
+    /* Second pass: the segment itself, straight after the table.  The
+     * builder zeroes only the words it hands out. */
     capnp_builder_t builder;
-    capnp_builder_init(&builder, work, sizeof(work));
+    capnp_builder_init(&builder, buf + RESPONSE_HEADER_LEN, seg_words * 8);
 
     /* Allocate root struct pointer slot (1 word at offset 0) */
     int root_ptr_off = capnp_alloc(&builder, 1);
     if (root_ptr_off < 0) return -1;
 
-    /* Allocate ConnectResponse struct: 0 data words + 2 pointers */
-    int struct_off = capnp_alloc(&builder, 0 + 2);
+    int struct_off = capnp_new_struct(&builder, (size_t)root_ptr_off,
+                                      STREAM_CONNECT_RESPONSE_DATA_WORDS,
+                                      STREAM_CONNECT_RESPONSE_PTR_COUNT);
     if (struct_off < 0) return -1;
 
-    /* Write root pointer -> struct */
-    capnp_write_struct_ptr(builder.buf, (size_t)root_ptr_off,
-                           (size_t)struct_off, 0, 2);
-
-    size_t ptr0_off = (size_t)struct_off + 0;  /* pointer[0] = error */
-    size_t ptr1_off = (size_t)struct_off + 8;  /* pointer[1] = metadata */
-
-    /* Write error text at pointer[0] */
-    if (resp->error[0] != '\0') {
-        if (capnp_write_text(&builder, ptr0_off, resp->error) != 0)
-            return -1;
-    }
+    if (capnp_write_text(&builder, (size_t)struct_off +
+                         CAPNP_PTR(STREAM_CONNECT_RESPONSE_DATA_WORDS,
+                                   STREAM_CONNECT_RESPONSE_ERROR_PTR),
+                         resp->error) != 0)
+        return -1;
 
-    /* Write metadata list at pointer[1] */
-    if (resp->metadata_count > 0) {
+    const cf_metadata_list_t *md = &resp->metadata;
+    if (md->count > 0) {
         /*
          * Composite list format:
          *   list pointer -> tag_word + N * element_words
-         *   tag_word: struct pointer format with offset=N, dw=0, pc=2
-         *   elements: each is 0 data words + 2 pointer words
+         *   tag_word: struct pointer format with offset=N and the
+         *             element shape
          */
-        size_t n = resp->metadata_count;
-        uint16_t elem_dw = 0;
-        uint16_t elem_pc = 2;
-        size_t elem_words = (size_t)elem_dw + (size_t)elem_pc;
+        size_t n = md->count;
+        uint16_t elem_dw = STREAM_METADATA_DATA_WORDS;
+        uint16_t elem_pc = STREAM_METADATA_PTR_COUNT;
+        size_t elem_words = METADATA_WORDS;
         size_t total_list_words = 1 + n * elem_words; /* 1 tag + N elements */
 
         int list_off = capnp_alloc(&builder, total_list_words);
@@ -614,35 +1006,33 @@ int capnp_encode_connect_response(const cf_connect_response_t *resp,
         /* Write tag word (struct pointer format: offset=element_count) */
         uint32_t tag_lo = (uint32_t)((uint32_t)n << 2) | 0x00; /* type=struct */
         uint32_t tag_hi = (uint32_t)elem_dw | ((uint32_t)elem_pc << 16);
-        write_le32(builder.buf + list_off, tag_lo);
-        write_le32(builder.buf + list_off + 4, tag_hi);
+        uint8_t *tag = capnp_at(&builder, (size_t)list_off);
+        capnp_write_le32(tag, tag_lo);
+        capnp_write_le32(tag + 4, tag_hi);
 
-        /* Write list pointer: elem_size=7 (composite), count=total words including tag */
-        capnp_write_list_ptr(builder.buf, ptr1_off,
-                             (size_t)list_off, 7, (uint32_t)total_list_words);
+        /* Write list pointer: elem_size=7 (composite), count=words after the tag */
+        capnp_write_list_ptr(&builder, (size_t)struct_off +
+                             CAPNP_PTR(STREAM_CONNECT_RESPONSE_DATA_WORDS,
+                                       STREAM_CONNECT_RESPONSE_METADATA_PTR),
+                             (size_t)list_off, 7, (uint32_t)(n * elem_words));
 
         /* Write each Metadata element */
         for (size_t i = 0; i < n; i++) {
+            const cf_metadata_t *e = &md->items[i];
             size_t e_off = (size_t)list_off + 8 + i * elem_words * 8;
-            /* Element has 0 data words, 2 pointers */
-            size_t e_ptr0 = e_off + (size_t)elem_dw * 8; /* key */
-            size_t e_ptr1 = e_ptr0 + 8;                   /* val */
-
-            if (capnp_write_text(&builder, e_ptr0, resp->metadata[i].key) != 0)
+            if (capnp_write_text_n(&builder, e_off +
+                                   CAPNP_PTR(elem_dw, STREAM_METADATA_KEY_PTR),
+                                   cf_metadata_str(md, e->key), e->key.len) != 0)
                 return -1;
-            if (capnp_write_text(&builder, e_ptr1, resp->metadata[i].val) != 0)
+            if (capnp_write_text_n(&builder, e_off +
+                                   CAPNP_PTR(elem_dw, STREAM_METADATA_VAL_PTR),
+                                   cf_metadata_str(md, e->val), e->val.len) != 0)
                 return -1;
         }
     }
 
-    /* Finalize Cap'n Proto message after the preamble */
-    size_t capnp_len = capnp_finalize(&builder,
-                                       buf + preamble_len,
-                                       buf_cap - preamble_len);
-    if (capnp_len == 0) return -1;
-
-    *out_len = preamble_len + capnp_len;
+    *out_len = total;
     ESP_LOGD(TAG, "encoded ConnectResponse: %zu bytes total (%zu capnp)",
-             *out_len, capnp_len);
+             total, total - 8);
     return 0;
 }
@@ -6,8 +6,10 @@
  * exactly the messages needed by the Cloudflare tunnel protocol:
  *   - ConnectRequest  (decode, from edge)
  *   - ConnectResponse (encode, to edge)
+ *   - RPC messages on the control stream (rpc_session.h)
  *
- * Single-segment messages only. No inter-segment pointers, no capabilities.
+ * Messages of up to CAPNP_MAX_SEGMENTS segments, with far pointers.
+ * Capability pointers are plain indexes into an RPC message's cap table.
  */
 
 #include <stdint.h>
@@ -15,30 +17,129 @@
 #include <stdbool.h>
 #include "tunnel_types.h"
 
-/* ── Cap'n Proto message builder (single-segment, pre-allocated) ── */
+/* Most segments a message may have, built or read.  Positions handed
+ * out by the builder carry the segment index above CAPNP_SEG_SHIFT. */
+#define CAPNP_MAX_SEGMENTS 16
+#define CAPNP_SEG_SHIFT    24                   /* 16 MB per segment */
+
+/* Returned by capnp_wire_message_size() for a segment table that can
+ * never be read, as opposed to 0 for one that is still incomplete. */
+#define CAPNP_WIRE_INVALID SIZE_MAX
+
+/* Field offsets and struct shapes come from capnp_schema.h, generated
+ * at build time from the schemas in schema/.  Byte offset of pointer
+ * `idx` (a *_PTR constant) in a struct with `data_words` data words: */
+#define CAPNP_PTR(data_words, idx) (((size_t)(data_words) + (size_t)(idx)) * 8)
+
+/* Whether a struct read with `data_words` data words holds the `size`
+ * bytes at data offset `off`.  Older peers send shorter structs; fields
+ * past the end read as their default. */
+#define CAPNP_HAS_DATA(data_words, off, size) \
+    ((size_t)(data_words) * 8 >= (size_t)(off) + (size_t)(size))
+
+struct mem_pool;
+
+/* ── Little-endian access ─────────────────────────────────────── */
+
+/* Cap'n Proto is little-endian on the wire; these work on any host and
+ * at any alignment. */
+static inline uint16_t capnp_read_le16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t capnp_read_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void capnp_write_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void capnp_write_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v);
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void capnp_write_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(v >> (i * 8));
+    }
+}
+
+/* ── Cap'n Proto message builder ──────────────────────────────── */
 
 typedef struct {
-    uint8_t *buf;   /* Working buffer (segment data, no header) */
-    size_t   cap;   /* Buffer capacity in bytes */
-    size_t   pos;   /* Current write position in bytes */
+    uint8_t *data;
+    size_t   cap;   /* Capacity in bytes */
+    size_t   used;  /* Bytes allocated so far */
+} capnp_segment_t;
+
+/* Builds into a caller-supplied first segment.  Once capnp_builder_chain()
+ * has been called, an allocation that does not fit opens a new segment
+ * from the pool and pointers into it become far pointers; otherwise it
+ * fails as before.  Errors while writing pointers are sticky and make
+ * capnp_finalize() fail. */
+typedef struct {
+    capnp_segment_t segs[CAPNP_MAX_SEGMENTS];
+    size_t seg_count;
+    bool chain;                 /* Extra segments allowed */
+    bool failed;                /* A pointer could not be written */
+    struct mem_pool *mem;       /* Extra segments (NULL = heap) */
 } capnp_builder_t;
 
-/* Initialise a builder over a caller-supplied buffer. */
+/* Initialise a builder over a caller-supplied buffer.  The buffer is not
+ * cleared: capnp_alloc() zeroes each allocation as it hands it out. */
 void capnp_builder_init(capnp_builder_t *b, uint8_t *buf, size_t cap);
 
-/* Allocate `words` 8-byte words, returns byte offset into buf, or -1 on overflow. */
+/* Let the builder chain extra segments from `mem` (NULL = heap) instead
+ * of failing when the first one is full. */
+void capnp_builder_chain(capnp_builder_t *b, struct mem_pool *mem);
+
+/* Return the chained segments to their pool. */
+void capnp_builder_free(capnp_builder_t *b);
+
+/* Allocate `words` 8-byte words (zeroed); returns their position, or -1
+ * on overflow. */
 int capnp_alloc(capnp_builder_t *b, size_t words);
 
+/* Allocate a struct of the given shape (zeroed) and write a pointer to
+ * it at `ptr_offset`; returns its position, or -1 on overflow. */
+int capnp_new_struct(capnp_builder_t *b, size_t ptr_offset,
+                     uint16_t data_words, uint16_t ptr_count);
+
+/* Allocate a composite list of `count` structs of the given shape
+ * (zeroed) and write a pointer to it at `ptr_offset`; returns the
+ * position of the first element, or -1 on overflow. */
+int capnp_new_struct_list(capnp_builder_t *b, size_t ptr_offset,
+                          uint32_t count,
+                          uint16_t data_words, uint16_t ptr_count);
+
+/* Write a capability pointer to entry `index` of the cap table. */
+void capnp_write_cap_ptr(capnp_builder_t *b, size_t ptr_offset, uint32_t index);
+
+/* Address of builder position `pos`. */
+uint8_t *capnp_at(const capnp_builder_t *b, size_t pos);
+
 /* Write a struct pointer at `ptr_offset` pointing to struct at `struct_offset`.
- * data_words / ptr_count describe the target struct's shape. */
-void capnp_write_struct_ptr(uint8_t *buf, size_t ptr_offset,
+ * data_words / ptr_count describe the target struct's shape.  Across
+ * segments this writes a far pointer and its landing pad. */
+void capnp_write_struct_ptr(capnp_builder_t *b, size_t ptr_offset,
                             size_t struct_offset,
                             uint16_t data_words, uint16_t ptr_count);
 
 /* Write a list pointer at `ptr_offset`.
  * elem_size: 0=void, 1=bit, 2=byte, 3=two-byte, 4=four-byte,
  *            5=eight-byte, 6=pointer, 7=composite. */
-void capnp_write_list_ptr(uint8_t *buf, size_t ptr_offset,
+void capnp_write_list_ptr(capnp_builder_t *b, size_t ptr_offset,
                           size_t list_offset,
                           uint8_t elem_size, uint32_t count);
 
@@ -46,33 +147,61 @@ void capnp_write_list_ptr(uint8_t *buf, size_t ptr_offset,
  * Returns 0 on success, -1 on overflow. */
 int capnp_write_text(capnp_builder_t *b, size_t ptr_offset, const char *text);
 
+/* Same for text[0, len), which need not be NUL-terminated. */
+int capnp_write_text_n(capnp_builder_t *b, size_t ptr_offset,
+                       const char *text, size_t len);
+
 /* Write raw data (byte list, no NUL).
  * Returns 0 on success, -1 on overflow. */
 int capnp_write_data(capnp_builder_t *b, size_t ptr_offset,
                      const uint8_t *data, size_t len);
 
+/* Bytes capnp_finalize() will write for the message built so far. */
+size_t capnp_message_size(const capnp_builder_t *b);
+
 /* Finalise builder into wire-format message (segment table + data).
- * Returns total bytes written to `out`, or 0 on overflow. */
+ * Returns total bytes written to `out`, or 0 on overflow or error. */
 size_t capnp_finalize(const capnp_builder_t *b, uint8_t *out, size_t out_cap);
 
-/* ── Cap'n Proto message reader (single-segment) ─────────────── */
+/* ── Cap'n Proto message reader ───────────────────────────────── */
 
+/* The segments of a message lie back to back after the segment table, so
+ * the reader addresses them as one range: an offset is relative to the
+ * start of segment 0, and far pointers are resolved through seg_start. */
 typedef struct {
     const uint8_t *seg;     /* Pointer to first segment data */
-    size_t         seg_len; /* Segment length in bytes */
+    size_t         seg_len; /* Length of all segments in bytes */
+    uint32_t       seg_count;
+    size_t         seg_start[CAPNP_MAX_SEGMENTS + 1]; /* [i, i+1) = segment i */
 } capnp_reader_t;
 
-/* Parse message wire format, point reader at first segment.
+/* Parse message wire format and the segment table.
  * Returns 0 on success, -1 on error. */
 int capnp_read_message(const uint8_t *data, size_t len, capnp_reader_t *r);
 
-/* Read a struct pointer at `ptr_offset`.
- * Fills struct_offset (absolute byte offset), data_words, ptr_count.
+/* Read a struct pointer at `ptr_offset`, following far pointers.
+ * Fills struct_offset (absolute byte offset), data_words, ptr_count; the
+ * whole struct is known to be inside the message.
  * Returns 0 on success, -1 on error (null/invalid pointer). */
 int capnp_read_struct_ptr(const capnp_reader_t *r, size_t ptr_offset,
                           size_t *struct_offset,
                           uint16_t *data_words, uint16_t *ptr_count);
 
+/* Read a composite (struct) list pointer at `ptr_offset`.  Sets *count
+ * (0 for a null pointer) and, for a non-empty list, the position of the
+ * first element, the bytes from one element to the next and the shape of
+ * each; every element is known to be inside the message.
+ * Returns 0 on success, -1 if malformed. */
+int capnp_read_struct_list(const capnp_reader_t *r, size_t ptr_offset,
+                           size_t *first, uint32_t *count, size_t *stride,
+                           uint16_t *data_words, uint16_t *ptr_count);
+
+/* Read a capability pointer at `ptr_offset` into its cap table index.
+ * Returns 0 on success, 1 for a null pointer, -1 if it is not a
+ * capability. */
+int capnp_read_cap_ptr(const capnp_reader_t *r, size_t ptr_offset,
+                       uint32_t *index);
+
 /* Read text from a list pointer.  Returns pointer into segment buffer.
  * Sets *out_len to string length (excluding NUL). */
 const char *capnp_read_text(const capnp_reader_t *r, size_t ptr_offset,
@@ -83,33 +212,117 @@ const char *capnp_read_text(const capnp_reader_t *r, size_t ptr_offset,
 const uint8_t *capnp_read_data(const capnp_reader_t *r, size_t ptr_offset,
                                size_t *out_len);
 
-/* Read uint16 from struct data section at byte_offset relative to struct_data_offset. */
-uint16_t capnp_read_uint16(const capnp_reader_t *r,
-                           size_t struct_data_offset, size_t byte_offset);
+/* Scalar fields of a struct's data section: the value at byte_offset
+ * relative to struct_data_offset, or 0 / false if it lies outside the
+ * message.  Inline, so that a field read with constant offsets from
+ * capnp_schema.h is a bounds check and a load. */
+static inline uint16_t capnp_read_uint16(const capnp_reader_t *r,
+                                         size_t struct_data_offset,
+                                         size_t byte_offset)
+{
+    size_t off = struct_data_offset + byte_offset;
+    if (off + 2 > r->seg_len) return 0;
+    return capnp_read_le16(r->seg + off);
+}
 
-/* Read uint8 from struct data section. */
-uint8_t capnp_read_uint8(const capnp_reader_t *r,
-                         size_t struct_data_offset, size_t byte_offset);
+static inline uint32_t capnp_read_uint32(const capnp_reader_t *r,
+                                         size_t struct_data_offset,
+                                         size_t byte_offset)
+{
+    size_t off = struct_data_offset + byte_offset;
+    if (off + 4 > r->seg_len) return 0;
+    return capnp_read_le32(r->seg + off);
+}
 
-/* Read bool from struct data section (bit `bit` within byte at byte_offset). */
-bool capnp_read_bool(const capnp_reader_t *r,
-                     size_t struct_data_offset, size_t byte_offset, int bit);
+static inline uint64_t capnp_read_uint64(const capnp_reader_t *r,
+                                         size_t struct_data_offset,
+                                         size_t byte_offset)
+{
+    size_t off = struct_data_offset + byte_offset;
+    if (off + 8 > r->seg_len) return 0;
+    return (uint64_t)capnp_read_le32(r->seg + off) |
+           ((uint64_t)capnp_read_le32(r->seg + off + 4) << 32);
+}
 
-/* Calculate the total wire size of a single-segment capnp message from raw bytes.
- * Returns 0 if the data is too short or malformed.
+static inline uint8_t capnp_read_uint8(const capnp_reader_t *r,
+                                       size_t struct_data_offset,
+                                       size_t byte_offset)
+{
+    size_t off = struct_data_offset + byte_offset;
+    if (off + 1 > r->seg_len) return 0;
+    return r->seg[off];
+}
+
+/* Bit `bit` of the byte at byte_offset. */
+static inline bool capnp_read_bool(const capnp_reader_t *r,
+                                   size_t struct_data_offset,
+                                   size_t byte_offset, int bit)
+{
+    size_t off = struct_data_offset + byte_offset;
+    if (off + 1 > r->seg_len) return false;
+    return (r->seg[off] >> bit) & 1;
+}
+
+/* Calculate the total wire size of a capnp message from raw bytes.
+ * Returns 0 if the data is too short, or CAPNP_WIRE_INVALID if the
+ * segment table is malformed (more than CAPNP_MAX_SEGMENTS segments).
  * Useful for determining where the capnp message ends in a stream buffer. */
 size_t capnp_wire_message_size(const uint8_t *data, size_t len);
 
+/* Like capnp_wire_message_size(), but as soon as the segment table is in:
+ * the size the message declares, however much of it has arrived.  Lets a
+ * stream reject an oversized message before buffering it. */
+size_t capnp_wire_declared_size(const uint8_t *data, size_t len);
+
 /* ── High-level: Data stream protocol ─────────────────────────── */
 
-/* Decode a ConnectRequest from raw Cap'n Proto bytes
- * (after the 6-byte signature + 2-byte version have been stripped). */
+/* A Text field in place: `len` bytes at `ptr`, not NUL-terminated. */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} capnp_text_t;
+
+/* A validated ConnectRequest read in place.  Nothing is copied: dest and
+ * the metadata point into the message, which must outlive the view. */
+typedef struct {
+    capnp_reader_t reader;
+    capnp_text_t dest;
+    cf_connection_type_t type;
+    uint32_t metadata_count;
+    size_t metadata_base;       /* Pointer section of metadata[0] */
+    size_t metadata_stride;     /* Bytes per list element */
+    size_t text_bytes;          /* dest + keys + values, one NUL each */
+} capnp_connect_request_view_t;
+
+/* Check a ConnectRequest from raw Cap'n Proto bytes (after the 6-byte
+ * signature + 2-byte version) and set up a view of it.  Every pointer,
+ * including each metadata key and value, is bounds-checked here.
+ * Returns 0 on success, -1 if the message is malformed. */
+int capnp_view_connect_request(const uint8_t *data, size_t len,
+                               capnp_connect_request_view_t *v);
+
+/* Key and value of metadata entry `i` (< metadata_count). */
+void capnp_connect_request_metadata(const capnp_connect_request_view_t *v,
+                                    uint32_t i,
+                                    capnp_text_t *key, capnp_text_t *val);
+
+/* Copy a view into `req`, whose metadata list must be initialised; its
+ * arena and entry array are sized once for the whole request.
+ * Returns 0, or -1 on OOM. */
+int capnp_connect_request_copy(const capnp_connect_request_view_t *v,
+                               cf_connect_request_t *req);
+
+/* View and copy in one step. */
 int capnp_decode_connect_request(const uint8_t *data, size_t len,
                                  cf_connect_request_t *req);
 
-/* Encode a ConnectResponse to wire format (signature + version + capnp).
- * Sets *out_len to the total bytes written.
- * Returns 0 on success, -1 on error. */
+/* Exact wire size of `resp` as written by capnp_encode_connect_response. */
+size_t capnp_connect_response_size(const cf_connect_response_t *resp);
+
+/* Encode a ConnectResponse to wire format (signature + version + capnp)
+ * in a single pass, directly into `buf`; only the bytes written are
+ * touched.  Sets *out_len to the total bytes written.
+ * Returns 0 on success, -1 if it does not fit in buf_cap. */
 int capnp_encode_connect_response(const cf_connect_response_t *resp,
                                   uint8_t *buf, size_t buf_cap,
                                   size_t *out_len);
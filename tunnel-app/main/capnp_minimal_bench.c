@@ -0,0 +1,521 @@
+/*
+ * Host check and benchmark for capnp_minimal.c; not part of the firmware
+ * build.
+ *
+ * Builds ConnectRequests the way the edge sends them for a browser
+ * request (HttpMethod, HttpHost and HttpHeader:* entries of realistic
+ * sizes) with 10, 15 and 40 metadata entries.  Each is checked field by
+ * field through the in-place view, the copy and the one-step decode, and
+ * must be rejected when cut short at any length.  Each is also built a
+ * second time from a small first segment with capnp_builder_chain(), so
+ * that the metadata list and most strings sit in other segments behind
+ * far pointers, and must read back the same.  Then times, per request
+ * and for both layouts: the view alone with every entry read, the view
+ * plus a copy into a reused pool-backed request (what
+ * try_handle_data_stream does), and capnp_decode_connect_request().
+ * Last, ConnectResponses with 10 and 20 entries are encoded, read back
+ * with the generic reader and timed.  capnp_schema.h is generated from
+ * schema/ first:
+ *
+ *   python3 schema/capnp_gen.py -o capnp_schema.h \
+ *       schema/rpc.capnp:RPC schema/tunnelrpc.capnp:TUNNEL \
+ *       schema/quic_metadata_protocol.capnp:STREAM
+ *   cc -O2 -I. -Ihost capnp_minimal_bench.c capnp_minimal.c cf_metadata.c \
+ *       mem_pool.c -lpthread && ./a.out
+ *
+ * Exits with 1 at the first mismatch.
+ */
+
+#include "capnp_minimal.h"
+#include "capnp_schema.h"
+#include "cf_metadata.h"
+#include "mem_pool.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Requests timed per entry count and path */
+#define BENCH_REQUESTS (1u * 1024 * 1024)
+
+/* Largest test message */
+#define MSG_CAP (16 * 1024)
+
+/* First segment of the chained layout: room for the root struct and
+ * dest, not for the metadata list */
+#define FIRST_SEG_BYTES 256
+
+#define MAX_ENTRIES 40
+
+/* ── Test requests ───────────────────────────────────────────────── */
+
+static uint64_t s_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return s_rng;
+}
+
+/* Headers of a browser page load through Cloudflare, in the order the
+ * edge tends to send them; requests with more entries than this get
+ * X-Custom-* headers of varying length. */
+static const char *const s_headers[][2] = {
+    { "HttpMethod", "GET" },
+    { "HttpHost", "tunnel.example.com" },
+    { "HttpHeader:User-Agent",
+      "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+      "Chrome/124.0.0.0 Safari/537.36" },
+    { "HttpHeader:Accept",
+      "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+      "image/webp,*/*;q=0.8" },
+    { "HttpHeader:Accept-Encoding", "gzip, br" },
+    { "HttpHeader:Accept-Language", "en-US,en;q=0.9" },
+    { "HttpHeader:Cf-Ray", "8a1b2c3d4e5f6789-SJC" },
+    { "HttpHeader:Cf-Connecting-Ip", "203.0.113.42" },
+    { "HttpHeader:X-Forwarded-For", "203.0.113.42" },
+    { "HttpHeader:X-Forwarded-Proto", "https" },
+    { "HttpHeader:Cf-Visitor", "{\"scheme\":\"https\"}" },
+    { "HttpHeader:Cf-Ipcountry", "US" },
+    { "HttpHeader:Cdn-Loop", "cloudflare; loops=1" },
+    { "HttpHeader:Cookie",
+      "session=4f1c2a9e7b3d4c8a9e1f2b3c4d5e6f70; theme=dark; "
+      "_ga=GA1.2.123456789.1700000000" },
+    { "HttpHeader:Referer", "https://tunnel.example.com/dashboard" },
+    { "HttpHeader:Sec-Ch-Ua",
+      "\"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"" },
+    { "HttpHeader:Sec-Ch-Ua-Mobile", "?0" },
+    { "HttpHeader:Sec-Ch-Ua-Platform", "\"Linux\"" },
+    { "HttpHeader:Sec-Fetch-Dest", "document" },
+    { "HttpHeader:Sec-Fetch-Mode", "navigate" },
+    { "HttpHeader:Sec-Fetch-Site", "same-origin" },
+    { "HttpHeader:Sec-Fetch-User", "?1" },
+    { "HttpHeader:Upgrade-Insecure-Requests", "1" },
+    { "HttpHeader:Priority", "u=0, i" },
+    { "HttpHeader:Cache-Control", "max-age=0" },
+};
+
+#define KNOWN_HEADERS (sizeof(s_headers) / sizeof(s_headers[0]))
+
+typedef struct {
+    const char *dest;
+    cf_connection_type_t type;
+    uint32_t count;
+    char key[MAX_ENTRIES][48];
+    char val[MAX_ENTRIES][160];
+} request_spec_t;
+
+static void make_spec(request_spec_t *spec, uint32_t count)
+{
+    spec->dest = "http://tunnel.example.com/dashboard?tab=streams";
+    spec->type = CF_CONN_TYPE_HTTP;
+    spec->count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i < KNOWN_HEADERS) {
+            snprintf(spec->key[i], sizeof(spec->key[i]), "%s", s_headers[i][0]);
+            snprintf(spec->val[i], sizeof(spec->val[i]), "%s", s_headers[i][1]);
+            continue;
+        }
+        size_t len = 8 + rng() % 48;
+        snprintf(spec->key[i], sizeof(spec->key[i]), "HttpHeader:X-Custom-%u", i);
+        for (size_t k = 0; k < len; k++) {
+            spec->val[i][k] = (char)('a' + rng() % 26);
+        }
+        spec->val[i][len] = '\0';
+    }
+}
+
+/* Encode `spec` in a single segment as the edge does, or with
+ * `first_seg` > 0 in a first segment of that many bytes followed by
+ * chained ones.  Returns the message length, or 0 if it does not fit. */
+static size_t encode_request(const request_spec_t *spec, size_t first_seg,
+                             uint8_t *out, size_t cap)
+{
+    static uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    capnp_builder_init(&b, seg, first_seg > 0 ? first_seg : sizeof(seg));
+    if (first_seg > 0) {
+        capnp_builder_chain(&b, NULL);
+    }
+    size_t len = 0;
+
+    if (capnp_alloc(&b, 1) < 0) {
+        goto done;
+    }
+    int root = capnp_new_struct(&b, 0, STREAM_CONNECT_REQUEST_DATA_WORDS,
+                                STREAM_CONNECT_REQUEST_PTR_COUNT);
+    if (root < 0) {
+        goto done;
+    }
+    capnp_write_le16(capnp_at(&b, root + STREAM_CONNECT_REQUEST_TYPE),
+                     (uint16_t)spec->type);
+    if (capnp_write_text(&b, root + CAPNP_PTR(STREAM_CONNECT_REQUEST_DATA_WORDS,
+                                              STREAM_CONNECT_REQUEST_DEST_PTR),
+                         spec->dest) != 0) {
+        goto done;
+    }
+    int list = capnp_new_struct_list(&b, root + CAPNP_PTR(STREAM_CONNECT_REQUEST_DATA_WORDS,
+                                                          STREAM_CONNECT_REQUEST_METADATA_PTR),
+                                     spec->count, STREAM_METADATA_DATA_WORDS,
+                                     STREAM_METADATA_PTR_COUNT);
+    if (list < 0) {
+        goto done;
+    }
+    for (uint32_t i = 0; i < spec->count; i++) {
+        size_t elem = (size_t)list +
+            (size_t)i * (STREAM_METADATA_DATA_WORDS + STREAM_METADATA_PTR_COUNT) * 8;
+        if (capnp_write_text(&b, elem + CAPNP_PTR(STREAM_METADATA_DATA_WORDS,
+                                                  STREAM_METADATA_KEY_PTR),
+                             spec->key[i]) != 0 ||
+            capnp_write_text(&b, elem + CAPNP_PTR(STREAM_METADATA_DATA_WORDS,
+                                                  STREAM_METADATA_VAL_PTR),
+                             spec->val[i]) != 0) {
+            goto done;
+        }
+    }
+    len = capnp_finalize(&b, out, cap);
+
+done:
+    capnp_builder_free(&b);
+    return len;
+}
+
+static uint32_t segment_count(const uint8_t *msg, size_t len)
+{
+    capnp_reader_t r;
+    return capnp_read_message(msg, len, &r) == 0 ? r.seg_count : 0;
+}
+
+/* Response headers from the same entries, as the proxy hands them on */
+static int make_response(cf_connect_response_t *resp, const request_spec_t *spec)
+{
+    resp->error[0] = '\0';
+    cf_metadata_clear(&resp->metadata);
+    for (uint32_t i = 0; i < spec->count; i++) {
+        if (cf_metadata_add(&resp->metadata, NULL, spec->key[i],
+                            strlen(spec->key[i]), spec->val[i],
+                            strlen(spec->val[i])) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ── Checks ──────────────────────────────────────────────────────── */
+
+/* Send stderr to /dev/null while malformed messages are fed on purpose,
+ * so their ESP_LOGE lines do not bury the results; returns the saved
+ * descriptor for loud(). */
+static int quiet(void)
+{
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void loud(int saved)
+{
+    if (saved >= 0) {
+        fflush(stderr);
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+}
+
+static int fail(uint32_t count, const char *what)
+{
+    fprintf(stderr, "FAIL %u entries: %s\n", count, what);
+    return -1;
+}
+
+static bool text_is(capnp_text_t t, const char *s)
+{
+    return t.len == strlen(s) && memcmp(t.ptr, s, t.len) == 0;
+}
+
+static bool read_text_is(const capnp_reader_t *r, size_t ptr_offset,
+                         const char *s)
+{
+    size_t len;
+    const char *p = capnp_read_text(r, ptr_offset, &len);
+    return p ? len == strlen(s) && memcmp(p, s, len) == 0 : s[0] == '\0';
+}
+
+static bool request_matches(const cf_connect_request_t *req,
+                            const request_spec_t *spec)
+{
+    if (req->type != spec->type || req->metadata.count != spec->count ||
+        strcmp(cf_metadata_str(&req->metadata, req->dest), spec->dest) != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < spec->count; i++) {
+        if (strcmp(cf_metadata_key(&req->metadata, i), spec->key[i]) != 0 ||
+            strcmp(cf_metadata_val(&req->metadata, i), spec->val[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int check_request(const request_spec_t *spec, const uint8_t *msg,
+                         size_t len, mem_pool_t *mem)
+{
+    uint32_t n = spec->count;
+    capnp_connect_request_view_t v;
+    if (capnp_view_connect_request(msg, len, &v) != 0) {
+        return fail(n, "view");
+    }
+    if (!text_is(v.dest, spec->dest) || v.type != spec->type ||
+        v.metadata_count != n) {
+        return fail(n, "view fields");
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        capnp_text_t key, val;
+        capnp_connect_request_metadata(&v, i, &key, &val);
+        if (!text_is(key, spec->key[i]) || !text_is(val, spec->val[i])) {
+            return fail(n, "view metadata");
+        }
+    }
+
+    cf_connect_request_t req = { 0 };
+    cf_metadata_init(&req.metadata, mem);
+    int rc = -1;
+    if (capnp_connect_request_copy(&v, &req) != 0 || !request_matches(&req, spec)) {
+        fail(n, "copy");
+        goto done;
+    }
+    if (capnp_decode_connect_request(msg, len, &req) != 0 ||
+        !request_matches(&req, spec)) {
+        fail(n, "decode");
+        goto done;
+    }
+
+    /* A request cut short anywhere is malformed, not a shorter request. */
+    int saved = quiet();
+    size_t cut = 0;
+    while (cut < len && capnp_view_connect_request(msg, cut, &v) != 0) {
+        cut++;
+    }
+    loud(saved);
+    if (cut < len) {
+        fail(n, "view accepted a truncated message");
+        goto done;
+    }
+    rc = 0;
+
+done:
+    cf_metadata_free(&req.metadata);
+    return rc;
+}
+
+/* Encode `resp` and read every field back with the generic reader. */
+static int check_response(const cf_connect_response_t *resp,
+                          const request_spec_t *spec, uint8_t *buf)
+{
+    uint32_t n = spec->count;
+    size_t len;
+    if (capnp_encode_connect_response(resp, buf, MSG_CAP, &len) != 0 ||
+        len != capnp_connect_response_size(resp) ||
+        memcmp(buf, CF_DATA_STREAM_SIGNATURE, 6) != 0 ||
+        memcmp(buf + 6, "01", 2) != 0) {
+        return fail(n, "response encode");
+    }
+
+    capnp_reader_t r;
+    size_t root, first, stride;
+    uint16_t dw, pc, edw, epc;
+    uint32_t count;
+    if (capnp_read_message(buf + 8, len - 8, &r) != 0 || r.seg_count != 1 ||
+        capnp_read_struct_ptr(&r, 0, &root, &dw, &pc) != 0 ||
+        !read_text_is(&r, root + CAPNP_PTR(dw, STREAM_CONNECT_RESPONSE_ERROR_PTR),
+                      resp->error) ||
+        capnp_read_struct_list(&r, root + CAPNP_PTR(dw, STREAM_CONNECT_RESPONSE_METADATA_PTR),
+                               &first, &count, &stride, &edw, &epc) != 0 ||
+        count != n) {
+        return fail(n, "response read back");
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        size_t elem = first + i * stride;
+        if (!read_text_is(&r, elem + CAPNP_PTR(edw, STREAM_METADATA_KEY_PTR),
+                          spec->key[i]) ||
+            !read_text_is(&r, elem + CAPNP_PTR(edw, STREAM_METADATA_VAL_PTR),
+                          spec->val[i])) {
+            return fail(n, "response metadata");
+        }
+    }
+    return 0;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double ns_per_request(double seconds)
+{
+    return seconds * 1e9 / (double)BENCH_REQUESTS;
+}
+
+static int bench_request(uint32_t n, const uint8_t *msg, size_t len,
+                         mem_pool_t *mem)
+{
+    capnp_connect_request_view_t v;
+    cf_connect_request_t req = { 0 };
+    cf_metadata_init(&req.metadata, mem);
+    volatile size_t sink = 0;
+    int rc = 0;
+
+    /* View only: validate, then read every entry in place. */
+    double t0 = now_s();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        if (capnp_view_connect_request(msg, len, &v) != 0) {
+            rc = fail(n, "view");
+            goto done;
+        }
+        size_t bytes = v.dest.len;
+        for (uint32_t i = 0; i < v.metadata_count; i++) {
+            capnp_text_t key, val;
+            capnp_connect_request_metadata(&v, i, &key, &val);
+            bytes += key.len + val.len;
+        }
+        sink += bytes;
+    }
+    double t_view = now_s() - t0;
+
+    /* View and copy into a request whose arena is reused. */
+    t0 = now_s();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        if (capnp_view_connect_request(msg, len, &v) != 0 ||
+            capnp_connect_request_copy(&v, &req) != 0) {
+            rc = fail(n, "view+copy");
+            goto done;
+        }
+        sink += req.metadata.count;
+    }
+    double t_copy = now_s() - t0;
+
+    t0 = now_s();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        if (capnp_decode_connect_request(msg, len, &req) != 0) {
+            rc = fail(n, "decode");
+            goto done;
+        }
+        sink += req.metadata.count;
+    }
+    double t_decode = now_s() - t0;
+    (void)sink;
+
+    printf("%7u  %4u  %5zu  %9.1f  %9.1f  %9.1f\n", n,
+           segment_count(msg, len), len,
+           ns_per_request(t_view), ns_per_request(t_copy),
+           ns_per_request(t_decode));
+
+done:
+    cf_metadata_free(&req.metadata);
+    return rc;
+}
+
+static int bench_response(const cf_connect_response_t *resp, uint32_t n,
+                          uint8_t *buf)
+{
+    volatile size_t sink = 0;
+    double t0 = now_s();
+    for (size_t r = 0; r < BENCH_REQUESTS; r++) {
+        size_t len;
+        if (capnp_encode_connect_response(resp, buf, MSG_CAP, &len) != 0) {
+            return fail(n, "response encode");
+        }
+        sink += len;
+    }
+    double t = now_s() - t0;
+    (void)sink;
+    printf("%7u  %5zu  %9.1f\n", n, capnp_connect_response_size(resp),
+           ns_per_request(t));
+    return 0;
+}
+
+int main(void)
+{
+    static const uint32_t counts[] = { 10, 15, 40 };
+    enum { COUNTS = sizeof(counts) / sizeof(counts[0]) };
+    static request_spec_t specs[COUNTS];
+    static uint8_t single[COUNTS][MSG_CAP], multi[COUNTS][MSG_CAP];
+    static uint8_t buf[MSG_CAP];
+    size_t single_len[COUNTS], multi_len[COUNTS];
+    mem_pool_t *mem = mem_pool_create();
+    if (!mem) {
+        return 1;
+    }
+
+    int rc = 0;
+    for (size_t c = 0; c < COUNTS && rc == 0; c++) {
+        uint32_t n = counts[c];
+        make_spec(&specs[c], n);
+        single_len[c] = encode_request(&specs[c], 0, single[c], MSG_CAP);
+        multi_len[c] = encode_request(&specs[c], FIRST_SEG_BYTES, multi[c], MSG_CAP);
+        if (single_len[c] == 0 || multi_len[c] == 0) {
+            rc = fail(n, "encode");
+        } else if (segment_count(single[c], single_len[c]) != 1 ||
+                   segment_count(multi[c], multi_len[c]) < 2) {
+            rc = fail(n, "segment count");
+        } else if (check_request(&specs[c], single[c], single_len[c], mem) != 0 ||
+                   check_request(&specs[c], multi[c], multi_len[c], mem) != 0) {
+            rc = -1;
+        }
+    }
+
+    static const uint32_t response_counts[] = { 10, 20 };
+    enum { RESPONSES = sizeof(response_counts) / sizeof(response_counts[0]) };
+    cf_connect_response_t resp[RESPONSES];
+    request_spec_t *spec = &specs[COUNTS - 1];
+    for (size_t c = 0; c < RESPONSES; c++) {
+        memset(&resp[c], 0, sizeof(resp[c]));
+        cf_metadata_init(&resp[c].metadata, mem);
+    }
+    for (size_t c = 0; c < RESPONSES && rc == 0; c++) {
+        uint32_t n = response_counts[c];
+        spec->count = n;
+        rc = make_response(&resp[c], spec) != 0 ? fail(n, "response")
+                                                : check_response(&resp[c], spec, buf);
+    }
+    spec->count = counts[COUNTS - 1];
+
+    if (rc == 0) {
+        printf("checks passed\n");
+        printf("\nConnectRequest, ns/request\n");
+        printf("entries  segs  bytes  view only  view+copy     decode\n");
+    }
+    for (size_t c = 0; c < COUNTS && rc == 0; c++) {
+        rc = bench_request(counts[c], single[c], single_len[c], mem);
+        if (rc == 0) {
+            rc = bench_request(counts[c], multi[c], multi_len[c], mem);
+        }
+    }
+    if (rc == 0) {
+        printf("\nConnectResponse encode, ns/message\n");
+        printf("entries  bytes     encode\n");
+    }
+    for (size_t c = 0; c < RESPONSES && rc == 0; c++) {
+        rc = bench_response(&resp[c], response_counts[c], buf);
+    }
+    for (size_t c = 0; c < RESPONSES; c++) {
+        cf_metadata_free(&resp[c].metadata);
+    }
+    mem_pool_destroy(mem);
+    return rc == 0 ? 0 : 1;
+}
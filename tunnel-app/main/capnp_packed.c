@@ -0,0 +1,277 @@
+/*
+ * Phase 4: Cap'n Proto packed encoding (see capnp_packed.h).
+ */
+
+#include "capnp_packed.h"
+#include "capnp_minimal.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/* CAPNP_PACKED_SCALAR builds the word-at-a-time path (as on ESP32) on
+ * any host, so capnp_packed_bench.c can check it against the others. */
+#if !defined(CAPNP_PACKED_SCALAR) && defined(__AVX2__)
+#define PACKED_AVX2 1
+#endif
+#if !defined(CAPNP_PACKED_SCALAR) && (defined(__AVX2__) || defined(__SSE2__))
+#define PACKED_SSE2 1
+#endif
+
+#if defined(PACKED_AVX2)
+#include <immintrin.h>
+#elif defined(PACKED_SSE2)
+#include <emmintrin.h>
+#endif
+
+/* Longest run after a 0x00 or 0xFF tag */
+#define PACKED_RUN_MAX 255
+
+/* ── Word scanning ───────────────────────────────────────────────── */
+
+/* Tag of the word at `p`: bit i is set when byte i is non-zero. */
+static inline unsigned word_tag(const uint8_t *p)
+{
+#if defined(PACKED_SSE2)
+    __m128i v = _mm_loadl_epi64((const __m128i *)p);
+    unsigned zero = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return ~zero & 0xFF;
+#else
+    unsigned tag = 0;
+    for (int i = 0; i < 8; i++) {
+        tag |= (unsigned)(p[i] != 0) << i;
+    }
+    return tag;
+#endif
+}
+
+/* A word with at most one zero byte (`zero` = its zero-byte mask) is
+ * cheaper copied verbatim than tagged. */
+static inline bool is_dense(unsigned zero)
+{
+    return (zero & (zero - 1)) == 0;
+}
+
+/* Number of all-zero words at `p`, up to `max`. */
+static size_t zero_run(const uint8_t *p, size_t max)
+{
+    size_t n = 0;
+#if defined(PACKED_AVX2)
+    while (max - n >= 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + n * 8));
+        uint32_t nonzero = ~(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        if (nonzero) {
+            return n + (size_t)__builtin_ctz(nonzero) / 8;
+        }
+        n += 4;
+    }
+#endif
+#if defined(PACKED_SSE2)
+    while (max - n >= 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + n * 8));
+        uint32_t nonzero = ~(uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xFFFF;
+        if (nonzero) {
+            return n + (size_t)__builtin_ctz(nonzero) / 8;
+        }
+        n += 2;
+    }
+#endif
+    while (n < max && word_tag(p + n * 8) == 0) {
+        n++;
+    }
+    return n;
+}
+
+/* Number of dense words at `p` (see is_dense), up to `max`. */
+static size_t dense_run(const uint8_t *p, size_t max)
+{
+    size_t n = 0;
+#if defined(PACKED_AVX2)
+    while (max - n >= 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + n * 8));
+        uint32_t zero = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        for (int k = 0; k < 4; k++, zero >>= 8) {
+            if (!is_dense(zero & 0xFF)) {
+                return n + (size_t)k;
+            }
+        }
+        n += 4;
+    }
+#endif
+    while (n < max && is_dense(~word_tag(p + n * 8) & 0xFF)) {
+        n++;
+    }
+    return n;
+}
+
+/* ── Packing ─────────────────────────────────────────────────────── */
+
+size_t capnp_packed_bound(size_t len)
+{
+    /* Worst case: a 0xFF tag, its word and a zero count per word */
+    return len + len / 4;
+}
+
+size_t capnp_pack(const uint8_t *in, size_t len, uint8_t *out, size_t out_cap)
+{
+    if (len % 8 != 0) {
+        return 0;
+    }
+    size_t words = len / 8;
+    size_t i = 0, o = 0;
+
+    while (i < words) {
+        const uint8_t *w = in + i * 8;
+        size_t rest = words - i - 1;
+        size_t max = rest < PACKED_RUN_MAX ? rest : PACKED_RUN_MAX;
+        unsigned tag = word_tag(w);
+
+        if (tag == 0) {
+            size_t n = zero_run(w + 8, max);
+            if (out_cap - o < 2) {
+                return 0;
+            }
+            out[o++] = 0;
+            out[o++] = (uint8_t)n;
+            i += 1 + n;
+        } else if (tag == 0xFF) {
+            size_t n = dense_run(w + 8, max);
+            if (out_cap - o < 10 + n * 8) {
+                return 0;
+            }
+            out[o++] = 0xFF;
+            memcpy(out + o, w, 8);
+            o += 8;
+            out[o++] = (uint8_t)n;
+            memcpy(out + o, w + 8, n * 8);
+            o += n * 8;
+            i += 1 + n;
+        } else {
+            size_t n = (size_t)__builtin_popcount(tag);
+            if (out_cap - o < 1 + n) {
+                return 0;
+            }
+            out[o++] = (uint8_t)tag;
+            uint8_t *p = out + o;
+            if (out_cap - o >= 8) {
+                /* Room to store every byte and keep only the non-zero */
+                for (int k = 0; k < 8; k++) {
+                    *p = w[k];
+                    p += (tag >> k) & 1;
+                }
+            } else {
+                for (int k = 0; k < 8; k++) {
+                    if ((tag >> k) & 1) {
+                        *p++ = w[k];
+                    }
+                }
+            }
+            o += n;
+            i++;
+        }
+    }
+    return o;
+}
+
+/* ── Unpacking ───────────────────────────────────────────────────── */
+
+/* Size of the message whose first `len` bytes are unpacked at `msg`:
+ * 0 while its segment table is incomplete, CAPNP_WIRE_INVALID if the
+ * table is malformed. */
+static size_t message_size(const uint8_t *msg, size_t len)
+{
+    uint64_t segs = (uint64_t)capnp_read_le32(msg) + 1;
+    if (segs > CAPNP_MAX_SEGMENTS) {
+        return CAPNP_WIRE_INVALID;
+    }
+    size_t header = (4 + 4 * (size_t)segs + 7) & ~(size_t)7;
+    if (len < header) {
+        return 0;
+    }
+    uint64_t total = header;
+    for (uint32_t i = 0; i < segs; i++) {
+        total += (uint64_t)capnp_read_le32(msg + 4 + 4 * i) * 8;
+    }
+    return total < CAPNP_WIRE_INVALID ? (size_t)total : CAPNP_WIRE_INVALID;
+}
+
+int capnp_unpack_message(const uint8_t *in, size_t in_len,
+                         uint8_t *out, size_t out_cap,
+                         size_t *consumed, size_t *out_len)
+{
+    size_t ip = 0, op = 0, need = 0;
+
+    while (need == 0 || op < need) {
+        if (ip == in_len) {
+            return 1;
+        }
+        unsigned tag = in[ip++];
+
+        if (tag == 0) {
+            if (ip == in_len) {
+                return 1;
+            }
+            size_t n = 1 + (size_t)in[ip++];
+            if (n * 8 > out_cap - op) {
+                return -1;
+            }
+            memset(out + op, 0, n * 8);
+            op += n * 8;
+        } else if (tag == 0xFF) {
+            if (in_len - ip < 9) {
+                return 1;
+            }
+            size_t n = in[ip + 8];
+            if ((1 + n) * 8 > out_cap - op) {
+                return -1;
+            }
+            if (in_len - ip - 9 < n * 8) {
+                return 1;
+            }
+            memcpy(out + op, in + ip, 8);
+            memcpy(out + op + 8, in + ip + 9, n * 8);
+            ip += 9 + n * 8;
+            op += (1 + n) * 8;
+        } else {
+            if (in_len - ip < (size_t)__builtin_popcount(tag)) {
+                return 1;
+            }
+            if (out_cap - op < 8) {
+                return -1;
+            }
+            uint8_t *w = out + op;
+            if (in_len - ip >= 8) {
+                /* Room to read ahead: take each byte or zero, no branches */
+                for (int k = 0; k < 8; k++) {
+                    unsigned bit = (tag >> k) & 1;
+                    w[k] = in[ip] & (uint8_t)-bit;
+                    ip += bit;
+                }
+            } else {
+                for (int k = 0; k < 8; k++) {
+                    unsigned bit = (tag >> k) & 1;
+                    w[k] = bit ? in[ip] : 0;
+                    ip += bit;
+                }
+            }
+            op += 8;
+        }
+
+        if (need == 0 && op >= 8) {
+            need = message_size(out, op);
+            if (need == CAPNP_WIRE_INVALID || need > out_cap) {
+                return -1;
+            }
+        }
+    }
+
+    /* Runs never cross into the next message */
+    if (op != need) {
+        return -1;
+    }
+    *consumed = ip;
+    *out_len = op;
+    return 0;
+}
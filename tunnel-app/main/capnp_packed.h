@@ -0,0 +1,40 @@
+#pragma once
+/*
+ * Phase 4: Cap'n Proto packed encoding.
+ *
+ * The standard packing (https://capnproto.org/encoding.html#packing):
+ * every 8-byte word becomes a tag byte, with bit i set when byte i is
+ * non-zero, followed by the non-zero bytes.  Tag 0x00 is followed by a
+ * count of further all-zero words, and tag 0xFF by a count of words copied
+ * verbatim after it.  Messages here are mostly pointers, small integers and
+ * NUL-padded text, so they typically shrink by a third to a half.
+ *
+ * The edge talks unpacked on both the control and data streams, so nothing
+ * is packed on the wire by default; this is for peers and records that ask
+ * for it (packed RPC transports, cached or recorded messages).
+ *
+ * Zero words and verbatim runs are found 32 bytes at a time with AVX2 (16
+ * with SSE2) where the compiler targets them, and a word at a time
+ * otherwise (ESP32).  All paths produce the same bytes; capnp_packed_bench.c
+ * checks each against a reference packer and times it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Largest packed size of `len` unpacked bytes. */
+size_t capnp_packed_bound(size_t len);
+
+/* Pack `len` bytes (a multiple of 8: a whole message, segment table
+ * included) into `out`.  Returns the packed size, or 0 if `len` is not a
+ * multiple of 8 or `out_cap` is too small. */
+size_t capnp_pack(const uint8_t *in, size_t len, uint8_t *out, size_t out_cap);
+
+/* Unpack one packed message from the front of in[0, in_len) into `out`,
+ * stopping where the message (as sized by its segment table) ends.
+ * Returns 0 with *consumed packed bytes and *out_len message bytes, 1 if
+ * `in` ends before the message does, or -1 if it is malformed or does not
+ * fit in `out_cap`. */
+int capnp_unpack_message(const uint8_t *in, size_t in_len,
+                         uint8_t *out, size_t out_cap,
+                         size_t *consumed, size_t *out_len);
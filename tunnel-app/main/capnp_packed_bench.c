@@ -0,0 +1,379 @@
+/*
+ * Host check and benchmark for capnp_packed.c; not part of the firmware
+ * build.
+ *
+ * capnp_packed.c scans words with AVX2, SSE2 or one word at a time (as on
+ * ESP32), picked at compile time.  Build this once per path.  Each build
+ * checks the packer byte for byte against the plain reference below,
+ * unpacks every message again (whole, back to back, cut short, and into
+ * too small a buffer), then times both directions against a plain copy
+ * of the unpacked bytes:
+ *
+ *   cc -O2 -mavx2 -I. capnp_packed_bench.c capnp_packed.c && ./a.out
+ *   cc -O2 -I. capnp_packed_bench.c capnp_packed.c && ./a.out
+ *   cc -O2 -DCAPNP_PACKED_SCALAR -I. capnp_packed_bench.c capnp_packed.c && ./a.out
+ *
+ * Exits with 1 at the first mismatch.
+ */
+
+#include "capnp_packed.h"
+#include "capnp_minimal.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(CAPNP_PACKED_SCALAR) || !(defined(__AVX2__) || defined(__SSE2__))
+#define PATH_NAME "scalar"
+#elif defined(__AVX2__)
+#define PATH_NAME "avx2"
+#else
+#define PATH_NAME "sse2"
+#endif
+
+/* Bytes timed per message kind and direction */
+#define BENCH_BYTES (256u * 1024 * 1024)
+
+/* Messages up to this size are also unpacked from every prefix. */
+#define PREFIX_CHECK_MAX 4096
+
+/* Fill past the end of output buffers, to catch writes beyond out_cap */
+#define CANARY     0xA5
+#define CANARY_LEN 64
+
+/* ── Test messages ───────────────────────────────────────────────── */
+
+static uint64_t s_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return s_rng;
+}
+
+static uint8_t nonzero_byte(void)
+{
+    return (uint8_t)(1 + rng() % 255);
+}
+
+typedef enum {
+    WORD_ZERO,
+    WORD_POINTER,   /* Low half set, as struct and list pointers */
+    WORD_INT,       /* One or two low bytes */
+    WORD_TEXT,      /* Printable bytes, NUL-padded at the end of a string */
+    WORD_DENSE,     /* No zero byte at all */
+    WORD_RANDOM,
+} word_kind_t;
+
+typedef struct {
+    const char *name;
+    int weight[WORD_RANDOM + 1];  /* Odds of each word kind, in percent */
+    size_t max_run;               /* Longest run of one kind */
+} msg_kind_t;
+
+static const msg_kind_t s_kinds[] = {
+    { "rpc",    { 40, 30, 15, 15,  0,   0 },   4 },
+    { "text",   { 10,  5,  5, 80,  0,   0 },  16 },
+    { "zeros",  { 90,  5,  0,  5,  0,   0 }, 600 },
+    { "dense",  {  5,  0,  0,  5, 90,   0 }, 600 },
+    { "random", {  0,  0,  0,  0,  0, 100 },   1 },
+};
+
+static void fill_word(uint8_t *w, word_kind_t kind)
+{
+    memset(w, 0, 8);
+    switch (kind) {
+    case WORD_ZERO:
+        break;
+    case WORD_POINTER:
+        for (int k = 0; k < 4; k++) {
+            w[k] = (uint8_t)rng();
+        }
+        w[4] = (uint8_t)(rng() % 4);
+        break;
+    case WORD_INT:
+        w[0] = nonzero_byte();
+        if (rng() % 2) {
+            w[1] = (uint8_t)rng();
+        }
+        break;
+    case WORD_TEXT: {
+        int len = rng() % 4 ? 8 : (int)(rng() % 8);
+        for (int k = 0; k < len; k++) {
+            w[k] = (uint8_t)(' ' + rng() % 95);
+        }
+        break;
+    }
+    case WORD_DENSE:
+        for (int k = 0; k < 8; k++) {
+            w[k] = nonzero_byte();
+        }
+        if (rng() % 8 == 0) {
+            w[rng() % 8] = 0;   /* Still dense: one zero byte */
+        }
+        break;
+    case WORD_RANDOM:
+        for (int k = 0; k < 8; k++) {
+            w[k] = (uint8_t)rng();
+        }
+        break;
+    }
+}
+
+/* A single-segment message of `words` words (segment table included). */
+static void build_message(uint8_t *msg, size_t words, const msg_kind_t *kind)
+{
+    capnp_write_le32(msg, 0);
+    capnp_write_le32(msg + 4, (uint32_t)(words - 1));
+    size_t i = 1;
+    while (i < words) {
+        int pick = (int)(rng() % 100);
+        word_kind_t k = WORD_ZERO;
+        while (pick >= kind->weight[k]) {
+            pick -= kind->weight[k];
+            k++;
+        }
+        size_t run = 1 + rng() % kind->max_run;
+        for (; run > 0 && i < words; run--, i++) {
+            fill_word(msg + i * 8, k);
+        }
+    }
+}
+
+/* ── Reference packer ────────────────────────────────────────────── */
+
+static int zero_bytes(const uint8_t *w)
+{
+    int n = 0;
+    for (int k = 0; k < 8; k++) {
+        n += w[k] == 0;
+    }
+    return n;
+}
+
+/* The encoding spelled out a word at a time, with the same choice of
+ * verbatim runs (words with at most one zero byte). */
+static size_t ref_pack(const uint8_t *in, size_t len, uint8_t *out)
+{
+    size_t i = 0, o = 0;
+    while (i < len) {
+        const uint8_t *w = in + i;
+        unsigned tag = 0;
+        for (int k = 0; k < 8; k++) {
+            tag |= (unsigned)(w[k] != 0) << k;
+        }
+        out[o++] = (uint8_t)tag;
+        i += 8;
+        if (tag == 0) {
+            size_t n = 0;
+            while (i < len && n < 255 && zero_bytes(in + i) == 8) {
+                n++;
+                i += 8;
+            }
+            out[o++] = (uint8_t)n;
+        } else if (tag == 0xFF) {
+            memcpy(out + o, w, 8);
+            o += 8;
+            size_t n = 0;
+            while (i + n * 8 < len && n < 255 && zero_bytes(in + i + n * 8) <= 1) {
+                n++;
+            }
+            out[o++] = (uint8_t)n;
+            memcpy(out + o, in + i, n * 8);
+            o += n * 8;
+            i += n * 8;
+        } else {
+            for (int k = 0; k < 8; k++) {
+                if (w[k]) {
+                    out[o++] = w[k];
+                }
+            }
+        }
+    }
+    return o;
+}
+
+/* ── Checks ──────────────────────────────────────────────────────── */
+
+static int fail(const char *kind, size_t len, const char *what)
+{
+    fprintf(stderr, "FAIL [%s] %s message of %zu bytes: %s\n",
+            PATH_NAME, kind, len, what);
+    return -1;
+}
+
+static bool canary_intact(const uint8_t *p)
+{
+    for (size_t i = 0; i < CANARY_LEN; i++) {
+        if (p[i] != CANARY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int check_message(const char *kind, const uint8_t *msg, size_t len)
+{
+    size_t bound = capnp_packed_bound(len);
+    uint8_t *packed = malloc(2 * bound + CANARY_LEN);
+    uint8_t *ref = malloc(bound);
+    uint8_t *out = malloc(2 * len + CANARY_LEN);
+    int rc = -1;
+    if (!packed || !ref || !out) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+
+    size_t n = capnp_pack(msg, len, packed, bound);
+    size_t n_ref = ref_pack(msg, len, ref);
+    if (n == 0 || n != n_ref || memcmp(packed, ref, n) != 0) {
+        fail(kind, len, "packed bytes differ from the reference");
+        goto done;
+    }
+
+    /* One byte short: no output, nothing written past out_cap */
+    memset(packed, CANARY, n - 1 + CANARY_LEN);
+    if (capnp_pack(msg, len, packed, n - 1) != 0 ||
+        !canary_intact(packed + n - 1)) {
+        fail(kind, len, "packing into a short buffer");
+        goto done;
+    }
+    capnp_pack(msg, len, packed, bound);
+
+    /* Whole, and followed by a second copy */
+    memcpy(packed + n, packed, n);
+    size_t consumed = 0, out_len = 0;
+    if (capnp_unpack_message(packed, 2 * n, out, 2 * len,
+                             &consumed, &out_len) != 0 ||
+        consumed != n || out_len != len || memcmp(out, msg, len) != 0) {
+        fail(kind, len, "round trip");
+        goto done;
+    }
+
+    /* Cut short: more input needed, never an error */
+    if (len <= PREFIX_CHECK_MAX) {
+        for (size_t k = 0; k < n; k++) {
+            if (capnp_unpack_message(packed, k, out, len,
+                                     &consumed, &out_len) != 1) {
+                fail(kind, len, "unpacking a truncated message");
+                goto done;
+            }
+        }
+    }
+
+    /* Output a word short: rejected, nothing written past out_cap */
+    memset(out, CANARY, len - 8 + CANARY_LEN);
+    if (capnp_unpack_message(packed, n, out, len - 8,
+                             &consumed, &out_len) != -1 ||
+        !canary_intact(out + len - 8)) {
+        fail(kind, len, "unpacking into a short buffer");
+        goto done;
+    }
+    rc = 0;
+
+done:
+    free(packed);
+    free(ref);
+    free(out);
+    return rc;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double mb_per_s(size_t bytes, double seconds)
+{
+    return (double)bytes / (1024.0 * 1024.0) / seconds;
+}
+
+/* Pack and unpack `msg` over and over, and copy it as the unpacked path
+ * would, `BENCH_BYTES` of message bytes each. */
+static int bench_message(const char *kind, const uint8_t *msg, size_t len)
+{
+    size_t bound = capnp_packed_bound(len);
+    uint8_t *packed = malloc(bound);
+    uint8_t *out = malloc(len);
+    if (!packed || !out) {
+        free(packed);
+        free(out);
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    size_t rounds = BENCH_BYTES / len;
+    size_t n = 0, consumed, out_len;
+    volatile uint8_t sink = 0;
+
+    double t0 = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        n = capnp_pack(msg, len, packed, bound);
+        sink ^= packed[r % n];
+    }
+    double t1 = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        capnp_unpack_message(packed, n, out, len, &consumed, &out_len);
+        sink ^= out[r % len];
+    }
+    double t2 = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        memcpy(out, msg, len);
+        sink ^= out[r % len];
+    }
+    double t3 = now_s();
+    (void)sink;
+
+    printf("%-6s %6zu B  packed %5.1f%%  pack %7.0f MB/s  unpack %7.0f MB/s"
+           "  copy %7.0f MB/s\n",
+           kind, len, 100.0 * (double)n / (double)len,
+           mb_per_s(rounds * len, t1 - t0), mb_per_s(rounds * len, t2 - t1),
+           mb_per_s(rounds * len, t3 - t2));
+    free(packed);
+    free(out);
+    return 0;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 16, 64, 520, 4096, 65536 };
+    size_t max_len = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    uint8_t *msg = malloc(max_len);
+    if (!msg) {
+        return 1;
+    }
+
+    printf("capnp_packed: %s path\n", PATH_NAME);
+    for (size_t k = 0; k < sizeof(s_kinds) / sizeof(s_kinds[0]); k++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (int rep = 0; rep < 50; rep++) {
+                build_message(msg, sizes[s] / 8, &s_kinds[k]);
+                if (check_message(s_kinds[k].name, msg, sizes[s]) != 0) {
+                    free(msg);
+                    return 1;
+                }
+            }
+        }
+    }
+    printf("checks passed\n");
+
+    for (size_t k = 0; k < sizeof(s_kinds) / sizeof(s_kinds[0]); k++) {
+        static const size_t bench_sizes[] = { 520, 65536 };
+        for (size_t s = 0; s < 2; s++) {
+            build_message(msg, bench_sizes[s] / 8, &s_kinds[k]);
+            if (bench_message(s_kinds[k].name, msg, bench_sizes[s]) != 0) {
+                free(msg);
+                return 1;
+            }
+        }
+    }
+    free(msg);
+    return 0;
+}
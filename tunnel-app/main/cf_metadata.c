@@ -0,0 +1,155 @@
+/*
+ * Phase 5: Metadata lists for ConnectRequest / ConnectResponse
+ * (see cf_metadata.h).
+ */
+
+#include "cf_metadata.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "cf_metadata";
+
+/* First allocation of each buffer; a typical request needs a few
+ * hundred bytes of strings and around a dozen entries. */
+#define METADATA_ARENA_INIT 512
+#define METADATA_ITEMS_INIT 16
+
+void cf_metadata_init(cf_metadata_list_t *l, mem_pool_t *mem)
+{
+    memset(l, 0, sizeof(*l));
+    l->mem = mem;
+}
+
+void cf_metadata_clear(cf_metadata_list_t *l)
+{
+    l->arena_len = 0;
+    l->count = 0;
+}
+
+void cf_metadata_free(cf_metadata_list_t *l)
+{
+    mem_pool_put(l->mem, l->arena);
+    mem_pool_put(l->mem, l->items);
+    cf_metadata_init(l, l->mem);
+}
+
+static int grow_arena(cf_metadata_list_t *l, size_t need)
+{
+    if (need > UINT32_MAX) {
+        ESP_LOGE(TAG, "metadata arena full");
+        return -1;
+    }
+    char *arena = mem_pool_grow(l->mem, l->arena, l->arena_len,
+                                need > METADATA_ARENA_INIT
+                                ? need : METADATA_ARENA_INIT);
+    if (!arena) {
+        ESP_LOGE(TAG, "out of memory for %zu metadata bytes", need);
+        return -1;
+    }
+    l->arena = arena;
+    l->arena_cap = mem_pool_capacity(arena);
+    return 0;
+}
+
+static int grow_items(cf_metadata_list_t *l, size_t need)
+{
+    size_t want = l->cap ? l->cap * 2 : METADATA_ITEMS_INIT;
+    if (want < need) {
+        want = need;
+    }
+    cf_metadata_t *items = mem_pool_grow(l->mem, l->items,
+                                         l->count * sizeof(cf_metadata_t),
+                                         want * sizeof(cf_metadata_t));
+    if (!items) {
+        ESP_LOGE(TAG, "out of memory for %zu metadata entries", want);
+        return -1;
+    }
+    l->items = items;
+    l->cap = mem_pool_capacity(items) / sizeof(cf_metadata_t);
+    return 0;
+}
+
+int cf_metadata_reserve(cf_metadata_list_t *l, size_t bytes, size_t entries)
+{
+    if (l->arena_len + bytes > l->arena_cap &&
+        grow_arena(l, l->arena_len + bytes) != 0) {
+        return -1;
+    }
+    if (l->count + entries > l->cap &&
+        grow_items(l, l->count + entries) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int cf_metadata_intern(cf_metadata_list_t *l, const char *prefix,
+                       const char *s, size_t len, cf_span_t *out)
+{
+    size_t plen = prefix ? strlen(prefix) : 0;
+    size_t need = l->arena_len + plen + len + 1;
+    if (need > l->arena_cap && grow_arena(l, need) != 0) {
+        return -1;
+    }
+
+    char *p = l->arena + l->arena_len;
+    if (plen > 0) {
+        memcpy(p, prefix, plen);
+    }
+    if (len > 0) {
+        memcpy(p + plen, s, len);
+    }
+    p[plen + len] = '\0';
+
+    out->off = (uint32_t)l->arena_len;
+    out->len = (uint32_t)(plen + len);
+    l->arena_len = need;
+    return 0;
+}
+
+int cf_metadata_add(cf_metadata_list_t *l, const char *prefix,
+                    const char *key, size_t key_len,
+                    const char *val, size_t val_len)
+{
+    if (l->count == l->cap && grow_items(l, l->count + 1) != 0) {
+        return -1;
+    }
+
+    cf_metadata_t *md = &l->items[l->count];
+    if (cf_metadata_intern(l, prefix, key, key_len, &md->key) != 0 ||
+        cf_metadata_intern(l, NULL, val, val_len, &md->val) != 0) {
+        return -1;
+    }
+    l->count++;
+    return 0;
+}
+
+const char *cf_metadata_str(const cf_metadata_list_t *l, cf_span_t s)
+{
+    return s.len > 0 ? l->arena + s.off : "";
+}
+
+const char *cf_metadata_key(const cf_metadata_list_t *l, size_t i)
+{
+    return cf_metadata_str(l, l->items[i].key);
+}
+
+const char *cf_metadata_val(const cf_metadata_list_t *l, size_t i)
+{
+    return cf_metadata_str(l, l->items[i].val);
+}
+
+const char *cf_metadata_find(const cf_metadata_list_t *l, const char *key)
+{
+    size_t klen = strlen(key);
+    for (size_t i = 0; i < l->count; i++) {
+        const cf_metadata_t *md = &l->items[i];
+        if (md->key.len == klen &&
+            memcmp(cf_metadata_str(l, md->key), key, klen) == 0) {
+            return cf_metadata_str(l, md->val);
+        }
+    }
+    return NULL;
+}
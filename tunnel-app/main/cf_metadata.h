@@ -0,0 +1,52 @@
+#pragma once
+/*
+ * Phase 5: Metadata lists for ConnectRequest / ConnectResponse.
+ *
+ * Every key and value (and a request's dest) is copied once into the
+ * list's bump arena and referred to by a cf_span_t, i.e. by offset, so
+ * the arena can grow without invalidating entries.  Buffers come from
+ * the list's mem pool and are kept across cf_metadata_clear(), so a
+ * recycled list usually appends without allocating.
+ *
+ * Strings returned by the accessors point into the arena: they stay
+ * valid until the next append (which may move it) or clear.
+ */
+
+#include <stddef.h>
+#include "tunnel_types.h"
+#include "mem_pool.h"
+
+/* Start an empty list backed by `mem` (NULL = heap). */
+void cf_metadata_init(cf_metadata_list_t *l, mem_pool_t *mem);
+
+/* Drop every entry but keep the buffers for reuse. */
+void cf_metadata_clear(cf_metadata_list_t *l);
+
+/* Return the buffers to the pool.  The list stays valid and empty. */
+void cf_metadata_free(cf_metadata_list_t *l);
+
+/* Make room for `bytes` more arena bytes (count the NULs: one per
+ * string) and `entries` more entries, so that appends within that
+ * budget do not allocate.  Returns 0, or -1 on OOM. */
+int cf_metadata_reserve(cf_metadata_list_t *l, size_t bytes, size_t entries);
+
+/* Copy `prefix` (may be NULL) followed by s[0, len) into the arena.
+ * Returns 0, or -1 on OOM. */
+int cf_metadata_intern(cf_metadata_list_t *l, const char *prefix,
+                       const char *s, size_t len, cf_span_t *out);
+
+/* Append an entry whose key is `prefix` (may be NULL) + key[0, key_len).
+ * Returns 0, or -1 on OOM. */
+int cf_metadata_add(cf_metadata_list_t *l, const char *prefix,
+                    const char *key, size_t key_len,
+                    const char *val, size_t val_len);
+
+/* NUL-terminated string for a span of this list ("" when empty). */
+const char *cf_metadata_str(const cf_metadata_list_t *l, cf_span_t s);
+
+/* Key and value of entry `i`. */
+const char *cf_metadata_key(const cf_metadata_list_t *l, size_t i);
+const char *cf_metadata_val(const cf_metadata_list_t *l, size_t i);
+
+/* Value of the first entry whose key is exactly `key`, or NULL. */
+const char *cf_metadata_find(const cf_metadata_list_t *l, const char *key);
@@ -2,39 +2,43 @@
 /*
  * Phase 4: Register tunnel via control stream.
  *
- * This encodes Cap'n Proto RPC messages for the RegisterConnection call.
- *
  * The control stream is the first bidirectional stream opened after QUIC
- * handshake.  The Go implementation uses full Cap'n Proto RPC (Bootstrap +
- * Call).  We implement a minimal hand-written encoder for exactly those
- * two messages, and a decoder for the Return message.
+ * handshake.  It carries a Cap'n Proto RPC session (rpc_session.h) on
+ * which we register the connection and answer the edge's calls.
  *
  * Protocol sequence:
  *   1. Client sends Bootstrap message  (get server's root interface)
- *   2. Client sends Call message        (invoke RegisterConnection)
- *   3. Server sends Return message      (ConnectionResponse)
+ *   2. Client sends Call message        (invoke RegisterConnection,
+ *                                        pipelined on the Bootstrap)
+ *   3. Server sends Return messages     (capability, ConnectionResponse)
+ *   4. Client sends Finish for each
  */
 
 #include "tunnel_types.h"
+#include "rpc_session.h"
 
-/* Encode the full registration request sequence (Bootstrap + Call).
- *
- * Writes two consecutive Cap'n Proto RPC messages into buf:
- *   [Bootstrap message][Call message]
- *
- * Returns 0 on success, -1 on error.  Sets *out_len to total bytes written. */
-int control_stream_encode_register(
+/* Send Bootstrap and the RegisterConnection call pipelined on it.  `done`
+ * gets the call's Return; pass it to control_stream_decode_response().
+ * Returns the call's question ID, or -1 on error. */
+int control_stream_register(
+    rpc_session_t *s,
     const cf_tunnel_auth_t *auth,
     const uint8_t *tunnel_id, size_t tunnel_id_len,
     uint8_t conn_index,
     const cf_conn_options_t *options,
-    uint8_t *buf, size_t buf_cap, size_t *out_len);
+    rpc_return_fn done, void *arg);
 
-/* Decode a registration response from control stream data.
- *
- * Expects a Cap'n Proto RPC Return message containing a ConnectionResponse.
+/* Decode the Return of RegisterConnection into a registration result.
  *
- * Returns 0 on success, -1 on error. */
+ * Returns 0 on success (result->success or result->error set), -1 if the
+ * Return is malformed.  result->should_retry is cleared only by a
+ * ConnectionError the edge sent with shouldRetry unset; an exception, a
+ * canceled call or an error that cannot be read leaves it set. */
 int control_stream_decode_response(
-    const uint8_t *data, size_t len,
+    const rpc_return_t *ret,
     cf_registration_result_t *result);
+
+/* Export the interfaces the edge calls on the control stream
+ * (SessionManager, ConfigurationManager) as our bootstrap capability.
+ * Returns 0 on success, -1 on error. */
+int control_stream_serve(rpc_session_t *s);
@@ -0,0 +1,480 @@
+/*
+ * Host check and benchmark for control_stream.c; not part of the firmware
+ * build.
+ *
+ * Registers on a fresh RPC session whose transport captures what is sent,
+ * and reads the Bootstrap and the registerConnection Call back with the
+ * generic reader, field by field.  Then builds the registerConnection
+ * results the edge returns (ConnectionDetails, and a ConnectionError) and
+ * checks control_stream_decode_response() on them, on the exception and
+ * canceled Returns, and on results cut short at every length.  Last, it
+ * times the registration encode (session setup subtracted) and the
+ * decode of each Return.  capnp_schema.h is generated from schema/ first:
+ *
+ *   python3 schema/capnp_gen.py -o capnp_schema.h \
+ *       schema/rpc.capnp:RPC schema/tunnelrpc.capnp:TUNNEL \
+ *       schema/quic_metadata_protocol.capnp:STREAM
+ *   cc -O2 -I. -Ihost control_stream_bench.c control_stream.c rpc_session.c \
+ *       capnp_minimal.c cf_metadata.c mem_pool.c -lpthread && ./a.out
+ *
+ * Exits with 1 at the first mismatch.
+ */
+
+#include "control_stream.h"
+#include "capnp_minimal.h"
+#include "capnp_schema.h"
+#include "mem_pool.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Registrations and Return decodes timed */
+#define BENCH_OPS (1u * 1024 * 1024)
+
+#define MSG_CAP 4096
+
+/* ── Registration ────────────────────────────────────────────────── */
+
+/* Captures the messages a session sends, back to back. */
+typedef struct {
+    uint8_t buf[4 * MSG_CAP];
+    size_t used;
+    size_t reserved;
+    size_t count;
+    size_t off[4];
+    size_t len[4];
+} capture_t;
+
+static uint8_t *capture_reserve(void *arg, size_t len)
+{
+    capture_t *c = arg;
+    if (c->count == 4 || c->used + len > sizeof(c->buf)) {
+        return NULL;
+    }
+    c->reserved = len;
+    return c->buf + c->used;
+}
+
+static int capture_commit(void *arg, size_t len)
+{
+    capture_t *c = arg;
+    if (len > c->reserved) {
+        return -1;
+    }
+    c->off[c->count] = c->used;
+    c->len[c->count] = len;
+    c->count++;
+    c->used += len;
+    return 0;
+}
+
+static void capture_reset(capture_t *c)
+{
+    c->used = 0;
+    c->count = 0;
+}
+
+static const uint8_t s_tunnel_id[16] = {
+    0x3f, 0x1c, 0x9a, 0x62, 0x0b, 0x4e, 0x4d, 0x71,
+    0x8e, 0x25, 0xc4, 0x0d, 0x93, 0x5a, 0x17, 0xe8,
+};
+static const uint8_t s_client_id[16] = {
+    0x52, 0x8b, 0x31, 0xf0, 0x6d, 0x14, 0x4a, 0x9c,
+    0xb7, 0x02, 0x5e, 0xe3, 0x48, 0xc1, 0x76, 0x2f,
+};
+static const uint8_t s_secret[32] = {
+    0x8a, 0x41, 0xd2, 0x67, 0x1e, 0xb9, 0x30, 0xc5,
+    0x74, 0x0f, 0xe6, 0x5b, 0x92, 0x28, 0xad, 0x13,
+    0x69, 0xf4, 0x3c, 0x87, 0x50, 0xcb, 0x1a, 0xde,
+    0x25, 0x98, 0x6e, 0xb1, 0x04, 0x7f, 0xc2, 0x3d,
+};
+
+static const cf_tunnel_auth_t s_auth = {
+    .account_tag = "5ab4e9dfbd435d24068829fda0077963",
+    .tunnel_secret = s_secret,
+    .tunnel_secret_len = sizeof(s_secret),
+};
+
+static const cf_conn_options_t s_options = {
+    .client_id = s_client_id,
+    .version = "esp32-cloudflared/0.1.0",
+    .arch = "esp32s3",
+    .replace_existing = true,
+    .num_previous_attempts = 2,
+};
+
+/* ── Checks ──────────────────────────────────────────────────────── */
+
+/* Send stderr to /dev/null while malformed messages are fed on purpose,
+ * so their ESP_LOGE lines do not bury the results; returns the saved
+ * descriptor for loud(). */
+static int quiet(void)
+{
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    return saved;
+}
+
+static void loud(int saved)
+{
+    if (saved >= 0) {
+        fflush(stderr);
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+}
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "FAIL %s\n", what);
+    return -1;
+}
+
+static bool data_is(const capnp_reader_t *r, size_t ptr_offset,
+                    const void *data, size_t len)
+{
+    size_t got;
+    const uint8_t *p = capnp_read_data(r, ptr_offset, &got);
+    return p && got == len && memcmp(p, data, len) == 0;
+}
+
+static bool text_is(const capnp_reader_t *r, size_t ptr_offset, const char *s)
+{
+    size_t got;
+    const char *p = capnp_read_text(r, ptr_offset, &got);
+    return p && got == strlen(s) && memcmp(p, s, got) == 0;
+}
+
+/* Root Message of a captured message, and its union member. */
+static int read_message(const capture_t *c, size_t i, capnp_reader_t *r,
+                        uint16_t *which, size_t *body,
+                        uint16_t *body_dw, uint16_t *body_pc)
+{
+    size_t msg;
+    uint16_t dw, pc;
+    if (capnp_read_message(c->buf + c->off[i], c->len[i], r) != 0 ||
+        capnp_read_struct_ptr(r, 0, &msg, &dw, &pc) != 0) {
+        return -1;
+    }
+    *which = capnp_read_uint16(r, msg, RPC_MESSAGE_WHICH);
+    return capnp_read_struct_ptr(r, msg + CAPNP_PTR(dw, RPC_MESSAGE_CALL_PTR),
+                                 body, body_dw, body_pc);
+}
+
+static int check_register(capture_t *c)
+{
+    rpc_transport_t tr = { capture_reserve, capture_commit, c };
+    rpc_session_t *s = rpc_session_create(&tr, NULL);
+    if (!s) {
+        return fail("session");
+    }
+    capture_reset(c);
+    int call = control_stream_register(s, &s_auth, s_tunnel_id,
+                                       sizeof(s_tunnel_id), 3, &s_options,
+                                       NULL, NULL);
+    rpc_session_destroy(s);
+    if (call < 0 || c->count != 2) {
+        return fail("register");
+    }
+
+    capnp_reader_t r;
+    uint16_t which, dw, pc;
+    size_t boot, body;
+    if (read_message(c, 0, &r, &which, &boot, &dw, &pc) != 0 ||
+        which != RPC_MESSAGE_WHICH_BOOTSTRAP) {
+        return fail("bootstrap message");
+    }
+    uint32_t boot_id = capnp_read_uint32(&r, boot, RPC_BOOTSTRAP_QUESTION_ID);
+
+    if (read_message(c, 1, &r, &which, &body, &dw, &pc) != 0 ||
+        which != RPC_MESSAGE_WHICH_CALL ||
+        capnp_read_uint32(&r, body, RPC_CALL_QUESTION_ID) != (uint32_t)call ||
+        (uint32_t)call == boot_id ||
+        capnp_read_uint64(&r, body, RPC_CALL_INTERFACE_ID) != TUNNEL_REGISTRATION_SERVER_ID ||
+        capnp_read_uint16(&r, body, RPC_CALL_METHOD_ID) !=
+            TUNNEL_REGISTRATION_SERVER_REGISTER_CONNECTION) {
+        return fail("call header");
+    }
+
+    size_t payload, params, auth, options, client;
+    uint16_t pdw, ppc, adw, apc, odw, opc, cdw, cpc;
+    if (capnp_read_struct_ptr(&r, body + CAPNP_PTR(dw, RPC_CALL_PARAMS_PTR),
+                              &payload, &pdw, &ppc) != 0 ||
+        capnp_read_struct_ptr(&r, payload + CAPNP_PTR(pdw, RPC_PAYLOAD_CONTENT_PTR),
+                              &params, &pdw, &ppc) != 0 ||
+        capnp_read_uint8(&r, params, TUNNEL_REGISTER_CONNECTION_PARAMS_CONN_INDEX) != 3 ||
+        !data_is(&r, params + CAPNP_PTR(pdw, TUNNEL_REGISTER_CONNECTION_PARAMS_TUNNEL_ID_PTR),
+                 s_tunnel_id, sizeof(s_tunnel_id))) {
+        return fail("params");
+    }
+    if (capnp_read_struct_ptr(&r, params + CAPNP_PTR(pdw, TUNNEL_REGISTER_CONNECTION_PARAMS_AUTH_PTR),
+                              &auth, &adw, &apc) != 0 ||
+        !text_is(&r, auth + CAPNP_PTR(adw, TUNNEL_TUNNEL_AUTH_ACCOUNT_TAG_PTR),
+                 s_auth.account_tag) ||
+        !data_is(&r, auth + CAPNP_PTR(adw, TUNNEL_TUNNEL_AUTH_TUNNEL_SECRET_PTR),
+                 s_secret, sizeof(s_secret))) {
+        return fail("auth");
+    }
+    if (capnp_read_struct_ptr(&r, params + CAPNP_PTR(pdw, TUNNEL_REGISTER_CONNECTION_PARAMS_OPTIONS_PTR),
+                              &options, &odw, &opc) != 0 ||
+        !capnp_read_bool(&r, options, TUNNEL_CONNECTION_OPTIONS_REPLACE_EXISTING,
+                         TUNNEL_CONNECTION_OPTIONS_REPLACE_EXISTING_BIT) ||
+        capnp_read_uint8(&r, options, TUNNEL_CONNECTION_OPTIONS_NUM_PREVIOUS_ATTEMPTS) != 2 ||
+        capnp_read_struct_ptr(&r, options + CAPNP_PTR(odw, TUNNEL_CONNECTION_OPTIONS_CLIENT_PTR),
+                              &client, &cdw, &cpc) != 0 ||
+        !data_is(&r, client + CAPNP_PTR(cdw, TUNNEL_CLIENT_INFO_CLIENT_ID_PTR),
+                 s_client_id, sizeof(s_client_id)) ||
+        !text_is(&r, client + CAPNP_PTR(cdw, TUNNEL_CLIENT_INFO_VERSION_PTR),
+                 s_options.version) ||
+        !text_is(&r, client + CAPNP_PTR(cdw, TUNNEL_CLIENT_INFO_ARCH_PTR),
+                 s_options.arch)) {
+        return fail("options");
+    }
+    return 0;
+}
+
+/* ── Returns ─────────────────────────────────────────────────────── */
+
+/* registerConnection results as the root of a message, so that the
+ * Return's content pointer is at 0.  details selects the union member;
+ * an error carries shouldRetry as given. */
+static size_t encode_results(bool details, bool retry, uint8_t *out, size_t cap)
+{
+    uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    capnp_builder_init(&b, seg, sizeof(seg));
+
+    if (capnp_alloc(&b, 1) < 0) {
+        return 0;
+    }
+    int results = capnp_new_struct(&b, 0, TUNNEL_REGISTER_CONNECTION_RESULTS_DATA_WORDS,
+                                   TUNNEL_REGISTER_CONNECTION_RESULTS_PTR_COUNT);
+    if (results < 0) {
+        return 0;
+    }
+    int cr = capnp_new_struct(&b, (size_t)results +
+                              CAPNP_PTR(TUNNEL_REGISTER_CONNECTION_RESULTS_DATA_WORDS,
+                                        TUNNEL_REGISTER_CONNECTION_RESULTS_RESULT_PTR),
+                              TUNNEL_CONNECTION_RESPONSE_DATA_WORDS,
+                              TUNNEL_CONNECTION_RESPONSE_PTR_COUNT);
+    if (cr < 0) {
+        return 0;
+    }
+    size_t slot = (size_t)cr + CAPNP_PTR(TUNNEL_CONNECTION_RESPONSE_DATA_WORDS,
+                                         TUNNEL_CONNECTION_RESPONSE_RESULT_ERROR_PTR);
+
+    if (details) {
+        capnp_write_le16(capnp_at(&b, (size_t)cr + TUNNEL_CONNECTION_RESPONSE_RESULT_WHICH),
+                         TUNNEL_CONNECTION_RESPONSE_RESULT_WHICH_CONNECTION_DETAILS);
+        int d = capnp_new_struct(&b, slot, TUNNEL_CONNECTION_DETAILS_DATA_WORDS,
+                                 TUNNEL_CONNECTION_DETAILS_PTR_COUNT);
+        if (d < 0 ||
+            capnp_write_data(&b, (size_t)d + CAPNP_PTR(TUNNEL_CONNECTION_DETAILS_DATA_WORDS,
+                                                       TUNNEL_CONNECTION_DETAILS_UUID_PTR),
+                             s_tunnel_id, sizeof(s_tunnel_id)) != 0 ||
+            capnp_write_text(&b, (size_t)d + CAPNP_PTR(TUNNEL_CONNECTION_DETAILS_DATA_WORDS,
+                                                       TUNNEL_CONNECTION_DETAILS_LOCATION_NAME_PTR),
+                             "sjc07") != 0) {
+            return 0;
+        }
+        *capnp_at(&b, (size_t)d + TUNNEL_CONNECTION_DETAILS_TUNNEL_IS_REMOTELY_MANAGED) |=
+            1 << TUNNEL_CONNECTION_DETAILS_TUNNEL_IS_REMOTELY_MANAGED_BIT;
+    } else {
+        int e = capnp_new_struct(&b, slot, TUNNEL_CONNECTION_ERROR_DATA_WORDS,
+                                 TUNNEL_CONNECTION_ERROR_PTR_COUNT);
+        if (e < 0 ||
+            capnp_write_text(&b, (size_t)e + CAPNP_PTR(TUNNEL_CONNECTION_ERROR_DATA_WORDS,
+                                                       TUNNEL_CONNECTION_ERROR_CAUSE_PTR),
+                             "connection limit reached for this tunnel") != 0) {
+            return 0;
+        }
+        capnp_write_le64(capnp_at(&b, (size_t)e + TUNNEL_CONNECTION_ERROR_RETRY_AFTER),
+                         5000000000ull);
+        if (retry) {
+            *capnp_at(&b, (size_t)e + TUNNEL_CONNECTION_ERROR_SHOULD_RETRY) |=
+                1 << TUNNEL_CONNECTION_ERROR_SHOULD_RETRY_BIT;
+        }
+    }
+    return capnp_finalize(&b, out, cap);
+}
+
+static int decode_results(const uint8_t *msg, size_t len,
+                          cf_registration_result_t *result)
+{
+    capnp_reader_t r;
+    if (capnp_read_message(msg, len, &r) != 0) {
+        return -1;
+    }
+    rpc_return_t ret = {
+        .which = RPC_RETURN_WHICH_RESULTS,
+        .reader = &r,
+        .content = 0,
+        .cap = RPC_NO_CAP,
+    };
+    return control_stream_decode_response(&ret, result);
+}
+
+static int check_returns(const uint8_t *details, size_t details_len,
+                         const uint8_t *error, size_t error_len)
+{
+    cf_registration_result_t res;
+    if (decode_results(details, details_len, &res) != 0 || !res.success ||
+        strcmp(res.uuid, "3f1c9a62-0b4e-4d71-8e25-c40d935a17e8") != 0 ||
+        strcmp(res.location, "sjc07") != 0 || !res.tunnel_is_remote) {
+        return fail("details Return");
+    }
+
+    int saved = quiet();
+    int rc = decode_results(error, error_len, &res);
+    loud(saved);
+    if (rc != 0 || res.success || !res.should_retry ||
+        res.retry_after_ns != 5000000000ll ||
+        strcmp(res.error, "connection limit reached for this tunnel") != 0) {
+        return fail("error Return");
+    }
+
+    /* Only a refusal with shouldRetry unset stops retrying */
+    uint8_t refused[MSG_CAP];
+    size_t refused_len = encode_results(false, false, refused, sizeof(refused));
+    saved = quiet();
+    rc = decode_results(refused, refused_len, &res);
+    loud(saved);
+    if (refused_len == 0 || rc != 0 || res.success || res.should_retry) {
+        return fail("refused Return");
+    }
+
+    capnp_reader_t r = { 0 };
+    rpc_return_t ret = {
+        .which = RPC_RETURN_WHICH_EXCEPTION,
+        .reader = &r,
+        .reason = { "worker shutting down", 20 },
+    };
+    saved = quiet();
+    rc = control_stream_decode_response(&ret, &res);
+    ret.which = RPC_RETURN_WHICH_CANCELED;
+    cf_registration_result_t canceled;
+    int rc_canceled = control_stream_decode_response(&ret, &canceled);
+    loud(saved);
+    if (rc != 0 || res.success || !res.should_retry ||
+        strcmp(res.error, "worker shutting down") != 0 ||
+        rc_canceled != 0 || canceled.success || !canceled.should_retry) {
+        return fail("exception and canceled Returns");
+    }
+
+    /* Cut short anywhere, results are malformed or at most an error. */
+    saved = quiet();
+    for (size_t cut = 0; cut < details_len; cut++) {
+        if (decode_results(details, cut, &res) == 0 && res.success) {
+            loud(saved);
+            return fail("truncated results read as registered");
+        }
+    }
+    loud(saved);
+    return 0;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double ns_per_op(double seconds)
+{
+    return seconds * 1e9 / (double)BENCH_OPS;
+}
+
+static int bench_register(capture_t *c)
+{
+    rpc_transport_t tr = { capture_reserve, capture_commit, c };
+    volatile uintptr_t sink = 0;
+
+    /* Session setup alone, to subtract */
+    double t0 = now_s();
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        rpc_session_t *s = rpc_session_create(&tr, NULL);
+        sink ^= (uintptr_t)s;
+        rpc_session_destroy(s);
+    }
+    double t_setup = now_s() - t0;
+
+    t0 = now_s();
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        rpc_session_t *s = rpc_session_create(&tr, NULL);
+        capture_reset(c);
+        if (!s || control_stream_register(s, &s_auth, s_tunnel_id,
+                                          sizeof(s_tunnel_id), 3, &s_options,
+                                          NULL, NULL) < 0) {
+            rpc_session_destroy(s);
+            return fail("register");
+        }
+        rpc_session_destroy(s);
+    }
+    double t_register = now_s() - t0;
+    (void)sink;
+
+    printf("registration encode (Bootstrap %zu + Call %zu bytes)  %7.1f ns\n",
+           c->len[0], c->len[1], ns_per_op(t_register - t_setup));
+    return 0;
+}
+
+static int bench_return(const char *name, const uint8_t *msg, size_t len)
+{
+    cf_registration_result_t res;
+    volatile int sink = 0;
+    int saved = quiet();
+    double t0 = now_s();
+    for (size_t i = 0; i < BENCH_OPS; i++) {
+        if (decode_results(msg, len, &res) != 0) {
+            loud(saved);
+            return fail("decode");
+        }
+        sink += res.success;
+    }
+    double t = now_s() - t0;
+    loud(saved);
+    (void)sink;
+    printf("Return decode (%s, %zu bytes)%*s%7.1f ns\n", name, len,
+           (int)(25 - strlen(name)), "", ns_per_op(t));
+    return 0;
+}
+
+int main(void)
+{
+    static capture_t capture;
+    uint8_t details[MSG_CAP], error[MSG_CAP];
+    size_t details_len = encode_results(true, true, details, sizeof(details));
+    size_t error_len = encode_results(false, true, error, sizeof(error));
+
+    int rc = check_register(&capture);
+    if (rc == 0 && (details_len == 0 || error_len == 0)) {
+        rc = fail("encode results");
+    }
+    if (rc == 0) {
+        rc = check_returns(details, details_len, error, error_len);
+    }
+    if (rc == 0) {
+        printf("checks passed\n\n");
+        rc = bench_register(&capture);
+    }
+    if (rc == 0) {
+        rc = bench_return("details", details, details_len);
+    }
+    if (rc == 0) {
+        rc = bench_return("error", error, error_len);
+    }
+    return rc == 0 ? 0 : 1;
+}
@@ -10,6 +10,7 @@
 
 #include "data_stream.h"
 #include "capnp_minimal.h"
+#include "cf_metadata.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -24,8 +25,8 @@ static const char *TAG = "data_stream";
  *  Parse incoming ConnectRequest
  * ──────────────────────────────────────────────────────────────── */
 
-int data_stream_parse_request(const uint8_t *data, size_t len,
-                              cf_connect_request_t *req)
+int data_stream_view_request(const uint8_t *data, size_t len,
+                             capnp_connect_request_view_t *view)
 {
     if (len < PREAMBLE_LEN) {
         ESP_LOGE(TAG, "data too short for preamble: %zu bytes", len);
@@ -50,8 +51,18 @@ int data_stream_parse_request(const uint8_t *data, size_t len,
              len - PREAMBLE_LEN);
 
     /* Decode Cap'n Proto ConnectRequest from remaining bytes */
-    return capnp_decode_connect_request(data + PREAMBLE_LEN,
-                                        len - PREAMBLE_LEN, req);
+    return capnp_view_connect_request(data + PREAMBLE_LEN,
+                                      len - PREAMBLE_LEN, view);
+}
+
+int data_stream_parse_request(const uint8_t *data, size_t len,
+                              cf_connect_request_t *req)
+{
+    capnp_connect_request_view_t view;
+    if (data_stream_view_request(data, len, &view) != 0) {
+        return -1;
+    }
+    return capnp_connect_request_copy(&view, req);
 }
 
 /* ────────────────────────────────────────────────────────────────
@@ -63,7 +74,7 @@ size_t data_stream_request_size(const uint8_t *data, size_t len)
     if (len < PREAMBLE_LEN) return 0;
     size_t capnp_size = capnp_wire_message_size(data + PREAMBLE_LEN,
                                                  len - PREAMBLE_LEN);
-    if (capnp_size == 0) return 0;
+    if (capnp_size == 0 || capnp_size == CAPNP_WIRE_INVALID) return capnp_size;
     return PREAMBLE_LEN + capnp_size;
 }
 
@@ -71,6 +82,11 @@ size_t data_stream_request_size(const uint8_t *data, size_t len)
  *  Build outgoing ConnectResponse
  * ──────────────────────────────────────────────────────────────── */
 
+size_t data_stream_response_size(const cf_connect_response_t *resp)
+{
+    return capnp_connect_response_size(resp);
+}
+
 int data_stream_build_response(const cf_connect_response_t *resp,
                                uint8_t *buf, size_t buf_cap,
                                size_t *out_len)
@@ -86,12 +102,7 @@ int data_stream_build_response(const cf_connect_response_t *resp,
 /* Search metadata for a key (case-sensitive match). */
 static const char *find_metadata(const cf_connect_request_t *req, const char *key)
 {
-    for (size_t i = 0; i < req->metadata_count; i++) {
-        if (strcmp(req->metadata[i].key, key) == 0) {
-            return req->metadata[i].val;
-        }
-    }
-    return NULL;
+    return cf_metadata_find(&req->metadata, key);
 }
 
 const char *data_stream_get_method(const cf_connect_request_t *req)
@@ -113,51 +124,31 @@ const char *data_stream_get_host(const cf_connect_request_t *req)
  * ──────────────────────────────────────────────────────────────── */
 
 int data_stream_build_http_metadata(int status_code,
-                                    const cf_metadata_t *headers,
-                                    size_t header_count,
+                                    const cf_metadata_list_t *headers,
                                     cf_connect_response_t *resp)
 {
-    memset(resp, 0, sizeof(*resp));
-
-    size_t idx = 0;
+    resp->error[0] = '\0';     /* No error string for successful responses */
+    cf_metadata_clear(&resp->metadata);
 
     /* HttpStatus metadata entry */
-    if (idx >= CF_MAX_METADATA) {
-        ESP_LOGE(TAG, "metadata overflow adding HttpStatus");
+    char status[12];
+    int n = snprintf(status, sizeof(status), "%d", status_code);
+    if (cf_metadata_add(&resp->metadata, NULL, "HttpStatus", 10,
+                        status, (size_t)n) != 0) {
         return -1;
     }
-    snprintf(resp->metadata[idx].key, sizeof(resp->metadata[idx].key), "HttpStatus");
-    snprintf(resp->metadata[idx].val, sizeof(resp->metadata[idx].val), "%d", status_code);
-    idx++;
 
     /* Copy response headers as "HttpHeader:<Name>" entries */
-    for (size_t i = 0; i < header_count; i++) {
-        if (idx >= CF_MAX_METADATA) {
-            ESP_LOGW(TAG, "metadata overflow at header %zu/%zu", i, header_count);
-            break;
+    for (size_t i = 0; i < headers->count; i++) {
+        const cf_metadata_t *h = &headers->items[i];
+        if (cf_metadata_add(&resp->metadata, "HttpHeader:",
+                            cf_metadata_str(headers, h->key), h->key.len,
+                            cf_metadata_str(headers, h->val), h->val.len) != 0) {
+            return -1;
         }
-
-        /* Truncation is safe here - snprintf guarantees NUL-termination */
-        #pragma GCC diagnostic push
-        #pragma GCC diagnostic ignored "-Wformat-truncation"
-        snprintf(resp->metadata[idx].key, sizeof(resp->metadata[idx].key),
-                 "HttpHeader:%s", headers[i].key);
-        #pragma GCC diagnostic pop
-
-        size_t val_len = strlen(headers[i].val);
-        size_t copy_len = val_len < sizeof(resp->metadata[idx].val) - 1
-                              ? val_len : sizeof(resp->metadata[idx].val) - 1;
-        memcpy(resp->metadata[idx].val, headers[i].val, copy_len);
-        resp->metadata[idx].val[copy_len] = '\0';
-
-        idx++;
     }
 
-    resp->metadata_count = idx;
-    /* No error string for successful responses */
-    resp->error[0] = '\0';
-
     ESP_LOGD(TAG, "built HTTP metadata: status=%d, %zu entries total",
-             status_code, idx);
+             status_code, resp->metadata.count);
     return 0;
 }
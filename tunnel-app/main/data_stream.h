@@ -14,6 +14,13 @@
  */
 
 #include "tunnel_types.h"
+#include "capnp_minimal.h"
+
+/* Check a data stream's initial bytes (signature + version + capnp) and
+ * view the ConnectRequest in place, without copying anything.  The view
+ * points into `data`.  Returns 0 on success, -1 on error. */
+int data_stream_view_request(const uint8_t *data, size_t len,
+                             capnp_connect_request_view_t *view);
 
 /* Parse a data stream's initial bytes into a ConnectRequest.
  * The input must include the full preamble (signature + version + capnp).
@@ -21,6 +28,9 @@
 int data_stream_parse_request(const uint8_t *data, size_t len,
                               cf_connect_request_t *req);
 
+/* Exact number of bytes data_stream_build_response() writes for `resp`. */
+size_t data_stream_response_size(const cf_connect_response_t *resp);
+
 /* Build a data stream response from a ConnectResponse.
  * Writes signature + version + capnp into buf.
  * Returns 0 on success, -1 on error.  Sets *out_len to bytes written. */
@@ -29,13 +39,14 @@ int data_stream_build_response(const cf_connect_response_t *resp,
                                size_t *out_len);
 
 /* Calculate total bytes consumed by preamble + ConnectRequest capnp message.
- * Returns 0 if the data is too short or malformed.
+ * Returns 0 if the data is too short, or CAPNP_WIRE_INVALID if its
+ * segment table is malformed (no amount of data will complete it).
  * The HTTP body, if any, starts at data + returned_size. */
 size_t data_stream_request_size(const uint8_t *data, size_t len);
 
 /* Extract HTTP method from ConnectRequest metadata.
  * Returns pointer to the value string, or NULL if not found.
- * The returned pointer is into req->metadata and valid while req lives. */
+ * The returned pointer is into req's metadata arena. */
 const char *data_stream_get_method(const cf_connect_request_t *req);
 
 /* Extract HTTP host from ConnectRequest metadata.
@@ -43,9 +54,8 @@ const char *data_stream_get_method(const cf_connect_request_t *req);
 const char *data_stream_get_host(const cf_connect_request_t *req);
 
 /* Build response metadata for an HTTP response.
- * Populates resp with status code and headers as metadata entries.
- * Returns 0 on success, -1 on overflow. */
+ * Replaces resp's metadata with the status code and headers.
+ * Returns 0 on success, -1 on OOM. */
 int data_stream_build_http_metadata(int status_code,
-                                    const cf_metadata_t *headers,
-                                    size_t header_count,
+                                    const cf_metadata_list_t *headers,
                                     cf_connect_response_t *resp);
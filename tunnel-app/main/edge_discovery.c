@@ -0,0 +1,140 @@
+/*
+ * Phase 3: Edge address discovery.
+ *
+ * Resolves the edge regions the HA connections are spread over; see
+ * edge_discovery.h.
+ */
+
+#include "edge_discovery.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "edge_discovery";
+
+/* Resolve one region's host into `region`.  Returns 0, or -1 if it has no
+ * usable address. */
+static int resolve_region(edge_region_t *region, const char *host,
+                          uint16_t port, edge_ip_version_t ip_version)
+{
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = ip_version == EDGE_IP_V4 ? AF_INET :
+                        ip_version == EDGE_IP_V6 ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", port);
+
+    snprintf(region->host, sizeof(region->host), "%s", host);
+    region->count = 0;
+
+    int rc = getaddrinfo(host, port_str, &hints, &res);
+    if (rc != 0 || !res) {
+        ESP_LOGE(TAG, "getaddrinfo(%s:%s) failed: %s", host, port_str,
+                 gai_strerror(rc));
+        return -1;
+    }
+
+    /* Auto: IPv4 if the region has any, like most of our targets' stacks */
+    int family = AF_UNSPEC;
+    if (ip_version == EDGE_IP_AUTO) {
+        family = AF_INET6;
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            if (ai->ai_family == AF_INET) {
+                family = AF_INET;
+                break;
+            }
+        }
+    }
+
+    for (struct addrinfo *ai = res; ai && region->count < EDGE_MAX_ADDRS;
+         ai = ai->ai_next) {
+        if ((family != AF_UNSPEC && ai->ai_family != family) ||
+            ai->ai_addrlen > sizeof(region->addrs[0])) {
+            continue;
+        }
+        memcpy(&region->addrs[region->count], ai->ai_addr, ai->ai_addrlen);
+        region->count++;
+    }
+    freeaddrinfo(res);
+
+    if (region->count == 0) {
+        ESP_LOGE(TAG, "%s resolved to no usable address", host);
+        return -1;
+    }
+    char buf[64];
+    for (size_t i = 0; i < region->count; i++) {
+        ESP_LOGI(TAG, "%s: %s", host,
+                 edge_addr_str((const struct sockaddr *)&region->addrs[i],
+                               buf, sizeof(buf)));
+    }
+    return 0;
+}
+
+int edge_discovery_resolve(edge_addrs_t *out, const char *host, uint16_t port,
+                           edge_ip_version_t ip_version)
+{
+    static const char *const s_regions[EDGE_MAX_REGIONS] = {
+        EDGE_REGION1_HOST, EDGE_REGION2_HOST,
+    };
+
+    memset(out, 0, sizeof(*out));
+    if (host != NULL) {
+        out->num_regions = 1;
+        return resolve_region(&out->regions[0], host, port, ip_version);
+    }
+    for (size_t i = 0; i < EDGE_MAX_REGIONS; i++) {
+        if (resolve_region(&out->regions[i], s_regions[i], port, ip_version) != 0) {
+            return -1;
+        }
+    }
+    out->num_regions = EDGE_MAX_REGIONS;
+    return 0;
+}
+
+const struct sockaddr *edge_addr_for(const edge_addrs_t *edges,
+                                     uint8_t conn_index, uint32_t attempt)
+{
+    const edge_region_t *region = &edges->regions[conn_index % edges->num_regions];
+    size_t slot = conn_index / edges->num_regions + attempt;
+    return (const struct sockaddr *)&region->addrs[slot % region->count];
+}
+
+int edge_addrs_family(const edge_addrs_t *edges)
+{
+    int family = AF_UNSPEC;
+    for (size_t r = 0; r < edges->num_regions; r++) {
+        for (size_t i = 0; i < edges->regions[r].count; i++) {
+            int f = edges->regions[r].addrs[i].ss_family;
+            if (family != AF_UNSPEC && f != family) {
+                return AF_UNSPEC;
+            }
+            family = f;
+        }
+    }
+    return family;
+}
+
+const char *edge_addr_str(const struct sockaddr *addr, char *buf, size_t len)
+{
+    char ip[INET6_ADDRSTRLEN] = "?";
+    unsigned port = 0;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        port = ntohs(in->sin_port);
+        snprintf(buf, len, "%s:%u", ip, port);
+    } else {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        port = ntohs(in6->sin6_port);
+        snprintf(buf, len, "[%s]:%u", ip, port);
+    }
+    return buf;
+}
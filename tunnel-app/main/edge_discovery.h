@@ -0,0 +1,57 @@
+#pragma once
+/*
+ * Phase 3: Edge address discovery.
+ *
+ * cloudflared spreads its connections over two edge regions, the targets
+ * of the _v2-origintunneld._tcp.argotunnel.com SRV record (see
+ * components/cloudflared EdgeDiscovery::ResolveEdgeAddrs).  lwIP has no
+ * SRV lookup, so the two well-known targets are resolved directly; each
+ * region keeps its addresses in resolver order, filtered by IP version.
+ *
+ * Connection `i` goes to region i % num_regions, and successive attempts
+ * of the same connection walk that region's addresses, so two connections
+ * never share an address while the region has enough of them.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#define EDGE_REGION1_HOST   "region1.v2.argotunnel.com"
+#define EDGE_REGION2_HOST   "region2.v2.argotunnel.com"
+
+#define EDGE_MAX_REGIONS    2
+#define EDGE_MAX_ADDRS      8       /* Per region */
+
+typedef enum {
+    EDGE_IP_AUTO = 0,   /* IPv4 where the region has any, else IPv6 */
+    EDGE_IP_V4 = 4,
+    EDGE_IP_V6 = 6,
+} edge_ip_version_t;
+
+typedef struct {
+    char host[64];
+    struct sockaddr_storage addrs[EDGE_MAX_ADDRS];
+    size_t count;
+} edge_region_t;
+
+typedef struct {
+    edge_region_t regions[EDGE_MAX_REGIONS];
+    size_t num_regions;
+} edge_addrs_t;
+
+/* Resolve the edge regions on `port`.  With `host` set (e.g. CF_EDGE),
+ * that single host is the only region.  Returns 0, or -1 if a region has
+ * no usable address. */
+int edge_discovery_resolve(edge_addrs_t *out, const char *host, uint16_t port,
+                           edge_ip_version_t ip_version);
+
+/* Address for attempt `attempt` of connection `conn_index`. */
+const struct sockaddr *edge_addr_for(const edge_addrs_t *edges,
+                                     uint8_t conn_index, uint32_t attempt);
+
+/* Address family shared by all addresses, or AF_UNSPEC if mixed. */
+int edge_addrs_family(const edge_addrs_t *edges);
+
+/* Format an address as "ip:port" for logs. */
+const char *edge_addr_str(const struct sockaddr *addr, char *buf, size_t len);
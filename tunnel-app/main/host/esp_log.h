@@ -0,0 +1,14 @@
+#pragma once
+/*
+ * esp_log.h for the host checks and benchmarks next to the sources (the
+ * *_bench.c programs); not part of the firmware build.  Errors go to
+ * stderr, everything else is compiled out.
+ */
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
@@ -0,0 +1,166 @@
+/*
+ * Phase 6: HTTP/1.x response head parser (see http_parse.h).
+ */
+
+#include "http_parse.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* ── Byte scanning ───────────────────────────────────────────────── */
+
+/* First occurrence of `c` in [p, end), or `end`. */
+static const char *scan_byte(const char *p, const char *end, char c)
+{
+#if defined(__AVX2__)
+    const __m256i want32 = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, want32));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i want16 = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, want16));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != c) {
+        p++;
+    }
+    return p;
+}
+
+/* ── End of head ─────────────────────────────────────────────────── */
+
+size_t http_head_end(http_head_scan_t *scan, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    const char *p = buf + scan->scanned;
+
+    for (;;) {
+        const char *lf = scan_byte(p, end, '\n');
+        if (lf == end) {
+            scan->scanned = len;
+            return 0;
+        }
+        /* A blank line is an LF right after the previous one, optionally
+         * with a CR in between. */
+        size_t at = (size_t)(lf - buf);
+        if ((at >= 1 && buf[at - 1] == '\n') ||
+            (at >= 2 && buf[at - 1] == '\r' && buf[at - 2] == '\n')) {
+            scan->scanned = at + 1;
+            return at + 1;
+        }
+        p = lf + 1;
+    }
+}
+
+/* ── Head parsing ────────────────────────────────────────────────── */
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/* Header names are tokens; reject the characters that would make one
+ * ambiguous (whitespace, controls, separators that matter here). */
+static bool is_name_char(char c)
+{
+    unsigned char u = (unsigned char)c;
+    return u > 0x20 && u < 0x7f && c != ':';
+}
+
+int http_parse_response(const char *buf, size_t len, int *minor, int *status,
+                        http_header_t *headers, size_t *num_headers)
+{
+    const char *end = buf + len;
+    size_t max_headers = *num_headers;
+    *num_headers = 0;
+
+    /* "HTTP/1.x NNN[ reason]" */
+    if (len < 12 || memcmp(buf, "HTTP/1.", 7) != 0 || !is_digit(buf[7]) ||
+        buf[8] != ' ' || !is_digit(buf[9]) || !is_digit(buf[10]) ||
+        !is_digit(buf[11])) {
+        return -1;
+    }
+    *minor  = buf[7] - '0';
+    *status = (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+    const char *line = scan_byte(buf + 12, end, '\n');
+    if (line == end) {
+        return -1;
+    }
+    line++;
+
+    size_t count = 0;
+    while (line < end) {
+        const char *lf = scan_byte(line, end, '\n');
+        if (lf == end) {
+            return -1;
+        }
+        const char *eol = lf;
+        if (eol > line && eol[-1] == '\r') {
+            eol--;
+        }
+        if (eol == line) {
+            break;                          /* Blank line: end of head */
+        }
+        const char *colon = scan_byte(line, eol, ':');
+        if (colon == eol || colon == line) {
+            return -1;                      /* Also rejects obs-fold lines */
+        }
+        for (const char *c = line; c < colon; c++) {
+            if (!is_name_char(*c)) {
+                return -1;
+            }
+        }
+
+        const char *v = colon + 1;
+        while (v < eol && (*v == ' ' || *v == '\t')) {
+            v++;
+        }
+        const char *v_end = eol;
+        while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+            v_end--;
+        }
+
+        if (count < max_headers) {
+            headers[count].name      = line;
+            headers[count].name_len  = (size_t)(colon - line);
+            headers[count].value     = v;
+            headers[count].value_len = (size_t)(v_end - v);
+        }
+        count++;
+        line = lf + 1;
+    }
+
+    /* Past the array, lines are still checked and counted. */
+    if (count > max_headers) {
+        *num_headers = count;
+        return HTTP_PARSE_MORE_HEADERS;
+    }
+    *num_headers = count;
+    return 0;
+}
+
+bool http_header_is(const http_header_t *h, const char *name)
+{
+    size_t n = strlen(name);
+    return h->name_len == n && strncasecmp(h->name, name, n) == 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+/*
+ * Phase 6: HTTP/1.x response head parser for http_proxy.
+ *
+ * Modelled on picohttpparser: nothing is copied or allocated.  The
+ * status line is decoded into integers and every header comes back as a
+ * name/value span pointing into the caller's receive buffer, which must
+ * therefore stay put for as long as the spans are used.
+ *
+ * Finding the end of the head is incremental: http_head_end() remembers
+ * how far it has searched, so calling it after every recv() costs only
+ * the new bytes.  Line breaks and the ':' separator are found 32 or 16
+ * bytes at a time with AVX2/SSE2 where the compiler targets them, and a
+ * byte at a time otherwise (ESP32).
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Headers a caller typically makes room for; heads with more are still
+ * parsed (see HTTP_PARSE_MORE_HEADERS). */
+#define HTTP_MAX_HEADERS 64
+
+/* http_parse_response(): the head is valid but has more headers than
+ * fit in the array. */
+#define HTTP_PARSE_MORE_HEADERS 1
+
+/* One "Name: value" header; the value has surrounding whitespace
+ * stripped.  Neither span is NUL-terminated. */
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} http_header_t;
+
+/* Progress of the search for the end of a head (zero-initialise). */
+typedef struct {
+    size_t scanned;             /* Bytes of the buffer already searched */
+} http_head_scan_t;
+
+/* Look for the blank line that ends a head in buf[0, len), continuing
+ * where the previous call on the same buffer stopped.  Returns the
+ * length of the head including the blank line, or 0 if it is not
+ * complete yet. */
+size_t http_head_end(http_head_scan_t *scan, const char *buf, size_t len);
+
+/* Parse a complete response head of `len` bytes (as measured by
+ * http_head_end).  Stores the HTTP minor version, the status code and up
+ * to `*num_headers` header spans, and sets *num_headers to the number
+ * stored.  Returns 0, or -1 if the head is malformed.  A valid head with
+ * more headers than fit returns HTTP_PARSE_MORE_HEADERS with *num_headers
+ * set to how many it has, so the caller can parse again into an array
+ * that large. */
+int http_parse_response(const char *buf, size_t len, int *minor, int *status,
+                        http_header_t *headers, size_t *num_headers);
+
+/* True if `h` is named `name` (ASCII case-insensitive). */
+bool http_header_is(const http_header_t *h, const char *name);
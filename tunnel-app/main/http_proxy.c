@@ -3,19 +3,43 @@
  *
  * This implementation uses POSIX sockets and targets the Linux host build.
  * An ESP32 build would replace socket calls with esp_http_client.
+ *
+ * Responses are framed per RFC 9112 section 6.3: interim 1xx responses
+ * are skipped, HEAD/204/304 have no body, chunked bodies are decoded as
+ * they arrive, and a body ends as soon as its last byte is in rather
+ * than at the read timeout.
+ *
+ * Origin connections are HTTP/1.1 keep-alive: once a response body has
+ * been read to its framed end, the socket goes back to a small idle pool
+ * and the next request reuses it.  Pooled sockets are checked before
+ * reuse, and an idempotent request without a body that hits a socket the
+ * origin has closed meanwhile is retried once on a fresh connection.
+ *
+ * The origin host is resolved once at init and re-resolved by a small
+ * background thread every dns_refresh_ms (getaddrinfo doesn't expose the
+ * record TTL), so requests never wait on DNS.  Every returned address is
+ * kept, and connects race them happy-eyeballs style (RFC 8305),
+ * starting with the address family that connected last time.
  */
 
 #include "http_proxy.h"
 #include "http_proxy_static.h"
+#include "http_parse.h"
+#include "cf_metadata.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -25,14 +49,46 @@
 
 static const char *TAG = "http_proxy";
 
-/* Maximum response body we are willing to buffer (1 MB). */
+/* Maximum response body http_proxy_forward() is willing to buffer (1 MB).
+ * The streaming path (http_proxy_open/read_body) has no such limit. */
 #define MAX_RESPONSE_BODY  (1024 * 1024)
 
+/* Maximum size of the origin's response head (status line + headers). */
+#define MAX_RESPONSE_HEAD  (64 * 1024)
+
 /* Initial receive buffer size for the HTTP response. */
 #define RECV_BUF_INIT      4096
 
+/* Request body copy buffer (one chunk of the upload in flight). */
+#define UPLOAD_BUF_SIZE    (16 * 1024)
+
+/* Pieces of the request head gathered per sendmsg() call. */
+#define REQUEST_IOV_BATCH  64
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/* Upper bound on http_proxy_config_t.max_idle_conns. */
+#define MAX_IDLE_CONNS     32
+
+/* Origin addresses kept from one lookup. */
+#define ORIGIN_MAX_ADDRS   8
+
+/* Head start each origin address gets before the next one is raced
+ * against it (RFC 8305 "Connection Attempt Delay"). */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/* Stack for the background resolver thread (getaddrinfo only). */
+#define RESOLVER_STACK_SIZE (8 * 1024)
+
 /* ── Internal state ──────────────────────────────────────────────── */
 
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t len;
+} origin_addr_t;
+
 typedef struct {
     char host[256];
     uint16_t port;
@@ -41,23 +97,102 @@ typedef struct {
     int read_timeout_ms;
     bool initialised;
     bool static_mode;
+    mem_pool_t *mem;
+
+    /* Keep-alive pool (s_pool_lock), most recently used last */
+    int max_idle;
+    int idle_timeout_ms;
+    struct {
+        int fd;
+        uint64_t since_ms;
+    } idle[MAX_IDLE_CONNS];
+    int idle_count;
+    http_proxy_stats_t stats;
+
+    /* Origin address cache (s_addr_lock), refreshed by the resolver */
+    int dns_refresh_ms;
+    origin_addr_t addrs[ORIGIN_MAX_ADDRS];
+    int addr_count;
+    int preferred_family;   /* Family of the last address that connected */
+    pthread_t resolver;
+    bool resolver_running;
+    bool resolver_stop;
+    bool resolve_now;
 } proxy_state_t;
 
 static proxy_state_t s_state;
+static pthread_mutex_t s_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t s_addr_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_addr_cv   = PTHREAD_COND_INITIALIZER;
+
+/* Chunked transfer coding (RFC 9112 section 7.1), decoded incrementally
+ * as body bytes arrive. */
+typedef enum {
+    CHUNK_SIZE,             /* Hex digits of the chunk size */
+    CHUNK_EXT,              /* Chunk extension, up to CR */
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,          /* Start of a trailer line (or final CRLF) */
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_FINAL_LF,
+    CHUNK_DONE,
+} chunk_state_t;
+
+/* An origin response whose head has been parsed and whose body is still
+ * on the socket (plus whatever arrived in the same reads as the head). */
+struct http_proxy_stream {
+    int fd;
+    int timeout_ms;
+    uint8_t *head_buf;      /* Receive buffer used for the head */
+    size_t pending_off;     /* Body bytes already in head_buf: [off, len) */
+    size_t pending_len;
+    bool have_length;       /* Framed by Content-Length */
+    size_t remaining;       /* Body bytes still expected (have_length) */
+    size_t received;        /* Body bytes handed out so far */
+    bool done;
+    uint64_t last_io_ms;    /* Pull mode: last time body bytes arrived */
+    bool chunked;           /* Transfer-Encoding: chunked (decoded) */
+    chunk_state_t chunk_state;
+    uint64_t chunk_left;    /* Size digits, then data bytes left */
+    bool head_only;         /* Response to HEAD: no body */
+    bool head_closed;       /* Origin closed before sending any byte */
+    bool keep_alive;        /* Connection may be pooled after the body */
+};
 
 /* ── Helpers (forward declarations) ──────────────────────────────── */
 
 static int  parse_origin_url(const char *url, char *host, size_t host_sz,
                              uint16_t *port, char *path, size_t path_sz);
-static int  connect_to_origin(const char *host, uint16_t port, int timeout_ms);
+static int  connect_to_origin(int timeout_ms);
+static void origin_addrs_refresh(void);
+static int  resolver_start(void);
+static void resolver_stop(void);
+static int  origin_acquire(bool allow_reuse, bool *reused);
+static void origin_release(http_proxy_stream_t *s);
 static int  send_all(int fd, const void *buf, size_t len, int timeout_ms);
-static int  send_http_request(int fd, const char *method, const char *path,
-                              const char *host, const cf_metadata_t *headers,
-                              size_t header_count, const uint8_t *body,
-                              size_t body_len, int timeout_ms);
-static int  read_http_response(int fd, cf_http_response_t *resp, int timeout_ms);
-static const char *extract_metadata_value(const cf_metadata_t *md, size_t count,
-                                          const char *key);
+static int  send_http_request(int fd, const char *method,
+                              const cf_connect_request_t *req,
+                              http_body_framing_t framing, uint64_t length,
+                              const http_body_source_t *inline_body,
+                              bool more, int timeout_ms);
+static int  buffer_source_read(void *arg, uint8_t *buf, size_t cap);
+static int  send_request_body(int fd, const http_body_source_t *body,
+                              http_body_framing_t framing, uint64_t length,
+                              int timeout_ms);
+static int  open_request(const cf_connect_request_t *req,
+                         const http_body_source_t *body,
+                         http_body_framing_t framing, uint64_t length,
+                         cf_http_response_t *resp, http_proxy_stream_t **out);
+static int  recv_with_timeout(int fd, uint8_t *buf, size_t buf_sz,
+                              size_t *out_len, int timeout_ms);
+static int  read_response_head(http_proxy_stream_t *s, cf_http_response_t *resp);
+static int  chunk_decode(http_proxy_stream_t *s, uint8_t *p, size_t n,
+                         size_t data_max, size_t *data_len);
+static bool body_complete(const http_proxy_stream_t *s);
+static int  read_body_buffered(http_proxy_stream_t *s, cf_http_response_t *resp);
 static void set_bad_gateway(cf_http_response_t *resp, const char *reason);
 
 /* ── Public API ──────────────────────────────────────────────────── */
@@ -70,6 +205,7 @@ int http_proxy_init(const http_proxy_config_t *config)
     }
 
     memset(&s_state, 0, sizeof(s_state));
+    s_state.mem = config->mem_pool;
 
     if (strcmp(config->origin_url, "static://") == 0) {
         s_state.static_mode = true;
@@ -90,119 +226,698 @@ int http_proxy_init(const http_proxy_config_t *config)
                                  ? config->connect_timeout_ms : 5000;
     s_state.read_timeout_ms    = config->read_timeout_ms > 0
                                  ? config->read_timeout_ms : 30000;
+    s_state.max_idle           = config->max_idle_conns > 0
+                                 ? config->max_idle_conns : 0;
+    if (s_state.max_idle > MAX_IDLE_CONNS) {
+        s_state.max_idle = MAX_IDLE_CONNS;
+    }
+    s_state.idle_timeout_ms    = config->idle_timeout_ms > 0
+                                 ? config->idle_timeout_ms : 30000;
+    s_state.dns_refresh_ms     = config->dns_refresh_ms > 0
+                                 ? config->dns_refresh_ms : 60000;
     s_state.initialised = true;
 
-    ESP_LOGI(TAG, "init: origin=%s:%u prefix=\"%s\" "
-             "connect_timeout=%dms read_timeout=%dms",
-             s_state.host, s_state.port, s_state.path_prefix,
-             s_state.connect_timeout_ms, s_state.read_timeout_ms);
+    /* Resolve now so the first request doesn't pay for the lookup; if the
+     * name doesn't resolve yet, connects retry it until it does. */
+    origin_addrs_refresh();
+    resolver_start();
+
+    ESP_LOGI(TAG, "init: origin=%s:%u (%d addresses) prefix=\"%s\" "
+             "connect_timeout=%dms read_timeout=%dms keep_alive=%d/%dms "
+             "dns_refresh=%dms",
+             s_state.host, s_state.port, s_state.addr_count,
+             s_state.path_prefix,
+             s_state.connect_timeout_ms, s_state.read_timeout_ms,
+             s_state.max_idle, s_state.idle_timeout_ms,
+             s_state.dns_refresh_ms);
     return 0;
 }
 
-int http_proxy_forward(const cf_connect_request_t *req,
-                       const uint8_t *body, size_t body_len,
-                       cf_http_response_t *resp)
+/* True if the comma-separated header value val[0, len) lists `token`. */
+static bool has_token_n(const char *val, size_t len, const char *token)
+{
+    size_t tlen = strlen(token);
+    for (size_t i = 0; i + tlen <= len; i++) {
+        const char *p = val + i;
+        if ((i == 0 || p[-1] == ',' || p[-1] == ' ') &&
+            strncasecmp(p, token, tlen) == 0 &&
+            (i + tlen == len || p[tlen] == ',' || p[tlen] == ' ' ||
+             p[tlen] == ';')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool has_token(const char *val, const char *token)
+{
+    return has_token_n(val, strlen(val), token);
+}
+
+static bool is_list_space(char c)
+{
+    return c == ' ' || c == '\t' || c == ',';
+}
+
+/* Length of the comma-separated header value val[0, len) without
+ * trailing separators and whitespace; 0 if it lists nothing. */
+static size_t list_trim_end(const char *val, size_t len)
+{
+    while (len > 0 && is_list_space(val[len - 1])) {
+        len--;
+    }
+    return len;
+}
+
+/* If the comma-separated header value val[0, len) ends with `token`,
+ * return the length of what comes before it, separator trimmed; else -1. */
+static ssize_t strip_last_token(const char *val, size_t len, const char *token)
+{
+    size_t tlen = strlen(token);
+    len = list_trim_end(val, len);
+    if (len < tlen || strncasecmp(val + len - tlen, token, tlen) != 0) {
+        return -1;
+    }
+    size_t rest = len - tlen;
+    if (rest > 0 && !is_list_space(val[rest - 1])) {
+        return -1;
+    }
+    return (ssize_t)list_trim_end(val, rest);
+}
+
+/* Parse a Content-Length value: digits only, surrounding whitespace
+ * allowed.  Returns 0, or -1 if it is empty, not a number or overflows. */
+static int parse_content_length(const char *val, size_t len, uint64_t *out)
+{
+    while (len > 0 && (*val == ' ' || *val == '\t')) {
+        val++;
+        len--;
+    }
+    while (len > 0 && (val[len - 1] == ' ' || val[len - 1] == '\t')) {
+        len--;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (val[i] < '0' || val[i] > '9') {
+            return -1;
+        }
+        uint64_t d = (uint64_t)(val[i] - '0');
+        if (n > (UINT64_MAX - d) / 10) {
+            return -1;
+        }
+        n = n * 10 + d;
+    }
+    *out = n;
+    return 0;
+}
+
+http_body_framing_t http_proxy_request_framing(const cf_connect_request_t *req,
+                                               uint64_t *length)
+{
+    http_body_framing_t framing = HTTP_BODY_NONE;
+    for (size_t i = 0; i < req->metadata.count; i++) {
+        const char *key = cf_metadata_key(&req->metadata, i);
+        if (strncmp(key, "HttpHeader:", 11) != 0) {
+            continue;
+        }
+        const char *name = key + 11;
+        const char *val = cf_metadata_val(&req->metadata, i);
+        if (strcasecmp(name, "Transfer-Encoding") == 0 &&
+            has_token(val, "chunked")) {
+            return HTTP_BODY_CHUNKED;       /* Overrides Content-Length */
+        }
+        if (strcasecmp(name, "Content-Length") == 0) {
+            uint64_t n = 0;
+            if (parse_content_length(val, strlen(val), &n) == 0 && n > 0) {
+                framing = HTTP_BODY_LENGTH;
+                if (length) {
+                    *length = n;
+                }
+            }
+        }
+    }
+    return framing;
+}
+
+int http_proxy_open(const cf_connect_request_t *req,
+                    const http_body_source_t *body,
+                    cf_http_response_t *resp, http_proxy_stream_t **out)
+{
+    uint64_t length = 0;
+    http_body_framing_t framing = HTTP_BODY_NONE;
+    if (req && body) {
+        framing = http_proxy_request_framing(req, &length);
+    }
+    return open_request(req, body, framing, length, resp, out);
+}
+
+static int open_request(const cf_connect_request_t *req,
+                        const http_body_source_t *body,
+                        http_body_framing_t framing, uint64_t length,
+                        cf_http_response_t *resp, http_proxy_stream_t **out)
 {
+    if (out) {
+        *out = NULL;
+    }
     if (!s_state.initialised) {
         ESP_LOGE(TAG, "forward: proxy not initialised");
         return -1;
     }
-    if (!req || !resp) {
-        ESP_LOGE(TAG, "forward: NULL req or resp");
+    if (!req || !resp || !out) {
+        ESP_LOGE(TAG, "forward: NULL req, resp or out");
         return -1;
     }
 
     if (s_state.static_mode) {
-        return http_proxy_static_forward(req, body, body_len, resp);
+        return http_proxy_static_forward(req, NULL, 0, resp);
     }
 
-    memset(resp, 0, sizeof(*resp));
+    /* Everything but the header list (and its reusable buffers). */
+    resp->status_code = 0;
+    resp->body = NULL;
+    resp->body_len = 0;
+    resp->body_static = false;
+    cf_metadata_clear(&resp->headers);
 
     /* ── 1. Extract metadata fields ───────────────────────────────── */
-    const char *method = extract_metadata_value(
-        req->metadata, req->metadata_count, "HttpMethod");
+    const char *method = cf_metadata_find(&req->metadata, "HttpMethod");
     if (!method) {
         method = "GET";
     }
 
-    /* Build the request path from dest + optional path prefix. */
-    char path[1024];
-    const char *dest = req->dest;
-    if (dest[0] == '\0') {
-        dest = "/";
-    }
-    if (s_state.path_prefix[0] != '\0'
-        && strcmp(s_state.path_prefix, "/") != 0) {
-        snprintf(path, sizeof(path), "%s%s", s_state.path_prefix, dest);
-    } else {
-        snprintf(path, sizeof(path), "%s", dest);
-    }
-
-    /* Collect forwarded headers (metadata keys starting with "HttpHeader:"). */
-    cf_metadata_t fwd_headers[CF_MAX_METADATA];
     size_t fwd_count = 0;
-    for (size_t i = 0; i < req->metadata_count && fwd_count < CF_MAX_METADATA; i++) {
-        if (strncmp(req->metadata[i].key, "HttpHeader:", 11) == 0) {
-            snprintf(fwd_headers[fwd_count].key,
-                     sizeof(fwd_headers[fwd_count].key),
-                     "%s", req->metadata[i].key + 11);
-            snprintf(fwd_headers[fwd_count].val,
-                     sizeof(fwd_headers[fwd_count].val),
-                     "%s", req->metadata[i].val);
+    for (size_t i = 0; i < req->metadata.count; i++) {
+        if (strncmp(cf_metadata_key(&req->metadata, i), "HttpHeader:", 11) == 0) {
             fwd_count++;
         }
     }
 
-    ESP_LOGI(TAG, "forward: %s %s (%zu headers, %zu body bytes)",
-             method, path, fwd_count, body_len);
-
-    /* ── 2. Connect to origin ─────────────────────────────────────── */
-    int fd = connect_to_origin(s_state.host, s_state.port,
-                               s_state.connect_timeout_ms);
-    if (fd < 0) {
-        ESP_LOGE(TAG, "forward: connection to origin failed");
-        set_bad_gateway(resp, "connection to origin failed");
-        return 0; /* resp populated with 502 */
-    }
-
-    /* ── 3. Send HTTP request ─────────────────────────────────────── */
-    if (send_http_request(fd, method, path, s_state.host,
-                          fwd_headers, fwd_count,
-                          body, body_len,
-                          s_state.read_timeout_ms) != 0) {
-        ESP_LOGE(TAG, "forward: failed to send request to origin");
-        close(fd);
-        set_bad_gateway(resp, "failed to send request to origin");
-        return 0;
+    ESP_LOGI(TAG, "forward: %s %s%s (%zu headers, body %s)",
+             method, s_state.path_prefix,
+             cf_metadata_str(&req->metadata, req->dest), fwd_count,
+             framing == HTTP_BODY_LENGTH  ? "content-length" :
+             framing == HTTP_BODY_CHUNKED ? "chunked" : "none");
+
+    /* A body that is already in memory goes out with the head, straight
+     * from its buffer; anything else is streamed after it. */
+    const http_body_source_t *inline_body = NULL;
+    if (body && framing != HTTP_BODY_CHUNKED &&
+        body->read == buffer_source_read) {
+        inline_body = body;
     }
+    bool streamed = framing != HTTP_BODY_NONE && body && !inline_body;
+
+    /* A request can be replayed on a new connection only if it is
+     * idempotent and its body (none) has not been consumed. */
+    bool retryable = framing == HTTP_BODY_NONE &&
+                     (strcasecmp(method, "GET") == 0 ||
+                      strcasecmp(method, "HEAD") == 0 ||
+                      strcasecmp(method, "OPTIONS") == 0 ||
+                      strcasecmp(method, "PUT") == 0 ||
+                      strcasecmp(method, "DELETE") == 0);
+
+    http_proxy_stream_t *s = NULL;
+    bool allow_reuse = true;
+    for (;;) {
+        /* ── 2. Connect to origin (or reuse a pooled connection) ──── */
+        bool reused = false;
+        int fd = origin_acquire(allow_reuse, &reused);
+        if (fd < 0) {
+            ESP_LOGE(TAG, "forward: connection to origin failed");
+            set_bad_gateway(resp, "connection to origin failed");
+            return 0; /* resp populated with 502 */
+        }
+
+        /* ── 3. Send HTTP request ─────────────────────────────────── */
+        if (send_http_request(fd, method, req, framing, length, inline_body,
+                              streamed, s_state.read_timeout_ms) != 0 ||
+            (streamed && send_request_body(fd, body, framing, length,
+                                           s_state.read_timeout_ms) != 0)) {
+            close(fd);
+            if (reused && retryable) {
+                ESP_LOGW(TAG, "forward: pooled connection failed, retrying");
+                goto retry;
+            }
+            ESP_LOGE(TAG, "forward: failed to send request to origin");
+            set_bad_gateway(resp, "failed to send request to origin");
+            return 0;
+        }
+
+        /* ── 4. Read HTTP response head ───────────────────────────── */
+        s = mem_pool_get_zeroed(s_state.mem, sizeof(*s));
+        if (!s) {
+            ESP_LOGE(TAG, "forward: out of memory");
+            close(fd);
+            set_bad_gateway(resp, "out of memory");
+            return 0;
+        }
+        s->fd = fd;
+        s->timeout_ms = s_state.read_timeout_ms;
+        s->head_only = strcasecmp(method, "HEAD") == 0;
 
-    /* ── 4. Read HTTP response ────────────────────────────────────── */
-    if (read_http_response(fd, resp, s_state.read_timeout_ms) != 0) {
+        if (read_response_head(s, resp) == 0) {
+            break;
+        }
+        bool stale = reused && s->head_closed;
+        http_proxy_close(s);
+        if (stale && retryable) {
+            ESP_LOGW(TAG, "forward: pooled connection closed by origin, retrying");
+            goto retry;
+        }
         ESP_LOGE(TAG, "forward: failed to read response from origin");
-        close(fd);
         set_bad_gateway(resp, "failed to read response from origin");
         return 0;
+
+    retry:
+        pthread_mutex_lock(&s_pool_lock);
+        s_state.stats.retries++;
+        pthread_mutex_unlock(&s_pool_lock);
+        /* The next pooled connection may be just as stale. */
+        allow_reuse = false;
+        retryable = false;
+    }
+
+    ESP_LOGI(TAG, "forward: origin responded %d (%s%s)", resp->status_code,
+             s->have_length ? "content-length" :
+             s->chunked ? "chunked" : "read until close",
+             s->keep_alive ? ", keep-alive" : "");
+    *out = s;
+    return 0;
+}
+
+/* Body source over a buffer that is already complete. */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t off;
+} buffer_source_t;
+
+static int buffer_source_read(void *arg, uint8_t *buf, size_t cap)
+{
+    buffer_source_t *b = (buffer_source_t *)arg;
+    size_t n = b->len - b->off;
+    if (n > cap) {
+        n = cap;
+    }
+    memcpy(buf, b->data + b->off, n);
+    b->off += n;
+    return (int)n;
+}
+
+int http_proxy_forward(const cf_connect_request_t *req,
+                       const uint8_t *body, size_t body_len,
+                       cf_http_response_t *resp)
+{
+    buffer_source_t buffer = { .data = body, .len = body ? body_len : 0 };
+    http_body_source_t source = { .read = buffer_source_read, .arg = &buffer };
+
+    /* The whole body is already here: frame it by its own length unless
+     * the edge asked for chunked encoding. */
+    uint64_t length = 0;
+    http_body_framing_t framing = HTTP_BODY_NONE;
+    if (req) {
+        framing = http_proxy_request_framing(req, &length);
+    }
+    if (framing != HTTP_BODY_CHUNKED) {
+        length = buffer.len;
+        framing = length > 0 ? HTTP_BODY_LENGTH : HTTP_BODY_NONE;
+    }
+
+    http_proxy_stream_t *s = NULL;
+    int ret = open_request(req, &source, framing, length, resp, &s);
+    if (ret != 0 || s == NULL) {
+        return ret;
     }
 
-    close(fd);
+    if (read_body_buffered(s, resp) != 0) {
+        ESP_LOGE(TAG, "forward: failed to read response body from origin");
+        http_proxy_close(s);
+        http_proxy_free_response(resp);
+        set_bad_gateway(resp, "failed to read response from origin");
+        return 0;
+    }
+    http_proxy_close(s);
 
     ESP_LOGI(TAG, "forward: origin responded %d (%zu body bytes)",
              resp->status_code, resp->body_len);
     return 0;
 }
 
+/* Read up to `want` raw body bytes: those that came with the head
+ * first, then from the socket.  *n == 0 means the origin closed. */
+static int read_raw(http_proxy_stream_t *s, uint8_t *buf, size_t want,
+                    size_t *n)
+{
+    if (s->pending_off < s->pending_len) {
+        /* Body bytes that arrived together with the head. */
+        *n = s->pending_len - s->pending_off;
+        if (*n > want) {
+            *n = want;
+        }
+        memcpy(buf, s->head_buf + s->pending_off, *n);
+        s->pending_off += *n;
+        return 0;
+    }
+    return recv_with_timeout(s->fd, buf, want, n, s->timeout_ms);
+}
+
+/* Decode chunked body bytes into `buf` until some data comes out or the
+ * last chunk has been read. */
+static int read_body_chunked(http_proxy_stream_t *s, uint8_t *buf, size_t cap)
+{
+    while (s->chunk_state != CHUNK_DONE) {
+        size_t n = 0;
+        if (read_raw(s, buf, cap, &n) != 0) {
+            return -1;
+        }
+        if (n == 0) {
+            s->done = true;
+            ESP_LOGE(TAG, "read_body: origin closed inside chunked body");
+            return -1;
+        }
+        size_t data = 0;
+        int used = chunk_decode(s, buf, n, n, &data);
+        if (used < 0) {
+            return -1;
+        }
+        if ((size_t)used < n) {
+            /* Junk after the last chunk: drop it, and the connection. */
+            s->keep_alive = false;
+        }
+        if (data > 0) {
+            s->received += data;
+            return (int)data;
+        }
+    }
+    s->done = true;
+    return 0;
+}
+
+int http_proxy_read_body(http_proxy_stream_t *s, uint8_t *buf, size_t cap)
+{
+    if (s->done || cap == 0) {
+        return 0;
+    }
+
+    size_t want = cap;
+    if (want > INT32_MAX) {
+        want = INT32_MAX;
+    }
+    if (s->chunked) {
+        return read_body_chunked(s, buf, want);
+    }
+    if (s->have_length) {
+        if (s->remaining == 0) {
+            s->done = true;
+            return 0;
+        }
+        if (want > s->remaining) {
+            want = s->remaining;
+        }
+    }
+
+    size_t n = 0;
+    if (read_raw(s, buf, want, &n) != 0) {
+        /* Treat timeout as end-of-body when we already have data. */
+        if (!s->have_length && s->received > 0) {
+            s->done = true;
+            return 0;
+        }
+        return -1;
+    }
+    if (n == 0) {
+        s->done = true;
+        if (s->have_length) {
+            ESP_LOGE(TAG, "read_body: origin closed with %zu bytes missing",
+                     s->remaining);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (s->have_length) {
+        s->remaining -= n;
+        if (s->remaining == 0) {
+            s->done = true;
+        }
+    }
+    s->received += n;
+    return (int)n;
+}
+
+/* ── Pull-mode body access ───────────────────────────────────────── */
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int http_proxy_pull_begin(http_proxy_stream_t *s)
+{
+    int avail = 0;
+    if (ioctl(s->fd, FIONREAD, &avail) != 0) {
+        ESP_LOGD(TAG, "pull: FIONREAD unavailable (%s)", strerror(errno));
+        return -1;
+    }
+    int flags = fcntl(s->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        ESP_LOGE(TAG, "pull: cannot make origin socket non-blocking");
+        return -1;
+    }
+    s->last_io_ms = now_ms();
+    return 0;
+}
+
+/* Pull mode only hands out chunk data, so step over the chunk framing
+ * in front of it: the `avail` bytes that are buffered (or readable on the
+ * socket) are decoded up to the next chunk's data and discarded. */
+static int pull_skip_framing(http_proxy_stream_t *s, size_t avail)
+{
+    size_t data = 0;
+    int used;
+    if (s->pending_off < s->pending_len) {
+        used = chunk_decode(s, s->head_buf + s->pending_off,
+                            s->pending_len - s->pending_off, 0, &data);
+        if (used < 0) {
+            return -1;
+        }
+        s->pending_off += (size_t)used;
+        return 0;
+    }
+
+    /* Peek so that data after the framing stays on the socket. */
+    uint8_t tmp[64];
+    size_t take = avail < sizeof(tmp) ? avail : sizeof(tmp);
+    ssize_t r = recv(s->fd, tmp, take, MSG_PEEK);
+    if (r <= 0) {
+        ESP_LOGE(TAG, "pull: recv() error: %s", strerror(errno));
+        return -1;
+    }
+    used = chunk_decode(s, tmp, (size_t)r, 0, &data);
+    if (used < 0) {
+        return -1;
+    }
+    if (used > 0 && recv(s->fd, tmp, (size_t)used, 0) != used) {
+        ESP_LOGE(TAG, "pull: lost chunk framing bytes");
+        return -1;
+    }
+    s->last_io_ms = now_ms();
+    return 0;
+}
+
+int http_proxy_pull_ready(http_proxy_stream_t *s, size_t max, bool *fin)
+{
+    *fin = false;
+    for (;;) {
+        if (s->chunked && s->chunk_state == CHUNK_DONE) {
+            s->done = true;
+        }
+        if (s->done) {
+            if ((s->have_length || s->chunked) && !body_complete(s)) {
+                return -1;
+            }
+            *fin = true;
+            return 0;
+        }
+        if (s->have_length && s->remaining == 0) {
+            s->done = true;
+            *fin = true;
+            return 0;
+        }
+
+        size_t n = 0;
+        if (s->pending_off < s->pending_len) {
+            n = s->pending_len - s->pending_off;
+        } else {
+            int avail = 0;
+            if (ioctl(s->fd, FIONREAD, &avail) != 0) {
+                ESP_LOGE(TAG, "pull: FIONREAD failed: %s", strerror(errno));
+                return -1;
+            }
+            if (avail > 0) {
+                n = (size_t)avail;
+            } else {
+                /* Nothing buffered: either the origin closed or it is slow. */
+                uint8_t byte;
+                ssize_t r = recv(s->fd, &byte, 1, MSG_PEEK);
+                if (r == 0) {
+                    s->done = true;
+                    if (s->have_length || s->chunked) {
+                        ESP_LOGE(TAG, "pull: origin closed before the end of the body");
+                        return -1;
+                    }
+                    *fin = true;
+                    return 0;
+                }
+                if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    ESP_LOGE(TAG, "pull: recv() error: %s", strerror(errno));
+                    return -1;
+                }
+                if (r < 0 && now_ms() - s->last_io_ms > (uint64_t)s->timeout_ms) {
+                    /* Same rule as http_proxy_read_body(). */
+                    if (!s->have_length && !s->chunked && s->received > 0) {
+                        s->done = true;
+                        *fin = true;
+                        return 0;
+                    }
+                    ESP_LOGE(TAG, "pull: timed out");
+                    return -1;
+                }
+                return 0;
+            }
+        }
+
+        if (s->chunked && s->chunk_state != CHUNK_DATA) {
+            if (pull_skip_framing(s, n) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (s->chunked && n > s->chunk_left) {
+            n = (size_t)s->chunk_left;
+        }
+        if (s->have_length && n > s->remaining) {
+            n = s->remaining;
+        }
+        if (n > max) {
+            n = max;
+        }
+        if (n > INT32_MAX) {
+            n = INT32_MAX;
+        }
+        if (s->have_length && n == s->remaining) {
+            *fin = true;
+        }
+        return (int)n;
+    }
+}
+
+int http_proxy_pull_read(http_proxy_stream_t *s, uint8_t *buf, size_t len)
+{
+    if (s->pending_off < s->pending_len) {
+        memcpy(buf, s->head_buf + s->pending_off, len);
+        s->pending_off += len;
+    } else {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t r = recv(s->fd, buf + got, len - got, 0);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                ESP_LOGE(TAG, "pull: short read (%zu of %zu bytes)", got, len);
+                return -1;
+            }
+            got += (size_t)r;
+        }
+    }
+
+    if (s->chunked) {
+        /* ready() stopped at chunk data, so these bytes are all data and
+         * decoding only advances the state. */
+        size_t data = 0;
+        if (chunk_decode(s, buf, len, len, &data) < 0) {
+            return -1;
+        }
+    }
+    if (s->have_length) {
+        s->remaining -= len;
+        if (s->remaining == 0) {
+            s->done = true;
+        }
+    }
+    s->received += len;
+    s->last_io_ms = now_ms();
+    return 0;
+}
+
+int http_proxy_pull_fd(const http_proxy_stream_t *s)
+{
+    return s->fd;
+}
+
+void http_proxy_close(http_proxy_stream_t *s)
+{
+    if (s == NULL) {
+        return;
+    }
+    if (s->fd >= 0) {
+        if (s->keep_alive && body_complete(s) && s->pending_off >= s->pending_len) {
+            origin_release(s);
+        } else {
+            close(s->fd);
+        }
+    }
+    mem_pool_put(s_state.mem, s->head_buf);
+    mem_pool_put(s_state.mem, s);
+}
+
 void http_proxy_free_response(cf_http_response_t *resp)
 {
+    if (resp) {
+        cf_metadata_free(&resp->headers);
+    }
     if (resp && resp->body) {
-        free(resp->body);
+        if (!resp->body_static) {
+            free(resp->body);
+        }
         resp->body = NULL;
         resp->body_len = 0;
+        resp->body_static = false;
     }
 }
 
+void http_proxy_get_stats(http_proxy_stats_t *stats)
+{
+    pthread_mutex_lock(&s_pool_lock);
+    *stats = s_state.stats;
+    pthread_mutex_unlock(&s_pool_lock);
+}
+
 void http_proxy_cleanup(void)
 {
-    ESP_LOGI(TAG, "cleanup");
+    resolver_stop();
+
+    pthread_mutex_lock(&s_pool_lock);
+    for (int i = 0; i < s_state.idle_count; i++) {
+        close(s_state.idle[i].fd);
+    }
+    s_state.idle_count = 0;
+    pthread_mutex_unlock(&s_pool_lock);
+
+    const http_proxy_stats_t *st = &s_state.stats;
+    ESP_LOGI(TAG, "cleanup: origin connections %" PRIu64 " opened, %" PRIu64
+             " reused, %" PRIu64 " stale, %" PRIu64 " expired, %" PRIu64 " retries",
+             st->conn_opened, st->conn_reused, st->conn_stale,
+             st->conn_expired, st->retries);
+    ESP_LOGI(TAG, "cleanup: origin lookups %" PRIu64 " (%" PRIu64 " failed), "
+             "%" PRIu64 " connect failovers",
+             st->dns_lookups, st->dns_failures, st->connect_failovers);
     s_state.initialised = false;
 }
 
@@ -272,9 +987,11 @@ static int parse_origin_url(const char *url, char *host, size_t host_sz,
     return 0;
 }
 
-/* ── TCP connection with timeout ─────────────────────────────────── */
+/* ── Origin address cache ────────────────────────────────────────── */
 
-static int connect_to_origin(const char *host, uint16_t port, int timeout_ms)
+/* Resolve the origin host into `out` (every stream address, in resolver
+ * order).  Returns the number of addresses, or -1. */
+static int resolve_origin(origin_addr_t *out, int max)
 {
     struct addrinfo hints, *res = NULL;
     memset(&hints, 0, sizeof(hints));
@@ -282,182 +999,698 @@ static int connect_to_origin(const char *host, uint16_t port, int timeout_ms)
     hints.ai_socktype = SOCK_STREAM;
 
     char port_str[8];
-    snprintf(port_str, sizeof(port_str), "%u", port);
+    snprintf(port_str, sizeof(port_str), "%u", s_state.port);
 
-    int rc = getaddrinfo(host, port_str, &hints, &res);
+    int rc = getaddrinfo(s_state.host, port_str, &hints, &res);
     if (rc != 0 || !res) {
-        ESP_LOGE(TAG, "connect: getaddrinfo(%s:%s) failed: %s",
-                 host, port_str, gai_strerror(rc));
+        ESP_LOGE(TAG, "resolve: getaddrinfo(%s:%s) failed: %s",
+                 s_state.host, port_str, gai_strerror(rc));
         return -1;
     }
 
-    int fd = socket(res->ai_family, SOCK_STREAM, 0);
-    if (fd < 0) {
-        ESP_LOGE(TAG, "connect: socket() failed: %s", strerror(errno));
-        freeaddrinfo(res);
-        return -1;
+    int count = 0;
+    for (struct addrinfo *ai = res; ai && count < max; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(out[count].addr)) {
+            continue;
+        }
+        memcpy(&out[count].addr, ai->ai_addr, ai->ai_addrlen);
+        out[count].len = (socklen_t)ai->ai_addrlen;
+        count++;
     }
+    freeaddrinfo(res);
+    return count > 0 ? count : -1;
+}
 
-    /* Set non-blocking for connect timeout. */
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        ESP_LOGE(TAG, "connect: fcntl failed: %s", strerror(errno));
-        close(fd);
-        freeaddrinfo(res);
-        return -1;
+/* Re-resolve the origin and swap the new list in.  On failure the old
+ * list is kept. */
+static void origin_addrs_refresh(void)
+{
+    origin_addr_t addrs[ORIGIN_MAX_ADDRS];
+    int count = resolve_origin(addrs, ORIGIN_MAX_ADDRS);
+
+    pthread_mutex_lock(&s_addr_lock);
+    if (count > 0) {
+        memcpy(s_state.addrs, addrs, (size_t)count * sizeof(addrs[0]));
+        s_state.addr_count = count;
     }
+    pthread_mutex_unlock(&s_addr_lock);
 
-    rc = connect(fd, res->ai_addr, res->ai_addrlen);
-    freeaddrinfo(res);
+    pthread_mutex_lock(&s_pool_lock);
+    s_state.stats.dns_lookups++;
+    if (count < 0) {
+        s_state.stats.dns_failures++;
+    }
+    pthread_mutex_unlock(&s_pool_lock);
 
-    if (rc < 0 && errno != EINPROGRESS) {
-        ESP_LOGE(TAG, "connect: connect() failed: %s", strerror(errno));
-        close(fd);
+    if (count > 0) {
+        ESP_LOGD(TAG, "resolve: %s has %d address(es)", s_state.host, count);
+    } else {
+        ESP_LOGW(TAG, "resolve: keeping %d cached address(es) for %s",
+                 s_state.addr_count, s_state.host);
+    }
+}
+
+/* Background resolver: refreshes the list every dns_refresh_ms, or
+ * sooner when a connect found every cached address dead. */
+static void *resolver_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&s_addr_lock);
+    while (!s_state.resolver_stop) {
+        if (!s_state.resolve_now) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += s_state.dns_refresh_ms / 1000;
+            deadline.tv_nsec += (long)(s_state.dns_refresh_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&s_addr_cv, &s_addr_lock, &deadline);
+            if (s_state.resolver_stop) {
+                break;
+            }
+        }
+        s_state.resolve_now = false;
+        pthread_mutex_unlock(&s_addr_lock);
+        origin_addrs_refresh();
+        pthread_mutex_lock(&s_addr_lock);
+    }
+    pthread_mutex_unlock(&s_addr_lock);
+    return NULL;
+}
+
+/* Copy the cached addresses into `out`, resolving synchronously if the
+ * cache is still empty.  Returns the number of addresses. */
+static int origin_addrs_get(origin_addr_t *out, int max)
+{
+    pthread_mutex_lock(&s_addr_lock);
+    int count = s_state.addr_count;
+    pthread_mutex_unlock(&s_addr_lock);
+    if (count == 0) {
+        origin_addrs_refresh();
+    }
+
+    pthread_mutex_lock(&s_addr_lock);
+    count = s_state.addr_count < max ? s_state.addr_count : max;
+    memcpy(out, s_state.addrs, (size_t)count * sizeof(out[0]));
+    pthread_mutex_unlock(&s_addr_lock);
+    return count;
+}
+
+/* Ask the resolver thread for an early refresh. */
+static void origin_addrs_invalidate(void)
+{
+    pthread_mutex_lock(&s_addr_lock);
+    s_state.resolve_now = true;
+    pthread_cond_signal(&s_addr_cv);
+    pthread_mutex_unlock(&s_addr_lock);
+}
+
+static int resolver_start(void)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RESOLVER_STACK_SIZE);
+    int rc = pthread_create(&s_state.resolver, &attr, resolver_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "resolve: no resolver thread, addresses won't refresh");
         return -1;
     }
+    s_state.resolver_running = true;
+    return 0;
+}
+
+static void resolver_stop(void)
+{
+    if (!s_state.resolver_running) {
+        return;
+    }
+    pthread_mutex_lock(&s_addr_lock);
+    s_state.resolver_stop = true;
+    pthread_cond_signal(&s_addr_cv);
+    pthread_mutex_unlock(&s_addr_lock);
+    pthread_join(s_state.resolver, NULL);
+    s_state.resolver_running = false;
+}
+
+/* ── TCP connection with timeout ─────────────────────────────────── */
+
+/* Put `addrs` in connect order (RFC 8305 section 4): the remembered
+ * family first (else the resolver's first choice), then alternating
+ * between families, keeping the resolver's order within each family. */
+static void origin_addrs_order(origin_addr_t *addrs, int count, int preferred)
+{
+    if (count < 2) {
+        return;
+    }
+    int first = preferred;
+    bool have_first = false;
+    for (int i = 0; i < count; i++) {
+        if (addrs[i].addr.ss_family == first) {
+            have_first = true;
+            break;
+        }
+    }
+    if (!have_first) {
+        first = addrs[0].addr.ss_family;
+    }
+
+    origin_addr_t out[ORIGIN_MAX_ADDRS];
+    bool used[ORIGIN_MAX_ADDRS] = { false };
+    bool want_first = true;
+    for (int n = 0; n < count; n++) {
+        int pick = -1;
+        for (int i = 0; i < count && pick < 0; i++) {
+            if (!used[i] &&
+                (addrs[i].addr.ss_family == first) == want_first) {
+                pick = i;
+            }
+        }
+        if (pick < 0) {
+            /* One family ran out; the rest go in resolver order. */
+            for (int i = 0; i < count && pick < 0; i++) {
+                if (!used[i]) {
+                    pick = i;
+                }
+            }
+        }
+        used[pick] = true;
+        out[n] = addrs[pick];
+        want_first = !want_first;
+    }
+    memcpy(addrs, out, (size_t)count * sizeof(out[0]));
+}
+
+/* Start a non-blocking connect to `a`.  Returns 1 if it connected at
+ * once, 0 if it is in progress, -1 on failure; *fd is set unless -1. */
+static int connect_start(const origin_addr_t *a, int *fd)
+{
+    int s = socket(a->addr.ss_family, SOCK_STREAM, 0);
+    if (s < 0) {
+        ESP_LOGW(TAG, "connect: socket() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ESP_LOGE(TAG, "connect: fcntl failed: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (connect(s, (const struct sockaddr *)&a->addr, a->len) == 0) {
+        *fd = s;
+        return 1;
+    }
+    if (errno != EINPROGRESS) {
+        ESP_LOGW(TAG, "connect: connect() failed: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+    *fd = s;
+    return 0;
+}
+
+/* Connect to the origin, racing its cached addresses happy-eyeballs
+ * style (RFC 8305): a new attempt starts every CONNECT_ATTEMPT_DELAY_MS,
+ * or at once when the previous one fails, and the first to complete
+ * wins.  The winner's family is tried first next time.  Returns the fd
+ * (in blocking mode), or -1 once every address failed or `timeout_ms`
+ * has passed. */
+static int connect_to_origin(int timeout_ms)
+{
+    origin_addr_t addrs[ORIGIN_MAX_ADDRS];
+    int count = origin_addrs_get(addrs, ORIGIN_MAX_ADDRS);
+
+    pthread_mutex_lock(&s_addr_lock);
+    int preferred = s_state.preferred_family;
+    pthread_mutex_unlock(&s_addr_lock);
+    origin_addrs_order(addrs, count, preferred);
+
+    int fds[ORIGIN_MAX_ADDRS];
+    int which[ORIGIN_MAX_ADDRS];
+    int pending = 0;
+    int next = 0;
+    int fd = -1;
+    int won = -1;
+    uint64_t start    = now_ms();
+    uint64_t deadline = start + (uint64_t)timeout_ms;
+    uint64_t next_at  = start;
+
+    while (fd < 0) {
+        uint64_t now = now_ms();
+        if (now >= deadline) {
+            ESP_LOGW(TAG, "connect: timed out");
+            break;
+        }
+
+        /* Start the next attempt when it's due or nothing is in flight. */
+        if (next < count && (pending == 0 || now >= next_at)) {
+            int s;
+            int rc = connect_start(&addrs[next], &s);
+            if (next > 0) {
+                pthread_mutex_lock(&s_pool_lock);
+                s_state.stats.connect_failovers++;
+                pthread_mutex_unlock(&s_pool_lock);
+            }
+            if (rc > 0) {
+                fd = s;
+                won = next;
+            } else if (rc == 0) {
+                fds[pending]   = s;
+                which[pending] = next;
+                pending++;
+                next_at = now + CONNECT_ATTEMPT_DELAY_MS;
+            }
+            next++;
+            continue;
+        }
+        if (pending == 0) {
+            break;                          /* Every address failed */
+        }
+
+        uint64_t wait_ms = deadline - now;
+        if (next < count && next_at - now < wait_ms) {
+            wait_ms = next_at - now;
+        }
 
-    if (rc < 0) {
-        /* Wait for connection with timeout. */
         fd_set wset;
         FD_ZERO(&wset);
-        FD_SET(fd, &wset);
-
+        int maxfd = -1;
+        for (int i = 0; i < pending; i++) {
+            FD_SET(fds[i], &wset);
+            if (fds[i] > maxfd) {
+                maxfd = fds[i];
+            }
+        }
         struct timeval tv;
-        tv.tv_sec  = timeout_ms / 1000;
-        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tv.tv_sec  = (long)(wait_ms / 1000);
+        tv.tv_usec = (long)(wait_ms % 1000) * 1000;
 
-        rc = select(fd + 1, NULL, &wset, NULL, &tv);
-        if (rc <= 0) {
-            ESP_LOGE(TAG, "connect: %s",
-                     rc == 0 ? "timed out" : strerror(errno));
-            close(fd);
-            return -1;
+        int rc = select(maxfd + 1, NULL, &wset, NULL, &tv);
+        if (rc < 0 && errno != EINTR) {
+            ESP_LOGE(TAG, "connect: select failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = pending - 1; rc > 0 && i >= 0 && fd < 0; i--) {
+            if (!FD_ISSET(fds[i], &wset)) {
+                continue;
+            }
+            int so_err = 0;
+            socklen_t so_len = sizeof(so_err);
+            getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &so_err, &so_len);
+            if (so_err == 0) {
+                fd  = fds[i];
+                won = which[i];
+            } else {
+                ESP_LOGW(TAG, "connect: async connect error: %s",
+                         strerror(so_err));
+                close(fds[i]);
+            }
+            pending--;
+            fds[i]   = fds[pending];
+            which[i] = which[pending];
+            if (fd < 0) {
+                /* Don't sit out the delay after a failure. */
+                next_at = now;
+            }
         }
+    }
 
-        /* Check for connection error. */
-        int so_err = 0;
-        socklen_t so_len = sizeof(so_err);
-        getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_err, &so_len);
-        if (so_err != 0) {
-            ESP_LOGE(TAG, "connect: async connect error: %s",
-                     strerror(so_err));
-            close(fd);
-            return -1;
+    for (int i = 0; i < pending; i++) {
+        close(fds[i]);
+    }
+
+    if (fd < 0) {
+        ESP_LOGE(TAG, "connect: no address of %s:%u reachable",
+                 s_state.host, s_state.port);
+        if (count > 0) {
+            /* The origin may have moved; don't wait for the next refresh. */
+            origin_addrs_invalidate();
         }
+        return -1;
     }
 
     /* Restore blocking mode for subsequent I/O (select used for timeouts). */
-    fcntl(fd, F_SETFL, flags);
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    int family = addrs[won].addr.ss_family;
+    pthread_mutex_lock(&s_addr_lock);
+    s_state.preferred_family = family;
+    pthread_mutex_unlock(&s_addr_lock);
 
-    ESP_LOGI(TAG, "connect: connected to %s:%u", host, port);
+    ESP_LOGI(TAG, "connect: connected to %s:%u over IPv%d "
+             "(address %d of %d, %" PRIu64 " ms)",
+             s_state.host, s_state.port, family == AF_INET6 ? 6 : 4,
+             won + 1, count, now_ms() - start);
     return fd;
 }
 
+/* ── Keep-alive connection pool ──────────────────────────────────── */
+
+/* Close pooled connections past the idle timeout (oldest first). */
+static void idle_expire_locked(uint64_t now)
+{
+    int n = 0;
+    while (n < s_state.idle_count &&
+           now - s_state.idle[n].since_ms >= (uint64_t)s_state.idle_timeout_ms) {
+        close(s_state.idle[n].fd);
+        n++;
+    }
+    if (n > 0) {
+        s_state.idle_count -= n;
+        memmove(&s_state.idle[0], &s_state.idle[n],
+                (size_t)s_state.idle_count * sizeof(s_state.idle[0]));
+        s_state.stats.conn_expired += (uint64_t)n;
+    }
+}
+
+/* An idle connection is usable if the origin has neither closed it nor
+ * sent anything unsolicited. */
+static bool idle_conn_usable(int fd)
+{
+    uint8_t byte;
+    ssize_t r = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Get a connection to the origin: the most recently pooled one that is
+ * still usable, or a new one.  Returns the fd, or -1.
+ */
+static int origin_acquire(bool allow_reuse, bool *reused)
+{
+    *reused = false;
+    if (allow_reuse && s_state.max_idle > 0) {
+        pthread_mutex_lock(&s_pool_lock);
+        idle_expire_locked(now_ms());
+        while (s_state.idle_count > 0) {
+            int fd = s_state.idle[--s_state.idle_count].fd;
+            if (idle_conn_usable(fd)) {
+                s_state.stats.conn_reused++;
+                pthread_mutex_unlock(&s_pool_lock);
+                *reused = true;
+                return fd;
+            }
+            close(fd);
+            s_state.stats.conn_stale++;
+        }
+        pthread_mutex_unlock(&s_pool_lock);
+    }
+
+    int fd = connect_to_origin(s_state.connect_timeout_ms);
+    if (fd >= 0) {
+        pthread_mutex_lock(&s_pool_lock);
+        s_state.stats.conn_opened++;
+        pthread_mutex_unlock(&s_pool_lock);
+    }
+    return fd;
+}
+
+/*
+ * Put a stream's connection back into the pool (its body has been read
+ * to the end), evicting the oldest idle connection if the pool is full.
+ */
+static void origin_release(http_proxy_stream_t *s)
+{
+    /* Pull mode leaves the socket non-blocking. */
+    int flags = fcntl(s->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+        close(s->fd);
+        return;
+    }
+
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&s_pool_lock);
+    idle_expire_locked(now);
+    if (s_state.idle_count == s_state.max_idle) {
+        close(s_state.idle[0].fd);
+        s_state.idle_count--;
+        memmove(&s_state.idle[0], &s_state.idle[1],
+                (size_t)s_state.idle_count * sizeof(s_state.idle[0]));
+    }
+    s_state.idle[s_state.idle_count].fd = s->fd;
+    s_state.idle[s_state.idle_count].since_ms = now;
+    s_state.idle_count++;
+    pthread_mutex_unlock(&s_pool_lock);
+}
+
 /* ── Reliable send with timeout ──────────────────────────────────── */
 
-static int send_all(int fd, const void *buf, size_t len, int timeout_ms)
+static int wait_writable(int fd, int timeout_ms)
 {
-    const uint8_t *p = (const uint8_t *)buf;
-    size_t remaining = len;
+    fd_set wset;
+    FD_ZERO(&wset);
+    FD_SET(fd, &wset);
 
-    while (remaining > 0) {
-        fd_set wset;
-        FD_ZERO(&wset);
-        FD_SET(fd, &wset);
+    struct timeval tv;
+    tv.tv_sec  = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
 
-        struct timeval tv;
-        tv.tv_sec  = timeout_ms / 1000;
-        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    int rc = select(fd + 1, NULL, &wset, NULL, &tv);
+    if (rc <= 0) {
+        ESP_LOGE(TAG, "send: %s", rc == 0 ? "timed out" : strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-        int rc = select(fd + 1, NULL, &wset, NULL, &tv);
-        if (rc <= 0) {
-            ESP_LOGE(TAG, "send_all: %s",
-                     rc == 0 ? "timed out" : strerror(errno));
-            return -1;
-        }
+/* Send all of iov[0, count) with as few sendmsg() calls as the socket
+ * allows.  The socket is only waited on once it is actually full.  `iov`
+ * is consumed.  MSG_MORE in `flags` tells the stack more data follows, so
+ * a partial head isn't pushed out as a packet of its own. */
+static int send_iov(int fd, struct iovec *iov, int count, int flags,
+                    int timeout_ms)
+{
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
 
-        ssize_t n = send(fd, p, remaining, MSG_NOSIGNAL);
+        ssize_t n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
         if (n < 0) {
-            if (errno == EINTR || errno == EAGAIN) continue;
-            ESP_LOGE(TAG, "send_all: send() failed: %s", strerror(errno));
-            return -1;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ESP_LOGE(TAG, "send: sendmsg() failed: %s", strerror(errno));
+                return -1;
+            }
+            if (wait_writable(fd, timeout_ms) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        size_t left = (size_t)n;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
         }
-        p += n;
-        remaining -= (size_t)n;
     }
     return 0;
 }
 
+static int send_all(int fd, const void *buf, size_t len, int timeout_ms)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return send_iov(fd, &iov, 1, 0, timeout_ms);
+}
+
 /* ── Build and send the HTTP/1.1 request ─────────────────────────── */
 
-static int send_http_request(int fd, const char *method, const char *path,
-                             const char *host, const cf_metadata_t *headers,
-                             size_t header_count, const uint8_t *body,
-                             size_t body_len, int timeout_ms)
-{
-    /*
-     * Estimate buffer size:
-     *   request-line  ~method(16) + path(1024) + " HTTP/1.1\r\n"(11) = ~1051
-     *   Host header   ~"Host: " + host(256) + "\r\n"                  = ~264
-     *   Per header    ~key(128) + ": " + val(512) + "\r\n"            = ~644
-     *   C-L header    ~"Content-Length: <20>\r\n"                      = ~40
-     *   Blank line    "\r\n"                                           = 2
-     *   Body          body_len
-     */
-    size_t est = 1400 + header_count * 650 + body_len;
-    char *buf = malloc(est);
-    if (!buf) {
-        ESP_LOGE(TAG, "send_http_request: malloc(%zu) failed", est);
-        return -1;
+/* Request head under construction: pieces pointing at the request and
+ * at string constants, sent REQUEST_IOV_BATCH at a time. */
+typedef struct {
+    struct iovec iov[REQUEST_IOV_BATCH];
+    int count;
+    int fd;
+    int timeout_ms;
+    int ret;
+} iov_batch_t;
+
+static void iov_add(iov_batch_t *b, const void *p, size_t len)
+{
+    if (len == 0 || b->ret != 0) {
+        return;
+    }
+    if (b->count == REQUEST_IOV_BATCH) {
+        b->ret = send_iov(b->fd, b->iov, b->count, MSG_MORE, b->timeout_ms);
+        b->count = 0;
     }
+    b->iov[b->count].iov_base = (void *)p;
+    b->iov[b->count].iov_len = len;
+    b->count++;
+}
+
+static void iov_add_str(iov_batch_t *b, const char *str)
+{
+    iov_add(b, str, strlen(str));
+}
 
-    int off = 0;
-    /* Request line. */
-    off += snprintf(buf + off, est - (size_t)off,
-                    "%s %s HTTP/1.1\r\n", method, path);
+/* Send the request head, followed by `inline_body` (a buffer source,
+ * may be NULL) in the same call.  `more` means a streamed body follows. */
+static int send_http_request(int fd, const char *method,
+                             const cf_connect_request_t *req,
+                             http_body_framing_t framing, uint64_t length,
+                             const http_body_source_t *inline_body,
+                             bool more, int timeout_ms)
+{
+    iov_batch_t b;
+    b.count = 0;
+    b.fd = fd;
+    b.timeout_ms = timeout_ms;
+    b.ret = 0;
+
+    /* Request line: path is the optional prefix + dest. */
+    iov_add_str(&b, method);
+    iov_add(&b, " ", 1);
+    if (strcmp(s_state.path_prefix, "/") != 0) {
+        iov_add_str(&b, s_state.path_prefix);
+    }
+    if (req->dest.len > 0) {
+        iov_add(&b, cf_metadata_str(&req->metadata, req->dest), req->dest.len);
+    } else {
+        iov_add(&b, "/", 1);
+    }
+    iov_add_str(&b, " HTTP/1.1\r\nHost: ");
 
     /* Host header (use origin host, not the one from the edge). */
-    off += snprintf(buf + off, est - (size_t)off,
-                    "Host: %s\r\n", host);
+    iov_add_str(&b, s_state.host);
+    iov_add(&b, "\r\n", 2);
 
-    /* Connection: close so the origin will close after responding. */
-    off += snprintf(buf + off, est - (size_t)off,
-                    "Connection: close\r\n");
+    /* HTTP/1.1 connections persist by default; without a pool, ask the
+     * origin to close after responding. */
+    if (s_state.max_idle == 0) {
+        iov_add_str(&b, "Connection: close\r\n");
+    }
 
-    /* Forwarded headers. */
-    for (size_t i = 0; i < header_count; i++) {
-        /* Skip Host (we already set it) and Connection. */
-        if (strcasecmp(headers[i].key, "Host") == 0) continue;
-        if (strcasecmp(headers[i].key, "Connection") == 0) continue;
-        off += snprintf(buf + off, est - (size_t)off,
-                        "%s: %s\r\n", headers[i].key, headers[i].val);
+    /* Forwarded headers (metadata keys starting with "HttpHeader:"). */
+    for (size_t i = 0; i < req->metadata.count; i++) {
+        const cf_metadata_t *md = &req->metadata.items[i];
+        const char *key = cf_metadata_str(&req->metadata, md->key);
+        if (md->key.len <= 11 || strncmp(key, "HttpHeader:", 11) != 0) {
+            continue;
+        }
+        /* Skip Host (we already set it) and Connection.  Body framing
+         * headers are regenerated below from `framing`. */
+        key += 11;
+        if (strcasecmp(key, "Host") == 0) continue;
+        if (strcasecmp(key, "Connection") == 0) continue;
+        if (strcasecmp(key, "Content-Length") == 0) continue;
+        if (strcasecmp(key, "Transfer-Encoding") == 0) continue;
+        iov_add(&b, key, md->key.len - 11);
+        iov_add(&b, ": ", 2);
+        iov_add(&b, cf_metadata_str(&req->metadata, md->val), md->val.len);
+        iov_add(&b, "\r\n", 2);
     }
 
-    /* Content-Length if body present. */
-    if (body && body_len > 0) {
-        off += snprintf(buf + off, est - (size_t)off,
-                        "Content-Length: %zu\r\n", body_len);
+    char clen[32];
+    if (framing == HTTP_BODY_LENGTH) {
+        int n = snprintf(clen, sizeof(clen), "Content-Length: %llu\r\n",
+                         (unsigned long long)length);
+        iov_add(&b, clen, (size_t)n);
+    } else if (framing == HTTP_BODY_CHUNKED) {
+        iov_add_str(&b, "Transfer-Encoding: chunked\r\n");
     }
 
     /* End of headers. */
-    off += snprintf(buf + off, est - (size_t)off, "\r\n");
+    iov_add(&b, "\r\n", 2);
 
-    /* Send headers. */
-    if (send_all(fd, buf, (size_t)off, timeout_ms) != 0) {
-        free(buf);
+    if (inline_body) {
+        buffer_source_t *src = (buffer_source_t *)inline_body->arg;
+        iov_add(&b, src->data + src->off, src->len - src->off);
+        src->off = src->len;
+    }
+
+    if (b.ret == 0) {
+        b.ret = send_iov(fd, b.iov, b.count, more ? MSG_MORE : 0, timeout_ms);
+    }
+    return b.ret;
+}
+
+/* Copy the request body from `body` to the origin, one buffer at a time,
+ * so an upload never needs more than UPLOAD_BUF_SIZE bytes in memory.
+ * send_all() blocks while the origin socket is not writable, and the
+ * source in turn stops draining the QUIC stream. */
+static int send_request_body(int fd, const http_body_source_t *body,
+                             http_body_framing_t framing, uint64_t length,
+                             int timeout_ms)
+{
+    if (framing == HTTP_BODY_NONE || body == NULL) {
+        return 0;
+    }
+
+    /* Leave room for a chunk-size line in front and CRLF behind. */
+    uint8_t *buf = mem_pool_get(s_state.mem, UPLOAD_BUF_SIZE);
+    if (!buf) {
+        ESP_LOGE(TAG, "send_body: malloc failed");
         return -1;
     }
+    uint8_t *data = buf + 10;
+    size_t data_cap = UPLOAD_BUF_SIZE - 16;
+    uint64_t sent = 0;
+    int ret = 0;
+
+    for (;;) {
+        size_t want = data_cap;
+        if (framing == HTTP_BODY_LENGTH) {
+            if (sent == length) {
+                break;
+            }
+            if (length - sent < want) {
+                want = (size_t)(length - sent);
+            }
+        }
 
-    /* Send body. */
-    if (body && body_len > 0) {
-        if (send_all(fd, body, body_len, timeout_ms) != 0) {
-            free(buf);
-            return -1;
+        int n = body->read(body->arg, data, want);
+        if (n < 0) {
+            ESP_LOGE(TAG, "send_body: request body aborted after %llu bytes",
+                     (unsigned long long)sent);
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            if (framing == HTTP_BODY_LENGTH) {
+                ESP_LOGE(TAG, "send_body: request body ended %llu bytes short",
+                         (unsigned long long)(length - sent));
+                ret = -1;
+            } else {
+                ret = send_all(fd, "0\r\n\r\n", 5, timeout_ms);
+            }
+            break;
+        }
+
+        const uint8_t *p = data;
+        size_t len = (size_t)n;
+        if (framing == HTTP_BODY_CHUNKED) {
+            /* Chunk-size line goes right in front of the data. */
+            char line[12];
+            int hl = snprintf(line, sizeof(line), "%x\r\n", (unsigned)n);
+            p = data - hl;
+            memcpy((uint8_t *)p, line, (size_t)hl);
+            data[n] = '\r';
+            data[n + 1] = '\n';
+            len = (size_t)n + (size_t)hl + 2;
         }
+        if (send_all(fd, p, len, timeout_ms) != 0) {
+            ret = -1;
+            break;
+        }
+        sent += (uint64_t)n;
     }
 
-    free(buf);
-    return 0;
+    mem_pool_put(s_state.mem, buf);
+    return ret;
 }
 
 /* ── Read and parse the HTTP/1.1 response ────────────────────────── */
@@ -481,6 +1714,7 @@ static int recv_with_timeout(int fd, uint8_t *buf, size_t buf_sz,
     }
     if (rc == 0) {
         ESP_LOGE(TAG, "recv: timed out");
+        errno = ETIMEDOUT;
         return -1;
     }
 
@@ -497,228 +1731,405 @@ static int recv_with_timeout(int fd, uint8_t *buf, size_t buf_sz,
     return 0;
 }
 
-/* Parse a single header line "Key: Value" into a cf_metadata_t entry. */
-static int parse_header_line(const char *line, size_t len,
-                             cf_metadata_t *out)
+/* Take the framing and headers of a parsed final response head. */
+static int apply_response_head(http_proxy_stream_t *s, cf_http_response_t *resp,
+                               int minor, int status_code,
+                               const http_header_t *headers, size_t num_headers)
 {
-    const char *colon = memchr(line, ':', len);
-    if (!colon) return -1;
+    resp->status_code = status_code;
 
-    size_t klen = (size_t)(colon - line);
-    if (klen == 0 || klen >= sizeof(out->key)) return -1;
-    memcpy(out->key, line, klen);
-    out->key[klen] = '\0';
+    /* ── Determine body framing ───────────────────────────────────── */
+    bool conn_close = false;
+    bool conn_keep_alive = false;
+    bool transfer_encoding = false;
+    size_t te_last = 0;         /* Transfer-Encoding line with the final coding */
+    for (size_t i = 0; i < num_headers; i++) {
+        const http_header_t *h = &headers[i];
+        if (http_header_is(h, "Content-Length")) {
+            /* A bad or conflicting length would leave body bytes on the
+             * socket for the next request to read as its response. */
+            uint64_t n = 0;
+            if (parse_content_length(h->value, h->value_len, &n) != 0 ||
+                n > SIZE_MAX || (s->have_length && s->remaining != n)) {
+                ESP_LOGE(TAG, "read_response: invalid Content-Length");
+                return -1;
+            }
+            s->remaining = (size_t)n;
+            s->have_length = true;
+        } else if (http_header_is(h, "Transfer-Encoding")) {
+            if (!transfer_encoding ||
+                list_trim_end(h->value, h->value_len) > 0) {
+                te_last = i;
+            }
+            transfer_encoding = true;
+        } else if (http_header_is(h, "Connection")) {
+            conn_close |= has_token_n(h->value, h->value_len, "close");
+            conn_keep_alive |= has_token_n(h->value, h->value_len, "keep-alive");
+        }
+    }
+    /* The body is chunked only if chunked is the final coding, applied
+     * once; with anything after it the body ends at close. */
+    ssize_t te_rest = -1;
+    if (transfer_encoding) {
+        const http_header_t *last = &headers[te_last];
+        te_rest = strip_last_token(last->value, last->value_len, "chunked");
+        bool again = te_rest > 0 &&
+                     has_token_n(last->value, (size_t)te_rest, "chunked");
+        for (size_t i = 0; i < te_last && !again; i++) {
+            again = http_header_is(&headers[i], "Transfer-Encoding") &&
+                    has_token_n(headers[i].value, headers[i].value_len, "chunked");
+        }
+        s->chunked = te_rest >= 0 && !again;
+    }
 
-    /* Skip colon and optional whitespace. */
-    const char *vstart = colon + 1;
-    size_t remaining = len - klen - 1;
-    while (remaining > 0 && *vstart == ' ') { vstart++; remaining--; }
+    /* Transfer-Encoding overrides Content-Length; a message with both, or
+     * with a coding we cannot frame, is read to close and never pooled
+     * (RFC 9112 section 6.3). */
+    bool ambiguous = transfer_encoding && (s->have_length || !s->chunked);
+    if (transfer_encoding) {
+        s->have_length = false;
+        s->remaining = 0;
+    }
 
-    if (remaining >= sizeof(out->val)) remaining = sizeof(out->val) - 1;
-    memcpy(out->val, vstart, remaining);
-    out->val[remaining] = '\0';
+    /* ── Copy headers into the response ───────────────────────────── */
+    cf_metadata_clear(&resp->headers);
+    for (size_t i = 0; i < num_headers; i++) {
+        const http_header_t *h = &headers[i];
+        size_t value_len = h->value_len;
+        if (transfer_encoding && http_header_is(h, "Content-Length")) {
+            continue;           /* Overridden, and never forwarded with it */
+        }
+        if (s->chunked && i == te_last) {
+            /* The body is passed on decoded: only the codings applied
+             * before chunked still describe it. */
+            value_len = (size_t)te_rest;
+            if (value_len == 0) {
+                continue;
+            }
+        }
+        if (cf_metadata_add(&resp->headers, NULL, h->name, h->name_len,
+                            h->value, value_len) != 0) {
+            ESP_LOGE(TAG, "read_response: out of memory for headers");
+            return -1;
+        }
+    }
 
+    /* Responses that never have a body (RFC 9112 section 6.3). */
+    if (s->head_only || status_code == 204 || status_code == 304 ||
+        status_code == 101) {
+        s->have_length = true;
+        s->remaining = 0;
+        s->chunked = false;
+    }
+    s->keep_alive = s_state.max_idle > 0 && !conn_close && !ambiguous &&
+                    status_code != 101 &&
+                    (minor >= 1 || conn_keep_alive) &&
+                    (s->have_length || s->chunked);
     return 0;
 }
 
-static int read_http_response(int fd, cf_http_response_t *resp, int timeout_ms)
+/* Read and parse the status line and headers.  Body bytes that arrive in
+ * the same reads are left in s->head_buf for http_proxy_read_body(). */
+static int read_response_head(http_proxy_stream_t *s, cf_http_response_t *resp)
 {
     /* Accumulate raw response data. */
     size_t buf_cap = RECV_BUF_INIT;
-    uint8_t *buf = malloc(buf_cap);
+    uint8_t *buf = mem_pool_get(s_state.mem, buf_cap);
     if (!buf) {
         ESP_LOGE(TAG, "read_response: malloc failed");
         return -1;
     }
     size_t buf_len = 0;
+    s->head_buf = buf;
 
-    /* Read until we have the full header section (terminated by \r\n\r\n). */
-    char *header_end = NULL;
-    while (!header_end) {
-        if (buf_len + 1 >= buf_cap) {
+    http_head_scan_t scan;
+    http_header_t headers[HTTP_MAX_HEADERS];
+    size_t num_headers;
+    int minor = 0;
+    int status_code = 0;
+    size_t head_len;
+
+next_response:
+    /* Read until we have the full header section (up to the blank line),
+     * searching only the bytes each recv() adds. */
+    memset(&scan, 0, sizeof(scan));
+    head_len = http_head_end(&scan, (const char *)buf, buf_len);
+    while (head_len == 0) {
+        if (buf_len == buf_cap) {
             size_t new_cap = buf_cap * 2;
-            if (new_cap > MAX_RESPONSE_BODY + 8192) {
+            if (new_cap > MAX_RESPONSE_HEAD) {
                 ESP_LOGE(TAG, "read_response: headers too large");
-                free(buf);
                 return -1;
             }
-            uint8_t *tmp = realloc(buf, new_cap);
+            uint8_t *tmp = mem_pool_grow(s_state.mem, buf, buf_len, new_cap);
             if (!tmp) {
                 ESP_LOGE(TAG, "read_response: realloc failed");
-                free(buf);
                 return -1;
             }
             buf = tmp;
             buf_cap = new_cap;
+            s->head_buf = buf;
         }
 
         size_t n = 0;
-        if (recv_with_timeout(fd, buf + buf_len,
-                              buf_cap - buf_len - 1, &n, timeout_ms) != 0) {
-            free(buf);
+        if (recv_with_timeout(s->fd, buf + buf_len,
+                              buf_cap - buf_len, &n, s->timeout_ms) != 0) {
+            s->head_closed = buf_len == 0 && errno != ETIMEDOUT;
             return -1;
         }
         if (n == 0) {
             /* Connection closed before headers complete. */
+            s->head_closed = buf_len == 0;
             ESP_LOGE(TAG, "read_response: connection closed in headers");
-            free(buf);
             return -1;
         }
         buf_len += n;
-        buf[buf_len] = '\0';
-
-        header_end = strstr((char *)buf, "\r\n\r\n");
+        head_len = http_head_end(&scan, (const char *)buf, buf_len);
     }
 
-    /* ── Parse status line ────────────────────────────────────────── */
-    char *status_line_end = strstr((char *)buf, "\r\n");
-    if (!status_line_end) {
-        ESP_LOGE(TAG, "read_response: no status line");
-        free(buf);
+    http_header_t *hdrs = headers;
+    num_headers = HTTP_MAX_HEADERS;
+    int rc = http_parse_response((const char *)buf, head_len, &minor,
+                                 &status_code, hdrs, &num_headers);
+    if (rc == HTTP_PARSE_MORE_HEADERS) {
+        /* Rare: room for every header of this head only. */
+        hdrs = mem_pool_get(s_state.mem, num_headers * sizeof(*hdrs));
+        if (!hdrs) {
+            ESP_LOGE(TAG, "read_response: out of memory for %zu headers",
+                     num_headers);
+            return -1;
+        }
+        rc = http_parse_response((const char *)buf, head_len, &minor,
+                                 &status_code, hdrs, &num_headers);
+    }
+    if (rc == 0 && status_code >= 100 && status_code < 200 &&
+        status_code != 101) {
+        /* Interim response (100 Continue, 103 Early Hints, ...): drop it
+         * and read the final one behind it. */
+        if (hdrs != headers) {
+            mem_pool_put(s_state.mem, hdrs);
+        }
+        buf_len -= head_len;
+        memmove(buf, buf + head_len, buf_len);
+        ESP_LOGD(TAG, "read_response: skipped interim %d response", status_code);
+        goto next_response;
+    }
+    if (rc != 0) {
+        ESP_LOGE(TAG, "read_response: malformed response head");
+    } else {
+        rc = apply_response_head(s, resp, minor, status_code, hdrs, num_headers);
+    }
+    if (hdrs != headers) {
+        mem_pool_put(s_state.mem, hdrs);
+    }
+    if (rc != 0) {
         return -1;
     }
 
-    /* "HTTP/1.x STATUS REASON" */
-    int status_code = 0;
-    if (sscanf((char *)buf, "HTTP/%*d.%*d %d", &status_code) != 1) {
-        ESP_LOGE(TAG, "read_response: failed to parse status code");
-        free(buf);
-        return -1;
+    /* Body starts right after the blank line. */
+    s->pending_off = head_len;
+    s->pending_len = buf_len;
+    return 0;
+}
+
+/* True once the framed body has been read to its end. */
+static bool body_complete(const http_proxy_stream_t *s)
+{
+    if (s->have_length) {
+        return s->remaining == 0;
     }
-    resp->status_code = status_code;
+    return s->chunked && s->chunk_state == CHUNK_DONE;
+}
+
+static int hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-    /* ── Parse response headers ───────────────────────────────────── */
-    resp->header_count = 0;
-    char *line = status_line_end + 2; /* skip first \r\n */
-    while (line < header_end) {
-        char *next = strstr(line, "\r\n");
-        if (!next || next == line) break;
-        size_t line_len = (size_t)(next - line);
-
-        if (resp->header_count < CF_MAX_METADATA) {
-            parse_header_line(line, line_len,
-                              &resp->headers[resp->header_count]);
-            resp->header_count++;
-        }
-        line = next + 2;
-    }
-
-    /* ── Determine body length ────────────────────────────────────── */
-    size_t content_length = 0;
-    bool have_content_length = false;
-    for (size_t i = 0; i < resp->header_count; i++) {
-        if (strcasecmp(resp->headers[i].key, "Content-Length") == 0) {
-            content_length = (size_t)strtoul(resp->headers[i].val, NULL, 10);
-            have_content_length = true;
+/*
+ * Decode `n` raw chunked bytes in place: chunk data is moved to the front
+ * of `p` and its length stored in *data_len.  At most `data_max` data
+ * bytes are taken; with 0 the decoder stops at the first data byte, so
+ * only framing is consumed.  Returns how many raw bytes were consumed
+ * (fewer than `n` once the last chunk has been seen, or at the data
+ * limit), or -1 if the framing is malformed.  Chunk extensions and
+ * trailer fields are skipped.
+ */
+static int chunk_decode(http_proxy_stream_t *s, uint8_t *p, size_t n,
+                        size_t data_max, size_t *data_len)
+{
+    size_t i = 0;
+    size_t out = 0;
+    while (i < n && s->chunk_state != CHUNK_DONE) {
+        uint8_t c = p[i];
+        switch (s->chunk_state) {
+        case CHUNK_SIZE: {
+            int d = hex_digit(c);
+            if (d >= 0) {
+                if (s->chunk_left >> 60) {
+                    goto bad;
+                }
+                s->chunk_left = (s->chunk_left << 4) | (uint64_t)d;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                s->chunk_state = CHUNK_EXT;
+            } else if (c == '\r') {
+                s->chunk_state = CHUNK_SIZE_LF;
+            } else {
+                goto bad;
+            }
+            i++;
+            break;
+        }
+        case CHUNK_EXT:
+            if (c == '\r') {
+                s->chunk_state = CHUNK_SIZE_LF;
+            }
+            i++;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                goto bad;
+            }
+            s->chunk_state = s->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t take = n - i;
+            if (take > s->chunk_left) {
+                take = (size_t)s->chunk_left;
+            }
+            if (take > data_max - out) {
+                take = data_max - out;
+            }
+            if (take == 0) {
+                *data_len = out;
+                return (int)i;
+            }
+            if (out != i) {
+                memmove(p + out, p + i, take);
+            }
+            out += take;
+            s->chunk_left -= take;
+            i += take;
+            if (s->chunk_left == 0) {
+                s->chunk_state = CHUNK_DATA_CR;
+            }
+            break;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r') {
+                goto bad;
+            }
+            s->chunk_state = CHUNK_DATA_LF;
+            i++;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                goto bad;
+            }
+            s->chunk_state = CHUNK_SIZE;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            s->chunk_state = c == '\r' ? CHUNK_FINAL_LF : CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\r') {
+                s->chunk_state = CHUNK_TRAILER_LF;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') {
+                goto bad;
+            }
+            s->chunk_state = CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_FINAL_LF:
+            if (c != '\n') {
+                goto bad;
+            }
+            s->chunk_state = CHUNK_DONE;
+            s->done = true;
+            i++;
+            break;
+        case CHUNK_DONE:
             break;
         }
     }
+    *data_len = out;
+    return (int)i;
 
-    /* Body starts right after "\r\n\r\n". */
-    size_t header_section_len = (size_t)(header_end - (char *)buf) + 4;
-    size_t body_already = buf_len - header_section_len;
+bad:
+    ESP_LOGE(TAG, "read_body: malformed chunked framing");
+    s->keep_alive = false;
+    return -1;
+}
 
-    if (have_content_length) {
-        if (content_length > MAX_RESPONSE_BODY) {
+/* Drain the whole body into resp->body (http_proxy_forward only). */
+static int read_body_buffered(http_proxy_stream_t *s, cf_http_response_t *resp)
+{
+    size_t buf_cap = RECV_BUF_INIT;
+    if (s->have_length) {
+        if (s->remaining > MAX_RESPONSE_BODY) {
             ESP_LOGE(TAG, "read_response: Content-Length %zu exceeds limit",
-                     content_length);
-            free(buf);
+                     s->remaining);
             return -1;
         }
+        buf_cap = s->remaining > 0 ? s->remaining : 1;
+    }
 
-        /* Read remaining body bytes. */
-        while (body_already < content_length) {
-            if (buf_len + 1 >= buf_cap) {
-                size_t new_cap = buf_cap * 2;
-                if (new_cap > MAX_RESPONSE_BODY + header_section_len + 64) {
-                    new_cap = content_length + header_section_len + 64;
-                }
-                uint8_t *tmp = realloc(buf, new_cap);
-                if (!tmp) {
-                    ESP_LOGE(TAG, "read_response: realloc failed for body");
-                    free(buf);
-                    return -1;
-                }
-                buf = tmp;
-                buf_cap = new_cap;
-            }
+    uint8_t *buf = malloc(buf_cap);
+    if (!buf) {
+        ESP_LOGE(TAG, "read_response: malloc for body failed");
+        return -1;
+    }
+    size_t buf_len = 0;
 
-            size_t n = 0;
-            if (recv_with_timeout(fd, buf + buf_len,
-                                  buf_cap - buf_len, &n, timeout_ms) != 0) {
+    for (;;) {
+        if (buf_len == buf_cap) {
+            if (s->have_length) {
+                break;      /* Sized for the whole body */
+            }
+            size_t new_cap = buf_cap * 2;
+            if (new_cap > MAX_RESPONSE_BODY) {
+                ESP_LOGE(TAG, "read_response: body too large (no C-L)");
                 free(buf);
                 return -1;
             }
-            if (n == 0) break; /* connection closed */
-            buf_len += n;
-            body_already = buf_len - header_section_len;
-        }
-
-        resp->body_len = content_length;
-    } else {
-        /* No Content-Length: read until connection close. */
-        for (;;) {
-            if (buf_len + 1 >= buf_cap) {
-                size_t new_cap = buf_cap * 2;
-                if (new_cap > MAX_RESPONSE_BODY + header_section_len + 64) {
-                    ESP_LOGE(TAG, "read_response: body too large (no C-L)");
-                    free(buf);
-                    return -1;
-                }
-                uint8_t *tmp = realloc(buf, new_cap);
-                if (!tmp) {
-                    ESP_LOGE(TAG, "read_response: realloc failed");
-                    free(buf);
-                    return -1;
-                }
-                buf = tmp;
-                buf_cap = new_cap;
-            }
-
-            size_t n = 0;
-            if (recv_with_timeout(fd, buf + buf_len,
-                                  buf_cap - buf_len, &n, timeout_ms) != 0) {
-                /* Treat timeout as end-of-body when we already have data. */
-                if (body_already > 0) break;
+            uint8_t *tmp = realloc(buf, new_cap);
+            if (!tmp) {
+                ESP_LOGE(TAG, "read_response: realloc failed");
                 free(buf);
                 return -1;
             }
-            if (n == 0) break;
-            buf_len += n;
-            body_already = buf_len - header_section_len;
+            buf = tmp;
+            buf_cap = new_cap;
         }
 
-        resp->body_len = body_already;
-    }
-
-    /* Copy body into its own allocation so the caller can free it. */
-    if (resp->body_len > 0) {
-        resp->body = malloc(resp->body_len);
-        if (!resp->body) {
-            ESP_LOGE(TAG, "read_response: malloc for body failed");
+        int n = http_proxy_read_body(s, buf + buf_len, buf_cap - buf_len);
+        if (n < 0) {
             free(buf);
             return -1;
         }
-        memcpy(resp->body, buf + header_section_len, resp->body_len);
-    } else {
-        resp->body = NULL;
+        if (n == 0) {
+            break;
+        }
+        buf_len += (size_t)n;
     }
 
-    free(buf);
-    return 0;
-}
-
-/* ── Metadata helpers ────────────────────────────────────────────── */
-
-static const char *extract_metadata_value(const cf_metadata_t *md, size_t count,
-                                          const char *key)
-{
-    for (size_t i = 0; i < count; i++) {
-        if (strcmp(md[i].key, key) == 0) {
-            return md[i].val;
-        }
+    if (buf_len == 0) {
+        free(buf);
+        buf = NULL;
     }
-    return NULL;
+    resp->body = buf;
+    resp->body_len = buf_len;
+    return 0;
 }
 
 /* ── Error helpers ───────────────────────────────────────────────── */
@@ -726,11 +2137,8 @@ static const char *extract_metadata_value(const cf_metadata_t *md, size_t count,
 static void set_bad_gateway(cf_http_response_t *resp, const char *reason)
 {
     resp->status_code = 502;
-    resp->header_count = 1;
-    snprintf(resp->headers[0].key, sizeof(resp->headers[0].key),
-             "Content-Type");
-    snprintf(resp->headers[0].val, sizeof(resp->headers[0].val),
-             "text/plain");
+    cf_metadata_clear(&resp->headers);
+    cf_metadata_add(&resp->headers, NULL, "Content-Type", 12, "text/plain", 10);
 
     const char *prefix = "502 Bad Gateway: ";
     size_t plen = strlen(prefix);
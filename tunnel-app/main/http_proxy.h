@@ -1,5 +1,6 @@
 #pragma once
 #include "tunnel_types.h"
+#include "mem_pool.h"
 
 /*
  * Phase 6: HTTP Proxy - Forward requests to local origin.
@@ -18,8 +19,29 @@ typedef struct {
     const char *origin_url;     /* e.g. "http://localhost:8080" */
     int connect_timeout_ms;     /* Default: 5000 */
     int read_timeout_ms;        /* Default: 30000 */
+    mem_pool_t *mem_pool;       /* Per-request buffers (NULL = heap) */
+    int max_idle_conns;         /* Keep-alive connections kept for reuse
+                                 * (0 = one connection per request) */
+    int idle_timeout_ms;        /* Drop idle connections after this long
+                                 * (default: 30000) */
+    int dns_refresh_ms;         /* Re-resolve the origin host this often
+                                 * (default: 60000) */
 } http_proxy_config_t;
 
+/* Origin connection pool counters. */
+typedef struct {
+    uint64_t conn_reused;       /* Requests sent on a pooled connection */
+    uint64_t conn_opened;       /* New origin connections */
+    uint64_t conn_stale;        /* Pooled connections found dead before use */
+    uint64_t conn_expired;      /* Pooled connections past the idle timeout */
+    uint64_t retries;           /* Idempotent requests retried on a fresh
+                                 * connection after a dead pooled one */
+    uint64_t dns_lookups;       /* Origin host resolutions */
+    uint64_t dns_failures;      /* ... that failed (old addresses kept) */
+    uint64_t connect_failovers; /* Extra addresses raced because the first
+                                 * failed or was slow to connect */
+} http_proxy_stats_t;
+
 /* Initialize proxy with configuration. Returns 0 on success. */
 int http_proxy_init(const http_proxy_config_t *config);
 
@@ -34,8 +56,73 @@ int http_proxy_forward(const cf_connect_request_t *req,
                        const uint8_t *body, size_t body_len,
                        cf_http_response_t *resp);
 
+/* How a request body is framed towards the origin. */
+typedef enum {
+    HTTP_BODY_NONE,             /* No body */
+    HTTP_BODY_LENGTH,           /* Exactly Content-Length bytes */
+    HTTP_BODY_CHUNKED,          /* Until end of stream, chunk-encoded */
+} http_body_framing_t;
+
+/* Work out the request body framing from the ConnectRequest metadata,
+ * the same way the Go client does: Transfer-Encoding: chunked wins,
+ * then Content-Length (stored in *length), otherwise no body. */
+http_body_framing_t http_proxy_request_framing(const cf_connect_request_t *req,
+                                               uint64_t *length);
+
+/* Request body supplier for http_proxy_open().
+ * read() fills up to `cap` bytes and returns the count, 0 at end of body,
+ * or -1 on error.  It may block until data arrives. */
+typedef struct {
+    int (*read)(void *arg, uint8_t *buf, size_t cap);
+    void *arg;
+} http_body_source_t;
+
+/* Streaming variant of http_proxy_forward.
+ *
+ * Sends the request, streaming the body from `body` (may be NULL) with
+ * the framing given by http_proxy_request_framing(), and reads only the
+ * response head (status + headers) into `resp`.  On return *out is either an open origin stream positioned
+ * at the first body byte, to be drained with http_proxy_read_body(), or
+ * NULL when `resp` is already complete (static page, 502 on origin
+ * failure) and its body, if any, is in resp->body.
+ *
+ * Returns 0 on success, -1 on invalid use. */
+typedef struct http_proxy_stream http_proxy_stream_t;
+
+int http_proxy_open(const cf_connect_request_t *req,
+                    const http_body_source_t *body,
+                    cf_http_response_t *resp, http_proxy_stream_t **out);
+
+/* Read up to `cap` response body bytes into `buf`.  A chunked body comes
+ * out decoded (its Transfer-Encoding header is dropped from the head).
+ * Returns the number of bytes read, 0 at end of body, -1 on error
+ * (origin closed or timed out before the framed length was reached). */
+int http_proxy_read_body(http_proxy_stream_t *s, uint8_t *buf, size_t cap);
+
+/* Pull mode: the body is read on demand by a non-blocking caller (the
+ * QUIC send path) instead of with http_proxy_read_body().
+ *
+ * http_proxy_pull_begin() switches the stream over; it returns -1 when the
+ * platform cannot report buffered socket bytes (FIONREAD), in which case
+ * the stream is left as it was.  http_proxy_pull_ready() returns how many
+ * body bytes (at most `max`) can be read right now, 0 if none yet, or -1
+ * on error or read timeout; it sets *fin when the body ends after those
+ * bytes.  http_proxy_pull_read() then reads exactly that many.
+ * http_proxy_pull_fd() is the origin socket, which turns readable when
+ * http_proxy_pull_ready() may have more, so the caller can wait on it. */
+int http_proxy_pull_begin(http_proxy_stream_t *s);
+int http_proxy_pull_ready(http_proxy_stream_t *s, size_t max, bool *fin);
+int http_proxy_pull_read(http_proxy_stream_t *s, uint8_t *buf, size_t len);
+int http_proxy_pull_fd(const http_proxy_stream_t *s);
+
+/* Close the origin connection and free the stream. */
+void http_proxy_close(http_proxy_stream_t *s);
+
 /* Free response body allocated by http_proxy_forward */
 void http_proxy_free_response(cf_http_response_t *resp);
 
-/* Cleanup proxy resources */
+/* Snapshot of the origin connection pool counters. */
+void http_proxy_get_stats(http_proxy_stats_t *stats);
+
+/* Cleanup proxy resources (closes pooled connections) */
 void http_proxy_cleanup(void);
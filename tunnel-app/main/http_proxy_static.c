@@ -7,9 +7,9 @@
  */
 
 #include "http_proxy_static.h"
+#include "cf_metadata.h"
 
 #include <string.h>
-#include <stdlib.h>
 #include <stdio.h>
 #include "esp_log.h"
 
@@ -42,28 +42,25 @@ int http_proxy_static_forward(const cf_connect_request_t *req,
     (void)body;
     (void)body_len;
 
-    memset(resp, 0, sizeof(*resp));
     resp->status_code = 200;
+    cf_metadata_clear(&resp->headers);
 
-    /* Content-Type */
-    snprintf(resp->headers[0].key, sizeof(resp->headers[0].key), "Content-Type");
-    snprintf(resp->headers[0].val, sizeof(resp->headers[0].val), "text/html; charset=utf-8");
-
-    /* Content-Length */
-    snprintf(resp->headers[1].key, sizeof(resp->headers[1].key), "Content-Length");
-    snprintf(resp->headers[1].val, sizeof(resp->headers[1].val), "%zu", s_page_len);
-
-    resp->header_count = 2;
-
-    resp->body = malloc(s_page_len);
-    if (!resp->body) {
-        ESP_LOGE(TAG, "malloc failed for static page body");
+    char len_str[24];
+    int len_n = snprintf(len_str, sizeof(len_str), "%zu", s_page_len);
+    static const char ctype[] = "text/html; charset=utf-8";
+    if (cf_metadata_add(&resp->headers, NULL, "Content-Type", 12,
+                        ctype, sizeof(ctype) - 1) != 0 ||
+        cf_metadata_add(&resp->headers, NULL, "Content-Length", 14,
+                        len_str, (size_t)len_n) != 0) {
         return -1;
     }
-    memcpy(resp->body, s_page, s_page_len);
+
+    /* The page outlives every request: lend it instead of copying. */
+    resp->body = (uint8_t *)s_page;
     resp->body_len = s_page_len;
+    resp->body_static = true;
 
     ESP_LOGI(TAG, "serving static page (%zu bytes) for %s", s_page_len,
-             req ? req->dest : "?");
+             req ? cf_metadata_str(&req->metadata, req->dest) : "?");
     return 0;
 }
@@ -8,7 +8,9 @@
  * Activated when origin URL is "static://".
  */
 
-/* Override the default page (NULL/0 resets to built-in default). */
+/* Override the default page (NULL/0 resets to built-in default).  The
+ * page is lent to every response, so `html` must stay valid while it is
+ * in use. */
 void http_proxy_static_set_page(const char *html, size_t len);
 
 /* Fulfil a request with the static page. Same signature as http_proxy_forward. */
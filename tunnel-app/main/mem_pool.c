@@ -0,0 +1,226 @@
+/*
+ * Phase 6: Per-connection buffer pool (see mem_pool.h).
+ *
+ * Every buffer carries a small header in front of the user pointer that
+ * records its capacity and size class, and links it into a free list
+ * while it is cached.
+ */
+
+#include "mem_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "esp_log.h"
+
+static const char *TAG = "mem_pool";
+
+#define MEM_POOL_CLASSES (MEM_POOL_MAX_SHIFT - MEM_POOL_MIN_SHIFT + 1)
+#define CLASS_NONE       0xFF   /* Oversized or from a NULL pool */
+
+/* Per-class cache: keep up to CACHE_BYTES worth of buffers, but never
+ * fewer than CACHE_MIN, so the largest classes still get reused. */
+#if defined(CONFIG_IDF_TARGET_LINUX)
+#define MEM_POOL_CACHE_BYTES (1024 * 1024)
+#define MEM_POOL_CACHE_MIN   4
+#else
+#define MEM_POOL_CACHE_BYTES (32 * 1024)
+#define MEM_POOL_CACHE_MIN   1
+#endif
+
+typedef union buf_hdr {
+    struct {
+        union buf_hdr *next;    /* Free-list link while cached */
+        size_t cap;
+        uint8_t cls;
+    } h;
+    max_align_t align;          /* Keep the user pointer fully aligned */
+} buf_hdr_t;
+
+typedef struct {
+    buf_hdr_t *free;
+    size_t count;
+    size_t limit;
+} size_class_t;
+
+struct mem_pool {
+    pthread_mutex_t lock;
+    size_class_t classes[MEM_POOL_CLASSES];
+    mem_pool_stats_t stats;
+};
+
+static buf_hdr_t *hdr_of(const void *buf)
+{
+    return (buf_hdr_t *)buf - 1;
+}
+
+/* Smallest class holding `size`, or CLASS_NONE if too large. */
+static uint8_t class_of(size_t size)
+{
+    if (size > MEM_POOL_MAX_SIZE) {
+        return CLASS_NONE;
+    }
+    uint8_t cls = 0;
+    while ((MEM_POOL_MIN_SIZE << cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static buf_hdr_t *heap_alloc(size_t cap, uint8_t cls)
+{
+    buf_hdr_t *hdr = malloc(sizeof(*hdr) + cap);
+    if (hdr == NULL) {
+        ESP_LOGE(TAG, "malloc(%zu) failed", cap);
+        return NULL;
+    }
+    hdr->h.next = NULL;
+    hdr->h.cap = cap;
+    hdr->h.cls = cls;
+    return hdr;
+}
+
+mem_pool_t *mem_pool_create(void)
+{
+    mem_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        ESP_LOGE(TAG, "failed to allocate pool");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    for (int i = 0; i < MEM_POOL_CLASSES; i++) {
+        size_t limit = MEM_POOL_CACHE_BYTES >> (MEM_POOL_MIN_SHIFT + i);
+        pool->classes[i].limit = limit < MEM_POOL_CACHE_MIN ? MEM_POOL_CACHE_MIN : limit;
+    }
+    return pool;
+}
+
+void mem_pool_destroy(mem_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    for (int i = 0; i < MEM_POOL_CLASSES; i++) {
+        buf_hdr_t *hdr = pool->classes[i].free;
+        while (hdr) {
+            buf_hdr_t *next = hdr->h.next;
+            free(hdr);
+            hdr = next;
+        }
+    }
+    ESP_LOGI(TAG, "%" PRIu64 " gets, %" PRIu64 " from cache, %" PRIu64 " mallocs",
+             pool->stats.gets, pool->stats.hits, pool->stats.mallocs);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *mem_pool_get(mem_pool_t *pool, size_t size)
+{
+    uint8_t cls = class_of(size);
+    size_t cap = cls == CLASS_NONE ? size : MEM_POOL_MIN_SIZE << cls;
+
+    if (pool == NULL) {
+        buf_hdr_t *hdr = heap_alloc(size, CLASS_NONE);
+        return hdr ? hdr + 1 : NULL;
+    }
+
+    buf_hdr_t *hdr = NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.gets++;
+    if (cls != CLASS_NONE && pool->classes[cls].free != NULL) {
+        size_class_t *c = &pool->classes[cls];
+        hdr = c->free;
+        c->free = hdr->h.next;
+        c->count--;
+        pool->stats.hits++;
+        pool->stats.cached_bytes -= cap;
+    } else {
+        pool->stats.mallocs++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (hdr == NULL) {
+        hdr = heap_alloc(cap, cls);
+        if (hdr == NULL) {
+            return NULL;
+        }
+    }
+    hdr->h.next = NULL;
+    return hdr + 1;
+}
+
+void *mem_pool_get_zeroed(mem_pool_t *pool, size_t size)
+{
+    void *buf = mem_pool_get(pool, size);
+    if (buf != NULL) {
+        memset(buf, 0, size);
+    }
+    return buf;
+}
+
+void mem_pool_put(mem_pool_t *pool, void *buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+    buf_hdr_t *hdr = hdr_of(buf);
+    uint8_t cls = hdr->h.cls;
+
+    if (pool != NULL) {
+        bool cached = false;
+        pthread_mutex_lock(&pool->lock);
+        if (cls != CLASS_NONE && pool->classes[cls].count < pool->classes[cls].limit) {
+            size_class_t *c = &pool->classes[cls];
+            hdr->h.next = c->free;
+            c->free = hdr;
+            c->count++;
+            pool->stats.cached_bytes += hdr->h.cap;
+            cached = true;
+        } else {
+            pool->stats.heap_frees++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (cached) {
+            return;
+        }
+    }
+    free(hdr);
+}
+
+size_t mem_pool_capacity(const void *buf)
+{
+    return buf ? hdr_of(buf)->h.cap : 0;
+}
+
+void *mem_pool_grow(mem_pool_t *pool, void *buf, size_t used, size_t size)
+{
+    size_t cap = mem_pool_capacity(buf);
+    if (buf != NULL && cap >= size) {
+        return buf;
+    }
+    if (size < cap * 2) {
+        size = cap * 2;
+    }
+    void *tmp = mem_pool_get(pool, size);
+    if (tmp == NULL) {
+        return NULL;
+    }
+    if (used > 0) {
+        memcpy(tmp, buf, used);
+    }
+    mem_pool_put(pool, buf);
+    return tmp;
+}
+
+void mem_pool_get_stats(mem_pool_t *pool, mem_pool_stats_t *stats)
+{
+    if (pool == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,65 @@
+#pragma once
+/*
+ * Phase 6: Per-connection buffer pool.
+ *
+ * Recycles the short-lived allocations made for every proxied request
+ * (stream slots, stream send/receive buffers, proxy jobs, origin I/O
+ * buffers) so that a tunnel in steady state does not call malloc at all.
+ *
+ * Buffers come in power-of-two size classes from MEM_POOL_MIN_SIZE to
+ * MEM_POOL_MAX_SIZE.  A freed buffer goes onto its class's free list,
+ * up to a per-class cache limit; larger requests go straight to the heap.
+ * Fixed-size objects (stream_ctx_t, proxy_job_t) simply map onto one
+ * class each, which makes their class a slab of reusable slots.
+ *
+ * The pool is shared by the packet loop and the proxy workers and is
+ * protected by a mutex.  A NULL pool is valid everywhere and means
+ * "plain heap", so callers need no special case.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MEM_POOL_MIN_SHIFT 6                    /* 64 B */
+#define MEM_POOL_MAX_SHIFT 16                   /* 64 KB */
+#define MEM_POOL_MIN_SIZE  ((size_t)1 << MEM_POOL_MIN_SHIFT)
+#define MEM_POOL_MAX_SIZE  ((size_t)1 << MEM_POOL_MAX_SHIFT)
+
+typedef struct mem_pool mem_pool_t;
+
+typedef struct {
+    uint64_t gets;              /* mem_pool_get() calls */
+    uint64_t hits;              /* ... served from a free list */
+    uint64_t mallocs;           /* Heap allocations (misses + oversized) */
+    uint64_t heap_frees;        /* Buffers returned to the heap */
+    size_t cached_bytes;        /* Bytes currently on free lists */
+} mem_pool_stats_t;
+
+/* Create an empty pool.  Returns NULL on OOM. */
+mem_pool_t *mem_pool_create(void);
+
+/* Free every cached buffer and the pool.  All buffers must have been
+ * returned with mem_pool_put() first. */
+void mem_pool_destroy(mem_pool_t *pool);
+
+/* Get a buffer of at least `size` bytes (contents undefined).
+ * Returns NULL on OOM. */
+void *mem_pool_get(mem_pool_t *pool, size_t size);
+
+/* Like mem_pool_get(), zero-filled. */
+void *mem_pool_get_zeroed(mem_pool_t *pool, size_t size);
+
+/* Return a buffer obtained from `pool` (NULL is ignored). */
+void mem_pool_put(mem_pool_t *pool, void *buf);
+
+/* Usable size of a buffer from mem_pool_get(). */
+size_t mem_pool_capacity(const void *buf);
+
+/* Make `buf` hold at least `size` bytes, keeping its first `used` bytes.
+ * Grows to at least twice the current capacity so repeated appends stay
+ * amortised O(1).  Returns the (possibly moved) buffer, or NULL on OOM
+ * with `buf` left untouched.  `buf` may be NULL. */
+void *mem_pool_grow(mem_pool_t *pool, void *buf, size_t used, size_t size);
+
+/* Snapshot of the pool's counters. */
+void mem_pool_get_stats(mem_pool_t *pool, mem_pool_stats_t *stats);
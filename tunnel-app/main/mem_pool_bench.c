@@ -0,0 +1,386 @@
+/*
+ * Host check and benchmark for mem_pool.c; not part of the firmware
+ * build.
+ *
+ * Counts every malloc, calloc and realloc in the process while it runs
+ * requests through the allocations the tunnel makes for each one, in the
+ * same sizes and order: the stream's receive buffer growing frame by
+ * frame, the ConnectRequest viewed in place and copied into a proxy job's
+ * metadata, the upload pipe and the worker's request body buffer, the
+ * origin's response head and headers, body chunks (bodies in pull mode
+ * take none), and the ConnectResponse built from them and encoded into a
+ * send segment.  REQUESTS_IN_FLIGHT requests overlap, as many as there are
+ * proxy workers, and the request and response sizes vary from one to the
+ * next.  (Stream contexts are covered by quic_tunnel_soak.c.)
+ *
+ * After a warm-up the pool must serve every request without touching the
+ * heap.  The same requests are then run on the plain heap (a NULL pool)
+ * for comparison.  capnp_schema.h is generated from schema/ first:
+ *
+ *   python3 schema/capnp_gen.py -o capnp_schema.h \
+ *       schema/rpc.capnp:RPC schema/tunnelrpc.capnp:TUNNEL \
+ *       schema/quic_metadata_protocol.capnp:STREAM
+ *   cc -O2 -DCONFIG_IDF_TARGET_LINUX -I. -Ihost mem_pool_bench.c mem_pool.c \
+ *       cf_metadata.c capnp_minimal.c data_stream.c -lpthread && ./a.out
+ *
+ * Leave out -DCONFIG_IDF_TARGET_LINUX for the ESP32 cache limits (see
+ * CHECK_FLAT).  The counter wraps glibc's allocator.  Exits with 1 if a
+ * request goes wrong or the pool calls malloc after the warm-up.
+ */
+
+#include "mem_pool.h"
+#include "cf_metadata.h"
+#include "capnp_minimal.h"
+#include "data_stream.h"
+#include "proxy_worker.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The ESP32 limits cache two 16 KB buffers, fewer than two uploads (pipe
+ * and origin send buffer each) or a chunk-ring download hold at once.
+ * Past that the pool gives memory back rather than keep it, by design,
+ * so there the heap calls are only reported. */
+#if defined(CONFIG_IDF_TARGET_LINUX)
+#define REQUESTS_IN_FLIGHT 4
+#define CHECK_FLAT         true
+#else
+#define REQUESTS_IN_FLIGHT 2
+#define CHECK_FLAT         false
+#endif
+
+#define WARMUP_REQUESTS 1000
+#define BENCH_REQUESTS  200000
+
+/* QUIC frame payload appended to the receive buffer at a time */
+#define FRAME_SIZE 1200
+
+/* First receive buffer, as quic_tunnel's RECV_BUF_MIN */
+#define RECV_BUF_MIN 4096
+
+/* Send segment header, roughly as quic_tunnel's send_seg_t */
+#define SEND_SEG_HDR 64
+
+/* http_proxy's response head and request body buffers */
+#define ORIGIN_HEAD_SIZE   4096
+#define ORIGIN_UPLOAD_SIZE (16 * 1024)
+
+/* ── Allocation counter ──────────────────────────────────────────── */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static unsigned long s_heap_calls;
+
+void *malloc(size_t size)
+{
+    s_heap_calls++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    s_heap_calls++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    s_heap_calls++;
+    return __libc_realloc(p, size);
+}
+
+/* ── Requests ────────────────────────────────────────────────────── */
+
+typedef struct {
+    size_t req_headers;         /* ConnectRequest metadata entries */
+    size_t resp_headers;        /* Origin response headers */
+    size_t chunks;              /* Body chunks in flight; 0 in pull mode */
+    bool upload;
+} request_kind_t;
+
+static const request_kind_t s_kinds[] = {
+    {   6,  4, 0, false },      /* 304, HEAD */
+    {  12,  8, 0, false },      /* Page, pulled straight from the origin */
+    {  15, 12, 4, false },      /* Download through the chunk ring */
+    {  20, 10, 0, true  },      /* Form post */
+    {  40, 30, 1, true  },      /* Upload, cookie-heavy, buffered answer */
+    { 120, 64, 0, false },      /* Unusually many headers */
+};
+
+#define NUM_KINDS (sizeof(s_kinds) / sizeof(s_kinds[0]))
+
+/* Wire bytes of each kind's ConnectRequest, preamble included */
+static uint8_t *s_wire[NUM_KINDS];
+static size_t s_wire_len[NUM_KINDS];
+
+typedef struct {
+    const request_kind_t *kind;
+    uint8_t *recv_buf;
+    proxy_job_t *job;
+    uint8_t *head_buf;          /* Origin response head */
+    uint8_t *send_seg;
+} request_t;
+
+static int build_wire(size_t k)
+{
+    const request_kind_t *kind = &s_kinds[k];
+    size_t cap = 1024 + kind->req_headers * 96;
+    uint8_t *work = malloc(cap);
+    uint8_t *wire = malloc(cap + 8);
+    if (!work || !wire) {
+        free(work);
+        free(wire);
+        return -1;
+    }
+    capnp_builder_t b;
+    capnp_builder_init(&b, work, cap);
+    int root = capnp_alloc(&b, 1);
+    int st = capnp_new_struct(&b, root, 1, 2);
+    capnp_write_text(&b, st + 8, "http://origin.example/some/path?with=query");
+    int list = capnp_new_struct_list(&b, st + 16, (uint32_t)kind->req_headers, 0, 2);
+    char key[48], val[96];
+    for (size_t i = 0; i < kind->req_headers; i++) {
+        if (i == 0) {
+            snprintf(key, sizeof(key), "HttpMethod");
+            snprintf(val, sizeof(val), kind->upload ? "POST" : "GET");
+        } else {
+            snprintf(key, sizeof(key), "HttpHeader:X-Header-%zu", i);
+            snprintf(val, sizeof(val), "value %zu of a request header, %zu", i, k);
+        }
+        capnp_write_text(&b, list + i * 16, key);
+        capnp_write_text(&b, list + i * 16 + 8, val);
+    }
+    memcpy(wire, CF_DATA_STREAM_SIGNATURE, 6);
+    memcpy(wire + 6, "01", 2);
+    size_t n = capnp_finalize(&b, wire + 8, cap);
+    free(work);
+    if (n == 0) {
+        free(wire);
+        return -1;
+    }
+    s_wire[k] = wire;
+    s_wire_len[k] = 8 + n;
+    return 0;
+}
+
+static int fail(size_t n, const char *what)
+{
+    fprintf(stderr, "FAIL request %zu: %s\n", n, what);
+    return -1;
+}
+
+/* Everything the loop thread and a worker allocate for request `n`, up
+ * to the ConnectResponse being queued. */
+static int request_start(mem_pool_t *mem, request_t *r, size_t n)
+{
+    size_t k = n % NUM_KINDS;
+    r->kind = &s_kinds[k];
+    const uint8_t *wire = s_wire[k];
+    size_t wire_len = s_wire_len[k];
+
+    /* The request arrives a frame at a time. */
+    size_t recv_len = 0;
+    while (recv_len < wire_len) {
+        size_t len = wire_len - recv_len < FRAME_SIZE ? wire_len - recv_len : FRAME_SIZE;
+        size_t needed = recv_len + len;
+        if (needed > mem_pool_capacity(r->recv_buf)) {
+            uint8_t *buf = mem_pool_grow(mem, r->recv_buf, recv_len,
+                                         needed < RECV_BUF_MIN ? RECV_BUF_MIN : needed);
+            if (buf == NULL) {
+                return fail(n, "receive buffer");
+            }
+            r->recv_buf = buf;
+        }
+        memcpy(r->recv_buf + recv_len, wire + recv_len, len);
+        recv_len += len;
+    }
+
+    capnp_connect_request_view_t view;
+    if (data_stream_request_size(r->recv_buf, recv_len) != wire_len ||
+        data_stream_view_request(r->recv_buf, wire_len, &view) != 0) {
+        return fail(n, "ConnectRequest does not parse");
+    }
+    r->job = mem_pool_get_zeroed(mem, sizeof(*r->job));
+    if (r->job == NULL) {
+        return fail(n, "job");
+    }
+    proxy_job_t *job = r->job;
+    cf_metadata_init(&job->req.metadata, mem);
+    cf_metadata_init(&job->resp.headers, mem);
+    if (capnp_connect_request_copy(&view, &job->req) != 0) {
+        return fail(n, "ConnectRequest copy");
+    }
+    const char *method = data_stream_get_method(&job->req);
+    if (job->req.metadata.count != r->kind->req_headers || method == NULL ||
+        strcmp(method, r->kind->upload ? "POST" : "GET") != 0) {
+        return fail(n, "ConnectRequest copied wrong");
+    }
+    if (r->kind->upload) {
+        job->upload_buf = mem_pool_get(mem, PROXY_UPLOAD_SIZE);
+        if (job->upload_buf == NULL) {
+            return fail(n, "upload pipe");
+        }
+    }
+
+    /* Worker: the request body goes out through a buffer of its own,
+     * then the origin's head is read and parsed. */
+    if (r->kind->upload) {
+        uint8_t *buf = mem_pool_get(mem, ORIGIN_UPLOAD_SIZE);
+        if (buf == NULL) {
+            return fail(n, "origin upload buffer");
+        }
+        mem_pool_put(mem, buf);
+    }
+    r->head_buf = mem_pool_get(mem, ORIGIN_HEAD_SIZE);
+    if (r->head_buf == NULL) {
+        return fail(n, "origin head buffer");
+    }
+    char val[64];
+    for (size_t i = 0; i < r->kind->resp_headers; i++) {
+        int len = snprintf(val, sizeof(val), "response header value %zu", i);
+        if (cf_metadata_add(&job->resp.headers, NULL, "X-Response", 10,
+                            val, (size_t)len) != 0) {
+            return fail(n, "response header");
+        }
+    }
+    job->resp.status_code = 200;
+    for (size_t i = 0; i < r->kind->chunks; i++) {
+        job->chunks[i].buf = mem_pool_get(mem, PROXY_CHUNK_SIZE);
+        if (job->chunks[i].buf == NULL) {
+            return fail(n, "body chunk");
+        }
+    }
+
+    /* Loop thread: the ConnectResponse, encoded into a send segment. */
+    cf_connect_response_t resp = { .error = "" };
+    cf_metadata_init(&resp.metadata, mem);
+    int rc = -1;
+    if (data_stream_build_http_metadata(job->resp.status_code,
+                                        &job->resp.headers, &resp) != 0) {
+        fail(n, "ConnectResponse metadata");
+        goto done;
+    }
+    size_t resp_len = data_stream_response_size(&resp), out_len = 0;
+    r->send_seg = mem_pool_get(mem, SEND_SEG_HDR + resp_len);
+    if (r->send_seg == NULL ||
+        data_stream_build_response(&resp, r->send_seg + SEND_SEG_HDR, resp_len,
+                                   &out_len) != 0 || out_len != resp_len) {
+        fail(n, "ConnectResponse encoding");
+        goto done;
+    }
+    rc = 0;
+
+done:
+    cf_metadata_free(&resp.metadata);
+    return rc;
+}
+
+/* Return everything once the response has been sent. */
+static void request_finish(mem_pool_t *mem, request_t *r)
+{
+    proxy_job_t *job = r->job;
+    if (job != NULL) {
+        cf_metadata_free(&job->req.metadata);
+        cf_metadata_free(&job->resp.headers);
+        for (size_t i = 0; i < PROXY_JOB_CHUNKS; i++) {
+            mem_pool_put(mem, job->chunks[i].buf);
+        }
+        mem_pool_put(mem, job->upload_buf);
+        mem_pool_put(mem, job);
+    }
+    mem_pool_put(mem, r->head_buf);
+    mem_pool_put(mem, r->send_seg);
+    mem_pool_put(mem, r->recv_buf);
+    memset(r, 0, sizeof(*r));
+}
+
+/* Run requests [first, first + count) with REQUESTS_IN_FLIGHT at once. */
+static int run_requests(mem_pool_t *mem, request_t *slots, size_t first, size_t count)
+{
+    for (size_t n = first; n < first + count; n++) {
+        request_t *r = &slots[n % REQUESTS_IN_FLIGHT];
+        request_finish(mem, r);
+        if (request_start(mem, r, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int bench(const char *name, mem_pool_t *mem, bool check_flat)
+{
+    request_t slots[REQUESTS_IN_FLIGHT];
+    memset(slots, 0, sizeof(slots));
+    int rc = -1;
+
+    if (run_requests(mem, slots, 0, WARMUP_REQUESTS) != 0) {
+        goto done;
+    }
+    unsigned long calls = s_heap_calls;
+    double t0 = now_s();
+    if (run_requests(mem, slots, WARMUP_REQUESTS, BENCH_REQUESTS) != 0) {
+        goto done;
+    }
+    double t = now_s() - t0;
+    calls = s_heap_calls - calls;
+
+    printf("%-5s %7.2f heap calls/request  %6.0f ns/request\n", name,
+           (double)calls / BENCH_REQUESTS, t * 1e9 / BENCH_REQUESTS);
+    if (check_flat && calls != 0) {
+        fprintf(stderr, "FAIL %lu heap calls in %u requests after warm-up\n",
+                calls, BENCH_REQUESTS);
+        goto done;
+    }
+    rc = 0;
+
+done:
+    for (size_t i = 0; i < REQUESTS_IN_FLIGHT; i++) {
+        request_finish(mem, &slots[i]);
+    }
+    return rc;
+}
+
+int main(void)
+{
+    for (size_t k = 0; k < NUM_KINDS; k++) {
+        if (build_wire(k) != 0) {
+            fprintf(stderr, "FAIL building request kind %zu\n", k);
+            return 1;
+        }
+    }
+    printf("mem_pool: %d requests in flight\n", REQUESTS_IN_FLIGHT);
+
+    mem_pool_t *mem = mem_pool_create();
+    if (mem == NULL) {
+        return 1;
+    }
+    int rc = bench("pool", mem, CHECK_FLAT);
+    mem_pool_stats_t st;
+    mem_pool_get_stats(mem, &st);
+    printf("pool  %llu gets, %llu from cache, %llu mallocs\n",
+           (unsigned long long)st.gets, (unsigned long long)st.hits,
+           (unsigned long long)st.mallocs);
+    mem_pool_destroy(mem);
+
+    if (rc == 0) {
+        rc = bench("heap", NULL, false);
+    }
+    for (size_t k = 0; k < NUM_KINDS; k++) {
+        free(s_wire[k]);
+    }
+    return rc == 0 ? 0 : 1;
+}
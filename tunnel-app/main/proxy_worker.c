@@ -0,0 +1,585 @@
+/*
+ * Phase 6: Origin proxy worker pool.
+ *
+ * A fixed set of pthreads pulls jobs from a FIFO request queue, opens the
+ * origin request with http_proxy_open() (which pulls the request body out
+ * of the job's upload pipe), and then streams the response body into the
+ * job's chunk ring (or, in pull mode, leaves the body on the origin
+ * socket for the loop thread).  Every state change (head parsed, chunk
+ * filled, worker finished) puts the job on the completion queue once;
+ * proxy_pool_pump() on the loop thread drains that queue into the sink.
+ *
+ * Everything shared between the two sides is protected by one mutex.
+ * Workers sleep on work_cv while the request queue is empty, on upload_cv
+ * while their job's upload pipe is empty, and on space_cv while their
+ * job's ring is full.  The loop thread never blocks:
+ * it only takes the mutex to unlink queues and advance ring counters.
+ */
+
+#include "proxy_worker.h"
+#include "http_proxy.h"
+#include "cf_metadata.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "esp_log.h"
+
+static const char *TAG = "proxy_worker";
+
+/* Worker stack: http_proxy_open keeps ~6 KB of headers/path on stack. */
+#define PROXY_WORKER_STACK_SIZE (32 * 1024)
+
+/* How long a worker waits for the next request body bytes. */
+#define PROXY_UPLOAD_TIMEOUT_S  30
+
+typedef struct {
+    proxy_job_t *head;
+    proxy_job_t *tail;
+} job_queue_t;
+
+struct proxy_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cv;    /* Request queue became non-empty */
+    pthread_cond_t  space_cv;   /* A ring slot was freed or job cancelled */
+    pthread_cond_t  upload_cv;  /* Upload bytes queued, EOF, or cancelled */
+    job_queue_t     work;       /* Submitted, not yet picked up */
+    job_queue_t     done;       /* Jobs with news for the loop thread */
+    bool            stopping;
+
+    /* Loop-thread only */
+    proxy_job_t    *stalled;    /* Jobs whose sink asked to retry later */
+    proxy_job_t    *uploads;    /* Jobs still taking request body bytes */
+    size_t          in_flight;
+
+    mem_pool_t     *mem;        /* Jobs and their buffers */
+    bool            pull;       /* Hand bodies over as job->body_stream */
+    void          (*wake)(void *arg); /* Loop thread has news (may be NULL) */
+    void           *wake_arg;
+    int             num_workers;
+    pthread_t       threads[PROXY_POOL_MAX_WORKERS];
+};
+
+/* ── Queue helpers (caller holds lock) ───────────────────────────── */
+
+static void queue_push(job_queue_t *q, proxy_job_t *job)
+{
+    job->next = NULL;
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+}
+
+static proxy_job_t *queue_pop(job_queue_t *q)
+{
+    proxy_job_t *job = q->head;
+    if (job) {
+        q->head = job->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        job->next = NULL;
+    }
+    return job;
+}
+
+/* Tell the loop thread the job has news (at most one queue entry). */
+static void notify_locked(proxy_pool_t *pool, proxy_job_t *job)
+{
+    if (!job->queued) {
+        job->queued = true;
+        queue_push(&pool->done, job);
+        if (pool->wake) {
+            pool->wake(pool->wake_arg);
+        }
+    }
+}
+
+/* Wake everything that may be waiting on this job's worker. */
+static void cancel_locked(proxy_pool_t *pool, proxy_job_t *job)
+{
+    job->cancelled = true;
+    pthread_cond_broadcast(&pool->space_cv);
+    pthread_cond_broadcast(&pool->upload_cv);
+}
+
+static void job_free(mem_pool_t *mem, proxy_job_t *job)
+{
+    cf_metadata_free(&job->req.metadata);
+    http_proxy_free_response(&job->resp);
+    http_proxy_close(job->body_stream);
+    for (int i = 0; i < PROXY_JOB_CHUNKS; i++) {
+        mem_pool_put(mem, job->chunks[i].buf);
+    }
+    mem_pool_put(mem, job->upload_buf);
+    mem_pool_put(mem, job);
+}
+
+/* ── Upload pipe, worker side ────────────────────────────────────── */
+
+typedef struct {
+    proxy_pool_t *pool;
+    proxy_job_t *job;
+} upload_source_t;
+
+/* http_body_source_t::read over the job's upload pipe. */
+static int upload_read(void *arg, uint8_t *buf, size_t cap)
+{
+    upload_source_t *u = (upload_source_t *)arg;
+    proxy_pool_t *pool = u->pool;
+    proxy_job_t *job = u->job;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PROXY_UPLOAD_TIMEOUT_S;
+
+    pthread_mutex_lock(&pool->lock);
+    int rc = 0;
+    while (job->upload_len == 0 && !job->upload_eof &&
+           !job->cancelled && !pool->stopping && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&pool->upload_cv, &pool->lock, &deadline);
+    }
+
+    int n;
+    if (job->cancelled || pool->stopping) {
+        n = -1;
+    } else if (job->upload_len > 0) {
+        /* A full pipe stalls the loop thread's feeding; tell it there is
+         * room again. */
+        if (job->upload_len == PROXY_UPLOAD_SIZE && pool->wake) {
+            pool->wake(pool->wake_arg);
+        }
+        size_t take = job->upload_len < cap ? job->upload_len : cap;
+        size_t first = PROXY_UPLOAD_SIZE - job->upload_head;
+        if (first > take) {
+            first = take;
+        }
+        memcpy(buf, job->upload_buf + job->upload_head, first);
+        memcpy(buf + first, job->upload_buf, take - first);
+        job->upload_head = (job->upload_head + take) % PROXY_UPLOAD_SIZE;
+        job->upload_len -= take;
+        n = (int)take;
+    } else if (job->upload_eof) {
+        n = 0;
+    } else {
+        ESP_LOGE(TAG, "stream %" PRIu64 ": request body timed out",
+                 job->stream_id);
+        n = -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+/* ── Worker thread ───────────────────────────────────────────────── */
+
+static void run_job(proxy_pool_t *pool, proxy_job_t *job)
+{
+    http_proxy_stream_t *stream = NULL;
+    upload_source_t upload = { .pool = pool, .job = job };
+    http_body_source_t source = { .read = upload_read, .arg = &upload };
+    if (http_proxy_open(&job->req, job->upload_buf ? &source : NULL,
+                        &job->resp, &stream) != 0) {
+        job->resp.status_code = 502;
+    }
+    if (stream != NULL && pool->pull && http_proxy_pull_begin(stream) == 0) {
+        /* The loop thread reads the body straight into QUIC frames. */
+        job->body_stream = stream;
+        stream = NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    job->head_ready = true;
+    notify_locked(pool, job);
+
+    while (stream != NULL) {
+        while (job->produced - job->consumed == PROXY_JOB_CHUNKS &&
+               !job->cancelled && !pool->stopping) {
+            pthread_cond_wait(&pool->space_cv, &pool->lock);
+        }
+        if (job->cancelled || pool->stopping) {
+            break;
+        }
+        proxy_chunk_t *chunk = &job->chunks[job->produced % PROXY_JOB_CHUNKS];
+        pthread_mutex_unlock(&pool->lock);
+
+        int n = -1;
+        if (chunk->buf == NULL) {
+            chunk->buf = mem_pool_get(pool->mem, PROXY_CHUNK_SIZE);
+        }
+        if (chunk->buf != NULL) {
+            n = http_proxy_read_body(stream, chunk->buf, PROXY_CHUNK_SIZE);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (n <= 0) {
+            if (n < 0) {
+                job->result = -1;
+            }
+            break;
+        }
+        chunk->len = (size_t)n;
+        job->produced++;
+        notify_locked(pool, job);
+    }
+
+    job->worker_done = true;
+    notify_locked(pool, job);
+    pthread_mutex_unlock(&pool->lock);
+
+    http_proxy_close(stream);
+}
+
+static void *worker_main(void *arg)
+{
+    proxy_pool_t *pool = (proxy_pool_t *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->work.head == NULL) {
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        proxy_job_t *job = queue_pop(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        run_job(pool, job);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* ── Loop-thread side ────────────────────────────────────────────── */
+
+static void finish_job(proxy_pool_t *pool, proxy_job_t *job,
+                       const proxy_sink_t *sink, void *arg, proxy_end_t how)
+{
+    if (job->uploading) {
+        proxy_job_t **pp = &pool->uploads;
+        while (*pp != job) {
+            pp = &(*pp)->upload_next;
+        }
+        *pp = job->upload_next;
+        job->uploading = false;
+    }
+    sink->on_end(arg, job, how);
+    job_free(pool->mem, job);
+    pool->in_flight--;
+}
+
+/* Push whatever the job has ready into the sink, and free the job once
+ * both the worker and the sink are done with it. */
+static void process_job(proxy_pool_t *pool, proxy_job_t *job,
+                        const proxy_sink_t *sink, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    bool head_ready = job->head_ready;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!job->cancelled && head_ready && !job->head_sent) {
+        job->head_sent = true;
+        if (sink->on_head(arg, job) != 0) {
+            goto cancel;
+        }
+    }
+
+    while (!job->cancelled && job->head_sent) {
+        pthread_mutex_lock(&pool->lock);
+        bool have_chunk = job->consumed != job->produced;
+        pthread_mutex_unlock(&pool->lock);
+        if (!have_chunk) {
+            break;
+        }
+
+        /* The worker never touches a filled, unconsumed chunk. */
+        proxy_chunk_t *chunk = &job->chunks[job->consumed % PROXY_JOB_CHUNKS];
+        int r = sink->on_body(arg, job, chunk);
+        if (r > 0) {
+            if (!job->stalled) {
+                job->stalled = true;
+                job->stall_next = pool->stalled;
+                pool->stalled = job;
+            }
+            return;
+        }
+        if (r < 0) {
+            goto cancel;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->consumed++;
+        pthread_cond_broadcast(&pool->space_cv);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    bool finished = job->worker_done && !job->queued &&
+                    (job->cancelled || job->consumed == job->produced);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (finished) {
+        finish_job(pool, job, sink, arg,
+                   job->cancelled ? PROXY_END_CANCELLED :
+                   job->result == 0 ? PROXY_END_OK : PROXY_END_TRUNCATED);
+    }
+    return;
+
+cancel:
+    pthread_mutex_lock(&pool->lock);
+    cancel_locked(pool, job);
+    finished = job->worker_done && !job->queued;
+    pthread_mutex_unlock(&pool->lock);
+    ESP_LOGW(TAG, "stream %" PRIu64 ": response cancelled", job->stream_id);
+    if (finished) {
+        finish_job(pool, job, sink, arg, PROXY_END_CANCELLED);
+    }
+}
+
+/* Offer every unfinished upload to the sink.  Jobs leave the list once
+ * their body is complete; cancelled jobs are handed to the next pump
+ * through the completion queue so process_job() can release them. */
+static void feed_uploads(proxy_pool_t *pool, const proxy_sink_t *sink, void *arg)
+{
+    proxy_job_t *list = pool->uploads;
+    pool->uploads = NULL;
+    proxy_job_t **tail = &pool->uploads;
+
+    while (list) {
+        proxy_job_t *job = list;
+        list = job->upload_next;
+        job->upload_next = NULL;
+
+        if (!job->upload_eof && !job->cancelled &&
+            sink->on_upload(arg, job) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            cancel_locked(pool, job);
+            notify_locked(pool, job);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        if (job->upload_eof || job->cancelled) {
+            job->uploading = false;
+        } else {
+            *tail = job;
+            tail = &job->upload_next;
+        }
+    }
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+proxy_pool_t *proxy_pool_create(int num_workers, mem_pool_t *mem)
+{
+    if (num_workers < 1 || num_workers > PROXY_POOL_MAX_WORKERS) {
+        ESP_LOGE(TAG, "invalid worker count %d", num_workers);
+        return NULL;
+    }
+
+    proxy_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        ESP_LOGE(TAG, "failed to allocate pool");
+        return NULL;
+    }
+    pool->mem = mem;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->space_cv, NULL);
+    pthread_cond_init(&pool->upload_cv, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PROXY_WORKER_STACK_SIZE);
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->threads[i], &attr, worker_main, pool) != 0) {
+            ESP_LOGE(TAG, "pthread_create failed for worker %d", i);
+            pthread_attr_destroy(&attr);
+            proxy_pool_destroy(pool);
+            return NULL;
+        }
+        pool->num_workers++;
+    }
+    pthread_attr_destroy(&attr);
+
+    ESP_LOGI(TAG, "started %d origin workers", num_workers);
+    return pool;
+}
+
+void proxy_pool_set_pull(proxy_pool_t *pool, bool pull)
+{
+    pool->pull = pull;
+}
+
+void proxy_pool_set_wake(proxy_pool_t *pool, void (*wake)(void *arg), void *arg)
+{
+    pool->wake = wake;
+    pool->wake_arg = arg;
+}
+
+proxy_job_t *proxy_pool_job_alloc(proxy_pool_t *pool)
+{
+    mem_pool_t *mem = pool ? pool->mem : NULL;
+    proxy_job_t *job = mem_pool_get_zeroed(mem, sizeof(*job));
+    if (job == NULL) {
+        ESP_LOGE(TAG, "failed to allocate job");
+        return NULL;
+    }
+    cf_metadata_init(&job->req.metadata, mem);
+    cf_metadata_init(&job->resp.headers, mem);
+    return job;
+}
+
+int proxy_pool_submit(proxy_pool_t *pool, proxy_job_t *job, bool upload)
+{
+    if (upload) {
+        job->upload_buf = mem_pool_get(pool->mem, PROXY_UPLOAD_SIZE);
+        if (job->upload_buf == NULL) {
+            ESP_LOGE(TAG, "failed to allocate upload pipe");
+            proxy_pool_release(pool, job);
+            return -1;
+        }
+        job->uploading = true;
+        job->upload_next = pool->uploads;
+        pool->uploads = job;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    queue_push(&pool->work, job);
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->in_flight++;
+    return 0;
+}
+
+size_t proxy_pool_upload(proxy_pool_t *pool, proxy_job_t *job,
+                         const uint8_t *data, size_t len, bool eof)
+{
+    if (job->upload_buf == NULL || job->upload_eof) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    size_t n = 0;
+    if (!job->cancelled) {
+        n = PROXY_UPLOAD_SIZE - job->upload_len;
+        if (n > len) {
+            n = len;
+        }
+        size_t tail = (job->upload_head + job->upload_len) % PROXY_UPLOAD_SIZE;
+        size_t first = PROXY_UPLOAD_SIZE - tail;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(job->upload_buf + tail, data, first);
+        memcpy(job->upload_buf, data + first, n - first);
+        job->upload_len += n;
+        if (eof && n == len) {
+            job->upload_eof = true;
+        }
+        if (n > 0 || job->upload_eof) {
+            pthread_cond_broadcast(&pool->upload_cv);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+void proxy_pool_pump(proxy_pool_t *pool, const proxy_sink_t *sink, void *arg)
+{
+    if (pool == NULL || pool->in_flight == 0) {
+        return;
+    }
+
+    feed_uploads(pool, sink, arg);
+
+    pthread_mutex_lock(&pool->lock);
+    proxy_job_t *news = pool->done.head;
+    pool->done.head = pool->done.tail = NULL;
+    for (proxy_job_t *j = news; j; j = j->next) {
+        j->queued = false;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* Stalled jobs are retried below; skip them here to keep order. */
+    while (news) {
+        proxy_job_t *job = news;
+        news = job->next;
+        job->next = NULL;
+        if (!job->stalled) {
+            process_job(pool, job, sink, arg);
+        }
+    }
+
+    proxy_job_t *stalled = pool->stalled;
+    pool->stalled = NULL;
+    while (stalled) {
+        proxy_job_t *job = stalled;
+        stalled = job->stall_next;
+        job->stall_next = NULL;
+        job->stalled = false;
+        process_job(pool, job, sink, arg);
+    }
+}
+
+void proxy_pool_release(proxy_pool_t *pool, proxy_job_t *job)
+{
+    if (job != NULL) {
+        job_free(pool ? pool->mem : NULL, job);
+    }
+}
+
+size_t proxy_pool_in_flight(const proxy_pool_t *pool)
+{
+    return pool ? pool->in_flight : 0;
+}
+
+void proxy_pool_destroy(proxy_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_cond_broadcast(&pool->space_cv);
+    pthread_cond_broadcast(&pool->upload_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* A worker stuck in an origin read finishes within read_timeout_ms. */
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    /* Every started job is now on the done queue; stalled jobs that are
+     * also queued are freed from there. */
+    proxy_job_t *job;
+    while ((job = pool->stalled) != NULL) {
+        pool->stalled = job->stall_next;
+        if (!job->queued) {
+            job_free(pool->mem, job);
+        }
+    }
+    while ((job = queue_pop(&pool->work)) != NULL) {
+        job_free(pool->mem, job);
+    }
+    while ((job = queue_pop(&pool->done)) != NULL) {
+        job_free(pool->mem, job);
+    }
+
+    pthread_cond_destroy(&pool->upload_cv);
+    pthread_cond_destroy(&pool->space_cv);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    ESP_LOGI(TAG, "worker pool stopped");
+}
@@ -0,0 +1,165 @@
+#pragma once
+/*
+ * Phase 6: Origin proxy worker pool.
+ *
+ * Runs origin I/O on a small pool of worker threads so that a slow
+ * origin never blocks the picoquic packet loop.  The loop thread parses
+ * the ConnectRequest and submits a job; the worker sends the request,
+ * streaming the request body out of the job's upload pipe, publishes the
+ * response head as soon as it is parsed, and then streams the response
+ * body through a small ring of fixed-size chunks.
+ *
+ *   loop thread                 worker threads
+ *   ───────────                 ──────────────
+ *   proxy_pool_submit()  ──►    http_proxy_open()      → head ready
+ *   proxy_pool_upload()  ──►      (request body)
+ *   proxy_pool_pump()    ◄──    http_proxy_read_body() → chunk ready
+ *     sink->on_upload/on_head/on_body/on_end
+ *
+ * Both directions are bounded.  The upload pipe holds PROXY_UPLOAD_SIZE
+ * bytes; the loop thread stops moving request bytes off the QUIC stream
+ * while it is full.  The response ring holds PROXY_JOB_CHUNKS chunks; a
+ * worker stops reading from the origin while they all wait for the loop
+ * thread, and the loop thread only takes a chunk when the sink accepts it
+ * (i.e. the QUIC stream's send backlog is below its high-water mark).
+ * Memory per request is therefore constant regardless of body sizes.
+ *
+ * All proxy_pool_* functions are meant to be called from the loop
+ * thread only.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "tunnel_types.h"
+#include "mem_pool.h"
+
+#define PROXY_POOL_MAX_WORKERS 16
+
+/* Body chunk size and ring depth per in-flight response. */
+#define PROXY_CHUNK_SIZE  (16 * 1024)
+#define PROXY_JOB_CHUNKS  4
+
+/* Request body pipe size per in-flight upload. */
+#define PROXY_UPLOAD_SIZE (16 * 1024)
+
+typedef struct proxy_pool proxy_pool_t;
+
+typedef struct {
+    uint8_t *buf;               /* PROXY_CHUNK_SIZE bytes, taken lazily */
+    size_t len;
+} proxy_chunk_t;
+
+/* How a job ended, as reported to the sink's on_end. */
+typedef enum {
+    PROXY_END_OK,               /* Whole response delivered */
+    PROXY_END_TRUNCATED,        /* Origin body cut short after the head */
+    PROXY_END_CANCELLED,        /* The sink or the upload side gave up */
+} proxy_end_t;
+
+/* A single proxied request.  Owned by the pool between submit and the
+ * sink's on_end. */
+typedef struct proxy_job {
+    uint64_t stream_id;
+    uint8_t conn_index;         /* Connection carrying the stream ... */
+    uint32_t conn_gen;          /* ... and its generation, so a job outliving
+                                 * its connection is not matched to a
+                                 * replacement's stream of the same ID */
+    cf_connect_request_t req;
+    cf_http_response_t resp;    /* Head (and buffered body, if any) */
+    struct http_proxy_stream *body_stream; /* Pull mode: body left on the origin socket */
+    int result;                 /* 0, or -1 if the body was cut short */
+
+    /* Body ring, shared with the worker (pool lock) */
+    proxy_chunk_t chunks[PROXY_JOB_CHUNKS];
+    uint32_t produced;          /* Chunks filled by the worker */
+    uint32_t consumed;          /* Chunks taken by the loop thread */
+    bool head_ready;
+    bool worker_done;
+    bool cancelled;
+    bool queued;                /* On the completion queue */
+
+    /* Request body pipe, loop thread → worker (pool lock) */
+    uint8_t *upload_buf;        /* PROXY_UPLOAD_SIZE bytes, NULL if no body */
+    size_t upload_head;         /* Next byte for the worker */
+    size_t upload_len;          /* Bytes queued */
+    bool upload_eof;            /* No more bytes will be queued */
+
+    /* Loop-thread state */
+    bool head_sent;
+    bool stalled;               /* On the stalled list (sink said "later") */
+    bool uploading;             /* On the upload list until upload_eof */
+    struct proxy_job *next;
+    struct proxy_job *stall_next;
+    struct proxy_job *upload_next;
+} proxy_job_t;
+
+/* Loop-thread callbacks used by proxy_pool_pump().
+ *
+ * on_upload: the job still takes request body bytes; feed it with
+ *          proxy_pool_upload().  Called on every pump until the upload
+ *          is finished.  Return 0, or -1 to cancel.
+ * on_head: response head is ready (resp->body may hold a buffered body,
+ *          e.g. a 502 or the static page).  In pull mode job->body_stream
+ *          is the rest of the body, to be read with http_proxy_pull_*();
+ *          the sink takes it by setting it to NULL (otherwise it is closed
+ *          with the job) and no chunks follow.  Return 0, or -1 to cancel.
+ * on_body: forward one body chunk.  Return 0 when consumed, 1 to retry
+ *          on a later pump (backpressure), or -1 to cancel.  The sink may
+ *          keep chunk->buf (a buffer from the pool's mem pool, to be
+ *          returned with mem_pool_put()) by setting it to NULL; the
+ *          worker takes a fresh buffer for that slot.
+ * on_end:  called exactly once, right before the job is freed. */
+typedef struct {
+    int  (*on_upload)(void *arg, proxy_job_t *job);
+    int  (*on_head)(void *arg, proxy_job_t *job);
+    int  (*on_body)(void *arg, proxy_job_t *job, proxy_chunk_t *chunk);
+    void (*on_end)(void *arg, proxy_job_t *job, proxy_end_t how);
+} proxy_sink_t;
+
+/* Create a pool with `num_workers` threads (1..PROXY_POOL_MAX_WORKERS).
+ * Jobs and their chunk/upload buffers come from `mem` (may be NULL) and
+ * go back to it when the job ends.  Returns NULL on error. */
+proxy_pool_t *proxy_pool_create(int num_workers, mem_pool_t *mem);
+
+/* Let workers hand the response body to the sink as job->body_stream
+ * instead of reading it into chunks, where the platform supports
+ * non-blocking body reads (see http_proxy_pull_begin()).  Call before
+ * submitting jobs. */
+void proxy_pool_set_pull(proxy_pool_t *pool, bool pull);
+
+/* Have workers call `wake(arg)` whenever they leave something for
+ * proxy_pool_pump() (news on a job, or room in a full upload pipe), so
+ * the loop thread need not poll.  `wake` runs on worker threads with the
+ * pool locked and must not block.  Call before submitting jobs. */
+void proxy_pool_set_wake(proxy_pool_t *pool, void (*wake)(void *arg), void *arg);
+
+/* Allocate an empty job.  The caller fills in the stream and req, then
+ * hands it over with proxy_pool_submit().  Returns NULL on OOM. */
+proxy_job_t *proxy_pool_job_alloc(proxy_pool_t *pool);
+
+/* Queue a job for the workers.  With `upload` the job has a request
+ * body, to be fed with proxy_pool_upload(); the worker streams it to the
+ * origin as it arrives.  Returns 0 on success, -1 on error (job is
+ * released). */
+int proxy_pool_submit(proxy_pool_t *pool, proxy_job_t *job, bool upload);
+
+/* Queue up to `len` request body bytes for the job's worker; `eof` marks
+ * the end of the body once all of `data` has been taken.  Returns the
+ * number of bytes taken (less than `len` when the pipe is full). */
+size_t proxy_pool_upload(proxy_pool_t *pool, proxy_job_t *job,
+                         const uint8_t *data, size_t len, bool eof);
+
+/* Deliver everything the workers have produced since the last pump to
+ * `sink`, and retry stalled chunks.  Finished jobs are released. */
+void proxy_pool_pump(proxy_pool_t *pool, const proxy_sink_t *sink, void *arg);
+
+/* Release a job obtained from proxy_pool_job_alloc() that was never
+ * submitted. */
+void proxy_pool_release(proxy_pool_t *pool, proxy_job_t *job);
+
+/* Number of jobs submitted and not yet finished. */
+size_t proxy_pool_in_flight(const proxy_pool_t *pool);
+
+/* Stop the workers, join them, and free all outstanding jobs. */
+void proxy_pool_destroy(proxy_pool_t *pool);
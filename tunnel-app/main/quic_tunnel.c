@@ -1,14 +1,19 @@
 /*
- * Phase 3: QUIC tunnel connection to Cloudflare edge via picoquic.
+ * Phase 3: QUIC tunnel connections to Cloudflare edge via picoquic.
  *
- * Establishes a QUIC connection using the "argotunnel" ALPN to a
- * Cloudflare edge server, manages bidirectional streams, and dispatches
- * events to the application layer.
+ * Establishes QUIC connections using the "argotunnel" ALPN to Cloudflare
+ * edge servers, all in one picoquic context and packet loop, manages
+ * their bidirectional streams, and dispatches events to the application
+ * layer.
  */
 
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
 
 #include <picoquic.h>
 #include <picoquic_utils.h>
@@ -23,68 +28,624 @@
 
 static const char *TAG = "quic_tunnel";
 
+/* ── Send queue ────────────────────────────────────────────────────── */
+
+/* Segment allocation size (header included): small writes share one
+ * segment, large ones are split so no segment exceeds one pool class. */
+#define SEND_SEG_MIN  4096
+#define SEND_SEG_MAX  (16 * 1024)
+
+static void send_queue_link(stream_ctx_t *sc, send_seg_t *seg)
+{
+    if (sc->send_tail) {
+        sc->send_tail->next = seg;
+    } else {
+        sc->send_head = seg;
+    }
+    sc->send_tail = seg;
+}
+
+/* Return a segment to the pool, releasing the caller's buffer if it
+ * points at one. */
+static void send_seg_free(quic_tunnel_ctx_t *ctx, send_seg_t *seg)
+{
+    if (seg->external && seg->release) {
+        seg->release(seg->release_arg, seg->data);
+    }
+    mem_pool_put(ctx->mem, seg);
+}
+
+/*
+ * Append `len` bytes to the stream's send queue: fill the room left in
+ * the tail segment, then chain new segments for the rest.
+ */
+static int send_queue_append(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                             const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        send_seg_t *tail = sc->send_tail;
+        if (tail == NULL || tail->len == tail->cap) {
+            size_t size = sizeof(send_seg_t) + len;
+            if (size < SEND_SEG_MIN) {
+                size = SEND_SEG_MIN;
+            } else if (size > SEND_SEG_MAX) {
+                size = SEND_SEG_MAX;
+            }
+            send_seg_t *seg = mem_pool_get(ctx->mem, size);
+            if (seg == NULL) {
+                ESP_LOGE(TAG, "send segment allocation failed");
+                return -1;
+            }
+            memset(seg, 0, sizeof(*seg));
+            seg->data = (uint8_t *)(seg + 1);
+            seg->cap = mem_pool_capacity(seg) - sizeof(send_seg_t);
+            send_queue_link(sc, seg);
+            tail = seg;
+        }
+        size_t n = tail->cap - tail->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(tail->data + tail->len, data, n);
+        tail->len += n;
+        sc->send_pending += n;
+        ctx->send_bytes_copied += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Make sure the tail segment has `len` contiguous free bytes, chaining a
+ * new one if it does not.  Unlike appends, a reservation is never split,
+ * so its segment may be larger than SEND_SEG_MAX.
+ */
+static send_seg_t *send_queue_reserve(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                                      size_t len)
+{
+    send_seg_t *tail = sc->send_tail;
+    if (tail != NULL && !tail->external && tail->cap - tail->len >= len) {
+        return tail;
+    }
+    size_t size = sizeof(send_seg_t) + len;
+    if (size < SEND_SEG_MIN) {
+        size = SEND_SEG_MIN;
+    }
+    send_seg_t *seg = mem_pool_get(ctx->mem, size);
+    if (seg == NULL) {
+        ESP_LOGE(TAG, "send segment allocation failed");
+        return NULL;
+    }
+    memset(seg, 0, sizeof(*seg));
+    seg->data = (uint8_t *)(seg + 1);
+    seg->cap = mem_pool_capacity(seg) - sizeof(send_seg_t);
+    send_queue_link(sc, seg);
+    return seg;
+}
+
+/*
+ * Copy `len` queued bytes into `out`, returning drained segments to the
+ * pool and external buffers to their owners.  The caller guarantees len <= sc->send_pending.
+ */
+static void send_queue_take(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                            uint8_t *out, size_t len)
+{
+    while (len > 0) {
+        send_seg_t *seg = sc->send_head;
+        size_t n = seg->len - seg->off;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out, seg->data + seg->off, n);
+        seg->off += n;
+        sc->send_pending -= n;
+        out += n;
+        len -= n;
+        if (seg->off == seg->len) {
+            if (seg->next == NULL && !seg->external) {
+                seg->off = seg->len = 0;    /* Keep the tail for reuse */
+                continue;
+            }
+            sc->send_head = seg->next;
+            if (sc->send_head == NULL) {
+                sc->send_tail = NULL;
+            }
+            send_seg_free(ctx, seg);
+        }
+    }
+}
+
+/*
+ * Queue the caller's buffer as an external segment.  On failure the
+ * buffer is released.
+ */
+static int send_queue_append_owned(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                                   uint8_t *data, size_t len,
+                                   qt_release_cb_t release, void *release_arg)
+{
+    send_seg_t *seg = mem_pool_get_zeroed(ctx->mem, sizeof(send_seg_t));
+    if (seg == NULL) {
+        ESP_LOGE(TAG, "send segment allocation failed");
+        if (release) {
+            release(release_arg, data);
+        }
+        return -1;
+    }
+    seg->data = data;
+    seg->len = len;
+    seg->cap = len;     /* No room for appends */
+    seg->external = true;
+    seg->release = release;
+    seg->release_arg = release_arg;
+    send_queue_link(sc, seg);
+    sc->send_pending += len;
+    ctx->send_bytes_owned += len;
+    return 0;
+}
+
+/* Drop everything queued and free the segments. */
+static void send_queue_clear(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc)
+{
+    send_seg_t *seg = sc->send_head;
+    while (seg) {
+        send_seg_t *next = seg->next;
+        send_seg_free(ctx, seg);
+        seg = next;
+    }
+    sc->send_head = NULL;
+    sc->send_tail = NULL;
+    sc->send_pending = 0;
+}
+
+/* ── Wake-ups ──────────────────────────────────────────────────────── */
+
+/* Source watcher thread: select() and the odd log line. */
+#define WATCH_STACK_SIZE (6 * 1024)
+
+static void wake_pair_close(int fds[2])
+{
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+/*
+ * Open two loopback UDP sockets connected to each other: a byte sent on
+ * fds[1] makes fds[0] readable.  Stands in for a pipe, which lwIP does
+ * not have.  Both ends are non-blocking so a wake-up never blocks.
+ */
+static int wake_pair_open(int fds[2])
+{
+    struct sockaddr_in addr[2];
+    fds[0] = -1;
+    fds[1] = -1;
+    for (int i = 0; i < 2; i++) {
+        socklen_t addr_len = sizeof(addr[i]);
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].sin_family = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] < 0 ||
+            bind(fds[i], (struct sockaddr *)&addr[i], sizeof(addr[i])) != 0 ||
+            getsockname(fds[i], (struct sockaddr *)&addr[i], &addr_len) != 0 ||
+            fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0) {
+            goto fail;
+        }
+    }
+    /* Each end only takes datagrams from the other. */
+    if (connect(fds[0], (struct sockaddr *)&addr[1], sizeof(addr[1])) != 0 ||
+        connect(fds[1], (struct sockaddr *)&addr[0], sizeof(addr[0])) != 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    ESP_LOGE(TAG, "Failed to open a wake-up socket pair: %s", strerror(errno));
+    wake_pair_close(fds);
+    return -1;
+}
+
+static void wake_pair_drain(int fd)
+{
+    uint8_t buf[8];
+    while (recv(fd, buf, sizeof(buf), 0) > 0) {
+    }
+}
+
+/* Get the watcher out of select() so it picks up a change. */
+static void watch_interrupt_locked(qt_watch_t *w)
+{
+    if (w->selecting) {
+        uint8_t c = 0;
+        (void)send(w->ctl[1], &c, 1, 0);
+    }
+    pthread_cond_broadcast(&w->cond);
+}
+
+/*
+ * Watcher thread: wait for a waiting source's descriptor to turn readable
+ * and wake the loop, then disarm until the loop has polled the sources,
+ * so a descriptor the source does not drain cannot make it spin.
+ */
+static void *watch_thread(void *arg)
+{
+    quic_tunnel_t *t = (quic_tunnel_t *)arg;
+    qt_watch_t *w = &t->watch;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        if (!w->armed || w->count == 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(w->ctl[0], &readable);
+        int max_fd = w->ctl[0];
+        for (size_t i = 0; i < w->count; i++) {
+            FD_SET(w->fds[i], &readable);
+            if (w->fds[i] > max_fd) {
+                max_fd = w->fds[i];
+            }
+        }
+        w->selecting = true;
+        w->select_gen++;
+        pthread_mutex_unlock(&w->lock);
+
+        int n = select(max_fd + 1, &readable, NULL, NULL, NULL);
+        int err = errno;
+        if (n > 0 && FD_ISSET(w->ctl[0], &readable)) {
+            wake_pair_drain(w->ctl[0]);
+            n--;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->selecting = false;
+        pthread_cond_broadcast(&w->cond);
+        if (n < 0 && err == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ESP_LOGE(TAG, "Source watcher: select() failed: %s", strerror(err));
+        }
+        if (n != 0) {
+            w->armed = false;
+            quic_tunnel_wake(t);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static int watch_start(quic_tunnel_t *t)
+{
+    qt_watch_t *w = &t->watch;
+    if (wake_pair_open(w->ctl) != 0) {
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->armed = true;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WATCH_STACK_SIZE);
+    int rc = pthread_create(&w->thread, &attr, watch_thread, t);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Failed to start the source watcher: %d", rc);
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        wake_pair_close(w->ctl);
+        return -1;
+    }
+    w->started = true;
+    return 0;
+}
+
+static void watch_stop(quic_tunnel_t *t)
+{
+    qt_watch_t *w = &t->watch;
+    if (!w->started) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    watch_interrupt_locked(w);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    wake_pair_close(w->ctl);
+    w->started = false;
+}
+
+/* Watch `fd` for a waiting source.  Returns false if it cannot be
+ * watched, in which case the source is polled instead. */
+static bool watch_add(quic_tunnel_t *t, int fd)
+{
+    qt_watch_t *w = &t->watch;
+    if (!w->started || fd < 0 || fd >= FD_SETSIZE) {
+        return false;
+    }
+    pthread_mutex_lock(&w->lock);
+    bool added = w->count < QT_WATCH_MAX;
+    if (added) {
+        w->fds[w->count++] = fd;
+        watch_interrupt_locked(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return added;
+}
+
+/* Stop watching `fd`.  Returns once the watcher no longer selects on it,
+ * so the caller may close it. */
+static void watch_remove(quic_tunnel_t *t, int fd)
+{
+    qt_watch_t *w = &t->watch;
+    if (!w->started) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    for (size_t i = 0; i < w->count; i++) {
+        if (w->fds[i] == fd) {
+            w->fds[i] = w->fds[--w->count];
+            break;
+        }
+    }
+    if (w->selecting) {
+        uint64_t gen = w->select_gen;
+        watch_interrupt_locked(w);
+        while (w->selecting && w->select_gen == gen) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* The loop has polled the sources: let the watcher fire again. */
+static void watch_rearm(quic_tunnel_t *t)
+{
+    qt_watch_t *w = &t->watch;
+    if (!w->started) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    if (!w->armed) {
+        w->armed = true;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* ── Pull-mode sources ─────────────────────────────────────────────── */
+
+/* Poll interval for waiting sources without a watched descriptor, and
+ * for the others as a fallback (a source may also end on a timeout). */
+#define SOURCE_POLL_INTERVAL_US     1000
+#define SOURCE_FALLBACK_INTERVAL_US 100000
+
+static void stream_ctx_maybe_release(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc);
+
+static void source_set_waiting(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                               bool waiting)
+{
+    if (sc->source_waiting == waiting) {
+        return;
+    }
+    sc->source_waiting = waiting;
+    if (waiting) {
+        ctx->sources_waiting++;
+        sc->source_fd = sc->source->fd ? sc->source->fd(sc->source_arg) : -1;
+        sc->source_watched = watch_add(ctx->tunnel, sc->source_fd);
+        if (!sc->source_watched) {
+            ctx->sources_unwatched++;
+        }
+    } else {
+        ctx->sources_waiting--;
+        if (sc->source_watched) {
+            watch_remove(ctx->tunnel, sc->source_fd);
+            sc->source_watched = false;
+        } else {
+            ctx->sources_unwatched--;
+        }
+    }
+}
+
+/* Close and forget the stream's source, if any. */
+static void source_detach(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc)
+{
+    if (sc->source == NULL) {
+        return;
+    }
+    const qt_stream_source_t *source = sc->source;
+    void *arg = sc->source_arg;
+    source_set_waiting(ctx, sc, false);
+    sc->source = NULL;
+    sc->source_arg = NULL;
+    sc->source_fin = false;
+    source->close(arg);
+}
+
+/*
+ * prepare_to_send for a stream whose queue is drained: have the source
+ * write into picoquic's frame buffer, or park the stream until it has
+ * something (see source_poll).
+ *
+ * The frame is committed before read() fills it, so data never carries
+ * the FIN: if read() fails, the stream is reset with no FIN sent.  When
+ * the source ends after the bytes just read, the FIN goes out alone on
+ * the next call.
+ */
+static int source_send(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                       void *context, size_t length)
+{
+    bool fin = sc->source_fin;
+    int n = 0;
+    if (!fin) {
+        n = sc->source->ready(sc->source_arg, length, &fin);
+        if (n < 0) {
+            quic_tunnel_reset_stream(ctx, sc->stream_id, 0);
+            return 0;
+        }
+        if (n == 0 && !fin) {
+            /* Go inactive; picoquic stops asking until we mark it again. */
+            (void)picoquic_provide_stream_data_buffer(context, 0, 0, 0);
+            source_set_waiting(ctx, sc, true);
+            return 0;
+        }
+    }
+
+    bool send_fin = fin && n == 0;
+    uint8_t *buf = picoquic_provide_stream_data_buffer(context, (size_t)n,
+                                                       send_fin ? 1 : 0,
+                                                       send_fin ? 0 : 1);
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "picoquic_provide_stream_data_buffer returned NULL");
+        return PICOQUIC_ERROR_UNEXPECTED_ERROR;
+    }
+    if (n > 0 && sc->source->read(sc->source_arg, buf, (size_t)n) != 0) {
+        /* The frame is already committed: blank it and abort the stream. */
+        memset(buf, 0, (size_t)n);
+        quic_tunnel_reset_stream(ctx, sc->stream_id, 0);
+        return 0;
+    }
+    ctx->send_bytes_served += (uint64_t)n;
+    ctx->send_bytes_pulled += (uint64_t)n;
+    ESP_LOGD(TAG, "Stream %" PRIu64 " pulled %d bytes (fin=%d)",
+             sc->stream_id, n, fin);
+
+    if (!send_fin) {
+        sc->source_fin = fin;
+        return 0;
+    }
+    ESP_LOGI(TAG, "Stream %" PRIu64 " source finished", sc->stream_id);
+    source_detach(ctx, sc);
+    sc->send_closed = true;
+    stream_ctx_maybe_release(ctx, sc);
+    return 0;
+}
+
+/*
+ * Wake the streams whose sources now have data (or have ended).
+ * Called once per packet-loop iteration.
+ */
+static void source_poll(quic_tunnel_ctx_t *ctx)
+{
+    if (ctx->sources_waiting == 0 || ctx->cnx == NULL) {
+        return;
+    }
+    /* Walk backwards: a reset may release the stream. */
+    for (size_t i = stream_table_count(&ctx->streams); i-- > 0; ) {
+        stream_ctx_t *sc = stream_table_at(&ctx->streams, i);
+        if (!sc->source_waiting) {
+            continue;
+        }
+        bool fin = false;
+        int n = sc->source->ready(sc->source_arg, 1, &fin);
+        if (n < 0) {
+            quic_tunnel_reset_stream(ctx, sc->stream_id, 0);
+        } else if (n > 0 || fin) {
+            source_set_waiting(ctx, sc, false);
+            picoquic_mark_active_stream(ctx->cnx, sc->stream_id, 1, sc);
+        }
+    }
+}
+
 /* ── Internal helpers ──────────────────────────────────────────────── */
 
 /*
- * Allocate and insert a new stream context into the linked list.
+ * Allocate a new stream context and add it to the stream table.
  */
 static stream_ctx_t *stream_ctx_create(quic_tunnel_ctx_t *ctx,
                                        uint64_t stream_id, bool is_control)
 {
-    stream_ctx_t *sc = calloc(1, sizeof(stream_ctx_t));
+    stream_ctx_t *sc = mem_pool_get_zeroed(ctx->mem, sizeof(stream_ctx_t));
     if (sc == NULL) {
         ESP_LOGE(TAG, "Failed to allocate stream context for %" PRIu64, stream_id);
         return NULL;
     }
     sc->stream_id = stream_id;
     sc->is_control = is_control;
-    sc->next = ctx->streams;
-    ctx->streams = sc;
+    if (stream_table_insert(&ctx->streams, sc) != 0) {
+        mem_pool_put(ctx->mem, sc);
+        return NULL;
+    }
+    ctx->streams_opened++;
     ESP_LOGI(TAG, "Created stream context: id=%" PRIu64 " control=%d", stream_id, is_control);
     return sc;
 }
 
 /*
- * Remove and free a stream context from the linked list.
+ * Remove a stream context from the stream table and free it.
  */
 static void stream_ctx_destroy(quic_tunnel_ctx_t *ctx, uint64_t stream_id)
 {
-    stream_ctx_t **pp = &ctx->streams;
-    while (*pp) {
-        if ((*pp)->stream_id == stream_id) {
-            stream_ctx_t *sc = *pp;
-            *pp = sc->next;
-            free(sc->send_buf);
-            free(sc->recv_buf);
-            free(sc);
-            ESP_LOGI(TAG, "Destroyed stream context: id=%" PRIu64, stream_id);
-            return;
-        }
-        pp = &(*pp)->next;
+    stream_ctx_t *sc = stream_table_remove(&ctx->streams, stream_id);
+    if (sc != NULL) {
+        send_queue_clear(ctx, sc);
+        source_detach(ctx, sc);
+        mem_pool_put(ctx->mem, sc->recv_buf);
+        mem_pool_put(ctx->mem, sc);
+        ESP_LOGI(TAG, "Destroyed stream context: id=%" PRIu64, stream_id);
     }
 }
 
+/*
+ * picoquic's app stream context for streams whose stream_ctx_t has been
+ * released.  picoquic may still deliver late data, a reset or a
+ * prepare_to_send for them; the callback recognises this marker and
+ * ignores the event instead of recreating the context.
+ */
+static char s_retired_stream;
+
+/*
+ * Release a stream context once both halves are closed.
+ */
+static void stream_ctx_maybe_release(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc)
+{
+    if (!sc->recv_closed || !sc->send_closed) {
+        return;
+    }
+    uint64_t stream_id = sc->stream_id;
+    if (ctx->cnx != NULL) {
+        picoquic_set_app_stream_ctx(ctx->cnx, stream_id, &s_retired_stream);
+    }
+    stream_ctx_destroy(ctx, stream_id);
+    ctx->streams_released++;
+}
+
+/* ── Receive buffer ────────────────────────────────────────────────── */
+
+/* First allocation of a receive buffer.  A control stream's buffer that
+ * has grown past this (for one large message) is returned to the pool
+ * once drained, so the stream holds the same memory however long the
+ * connection lives. */
+#define RECV_BUF_MIN  4096
+
 /*
  * Append data to the receive buffer, growing it as needed.
  */
-static int recv_buf_append(stream_ctx_t *sc, const uint8_t *data, size_t len)
+static int recv_buf_append(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                           const uint8_t *data, size_t len)
 {
     if (len == 0) {
         return 0;
     }
     size_t needed = sc->recv_len + len;
     if (needed > sc->recv_cap) {
-        size_t new_cap = sc->recv_cap ? sc->recv_cap * 2 : 4096;
-        while (new_cap < needed) {
-            new_cap *= 2;
-        }
-        uint8_t *tmp = realloc(sc->recv_buf, new_cap);
+        size_t new_cap = needed < RECV_BUF_MIN ? RECV_BUF_MIN : needed;
+        uint8_t *tmp = mem_pool_grow(ctx->mem, sc->recv_buf, sc->recv_len, new_cap);
         if (tmp == NULL) {
             ESP_LOGE(TAG, "recv_buf realloc failed (need %zu)", new_cap);
             return -1;
         }
         sc->recv_buf = tmp;
-        sc->recv_cap = new_cap;
+        sc->recv_cap = mem_pool_capacity(tmp);
     }
     memcpy(sc->recv_buf + sc->recv_len, data, len);
     sc->recv_len += len;
@@ -118,6 +679,15 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
         return PICOQUIC_ERROR_UNEXPECTED_ERROR;
     }
 
+    if (v_stream_ctx == &s_retired_stream) {
+        if (fin_or_event == picoquic_callback_prepare_to_send) {
+            (void)picoquic_provide_stream_data_buffer(bytes, 0, 0, 0);
+        }
+        ESP_LOGD(TAG, "Stream %" PRIu64 ": event %d after release, ignored",
+                 stream_id, (int)fin_or_event);
+        return 0;
+    }
+
     switch (fin_or_event) {
 
     /* ── Connection established ────────────────────────────────── */
@@ -176,8 +746,8 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
             }
         }
 
-        if (length > 0) {
-            if (recv_buf_append(sc, bytes, length) != 0) {
+        if (length > 0 && !sc->recv_closed) {
+            if (recv_buf_append(ctx, sc, bytes, length) != 0) {
                 return PICOQUIC_ERROR_MEMORY;
             }
             ESP_LOGI(TAG, "Stream %" PRIu64 " recv %zu bytes (total %zu)",
@@ -204,15 +774,24 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
                               NULL, 0, ctx->user_data);
             }
         }
+        if (sc->recv_closed) {
+            /* We already sent STOP_SENDING; nothing left to deliver. */
+            return 0;
+        }
         /* Append any trailing data delivered with FIN */
         if (length > 0) {
-            if (recv_buf_append(sc, bytes, length) != 0) {
+            if (recv_buf_append(ctx, sc, bytes, length) != 0) {
                 return PICOQUIC_ERROR_MEMORY;
             }
             if (ctx->event_cb) {
                 ctx->event_cb(ctx, QT_EVENT_STREAM_DATA, stream_id,
                               bytes, length, ctx->user_data);
             }
+            /* The handler may have closed the stream. */
+            sc = quic_tunnel_find_stream(ctx, stream_id);
+            if (sc == NULL || sc->recv_closed) {
+                return 0;
+            }
         }
         sc->recv_fin = true;
         ESP_LOGI(TAG, "Stream %" PRIu64 " FIN (total recv %zu bytes)",
@@ -221,6 +800,12 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
             ctx->event_cb(ctx, QT_EVENT_STREAM_FIN, stream_id,
                           sc->recv_buf, sc->recv_len, ctx->user_data);
         }
+        /* The application has seen everything; close the receive half. */
+        sc = quic_tunnel_find_stream(ctx, stream_id);
+        if (sc != NULL && !sc->recv_closed) {
+            sc->recv_closed = true;
+            stream_ctx_maybe_release(ctx, sc);
+        }
         return 0;
     }
 
@@ -229,13 +814,16 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
         if (sc == NULL) {
             return 0;
         }
-        size_t available = sc->send_len - sc->send_offset;
+        size_t available = sc->send_pending;
+        if (available == 0 && sc->source != NULL) {
+            return source_send(ctx, sc, bytes, length);
+        }
         if (available == 0 && !sc->send_fin) {
             return 0;
         }
         size_t to_send = (available < length) ? available : length;
-        int is_fin = (sc->send_fin && (sc->send_offset + to_send >= sc->send_len)) ? 1 : 0;
-        int is_still_active = (!is_fin && (sc->send_offset + to_send < sc->send_len)) ? 1 : 0;
+        int is_fin = (sc->send_fin && to_send == available) ? 1 : 0;
+        int is_still_active = (to_send < available || sc->source != NULL) ? 1 : 0;
 
         uint8_t *buf = picoquic_provide_stream_data_buffer(bytes, to_send,
                                                            is_fin, is_still_active);
@@ -243,22 +831,16 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
             ESP_LOGE(TAG, "picoquic_provide_stream_data_buffer returned NULL");
             return PICOQUIC_ERROR_UNEXPECTED_ERROR;
         }
-        if (to_send > 0) {
-            memcpy(buf, sc->send_buf + sc->send_offset, to_send);
-            sc->send_offset += to_send;
-        }
+        send_queue_take(ctx, sc, buf, to_send);
+        ctx->send_bytes_served += to_send;
         ESP_LOGI(TAG, "Stream %" PRIu64 " sent %zu bytes (fin=%d, still_active=%d)",
                  sc->stream_id, to_send, is_fin, is_still_active);
 
-        /* Free send buffer once fully consumed */
-        if (sc->send_offset >= sc->send_len) {
-            free(sc->send_buf);
-            sc->send_buf = NULL;
-            sc->send_len = 0;
-            sc->send_offset = 0;
-            if (is_fin) {
-                sc->send_fin = false;
-            }
+        if (is_fin) {
+            send_queue_clear(ctx, sc);
+            sc->send_fin = false;
+            sc->send_closed = true;
+            stream_ctx_maybe_release(ctx, sc);
         }
         return 0;
     }
@@ -267,15 +849,23 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
     case picoquic_callback_stream_reset:
         ESP_LOGW(TAG, "Stream %" PRIu64 " reset by peer", stream_id);
         if (sc != NULL) {
-            picoquic_reset_stream_ctx(cnx, stream_id);
-            stream_ctx_destroy(ctx, stream_id);
+            /* The request is abandoned: reset the response side too, so
+             * picoquic can drop the stream instead of holding it half
+             * open. */
+            sc->recv_len = 0;
+            sc->recv_closed = true;
+            if (!sc->send_closed) {
+                quic_tunnel_reset_stream(ctx, stream_id, 0);
+            } else {
+                stream_ctx_maybe_release(ctx, sc);
+            }
         }
         return 0;
 
     case picoquic_callback_stop_sending:
         ESP_LOGW(TAG, "Stop sending on stream %" PRIu64, stream_id);
         if (sc != NULL) {
-            picoquic_reset_stream(cnx, stream_id, 0);
+            quic_tunnel_reset_stream(ctx, stream_id, 0);
         }
         return 0;
 
@@ -304,16 +894,78 @@ static int tunnel_picoquic_callback(picoquic_cnx_t *cnx,
 
 /* ── Packet loop callback ──────────────────────────────────────────── */
 
+/*
+ * Free a connection's stream contexts, logging its counters.
+ */
+static void conn_free_streams(quic_tunnel_ctx_t *ctx)
+{
+    stream_table_t *t = &ctx->streams;
+    if (t->lookups > 0) {
+        ESP_LOGI(TAG, "[conn %u] Stream table: %zu live, %" PRIu64 " lookups, "
+                 "%" PRIu64 " probes", ctx->conn_index, stream_table_count(t),
+                 t->lookups, t->probes);
+    }
+    ESP_LOGI(TAG, "[conn %u] Streams: %" PRIu64 " opened, %" PRIu64 " released",
+             ctx->conn_index, ctx->streams_opened, ctx->streams_released);
+    if (ctx->send_bytes_served > 0) {
+        ESP_LOGI(TAG, "[conn %u] Send path: %" PRIu64 " bytes served, %" PRIu64
+                 " copied in, %" PRIu64 " by reference, %" PRIu64 " built in place, "
+                 "%" PRIu64 " pulled (%" PRIu64 " queue copies per 100 bytes)",
+                 ctx->conn_index, ctx->send_bytes_served, ctx->send_bytes_copied,
+                 ctx->send_bytes_owned, ctx->send_bytes_built,
+                 ctx->send_bytes_pulled,
+                 ctx->send_bytes_copied * 100 / ctx->send_bytes_served);
+    }
+    for (size_t i = 0; i < stream_table_count(t); i++) {
+        stream_ctx_t *sc = stream_table_at(t, i);
+        send_queue_clear(ctx, sc);
+        source_detach(ctx, sc);
+        mem_pool_put(ctx->mem, sc->recv_buf);
+        mem_pool_put(ctx->mem, sc);
+    }
+    stream_table_free(t);
+    ctx->sources_waiting = 0;
+    ctx->sources_unwatched = 0;
+}
+
+/*
+ * Release a connection that has closed: delete it from picoquic (client
+ * connections are left to the application) and free its streams.  The
+ * slot can then be dialled again.  Never called from within one of the
+ * connection's own callbacks.
+ */
+static void conn_release(quic_tunnel_ctx_t *ctx)
+{
+    ESP_LOGI(TAG, "[conn %u] Releasing closed connection", ctx->conn_index);
+    /* Nothing of ours is left for late callbacks to use. */
+    picoquic_set_callback(ctx->cnx, NULL, NULL);
+    picoquic_delete_cnx(ctx->cnx);
+    ctx->cnx = NULL;
+    conn_free_streams(ctx);
+}
+
+static bool tunnel_has_connections(const quic_tunnel_t *t)
+{
+    for (size_t i = 0; i < t->max_connections; i++) {
+        if (t->conns[i].cnx != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*
  * Called by picoquic_packet_loop at various stages.
- * We use it to detect when the connection has been closed and
- * to terminate the loop.
+ * We use it to release connections that have closed, to terminate the
+ * loop once the tunnel is stopped and they are all gone, and to give the
+ * application a periodic tick (time_check runs once per iteration, before
+ * the loop sleeps).
  */
 static int tunnel_loop_cb(picoquic_quic_t *quic,
                           picoquic_packet_loop_cb_enum cb_mode,
                           void *callback_ctx, void *callback_argv)
 {
-    quic_tunnel_ctx_t *ctx = (quic_tunnel_ctx_t *)callback_ctx;
+    quic_tunnel_t *t = (quic_tunnel_t *)callback_ctx;
 
     switch (cb_mode) {
     case picoquic_packet_loop_ready:
@@ -321,17 +973,48 @@ static int tunnel_loop_cb(picoquic_quic_t *quic,
         return 0;
 
     case picoquic_packet_loop_after_receive:
-        if (ctx->disconnected) {
-            ESP_LOGI(TAG, "Disconnected — terminating packet loop");
+    case picoquic_packet_loop_after_send:
+        if (t->stopping && !tunnel_has_connections(t)) {
+            ESP_LOGI(TAG, "All connections closed — terminating packet loop");
             return PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
         }
         return 0;
 
-    case picoquic_packet_loop_after_send:
-        if (ctx->disconnected) {
-            ESP_LOGI(TAG, "Disconnected — terminating packet loop (after send)");
-            return PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP;
+    case picoquic_packet_loop_time_check: {
+        packet_loop_time_check_arg_t *tc = (packet_loop_time_check_arg_t *)callback_argv;
+        for (size_t i = 0; i < t->max_connections; i++) {
+            quic_tunnel_ctx_t *ctx = &t->conns[i];
+            if (ctx->cnx != NULL && ctx->disconnected) {
+                conn_release(ctx);
+            } else if (ctx->cnx != NULL) {
+                source_poll(ctx);
+            }
+        }
+        watch_rearm(t);
+        if (t->event_cb) {
+            t->event_cb(NULL, QT_EVENT_LOOP_TICK, 0, NULL, 0, t->user_data);
         }
+        uint64_t interval = t->tick_interval_us;
+        for (size_t i = 0; i < t->max_connections; i++) {
+            uint64_t poll = 0;
+            if (t->conns[i].sources_unwatched > 0) {
+                poll = SOURCE_POLL_INTERVAL_US;
+            } else if (t->conns[i].sources_waiting > 0) {
+                poll = SOURCE_FALLBACK_INTERVAL_US;
+            }
+            if (poll > 0 && (interval == 0 || interval > poll)) {
+                interval = poll;
+            }
+        }
+        if (interval > 0 && tc->delta_t > (int64_t)interval) {
+            tc->delta_t = (int64_t)interval;
+        }
+        return 0;
+    }
+
+    case picoquic_packet_loop_wake_up:
+        /* quic_tunnel_wake(); the time check that follows does the work. */
+        __atomic_store_n(&t->wake_pending, false, __ATOMIC_RELEASE);
         return 0;
 
     default:
@@ -341,37 +1024,32 @@ static int tunnel_loop_cb(picoquic_quic_t *quic,
 
 /* ── Public API ────────────────────────────────────────────────────── */
 
-int quic_tunnel_connect(quic_tunnel_ctx_t *ctx, const quic_tunnel_config_t *config)
+int quic_tunnel_init(quic_tunnel_t *t, const quic_tunnel_config_t *config)
 {
-    int ret = 0;
-    int is_name = 0;
-
-    if (ctx == NULL || config == NULL || config->edge_server == NULL) {
-        ESP_LOGE(TAG, "Invalid arguments to quic_tunnel_connect");
+    if (t == NULL || config == NULL || config->max_connections == 0 ||
+        config->max_connections > QT_MAX_CONNECTIONS) {
+        ESP_LOGE(TAG, "Invalid arguments to quic_tunnel_init");
         return -1;
     }
 
-    memset(ctx, 0, sizeof(*ctx));
-    ctx->event_cb = config->event_cb;
-    ctx->user_data = config->user_data;
-
-    /* Resolve edge server address */
-    ESP_LOGI(TAG, "Resolving edge server: %s:%u", config->edge_server, config->edge_port);
-    ret = picoquic_get_server_address(config->edge_server, (int)config->edge_port,
-                                      &ctx->server_addr, &is_name);
-    if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to resolve server address: %s (ret=%d)",
-                 config->edge_server, ret);
-        return -1;
-    }
-    ESP_LOGI(TAG, "Resolved %s (is_name=%d)", config->edge_server, is_name);
+    memset(t, 0, sizeof(*t));
+    t->loop.wake_up_pipe_fd[0] = -1;
+    t->loop.wake_up_pipe_fd[1] = -1;
+    t->watch.ctl[0] = -1;
+    t->watch.ctl[1] = -1;
+    t->max_connections = config->max_connections;
+    t->local_af = config->local_af;
+    t->event_cb = config->event_cb;
+    t->user_data = config->user_data;
+    t->mem = config->mem_pool;
 
     /* Create picoquic context (client mode — no cert/key needed) */
     uint64_t current_time = picoquic_current_time();
-    ESP_LOGI(TAG, "Creating QUIC context (time=%" PRIu64 ")", current_time);
+    ESP_LOGI(TAG, "Creating QUIC context for %zu connection(s) (time=%" PRIu64 ")",
+             t->max_connections, current_time);
 
-    ctx->quic = picoquic_create(
-        1,          /* max_nb_connections */
+    t->quic = picoquic_create(
+        (uint32_t)t->max_connections, /* max_nb_connections */
         NULL,       /* cert_file_name (client — not needed) */
         NULL,       /* key_file_name */
         NULL,       /* cert_root_file_name (use system roots) */
@@ -387,25 +1065,69 @@ int quic_tunnel_connect(quic_tunnel_ctx_t *ctx, const quic_tunnel_config_t *conf
         NULL,       /* ticket_encryption_key */
         0           /* ticket_encryption_key_length */
     );
-    if (ctx->quic == NULL) {
+    if (t->quic == NULL) {
         ESP_LOGE(TAG, "picoquic_create failed");
         return -1;
     }
 
     /* Set BBR congestion control (matches cloudflared Go) */
-    picoquic_set_default_congestion_algorithm(ctx->quic, picoquic_bbr_algorithm);
+    picoquic_set_default_congestion_algorithm(t->quic, picoquic_bbr_algorithm);
     ESP_LOGI(TAG, "Congestion control: BBR");
 
+    /* Other threads wake the packet loop through its wake-up pipe instead
+     * of having it poll them (quic_tunnel_wake). */
+    if (wake_pair_open(t->loop.wake_up_pipe_fd) != 0 || watch_start(t) != 0) {
+        wake_pair_close(t->loop.wake_up_pipe_fd);
+        picoquic_free(t->quic);
+        t->quic = NULL;
+        return -1;
+    }
+    t->loop.wake_up_defined = 1;
+    return 0;
+}
+
+quic_tunnel_ctx_t *quic_tunnel_add_connection(quic_tunnel_t *t, uint8_t conn_index,
+                                              const struct sockaddr *addr)
+{
+    if (t == NULL || t->quic == NULL || addr == NULL ||
+        conn_index >= t->max_connections) {
+        ESP_LOGE(TAG, "Invalid arguments to quic_tunnel_add_connection");
+        return NULL;
+    }
+    if (t->stopping) {
+        return NULL;
+    }
+    quic_tunnel_ctx_t *ctx = &t->conns[conn_index];
+    if (ctx->cnx != NULL) {
+        ESP_LOGE(TAG, "[conn %u] Slot still in use", conn_index);
+        return NULL;
+    }
+
+    uint32_t generation = ctx->generation + 1;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->tunnel = t;
+    ctx->conn_index = conn_index;
+    ctx->generation = generation;
+    ctx->event_cb = t->event_cb;
+    ctx->user_data = t->user_data;
+    ctx->mem = t->mem;
+    memcpy(&ctx->server_addr, addr, addr->sa_family == AF_INET6 ?
+           sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+    if (stream_table_init(&ctx->streams) != 0) {
+        return NULL;
+    }
+
     /* Create QUIC connection */
-    ESP_LOGI(TAG, "Creating connection to %s (SNI=%s, ALPN=%s)",
-             config->edge_server, CF_EDGE_SNI, CF_EDGE_ALPN);
+    ESP_LOGI(TAG, "[conn %u] Creating connection (SNI=%s, ALPN=%s)",
+             conn_index, CF_EDGE_SNI, CF_EDGE_ALPN);
 
     ctx->cnx = picoquic_create_cnx(
-        ctx->quic,
+        t->quic,
         picoquic_null_connection_id,    /* initial local CID */
         picoquic_null_connection_id,    /* remote CID */
         (const struct sockaddr *)&ctx->server_addr,
-        current_time,
+        picoquic_current_time(),
         0,              /* preferred_version (0 = default) */
         CF_EDGE_SNI,    /* TLS SNI */
         CF_EDGE_ALPN,   /* QUIC ALPN */
@@ -413,47 +1135,59 @@ int quic_tunnel_connect(quic_tunnel_ctx_t *ctx, const quic_tunnel_config_t *conf
     );
     if (ctx->cnx == NULL) {
         ESP_LOGE(TAG, "picoquic_create_cnx failed");
-        picoquic_free(ctx->quic);
-        ctx->quic = NULL;
-        return -1;
+        stream_table_free(&ctx->streams);
+        return NULL;
     }
 
     /* Set per-connection callback */
     picoquic_set_callback(ctx->cnx, tunnel_picoquic_callback, ctx);
 
     /* Initiate TLS handshake */
-    ret = picoquic_start_client_cnx(ctx->cnx);
+    int ret = picoquic_start_client_cnx(ctx->cnx);
     if (ret != 0) {
         ESP_LOGE(TAG, "picoquic_start_client_cnx failed: %d", ret);
-        picoquic_free(ctx->quic);
-        ctx->quic = NULL;
+        picoquic_set_callback(ctx->cnx, NULL, NULL);
+        picoquic_delete_cnx(ctx->cnx);
         ctx->cnx = NULL;
-        return -1;
+        stream_table_free(&ctx->streams);
+        return NULL;
     }
 
-    ESP_LOGI(TAG, "QUIC handshake initiated");
-    return 0;
+    ESP_LOGI(TAG, "[conn %u] QUIC handshake initiated", conn_index);
+    return ctx;
 }
 
-int quic_tunnel_run(quic_tunnel_ctx_t *ctx)
+quic_tunnel_ctx_t *quic_tunnel_connection(quic_tunnel_t *t, uint8_t conn_index)
 {
-    if (ctx == NULL || ctx->quic == NULL) {
+    if (t == NULL || conn_index >= t->max_connections ||
+        t->conns[conn_index].cnx == NULL) {
+        return NULL;
+    }
+    return &t->conns[conn_index];
+}
+
+int quic_tunnel_run(quic_tunnel_t *t)
+{
+    if (t == NULL || t->quic == NULL) {
         ESP_LOGE(TAG, "Invalid context for quic_tunnel_run");
         return -1;
     }
 
-    ESP_LOGI(TAG, "Starting packet loop (af=%d)...", ctx->server_addr.ss_family);
-
-    int ret = picoquic_packet_loop(
-        ctx->quic,
-        0,                          /* local_port (0 = ephemeral) */
-        ctx->server_addr.ss_family, /* local_af */
-        0,                          /* dest_if */
-        0,                          /* socket_buffer_size (0 = default) */
-        0,                          /* do_not_use_gso */
-        tunnel_loop_cb,
-        ctx
-    );
+    ESP_LOGI(TAG, "Starting packet loop (af=%d)...", t->local_af);
+
+    /* Run the loop on this thread (v3 is what picoquic's network thread
+     * runs); the wake-up pipe was opened by quic_tunnel_init. */
+    picoquic_packet_loop_param_t param;
+    memset(&param, 0, sizeof(param));
+    param.local_port = 0;           /* ephemeral */
+    param.local_af = t->local_af;   /* AF_UNSPEC = both */
+    t->loop.quic = t->quic;
+    t->loop.param = &param;
+    t->loop.loop_callback = tunnel_loop_cb;
+    t->loop.loop_callback_ctx = t;
+    (void)picoquic_packet_loop_v3(&t->loop);
+    int ret = t->loop.return_code;
+    t->loop.param = NULL;
 
     if (ret == PICOQUIC_NO_ERROR_TERMINATE_PACKET_LOOP || ret == 0) {
         ESP_LOGI(TAG, "Packet loop terminated normally");
@@ -491,83 +1225,301 @@ uint64_t quic_tunnel_open_stream(quic_tunnel_ctx_t *ctx, bool is_control)
     return stream_id;
 }
 
-int quic_tunnel_send(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
-                     const uint8_t *data, size_t len, bool fin)
+/*
+ * Find a stream that can still take data, or NULL (logged).
+ */
+static stream_ctx_t *send_stream_find(quic_tunnel_ctx_t *ctx, uint64_t stream_id)
 {
     if (ctx == NULL || ctx->cnx == NULL) {
         ESP_LOGE(TAG, "Cannot send: no connection");
-        return -1;
+        return NULL;
     }
 
     stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
     if (sc == NULL) {
         ESP_LOGE(TAG, "Cannot send: stream %" PRIu64 " not found", stream_id);
-        return -1;
+        return NULL;
     }
 
-    if (len > 0 && data != NULL) {
-        /* Grow send buffer to accommodate new data */
-        size_t needed = sc->send_len + len;
-        uint8_t *tmp = realloc(sc->send_buf, needed);
-        if (tmp == NULL) {
-            ESP_LOGE(TAG, "send_buf realloc failed (need %zu)", needed);
-            return -1;
-        }
-        memcpy(tmp + sc->send_len, data, len);
-        sc->send_buf = tmp;
-        sc->send_len = needed;
+    if (sc->send_fin || sc->send_closed) {
+        ESP_LOGE(TAG, "Cannot send: stream %" PRIu64 " already finished", stream_id);
+        return NULL;
     }
 
+    if (sc->source != NULL) {
+        ESP_LOGE(TAG, "Cannot send: stream %" PRIu64 " is fed by a source", stream_id);
+        return NULL;
+    }
+    return sc;
+}
+
+/*
+ * Record the FIN and tell picoquic the stream has data ready.
+ */
+static int send_stream_activate(quic_tunnel_ctx_t *ctx, stream_ctx_t *sc,
+                                size_t len, bool fin)
+{
     if (fin) {
         sc->send_fin = true;
     }
 
-    /* Tell picoquic we have data ready */
-    int ret = picoquic_mark_active_stream(ctx->cnx, stream_id, 1, sc);
+    int ret = picoquic_mark_active_stream(ctx->cnx, sc->stream_id, 1, sc);
     if (ret != 0) {
         ESP_LOGE(TAG, "picoquic_mark_active_stream failed: %d", ret);
         return -1;
     }
 
     ESP_LOGD(TAG, "Queued %zu bytes on stream %" PRIu64 " (fin=%d, total=%zu)",
-             len, stream_id, fin, sc->send_len);
+             len, sc->stream_id, fin, sc->send_pending);
     return 0;
 }
 
+int quic_tunnel_send(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                     const uint8_t *data, size_t len, bool fin)
+{
+    stream_ctx_t *sc = send_stream_find(ctx, stream_id);
+    if (sc == NULL) {
+        return -1;
+    }
+
+    if (len > 0 && data != NULL &&
+        send_queue_append(ctx, sc, data, len) != 0) {
+        return -1;
+    }
+    return send_stream_activate(ctx, sc, len, fin);
+}
+
+int quic_tunnel_send_owned(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                           uint8_t *data, size_t len,
+                           qt_release_cb_t release, void *release_arg, bool fin)
+{
+    stream_ctx_t *sc = send_stream_find(ctx, stream_id);
+    if (sc == NULL) {
+        if (release && data != NULL) {
+            release(release_arg, data);
+        }
+        return -1;
+    }
+
+    if (len == 0 || data == NULL) {
+        if (release && data != NULL) {
+            release(release_arg, data);
+        }
+    } else if (send_queue_append_owned(ctx, sc, data, len,
+                                       release, release_arg) != 0) {
+        return -1;
+    }
+    return send_stream_activate(ctx, sc, len, fin);
+}
+
+uint8_t *quic_tunnel_send_reserve(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                                  size_t len)
+{
+    stream_ctx_t *sc = send_stream_find(ctx, stream_id);
+    if (sc == NULL) {
+        return NULL;
+    }
+    send_seg_t *seg = send_queue_reserve(ctx, sc, len);
+    return seg ? seg->data + seg->len : NULL;
+}
+
+int quic_tunnel_send_commit(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                            size_t len, bool fin)
+{
+    stream_ctx_t *sc = send_stream_find(ctx, stream_id);
+    if (sc == NULL) {
+        return -1;
+    }
+    if (len > 0) {
+        send_seg_t *tail = sc->send_tail;
+        if (tail == NULL || tail->external || tail->cap - tail->len < len) {
+            ESP_LOGE(TAG, "send_commit: %zu bytes not reserved on stream %" PRIu64,
+                     len, stream_id);
+            return -1;
+        }
+        tail->len += len;
+        sc->send_pending += len;
+        ctx->send_bytes_built += len;
+    }
+    return send_stream_activate(ctx, sc, len, fin);
+}
+
+int quic_tunnel_set_source(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                           const qt_stream_source_t *source, void *arg)
+{
+    stream_ctx_t *sc = send_stream_find(ctx, stream_id);
+    if (sc == NULL) {
+        source->close(arg);
+        return -1;
+    }
+    sc->source = source;
+    sc->source_arg = arg;
+    return send_stream_activate(ctx, sc, 0, false);
+}
+
+size_t quic_tunnel_send_pending(quic_tunnel_ctx_t *ctx, uint64_t stream_id)
+{
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
+    if (sc == NULL) {
+        return 0;
+    }
+    return sc->send_pending;
+}
+
+void quic_tunnel_consume(quic_tunnel_ctx_t *ctx, uint64_t stream_id, size_t len)
+{
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
+    if (sc == NULL || len == 0) {
+        return;
+    }
+    if (len >= sc->recv_len) {
+        sc->recv_len = 0;
+        if (sc->is_control && sc->recv_cap > RECV_BUF_MIN) {
+            mem_pool_put(ctx->mem, sc->recv_buf);
+            sc->recv_buf = NULL;
+            sc->recv_cap = 0;
+        }
+        return;
+    }
+    memmove(sc->recv_buf, sc->recv_buf + len, sc->recv_len - len);
+    sc->recv_len -= len;
+}
+
+int quic_tunnel_reset_stream(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                             uint64_t error)
+{
+    if (ctx == NULL || ctx->cnx == NULL) {
+        return -1;
+    }
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
+    if (sc == NULL) {
+        return -1;
+    }
+    if (sc->send_closed) {
+        return 0;
+    }
+
+    /* Drop anything still queued; picoquic stops asking for data. */
+    send_queue_clear(ctx, sc);
+    source_detach(ctx, sc);
+    sc->send_fin = false;
+
+    ESP_LOGW(TAG, "Resetting stream %" PRIu64 " (error=%" PRIu64 ")",
+             stream_id, error);
+    int ret = picoquic_reset_stream(ctx->cnx, stream_id, error);
+    sc->send_closed = true;
+    stream_ctx_maybe_release(ctx, sc);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "picoquic_reset_stream failed: %d", ret);
+        return -1;
+    }
+    return 0;
+}
+
+int quic_tunnel_stop_sending(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                             uint64_t error)
+{
+    if (ctx == NULL || ctx->cnx == NULL) {
+        return -1;
+    }
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
+    if (sc == NULL) {
+        return -1;
+    }
+
+    if (sc->recv_closed) {
+        return 0;
+    }
+
+    /* Whatever is still buffered will never be read. */
+    sc->recv_len = 0;
+
+    if (sc->recv_fin) {
+        /* The peer is done anyway; just close our half. */
+        sc->recv_closed = true;
+        stream_ctx_maybe_release(ctx, sc);
+        return 0;
+    }
+
+    ESP_LOGD(TAG, "Stop sending on stream %" PRIu64 " (error=%" PRIu64 ")",
+             stream_id, error);
+    int ret = picoquic_stop_sending(ctx->cnx, stream_id, error);
+    sc->recv_closed = true;
+    stream_ctx_maybe_release(ctx, sc);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "picoquic_stop_sending failed: %d", ret);
+        return -1;
+    }
+    return 0;
+}
+
+void quic_tunnel_set_tick_interval(quic_tunnel_t *t, uint64_t interval_us)
+{
+    if (t != NULL) {
+        t->tick_interval_us = interval_us;
+    }
+}
+
 void quic_tunnel_close(quic_tunnel_ctx_t *ctx)
 {
     if (ctx == NULL || ctx->cnx == NULL) {
         return;
     }
 
-    ESP_LOGI(TAG, "Closing QUIC connection gracefully");
+    ESP_LOGI(TAG, "[conn %u] Closing QUIC connection gracefully", ctx->conn_index);
     picoquic_close(ctx->cnx, 0);
-    /* The actual disconnect will be handled by the callback and loop termination */
+    /* The disconnect is reported by the callback; the next loop iteration
+     * releases the connection */
 }
 
-void quic_tunnel_free(quic_tunnel_ctx_t *ctx)
+void quic_tunnel_wake(quic_tunnel_t *t)
 {
-    if (ctx == NULL) {
+    /* One wake-up in flight is enough: the loop clears the flag as it
+     * wakes, before the tick that does the work. */
+    if (!__atomic_exchange_n(&t->wake_pending, true, __ATOMIC_ACQ_REL)) {
+        (void)picoquic_wake_up_network_thread(&t->loop);
+    }
+}
+
+void quic_tunnel_stop(quic_tunnel_t *t)
+{
+    if (t == NULL || t->stopping) {
+        return;
+    }
+    ESP_LOGI(TAG, "Stopping tunnel");
+    t->stopping = true;
+    for (size_t i = 0; i < t->max_connections; i++) {
+        if (t->conns[i].cnx != NULL && !t->conns[i].disconnected) {
+            quic_tunnel_close(&t->conns[i]);
+        }
+    }
+}
+
+void quic_tunnel_free(quic_tunnel_t *t)
+{
+    if (t == NULL) {
         return;
     }
 
-    /* Free all stream contexts */
-    stream_ctx_t *sc = ctx->streams;
-    while (sc) {
-        stream_ctx_t *next = sc->next;
-        free(sc->send_buf);
-        free(sc->recv_buf);
-        free(sc);
-        sc = next;
+    watch_stop(t);
+
+    /* Free the stream contexts of connections still open */
+    for (size_t i = 0; i < t->max_connections; i++) {
+        quic_tunnel_ctx_t *ctx = &t->conns[i];
+        if (ctx->cnx != NULL) {
+            picoquic_set_callback(ctx->cnx, NULL, NULL);
+            conn_free_streams(ctx);
+            ctx->cnx = NULL;
+        }
     }
-    ctx->streams = NULL;
 
     /* Free picoquic context (also frees all connections) */
-    if (ctx->quic) {
-        picoquic_free(ctx->quic);
-        ctx->quic = NULL;
-        ctx->cnx = NULL;
+    if (t->quic) {
+        picoquic_free(t->quic);
+        t->quic = NULL;
     }
+    t->loop.wake_up_defined = 0;
+    wake_pair_close(t->loop.wake_up_pipe_fd);
 
     ESP_LOGI(TAG, "Tunnel resources freed");
 }
@@ -577,12 +1529,5 @@ stream_ctx_t *quic_tunnel_find_stream(quic_tunnel_ctx_t *ctx, uint64_t stream_id
     if (ctx == NULL) {
         return NULL;
     }
-    stream_ctx_t *sc = ctx->streams;
-    while (sc) {
-        if (sc->stream_id == stream_id) {
-            return sc;
-        }
-        sc = sc->next;
-    }
-    return NULL;
+    return stream_table_find(&ctx->streams, stream_id);
 }
@@ -1,35 +1,103 @@
 #pragma once
 /*
- * Phase 3: QUIC tunnel connection to Cloudflare edge via picoquic.
+ * Phase 3: QUIC tunnel connections to Cloudflare edge via picoquic.
  *
- * Manages the lifecycle of a single QUIC connection to a Cloudflare
- * edge server, including stream multiplexing and event dispatch.
+ * A tunnel is one picoquic context and one UDP socket carrying up to
+ * QT_MAX_CONNECTIONS connections to edge servers (cloudflared's HA
+ * connections), each with its own streams and event dispatch.  Every
+ * connection lives in a fixed slot, its connection index; when one drops,
+ * the application dials a replacement into the same slot while the others
+ * keep running.
  */
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <picoquic.h>
+#include <picoquic_packet_loop.h>
+#include "stream_table.h"
+#include "mem_pool.h"
+
+/* Most connections one tunnel can hold */
+#define QT_MAX_CONNECTIONS 8
 
 /* Forward declare */
+typedef struct quic_tunnel quic_tunnel_t;
 typedef struct quic_tunnel_ctx quic_tunnel_ctx_t;
 
-/* Stream context for managing per-stream state */
+/* Called once a buffer queued with quic_tunnel_send_owned() has been
+ * fully taken by picoquic, or dropped along with the stream. */
+typedef void (*qt_release_cb_t)(void *arg, uint8_t *data);
+
+/* One buffer in a stream's send queue.  `data[off, len)` is still to be
+ * handed to picoquic; [len, cap) is free room for appends.  An external
+ * segment points at a caller's buffer (cap == len) and calls `release`,
+ * if set, when it is dropped. */
+typedef struct send_seg {
+    struct send_seg *next;
+    uint8_t *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+    bool external;
+    qt_release_cb_t release;
+    void *release_arg;
+} send_seg_t;
+
+/* Pull-mode data source for a stream's send half.  Once the send queue
+ * is drained, prepare_to_send asks the source how much it has and has it
+ * write that straight into picoquic's frame buffer, so nothing is staged
+ * in between and reads are paced by what picoquic can send.
+ *
+ * ready: bytes available right now, at most `max` (0 = none yet); set
+ *        *fin when the data ends after them.  -1 resets the stream.
+ * read:  write exactly `len` bytes (as reported by ready) into `buf`.
+ * close: called once when the stream is done with the source.
+ * fd:    optional; a descriptor that turns readable when ready() may have
+ *        more (-1 if none).  A waiting source without one is polled every
+ *        millisecond. */
+typedef struct {
+    int  (*ready)(void *arg, size_t max, bool *fin);
+    int  (*read)(void *arg, uint8_t *buf, size_t len);
+    void (*close)(void *arg);
+    int  (*fd)(void *arg);
+} qt_stream_source_t;
+
+/* Stream context for managing per-stream state.
+ *
+ * Each half of the stream is tracked separately.  The receive half closes
+ * on FIN or when we send STOP_SENDING; the send half closes once our FIN
+ * has been handed to picoquic (which retransmits it until acknowledged
+ * without our help) or when we reset the stream.  As soon as both halves
+ * are closed the context is released, so it must not be used after a
+ * quic_tunnel_* call that may close the last half; look it up again by
+ * stream ID instead. */
 typedef struct stream_ctx {
     uint64_t stream_id;
     bool is_control;
-    /* Send buffer */
-    uint8_t *send_buf;
-    size_t send_len;
-    size_t send_offset;
+    /* Send queue: segments drained front to back by prepare_to_send */
+    send_seg_t *send_head;
+    send_seg_t *send_tail;
+    size_t send_pending;  /* Queued bytes not yet taken by picoquic */
     bool send_fin;
+    /* Pull-mode source, read once the queue is drained */
+    const qt_stream_source_t *source;
+    void *source_arg;
+    bool source_waiting;  /* Had nothing to send; watched or polled */
+    bool source_watched;  /* ... and source_fd is in the tunnel's watch set */
+    bool source_fin;      /* Source has ended; FIN goes out on its own next */
+    int source_fd;
     /* Receive buffer */
     uint8_t *recv_buf;
     size_t recv_len;
     size_t recv_cap;
     bool recv_fin;
+    bool recv_closed;     /* FIN received or STOP_SENDING sent */
+    bool send_closed;     /* FIN handed to picoquic or RESET_STREAM sent */
     bool request_handled; /* App flag: data stream request already processed */
-    struct stream_ctx *next;
+    void *app_data;       /* App pointer (e.g. the proxy job taking the upload) */
+    size_t live_index;    /* Position in the stream table's live array */
 } stream_ctx_t;
 
 /* Tunnel event types */
@@ -39,6 +107,8 @@ typedef enum {
     QT_EVENT_STREAM_DATA,
     QT_EVENT_STREAM_FIN,
     QT_EVENT_STREAM_OPENED_REMOTE,
+    QT_EVENT_LOOP_TICK,          /* Once per packet-loop iteration, with
+                                  * ctx NULL (not tied to a connection) */
 } qt_event_t;
 
 /* Event callback */
@@ -48,42 +118,164 @@ typedef int (*qt_event_cb_t)(quic_tunnel_ctx_t *ctx, qt_event_t event,
 
 /* Configuration */
 typedef struct {
-    const char *edge_server;   /* Hostname or IP */
-    uint16_t edge_port;
+    size_t max_connections;    /* Connection slots (1..QT_MAX_CONNECTIONS) */
+    int local_af;              /* Family of the edge addresses, AF_UNSPEC
+                                * if mixed (opens sockets for both) */
     qt_event_cb_t event_cb;
     void *user_data;
+    mem_pool_t *mem_pool;      /* Stream slots and buffers (NULL = heap) */
 } quic_tunnel_config_t;
 
-/* Main tunnel context */
+/* One connection of the tunnel */
 struct quic_tunnel_ctx {
-    picoquic_quic_t *quic;
-    picoquic_cnx_t *cnx;
+    quic_tunnel_t *tunnel;
+    picoquic_cnx_t *cnx;       /* NULL while the slot is free */
     struct sockaddr_storage server_addr;
+    uint8_t conn_index;        /* Slot in the tunnel */
+    uint32_t generation;       /* Bumped each time the slot is dialled, so
+                                * state kept across a replacement can tell
+                                * the connections apart */
     bool connected;
     bool disconnected;
     qt_event_cb_t event_cb;
     void *user_data;
-    stream_ctx_t *streams;  /* Linked list of active streams */
+    stream_table_t streams; /* Active streams, by stream ID */
+    mem_pool_t *mem;        /* Stream slots and buffers (may be NULL) */
+    uint64_t streams_opened;   /* Stream contexts created */
+    uint64_t streams_released; /* Stream contexts freed after both halves closed */
+    uint64_t send_bytes_copied;  /* Bytes copied into send queues */
+    uint64_t send_bytes_owned;   /* Bytes queued by reference (no copy) */
+    uint64_t send_bytes_built;   /* Bytes written in place (send_reserve) */
+    uint64_t send_bytes_served;  /* Bytes handed to picoquic */
+    uint64_t send_bytes_pulled;  /* ... of which read straight from a source */
+    size_t sources_waiting;      /* Streams with source_waiting set */
+    size_t sources_unwatched;    /* ... of which have no watched descriptor */
 };
 
-/* Connect to Cloudflare edge (creates QUIC context + connection, starts handshake) */
-int quic_tunnel_connect(quic_tunnel_ctx_t *ctx, const quic_tunnel_config_t *config);
+/* Most source descriptors watched at once; beyond that, waiting sources
+ * fall back to polling. */
+#define QT_WATCH_MAX 16
+
+/* Descriptors of waiting sources.  A helper thread select()s on them and
+ * wakes the packet loop when one turns readable, then stays quiet until
+ * the loop has polled the sources (`armed`). */
+typedef struct {
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ctl[2];                /* Interrupts the thread's select() */
+    int fds[QT_WATCH_MAX];
+    size_t count;
+    bool armed;
+    bool selecting;            /* Thread is inside select() */
+    uint64_t select_gen;       /* select() calls started */
+    bool stop;
+} qt_watch_t;
+
+/* The shared picoquic context and its connections */
+struct quic_tunnel {
+    picoquic_quic_t *quic;
+    quic_tunnel_ctx_t conns[QT_MAX_CONNECTIONS];
+    size_t max_connections;
+    int local_af;
+    qt_event_cb_t event_cb;
+    void *user_data;
+    mem_pool_t *mem;
+    uint64_t tick_interval_us; /* Max packet-loop sleep (0 = picoquic decides) */
+    bool stopping;             /* quic_tunnel_stop() called */
+    picoquic_network_thread_ctx_t loop; /* Packet loop state and wake-up pair */
+    bool wake_pending;         /* Wake-up sent, loop not yet woken */
+    qt_watch_t watch;
+};
 
-/* Run the blocking packet loop (returns when disconnected or error) */
-int quic_tunnel_run(quic_tunnel_ctx_t *ctx);
+/* Create the picoquic context; connections are added separately. */
+int quic_tunnel_init(quic_tunnel_t *t, const quic_tunnel_config_t *config);
+
+/* Dial connection `conn_index` to `addr` and start its handshake.  The
+ * slot must be free: never used, or released on the loop iteration after
+ * its QT_EVENT_DISCONNECTED.  Returns the connection, or NULL on error. */
+quic_tunnel_ctx_t *quic_tunnel_add_connection(quic_tunnel_t *t, uint8_t conn_index,
+                                              const struct sockaddr *addr);
+
+/* Connection in slot `conn_index`, or NULL if the slot is free. */
+quic_tunnel_ctx_t *quic_tunnel_connection(quic_tunnel_t *t, uint8_t conn_index);
+
+/* Run the blocking packet loop for all connections (returns once
+ * quic_tunnel_stop() was called and every connection is gone, or on
+ * error) */
+int quic_tunnel_run(quic_tunnel_t *t);
 
 /* Open a new client-initiated bidirectional stream, returns stream_id */
 uint64_t quic_tunnel_open_stream(quic_tunnel_ctx_t *ctx, bool is_control);
 
-/* Queue data for sending on a stream */
+/* Queue data for sending on a stream (copied into the send queue) */
 int quic_tunnel_send(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
                      const uint8_t *data, size_t len, bool fin);
 
-/* Close the QUIC connection gracefully */
+/* Queue `data` for sending without copying it.  The stream takes the
+ * buffer over and calls `release(release_arg, data)` once picoquic has
+ * taken the last byte or the stream is dropped; the buffer must not be
+ * touched until then.  With `release` NULL the buffer is only borrowed
+ * and must stay valid for the life of the stream (e.g. static data).
+ * On error the buffer is released before returning. */
+int quic_tunnel_send_owned(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                           uint8_t *data, size_t len,
+                           qt_release_cb_t release, void *release_arg, bool fin);
+
+/* Reserve `len` contiguous bytes at the end of a stream's send queue for
+ * the caller to write in place, e.g. to encode a message without a
+ * scratch buffer.  Returns the room, or NULL on error.  Nothing is sent
+ * until quic_tunnel_send_commit(); the room is only valid until the next
+ * quic_tunnel_* call on the stream. */
+uint8_t *quic_tunnel_send_reserve(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                                  size_t len);
+
+/* Queue the first `len` bytes of the last reservation on the stream. */
+int quic_tunnel_send_commit(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                            size_t len, bool fin);
+
+/* Attach a pull-mode source to a stream's send half.  It is read after
+ * anything already queued and ends the stream with FIN when it reports
+ * the end of its data; no further quic_tunnel_send*() calls are allowed.
+ * On error the source is closed before returning. */
+int quic_tunnel_set_source(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                           const qt_stream_source_t *source, void *arg);
+
+/* Bytes queued on a stream that picoquic has not yet taken (0 if the
+ * stream does not exist). */
+size_t quic_tunnel_send_pending(quic_tunnel_ctx_t *ctx, uint64_t stream_id);
+
+/* Discard the first `len` bytes of a stream's receive buffer once the
+ * application has consumed them.  The rest moves to the front, so consume
+ * whole batches at once rather than message by message. */
+void quic_tunnel_consume(quic_tunnel_ctx_t *ctx, uint64_t stream_id, size_t len);
+
+/* Abort the sending side of a stream with RESET_STREAM(`error`). */
+int quic_tunnel_reset_stream(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                             uint64_t error);
+
+/* Ask the peer to stop sending on a stream with STOP_SENDING(`error`),
+ * drop any buffered receive data and close the receive half. */
+int quic_tunnel_stop_sending(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                             uint64_t error);
+
+/* Bound the packet loop's sleep to `interval_us` so QT_EVENT_LOOP_TICK
+ * fires at least that often (0 restores picoquic's own timer). */
+void quic_tunnel_set_tick_interval(quic_tunnel_t *t, uint64_t interval_us);
+
+/* Make the packet loop run an iteration (and QT_EVENT_LOOP_TICK) soon.
+ * Safe to call from any thread; never blocks. */
+void quic_tunnel_wake(quic_tunnel_t *t);
+
+/* Close one QUIC connection gracefully; the others are not affected */
 void quic_tunnel_close(quic_tunnel_ctx_t *ctx);
 
+/* Close every connection and end the packet loop once they are gone */
+void quic_tunnel_stop(quic_tunnel_t *t);
+
 /* Free all resources */
-void quic_tunnel_free(quic_tunnel_ctx_t *ctx);
+void quic_tunnel_free(quic_tunnel_t *t);
 
 /* Find stream context by ID */
 stream_ctx_t *quic_tunnel_find_stream(quic_tunnel_ctx_t *ctx, uint64_t stream_id);
@@ -0,0 +1,551 @@
+/*
+ * Host soak driver for quic_tunnel.c's stream lifecycle; not part of the
+ * firmware build.
+ *
+ * Stands in for picoquic with a few functions that hand stream events
+ * straight to quic_tunnel's callback, and plays the edge: it opens a
+ * stream per request, keeping STREAMS_IN_FLIGHT open at once, and drains
+ * each response through prepare_to_send until FIN.  Most requests end
+ * normally (request FIN, response FIN); the rest take the other ways a
+ * stream closes:
+ *
+ *   - the response goes out before the request FIN and the proxy stops
+ *     reading the request (STOP_SENDING), then the edge resets it late
+ *   - the edge resets the request half-way
+ *   - the edge sends STOP_SENDING half-way through the response
+ *   - the response is pulled from a source, as the proxy does by default,
+ *     and either ends normally or its last read() fails, which must reset
+ *     the stream without a FIN
+ *
+ * Every REPORT_EVERY requests it prints RSS, live stream contexts and the
+ * pool's heap allocations; all three should stay flat.  Only picoquic's
+ * headers are needed, not its library:
+ *
+ *   cc -O2 -DCONFIG_IDF_TARGET_LINUX -I. -Ihost -I$PICOQUIC/picoquic \
+ *      -I$PICOTLS/include quic_tunnel_soak.c quic_tunnel.c stream_table.c \
+ *      mem_pool.c -lpthread && ./a.out [requests]
+ *
+ * Runs a million requests by default.  Exits with 1 if a stream ends the
+ * wrong way, if contexts are still live once every stream has closed, or
+ * if RSS grows by more than RSS_SLACK after the first report.
+ */
+
+#include "quic_tunnel.h"
+#include "mem_pool.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define STREAMS_IN_FLIGHT 64
+#define REPORT_EVERY      100000
+#define RSS_SLACK         (1024 * 1024)
+
+/* Largest frame the edge takes per prepare_to_send */
+#define FRAME_SIZE 1200
+
+/* ── picoquic stand-in ───────────────────────────────────────────── */
+
+/* Ring of the streams the edge has open, by stream number.  Holds
+ * STREAMS_IN_FLIGHT plus the one being opened. */
+#define RING (STREAMS_IN_FLIGHT * 2)
+
+typedef struct {
+    uint64_t stream_id;
+    void *app_ctx;
+    bool active;            /* Marked active, wants prepare_to_send */
+    bool reset;             /* We sent RESET_STREAM */
+    bool stop_sending;      /* We sent STOP_SENDING */
+} fake_stream_t;
+
+struct st_picoquic_quic_t {
+    picoquic_cnx_t *cnx;
+};
+
+struct st_picoquic_cnx_t {
+    picoquic_quic_t *quic;
+    picoquic_stream_data_cb_fn cb;
+    void *cb_ctx;
+    uint64_t next_local;
+    fake_stream_t ring[RING];
+};
+
+/* What quic_tunnel provided to one prepare_to_send */
+typedef struct {
+    uint8_t buf[FRAME_SIZE];
+    size_t len;
+    bool fin;
+    bool active;
+} frame_t;
+
+const picoquic_connection_id_t picoquic_null_connection_id;
+picoquic_congestion_algorithm_t *picoquic_bbr_algorithm;
+
+static uint64_t s_now = 1000000;
+
+static fake_stream_t *fake_stream(picoquic_cnx_t *cnx, uint64_t stream_id)
+{
+    fake_stream_t *fs = &cnx->ring[(stream_id >> 2) % RING];
+    if (fs->stream_id != stream_id) {
+        fprintf(stderr, "FAIL stream %llu is not open\n",
+                (unsigned long long)stream_id);
+        exit(1);
+    }
+    return fs;
+}
+
+uint64_t picoquic_current_time(void)
+{
+    return s_now;
+}
+
+picoquic_quic_t *picoquic_create(uint32_t max_nb_connections,
+                                 char const *cert_file_name, char const *key_file_name,
+                                 char const *cert_root_file_name, char const *default_alpn,
+                                 picoquic_stream_data_cb_fn default_callback_fn,
+                                 void *default_callback_ctx,
+                                 picoquic_connection_id_cb_fn cnx_id_callback,
+                                 void *cnx_id_callback_data, uint8_t reset_seed[PICOQUIC_RESET_SECRET_SIZE],
+                                 uint64_t current_time, uint64_t *p_simulated_time,
+                                 char const *ticket_file_name,
+                                 const uint8_t *ticket_encryption_key,
+                                 size_t ticket_encryption_key_length)
+{
+    return calloc(1, sizeof(picoquic_quic_t));
+}
+
+void picoquic_free(picoquic_quic_t *quic)
+{
+    free(quic->cnx);
+    free(quic);
+}
+
+void picoquic_set_default_congestion_algorithm(picoquic_quic_t *quic,
+                                               picoquic_congestion_algorithm_t const *alg)
+{
+}
+
+picoquic_cnx_t *picoquic_create_cnx(picoquic_quic_t *quic,
+                                    picoquic_connection_id_t initial_cnx_id,
+                                    picoquic_connection_id_t remote_cnx_id,
+                                    const struct sockaddr *addr_to, uint64_t start_time,
+                                    uint32_t preferred_version, char const *sni,
+                                    char const *alpn, char client_mode)
+{
+    picoquic_cnx_t *cnx = calloc(1, sizeof(*cnx));
+    if (cnx != NULL) {
+        for (size_t i = 0; i < RING; i++) {
+            cnx->ring[i].stream_id = UINT64_MAX;
+        }
+        cnx->quic = quic;
+        quic->cnx = cnx;
+    }
+    return cnx;
+}
+
+void picoquic_set_callback(picoquic_cnx_t *cnx, picoquic_stream_data_cb_fn fn,
+                           void *ctx)
+{
+    cnx->cb = fn;
+    cnx->cb_ctx = ctx;
+}
+
+int picoquic_start_client_cnx(picoquic_cnx_t *cnx)
+{
+    return 0;
+}
+
+void picoquic_delete_cnx(picoquic_cnx_t *cnx)
+{
+    cnx->quic->cnx = NULL;
+    free(cnx);
+}
+
+int picoquic_close(picoquic_cnx_t *cnx, uint64_t application_reason_code)
+{
+    return 0;
+}
+
+uint64_t picoquic_get_next_local_stream_id(picoquic_cnx_t *cnx, int is_unidir)
+{
+    return cnx->next_local;
+}
+
+int picoquic_set_app_stream_ctx(picoquic_cnx_t *cnx, uint64_t stream_id,
+                                void *app_stream_ctx)
+{
+    fake_stream(cnx, stream_id)->app_ctx = app_stream_ctx;
+    return 0;
+}
+
+int picoquic_mark_active_stream(picoquic_cnx_t *cnx, uint64_t stream_id,
+                                int is_active, void *v_stream_ctx)
+{
+    fake_stream_t *fs = fake_stream(cnx, stream_id);
+    fs->active = is_active != 0;
+    fs->app_ctx = v_stream_ctx;
+    return 0;
+}
+
+int picoquic_reset_stream(picoquic_cnx_t *cnx, uint64_t stream_id,
+                          uint64_t local_stream_error)
+{
+    fake_stream_t *fs = fake_stream(cnx, stream_id);
+    fs->reset = true;
+    fs->active = false;
+    return 0;
+}
+
+int picoquic_stop_sending(picoquic_cnx_t *cnx, uint64_t stream_id,
+                          uint64_t local_stream_error)
+{
+    fake_stream(cnx, stream_id)->stop_sending = true;
+    return 0;
+}
+
+uint8_t *picoquic_provide_stream_data_buffer(void *context, size_t nb_bytes,
+                                             int is_fin, int is_still_active)
+{
+    frame_t *f = (frame_t *)context;
+    if (nb_bytes > sizeof(f->buf)) {
+        return NULL;
+    }
+    f->len = nb_bytes;
+    f->fin = is_fin != 0;
+    f->active = is_still_active != 0;
+    return f->buf;
+}
+
+void *picoquic_packet_loop_v3(void *v_ctx)
+{
+    return NULL;
+}
+
+int picoquic_wake_up_network_thread(picoquic_network_thread_ctx_t *thread_ctx)
+{
+    return 0;
+}
+
+/* ── Requests ────────────────────────────────────────────────────── */
+
+typedef enum {
+    END_NORMAL,
+    END_PULLED,             /* Response read from a source */
+    END_PULL_FAILS,         /* ... whose last read() fails */
+    END_EARLY_RESPONSE,     /* Response first, then STOP_SENDING */
+    END_PEER_RESET,
+    END_PEER_STOP_SENDING,
+} end_kind_t;
+
+static end_kind_t end_kind_of(uint64_t stream_id)
+{
+    switch ((stream_id >> 2) % 16) {
+    case 11: return END_PULLED;
+    case 12: return END_PULL_FAILS;
+    case 13: return END_EARLY_RESPONSE;
+    case 14: return END_PEER_RESET;
+    case 15: return END_PEER_STOP_SENDING;
+    default: return END_NORMAL;
+    }
+}
+
+/* Response size for a stream: small to several send segments. */
+static size_t response_len_of(uint64_t stream_id)
+{
+    static const size_t lens[] = { 90, 700, 3000, 9000, 40000 };
+    return lens[(stream_id >> 6) % (sizeof(lens) / sizeof(lens[0]))];
+}
+
+static uint8_t s_request[600];
+static uint8_t s_response[40000];
+
+static int fail(uint64_t stream_id, const char *what)
+{
+    fprintf(stderr, "FAIL stream %llu: %s\n", (unsigned long long)stream_id, what);
+    exit(1);
+}
+
+/* Pull-mode response of one stream, by ring slot.  Hands out at most
+ * SOURCE_CHUNK bytes per ready(), as a socket would. */
+#define SOURCE_CHUNK 1000
+
+typedef struct {
+    size_t off;
+    size_t len;
+    size_t fail_at;         /* read() past this offset fails */
+    bool open;
+} source_t;
+
+static source_t s_sources[RING];
+
+static int source_ready(void *arg, size_t max, bool *fin)
+{
+    source_t *src = arg;
+    size_t n = src->len - src->off;
+    n = n < max ? n : max;
+    n = n < SOURCE_CHUNK ? n : SOURCE_CHUNK;
+    *fin = src->off + n == src->len;
+    return (int)n;
+}
+
+static int source_read(void *arg, uint8_t *buf, size_t len)
+{
+    source_t *src = arg;
+    if (src->off + len > src->fail_at) {
+        return -1;
+    }
+    memcpy(buf, s_response + src->off, len);
+    src->off += len;
+    return 0;
+}
+
+static void source_close(void *arg)
+{
+    ((source_t *)arg)->open = false;
+}
+
+static const qt_stream_source_t s_source = {
+    .ready = source_ready,
+    .read = source_read,
+    .close = source_close,
+};
+
+static source_t *source_of(uint64_t stream_id)
+{
+    return &s_sources[(stream_id >> 2) % RING];
+}
+
+/* The application: answer each request once it is complete (or at once,
+ * for the early kind), as the proxy does. */
+static int app_event(quic_tunnel_ctx_t *ctx, qt_event_t event, uint64_t stream_id,
+                     const uint8_t *data, size_t len, void *user_data)
+{
+    bool early = end_kind_of(stream_id) == END_EARLY_RESPONSE;
+    if (event == QT_EVENT_STREAM_DATA && early) {
+        if (quic_tunnel_send(ctx, stream_id, s_response,
+                             response_len_of(stream_id), true) != 0) {
+            fail(stream_id, "early send");
+        }
+        quic_tunnel_stop_sending(ctx, stream_id, 0);
+    } else if (event == QT_EVENT_STREAM_FIN && !early) {
+        quic_tunnel_consume(ctx, stream_id, len);
+        end_kind_t kind = end_kind_of(stream_id);
+        size_t want = response_len_of(stream_id);
+        if (kind == END_PULLED || kind == END_PULL_FAILS) {
+            source_t *src = source_of(stream_id);
+            *src = (source_t){
+                .len = want,
+                .fail_at = kind == END_PULL_FAILS ? want - 1 : SIZE_MAX,
+                .open = true,
+            };
+            if (quic_tunnel_set_source(ctx, stream_id, &s_source, src) != 0) {
+                fail(stream_id, "set source");
+            }
+        } else if (quic_tunnel_send(ctx, stream_id, s_response, want, true) != 0) {
+            fail(stream_id, "send");
+        }
+    }
+    return 0;
+}
+
+static void deliver(picoquic_cnx_t *cnx, uint64_t stream_id,
+                    const uint8_t *data, size_t len, picoquic_call_back_event_t ev)
+{
+    fake_stream_t *fs = fake_stream(cnx, stream_id);
+    if (cnx->cb(cnx, stream_id, (uint8_t *)data, len, ev, cnx->cb_ctx, fs->app_ctx) != 0) {
+        fail(stream_id, "callback error");
+    }
+}
+
+/* prepare_to_send while the stream wants it, at most `max_frames` times.
+ * Returns the bytes taken; sets *fin once the FIN frame went out. */
+static size_t drain(picoquic_cnx_t *cnx, uint64_t stream_id, size_t max_frames,
+                    bool *fin)
+{
+    fake_stream_t *fs = fake_stream(cnx, stream_id);
+    static frame_t frame;
+    size_t taken = 0;
+    while (fs->active && !*fin && max_frames-- > 0) {
+        memset(&frame, 0, sizeof(frame));
+        frame.active = true;
+        deliver(cnx, stream_id, (uint8_t *)&frame, FRAME_SIZE,
+                picoquic_callback_prepare_to_send);
+        if (fs->reset) {
+            *fin = frame.fin;
+            break;              /* The frame is dropped with the stream */
+        }
+        if (memcmp(frame.buf, s_response + taken, frame.len) != 0) {
+            fail(stream_id, "response bytes differ");
+        }
+        taken += frame.len;
+        fs->active = frame.active;
+        *fin = frame.fin;
+    }
+    return taken;
+}
+
+/* Edge side of request `n`: open the stream and send the request. */
+static void request_start(picoquic_cnx_t *cnx, uint64_t n)
+{
+    uint64_t stream_id = n * 4 + 1;
+    fake_stream_t *fs = &cnx->ring[n % RING];
+    memset(fs, 0, sizeof(*fs));
+    fs->stream_id = stream_id;
+    deliver(cnx, stream_id, s_request, sizeof(s_request) / 2,
+            picoquic_callback_stream_data);
+}
+
+/* Edge side of request `n` STREAMS_IN_FLIGHT requests later: finish the
+ * request its way and read the response. */
+static void request_finish(picoquic_cnx_t *cnx, uint64_t n)
+{
+    uint64_t stream_id = n * 4 + 1;
+    fake_stream_t *fs = fake_stream(cnx, stream_id);
+    size_t want = response_len_of(stream_id);
+    size_t half = sizeof(s_request) / 2;
+    bool fin = false;
+    size_t got;
+
+    switch (end_kind_of(stream_id)) {
+    case END_NORMAL:
+        deliver(cnx, stream_id, s_request + half, half, picoquic_callback_stream_fin);
+        got = drain(cnx, stream_id, SIZE_MAX, &fin);
+        if (!fin || got != want || fs->reset) {
+            fail(stream_id, "normal end");
+        }
+        break;
+    case END_PULLED:
+        deliver(cnx, stream_id, s_request + half, half, picoquic_callback_stream_fin);
+        got = drain(cnx, stream_id, SIZE_MAX, &fin);
+        if (!fin || got != want || fs->reset || source_of(stream_id)->open) {
+            fail(stream_id, "pulled end");
+        }
+        break;
+    case END_PULL_FAILS:
+        deliver(cnx, stream_id, s_request + half, half, picoquic_callback_stream_fin);
+        drain(cnx, stream_id, SIZE_MAX, &fin);
+        if (fin || !fs->reset || source_of(stream_id)->open) {
+            fail(stream_id, "failed read not reset without FIN");
+        }
+        break;
+    case END_EARLY_RESPONSE:
+        got = drain(cnx, stream_id, SIZE_MAX, &fin);
+        if (!fin || got != want || !fs->stop_sending) {
+            fail(stream_id, "early response");
+        }
+        /* The edge answers STOP_SENDING with a reset, after release. */
+        deliver(cnx, stream_id, NULL, 0, picoquic_callback_stream_reset);
+        break;
+    case END_PEER_RESET:
+        deliver(cnx, stream_id, NULL, 0, picoquic_callback_stream_reset);
+        if (!fs->reset) {
+            fail(stream_id, "peer reset not answered");
+        }
+        break;
+    case END_PEER_STOP_SENDING:
+        deliver(cnx, stream_id, s_request + half, half, picoquic_callback_stream_fin);
+        drain(cnx, stream_id, 2, &fin);
+        deliver(cnx, stream_id, NULL, 0, picoquic_callback_stop_sending);
+        if (!fin && !fs->reset) {
+            fail(stream_id, "peer STOP_SENDING not answered");
+        }
+        break;
+    }
+    fs->stream_id = UINT64_MAX;
+}
+
+/* ── Reporting ───────────────────────────────────────────────────── */
+
+static size_t rss_bytes(void)
+{
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void report(uint64_t n, quic_tunnel_ctx_t *ctx, mem_pool_t *mem)
+{
+    mem_pool_stats_t st;
+    mem_pool_get_stats(mem, &st);
+    printf("%9llu requests  rss %6zu KB  live %3zu  opened %9llu  released %9llu"
+           "  pool mallocs %5llu\n",
+           (unsigned long long)n, rss_bytes() / 1024,
+           stream_table_count(&ctx->streams),
+           (unsigned long long)ctx->streams_opened,
+           (unsigned long long)ctx->streams_released,
+           (unsigned long long)st.mallocs);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t requests = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    for (size_t i = 0; i < sizeof(s_request); i++) {
+        s_request[i] = (uint8_t)('a' + i % 26);
+    }
+    for (size_t i = 0; i < sizeof(s_response); i++) {
+        s_response[i] = (uint8_t)(i * 7);
+    }
+
+    mem_pool_t *mem = mem_pool_create();
+    quic_tunnel_config_t config = {
+        .max_connections = 1,
+        .local_af = AF_INET,
+        .event_cb = app_event,
+        .mem_pool = mem,
+    };
+    quic_tunnel_t tunnel;
+    if (mem == NULL || quic_tunnel_init(&tunnel, &config) != 0) {
+        return 1;
+    }
+    struct sockaddr_in edge = { .sin_family = AF_INET, .sin_port = htons(7844) };
+    quic_tunnel_ctx_t *ctx = quic_tunnel_add_connection(&tunnel, 0,
+                                                        (struct sockaddr *)&edge);
+    if (ctx == NULL) {
+        return 1;
+    }
+    picoquic_cnx_t *cnx = ctx->cnx;
+    cnx->cb(cnx, 0, NULL, 0, picoquic_callback_ready, cnx->cb_ctx, NULL);
+
+    size_t rss_base = 0;
+    for (uint64_t n = 0; n < requests + STREAMS_IN_FLIGHT; n++) {
+        if (n < requests) {
+            request_start(cnx, n);
+        }
+        if (n >= STREAMS_IN_FLIGHT) {
+            request_finish(cnx, n - STREAMS_IN_FLIGHT);
+        }
+        s_now += 100;
+        if (n > 0 && n % REPORT_EVERY == 0 && n < requests) {
+            report(n, ctx, mem);
+            if (rss_base == 0) {
+                rss_base = rss_bytes();
+            }
+        }
+    }
+    report(requests, ctx, mem);
+
+    int rc = 0;
+    size_t rss = rss_bytes();
+    if (stream_table_count(&ctx->streams) != 0 ||
+        ctx->streams_opened != requests || ctx->streams_released != requests) {
+        fprintf(stderr, "FAIL stream contexts left after every stream closed\n");
+        rc = 1;
+    }
+    if (rss_base != 0 && rss > rss_base + RSS_SLACK) {
+        fprintf(stderr, "FAIL rss grew from %zu to %zu KB\n",
+                rss_base / 1024, rss / 1024);
+        rc = 1;
+    }
+    quic_tunnel_free(&tunnel);
+    mem_pool_destroy(mem);
+    return rc;
+}
@@ -0,0 +1,1141 @@
+/*
+ * Phase 4: Cap'n Proto RPC session on the control stream (see
+ * rpc_session.h).
+ *
+ * Messages are read and built with the capnp_minimal.h primitives, at the
+ * offsets capnp_schema.h gives for schema/rpc.capnp.  Every table is a
+ * small array: question IDs are ours to pick and index the table directly,
+ * answer and import IDs are the edge's and are looked up.
+ */
+
+#include "rpc_session.h"
+#include "capnp_schema.h"
+#include "mem_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <esp_log.h>
+
+static const char *TAG = "rpc";
+
+/* Stack room for an outgoing message; params or results that outgrow it
+ * chain segments from the session's pool. */
+#define RPC_WORK_SIZE 512
+
+/* ── Tables ──────────────────────────────────────────────────────── */
+
+typedef struct {
+    bool in_use;                /* Sent, Return not yet in */
+    rpc_return_fn done;
+    void *arg;
+} question_t;
+
+typedef enum {
+    ANSWER_FREE,
+    ANSWER_QUEUED,              /* Pipelined on a pending answer */
+    ANSWER_PENDING,             /* Dispatched, not yet returned */
+    ANSWER_RETURNED,            /* Waiting for the edge's Finish */
+} answer_state_t;
+
+typedef struct {
+    answer_state_t state;
+    bool finished;              /* Finish came before our Return */
+    bool failed;                /* Returned an exception */
+    uint32_t id;
+    uint32_t cap;               /* Results capability (export ID) */
+} answer_t;
+
+typedef struct {
+    rpc_dispatch_fn dispatch;   /* NULL = free slot */
+    void *arg;
+    uint32_t refs;              /* References the edge holds */
+} export_t;
+
+typedef struct {
+    bool in_use;
+    uint32_t id;
+    uint32_t refs;              /* Times the edge has sent it to us */
+} import_t;
+
+/* A Call held until the answer it is pipelined on resolves. */
+typedef struct {
+    uint32_t answer_id;         /* The call's own answer */
+    uint32_t waits_on;
+    uint8_t *msg;               /* Copy of the whole message */
+    size_t len;
+} queued_t;
+
+struct rpc_session {
+    rpc_transport_t transport;
+    mem_pool_t *mem;
+    question_t questions[RPC_MAX_QUESTIONS];
+    answer_t answers[RPC_MAX_ANSWERS];
+    export_t exports[RPC_MAX_EXPORTS];
+    import_t imports[RPC_MAX_IMPORTS];
+    queued_t queued[RPC_MAX_QUEUED];
+    size_t queued_count;
+    uint32_t bootstrap;         /* Export ID, or RPC_NO_CAP */
+    bool aborted;
+    rpc_session_stats_t stats;
+};
+
+/* ────────────────────────────────────────────────────────────────
+ *  Reading: a struct and its fields.  Fields past the end of the
+ *  struct the edge sent read as zero, pointers as null.
+ * ──────────────────────────────────────────────────────────────── */
+
+typedef struct {
+    size_t off;
+    uint16_t dw, pc;
+} sref_t;
+
+static inline size_t ptr_at(const sref_t *st, unsigned idx)
+{
+    return st->off + CAPNP_PTR(st->dw, idx);
+}
+
+/* Struct at pointer `idx` of `st`: 0, or -1 if null or invalid. */
+static int get_struct(const capnp_reader_t *r, const sref_t *st, unsigned idx,
+                      sref_t *out)
+{
+    if (idx >= st->pc) {
+        return -1;
+    }
+    return capnp_read_struct_ptr(r, ptr_at(st, idx), &out->off,
+                                 &out->dw, &out->pc);
+}
+
+static uint16_t get16(const capnp_reader_t *r, const sref_t *st, size_t off)
+{
+    return CAPNP_HAS_DATA(st->dw, off, 2) ? capnp_read_uint16(r, st->off, off) : 0;
+}
+
+static uint32_t get32(const capnp_reader_t *r, const sref_t *st, size_t off)
+{
+    return CAPNP_HAS_DATA(st->dw, off, 4) ? capnp_read_uint32(r, st->off, off) : 0;
+}
+
+static uint64_t get64(const capnp_reader_t *r, const sref_t *st, size_t off)
+{
+    return CAPNP_HAS_DATA(st->dw, off, 8) ? capnp_read_uint64(r, st->off, off) : 0;
+}
+
+static bool get_bit(const capnp_reader_t *r, const sref_t *st, size_t off,
+                    int bit)
+{
+    return CAPNP_HAS_DATA(st->dw, off, 1) && capnp_read_bool(r, st->off, off, bit);
+}
+
+static capnp_text_t get_text(const capnp_reader_t *r, const sref_t *st,
+                             unsigned idx)
+{
+    capnp_text_t t = { "", 0 };
+    if (idx < st->pc) {
+        const char *p = capnp_read_text(r, ptr_at(st, idx), &t.len);
+        t.ptr = p ? p : "";
+    }
+    return t;
+}
+
+/* ── Table lookups ───────────────────────────────────────────────── */
+
+static answer_t *find_answer(rpc_session_t *s, uint32_t id)
+{
+    for (size_t i = 0; i < RPC_MAX_ANSWERS; i++) {
+        if (s->answers[i].state != ANSWER_FREE && s->answers[i].id == id) {
+            return &s->answers[i];
+        }
+    }
+    return NULL;
+}
+
+static answer_t *new_answer(rpc_session_t *s, uint32_t id, answer_state_t state)
+{
+    for (size_t i = 0; i < RPC_MAX_ANSWERS; i++) {
+        answer_t *a = &s->answers[i];
+        if (a->state == ANSWER_FREE) {
+            *a = (answer_t){ .state = state, .id = id, .cap = RPC_NO_CAP };
+            return a;
+        }
+    }
+    return NULL;
+}
+
+static export_t *find_export(rpc_session_t *s, uint32_t id)
+{
+    if (id >= RPC_MAX_EXPORTS || !s->exports[id].dispatch) {
+        return NULL;
+    }
+    return &s->exports[id];
+}
+
+static import_t *find_import(rpc_session_t *s, uint32_t id)
+{
+    for (size_t i = 0; i < RPC_MAX_IMPORTS; i++) {
+        if (s->imports[i].in_use && s->imports[i].id == id) {
+            return &s->imports[i];
+        }
+    }
+    return NULL;
+}
+
+/* Count one more reference to import `id`.  Returns 0, or -1 if the
+ * table is full. */
+static int add_import(rpc_session_t *s, uint32_t id)
+{
+    import_t *im = find_import(s, id);
+    for (size_t i = 0; !im && i < RPC_MAX_IMPORTS; i++) {
+        if (!s->imports[i].in_use) {
+            im = &s->imports[i];
+            *im = (import_t){ .in_use = true, .id = id };
+        }
+    }
+    if (!im) {
+        return -1;
+    }
+    im->refs++;
+    return 0;
+}
+
+/* Lowest free question ID, or -1. */
+static int new_question(rpc_session_t *s, rpc_return_fn done, void *arg)
+{
+    for (int i = 0; i < RPC_MAX_QUESTIONS; i++) {
+        question_t *q = &s->questions[i];
+        if (!q->in_use) {
+            *q = (question_t){ .in_use = true, .done = done, .arg = arg };
+            return i;
+        }
+    }
+    ESP_LOGE(TAG, "too many questions in flight");
+    return -1;
+}
+
+/* ────────────────────────────────────────────────────────────────
+ *  Writing
+ * ──────────────────────────────────────────────────────────────── */
+
+static void builder_init(rpc_session_t *s, capnp_builder_t *b, uint8_t *work)
+{
+    capnp_builder_init(b, work, RPC_WORK_SIZE);
+    capnp_builder_chain(b, s->mem);
+}
+
+/* Start a Message whose union member `which` is a struct of the given
+ * shape; returns that struct's position, or -1. */
+static int begin_message(capnp_builder_t *b, uint16_t which,
+                         uint16_t data_words, uint16_t ptr_count)
+{
+    int rp = capnp_alloc(b, 1);
+    if (rp < 0) return -1;
+
+    int msg = capnp_new_struct(b, (size_t)rp, RPC_MESSAGE_DATA_WORDS,
+                               RPC_MESSAGE_PTR_COUNT);
+    if (msg < 0) return -1;
+    capnp_write_le16(capnp_at(b, (size_t)msg + RPC_MESSAGE_WHICH), which);
+
+    /* Every member of the Message union is its one pointer */
+    return capnp_new_struct(b, (size_t)msg +
+                            CAPNP_PTR(RPC_MESSAGE_DATA_WORDS,
+                                      RPC_MESSAGE_CALL_PTR),
+                            data_words, ptr_count);
+}
+
+/* Encode the message straight into the transport and send it. */
+static int send_message(rpc_session_t *s, const capnp_builder_t *b)
+{
+    size_t len = capnp_message_size(b);
+    uint8_t *out = s->transport.reserve(s->transport.arg, len);
+    if (!out || capnp_finalize(b, out, len) != len ||
+        s->transport.commit(s->transport.arg, len) != 0) {
+        ESP_LOGE(TAG, "failed to send %zu-byte message", len);
+        return -1;
+    }
+    s->stats.msgs_out++;
+    s->stats.bytes_out += len;
+    return 0;
+}
+
+static int write_exception(capnp_builder_t *b, int exc, uint16_t type,
+                           const char *reason)
+{
+    capnp_write_le16(capnp_at(b, (size_t)exc + RPC_EXCEPTION_TYPE), type);
+    return capnp_write_text(b, (size_t)exc +
+                            CAPNP_PTR(RPC_EXCEPTION_DATA_WORDS,
+                                      RPC_EXCEPTION_REASON_PTR),
+                            reason);
+}
+
+/* Send Abort and end the session; returns -1 for the caller to pass on. */
+static int send_abort(rpc_session_t *s, const char *reason)
+{
+    ESP_LOGE(TAG, "aborting session: %s", reason);
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int exc = begin_message(&b, RPC_MESSAGE_WHICH_ABORT,
+                            RPC_EXCEPTION_DATA_WORDS, RPC_EXCEPTION_PTR_COUNT);
+    if (exc >= 0 &&
+        write_exception(&b, exc, RPC_EXCEPTION_TYPE_FAILED, reason) == 0) {
+        send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    s->aborted = true;
+    return -1;
+}
+
+/* Start a Return; releaseParamCaps keeps its default (true), as we never
+ * hold on to capabilities passed in params. */
+static int begin_return(capnp_builder_t *b, uint32_t answer_id, uint16_t which)
+{
+    int ret = begin_message(b, RPC_MESSAGE_WHICH_RETURN,
+                            RPC_RETURN_DATA_WORDS, RPC_RETURN_PTR_COUNT);
+    if (ret < 0) return -1;
+    capnp_write_le32(capnp_at(b, (size_t)ret + RPC_RETURN_ANSWER_ID), answer_id);
+    capnp_write_le16(capnp_at(b, (size_t)ret + RPC_RETURN_WHICH), which);
+    return ret;
+}
+
+/* Return results: built by `build`, or the capability `cap` (an export ID)
+ * if it is not RPC_NO_CAP. */
+static int send_results(rpc_session_t *s, uint32_t answer_id,
+                        rpc_build_fn build, void *arg, uint32_t cap)
+{
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int ret = begin_return(&b, answer_id, RPC_RETURN_WHICH_RESULTS);
+    int payload = ret < 0 ? -1 :
+        capnp_new_struct(&b, (size_t)ret + CAPNP_PTR(RPC_RETURN_DATA_WORDS,
+                                                     RPC_RETURN_RESULTS_PTR),
+                         RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_PTR_COUNT);
+    if (payload >= 0) {
+        size_t content = (size_t)payload +
+            CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_CONTENT_PTR);
+        if (cap != RPC_NO_CAP) {
+            capnp_write_cap_ptr(&b, content, 0);
+            int desc = capnp_new_struct_list(
+                &b, (size_t)payload + CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS,
+                                                RPC_PAYLOAD_CAP_TABLE_PTR),
+                1, RPC_CAP_DESCRIPTOR_DATA_WORDS, RPC_CAP_DESCRIPTOR_PTR_COUNT);
+            if (desc >= 0) {
+                capnp_write_le16(capnp_at(&b, (size_t)desc + RPC_CAP_DESCRIPTOR_WHICH),
+                       RPC_CAP_DESCRIPTOR_WHICH_SENDER_HOSTED);
+                capnp_write_le32(capnp_at(&b, (size_t)desc + RPC_CAP_DESCRIPTOR_SENDER_HOSTED),
+                       cap);
+                ok = 0;
+            }
+        } else {
+            ok = build ? build(&b, content, arg) : 0;
+        }
+    }
+    if (ok == 0) {
+        ok = send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    return ok;
+}
+
+static int send_exception(rpc_session_t *s, uint32_t answer_id,
+                          uint16_t type, const char *reason)
+{
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int ret = begin_return(&b, answer_id, RPC_RETURN_WHICH_EXCEPTION);
+    int exc = ret < 0 ? -1 :
+        capnp_new_struct(&b, (size_t)ret + CAPNP_PTR(RPC_RETURN_DATA_WORDS,
+                                                     RPC_RETURN_EXCEPTION_PTR),
+                         RPC_EXCEPTION_DATA_WORDS, RPC_EXCEPTION_PTR_COUNT);
+    if (exc >= 0 && write_exception(&b, exc, type, reason) == 0) {
+        ok = send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    return ok;
+}
+
+static int send_canceled(rpc_session_t *s, uint32_t answer_id)
+{
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = begin_return(&b, answer_id, RPC_RETURN_WHICH_CANCELED) < 0
+                 ? -1 : send_message(s, &b);
+    capnp_builder_free(&b);
+    return ok;
+}
+
+static int send_finish(rpc_session_t *s, uint32_t question_id,
+                       bool release_result_caps)
+{
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int fin = begin_message(&b, RPC_MESSAGE_WHICH_FINISH,
+                            RPC_FINISH_DATA_WORDS, RPC_FINISH_PTR_COUNT);
+    if (fin >= 0) {
+        uint8_t *p = capnp_at(&b, (size_t)fin);
+        capnp_write_le32(p + RPC_FINISH_QUESTION_ID, question_id);
+        /* Bools are stored XORed with their default (true) */
+        if (!release_result_caps) {
+            p[RPC_FINISH_RELEASE_RESULT_CAPS] |=
+                1 << RPC_FINISH_RELEASE_RESULT_CAPS_BIT;
+        }
+        ok = send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    return ok;
+}
+
+/*
+ * Send a message we do not handle back as Unimplemented.  Only the data
+ * section of its body is echoed (enough for the edge to match question
+ * and export IDs); its pointers are dropped.
+ */
+static int send_unimplemented(rpc_session_t *s, const capnp_reader_t *r,
+                              uint16_t which, const sref_t *body)
+{
+    ESP_LOGW(TAG, "unimplemented message type %u", which);
+    s->stats.unimplemented++;
+
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int inner = begin_message(&b, RPC_MESSAGE_WHICH_UNIMPLEMENTED,
+                              RPC_MESSAGE_DATA_WORDS, RPC_MESSAGE_PTR_COUNT);
+    if (inner >= 0) {
+        capnp_write_le16(capnp_at(&b, (size_t)inner + RPC_MESSAGE_WHICH), which);
+        int copy = body
+            ? capnp_new_struct(&b, (size_t)inner +
+                               CAPNP_PTR(RPC_MESSAGE_DATA_WORDS,
+                                         RPC_MESSAGE_CALL_PTR),
+                               body->dw, 0)
+            : 0;
+        if (copy >= 0) {
+            if (body) {
+                memcpy(capnp_at(&b, (size_t)copy), r->seg + body->off,
+                       (size_t)body->dw * 8);
+            }
+            ok = send_message(s, &b);
+        }
+    }
+    capnp_builder_free(&b);
+    return ok;
+}
+
+/* ────────────────────────────────────────────────────────────────
+ *  Answers: calls from the edge
+ * ──────────────────────────────────────────────────────────────── */
+
+static int handle_call(rpc_session_t *s, const uint8_t *msg, size_t len,
+                       const capnp_reader_t *r, const sref_t *call,
+                       answer_t *a);
+
+static void free_answer(answer_t *a)
+{
+    a->state = ANSWER_FREE;
+}
+
+static void unref_export(rpc_session_t *s, uint32_t id, uint32_t count)
+{
+    export_t *e = find_export(s, id);
+    if (e) {
+        e->refs = e->refs > count ? e->refs - count : 0;
+    }
+}
+
+/* Dispatch the calls queued on `answer_id` now that it has returned, in
+ * the order they arrived. */
+static void run_queued(rpc_session_t *s, uint32_t answer_id)
+{
+    size_t i = 0;
+    while (i < s->queued_count) {
+        if (s->queued[i].waits_on != answer_id) {
+            i++;
+            continue;
+        }
+        queued_t q = s->queued[i];
+        s->queued_count--;
+        memmove(&s->queued[i], &s->queued[i + 1],
+                (s->queued_count - i) * sizeof(queued_t));
+
+        capnp_reader_t r;
+        sref_t root, call;
+        answer_t *a = find_answer(s, q.answer_id);
+        if (a && capnp_read_message(q.msg, q.len, &r) == 0 &&
+            capnp_read_struct_ptr(&r, 0, &root.off, &root.dw, &root.pc) == 0 &&
+            get_struct(&r, &root, RPC_MESSAGE_CALL_PTR, &call) == 0) {
+            handle_call(s, q.msg, q.len, &r, &call, a);
+        }
+        mem_pool_put(s->mem, q.msg);
+        i = 0;                  /* Dispatch may have changed the queue */
+    }
+}
+
+/* Our Return for `a` is out. */
+static void answer_done(rpc_session_t *s, answer_t *a, bool failed, uint32_t cap)
+{
+    a->state = ANSWER_RETURNED;
+    a->failed = failed;
+    a->cap = cap;
+    uint32_t id = a->id;
+    bool finished = a->finished;
+
+    run_queued(s, id);
+    if (finished) {
+        free_answer(a);
+    }
+}
+
+static void answer_exception(rpc_session_t *s, answer_t *a, uint16_t type,
+                             const char *reason)
+{
+    ESP_LOGW(TAG, "call %" PRIu32 " failed: %s", a->id, reason);
+    send_exception(s, a->id, type, reason);
+    answer_done(s, a, true, RPC_NO_CAP);
+}
+
+/* Hold a call until `waits_on` returns.  Returns 0, or -1 if it cannot be
+ * held (the call then fails). */
+static int queue_call(rpc_session_t *s, answer_t *a, uint32_t waits_on,
+                      const uint8_t *msg, size_t len)
+{
+    if (s->queued_count == RPC_MAX_QUEUED) {
+        return -1;
+    }
+    uint8_t *copy = mem_pool_get(s->mem, len);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, msg, len);
+    s->queued[s->queued_count++] = (queued_t){
+        .answer_id = a->id, .waits_on = waits_on, .msg = copy, .len = len,
+    };
+    a->state = ANSWER_QUEUED;
+    s->stats.calls_queued++;
+    return 0;
+}
+
+/*
+ * Find the export a call's MessageTarget designates.  Returns 0 with
+ * *export_id, 1 with *waits_on if the target is the result of an answer
+ * still pending, or -1 with *reason.
+ */
+static int resolve_target(rpc_session_t *s, const capnp_reader_t *r,
+                          const sref_t *target, uint32_t *export_id,
+                          uint32_t *waits_on, const char **reason)
+{
+    if (get16(r, target, RPC_MESSAGE_TARGET_WHICH) ==
+        RPC_MESSAGE_TARGET_WHICH_IMPORTED_CAP) {
+        *export_id = get32(r, target, RPC_MESSAGE_TARGET_IMPORTED_CAP);
+        if (!find_export(s, *export_id)) {
+            *reason = "no such capability";
+            return -1;
+        }
+        return 0;
+    }
+
+    sref_t pa;
+    if (get_struct(r, target, RPC_MESSAGE_TARGET_PROMISED_ANSWER_PTR, &pa) != 0) {
+        *reason = "bad call target";
+        return -1;
+    }
+    answer_t *on = find_answer(s, get32(r, &pa, RPC_PROMISED_ANSWER_QUESTION_ID));
+    if (!on) {
+        *reason = "pipelined on an unknown question";
+        return -1;
+    }
+    if (on->state != ANSWER_RETURNED) {
+        *waits_on = on->id;
+        return 1;
+    }
+    if (on->failed) {
+        *reason = "pipelined on a failed call";
+        return -1;
+    }
+
+    /* Results are either a capability at the root or hold none, so any
+     * getPointerField op leads away from a capability. */
+    size_t first, stride;
+    uint32_t ops = 0;
+    uint16_t op_dw, op_pc;
+    if (RPC_PROMISED_ANSWER_TRANSFORM_PTR < pa.pc &&
+        capnp_read_struct_list(r, ptr_at(&pa, RPC_PROMISED_ANSWER_TRANSFORM_PTR),
+                               &first, &ops, &stride, &op_dw, &op_pc) != 0) {
+        *reason = "bad transform";
+        return -1;
+    }
+    for (uint32_t i = 0; i < ops; i++) {
+        sref_t op = { first + (size_t)i * stride, op_dw, op_pc };
+        if (get16(r, &op, RPC_PROMISED_ANSWER_OP_WHICH) !=
+            RPC_PROMISED_ANSWER_OP_WHICH_NOOP) {
+            on = NULL;
+            break;
+        }
+    }
+    if (!on || on->cap == RPC_NO_CAP) {
+        *reason = "pipelined on a result that is not a capability";
+        return -1;
+    }
+    *export_id = on->cap;
+    return 0;
+}
+
+/*
+ * A Call from the edge.  `a` is its answer when it comes back out of the
+ * queue, NULL when it has just arrived.
+ */
+static int handle_call(rpc_session_t *s, const uint8_t *msg, size_t len,
+                       const capnp_reader_t *r, const sref_t *call,
+                       answer_t *a)
+{
+    uint32_t answer_id = get32(r, call, RPC_CALL_QUESTION_ID);
+    if (!a) {
+        if (find_answer(s, answer_id)) {
+            return send_abort(s, "Call reuses a question ID in use");
+        }
+        a = new_answer(s, answer_id, ANSWER_PENDING);
+        if (!a) {
+            /* Untracked: the edge's Finish for it is ignored */
+            ESP_LOGW(TAG, "call %" PRIu32 " refused: answer table full", answer_id);
+            send_exception(s, answer_id, RPC_EXCEPTION_TYPE_OVERLOADED,
+                           "too many calls in flight");
+            return 0;
+        }
+    } else if (a->finished) {
+        send_canceled(s, answer_id);
+        answer_done(s, a, true, RPC_NO_CAP);
+        return 0;
+    }
+
+    sref_t target, payload;
+    if (get_struct(r, call, RPC_CALL_TARGET_PTR, &target) != 0 ||
+        get_struct(r, call, RPC_CALL_PARAMS_PTR, &payload) != 0 ||
+        payload.pc <= RPC_PAYLOAD_CONTENT_PTR) {
+        free_answer(a);
+        return send_abort(s, "malformed Call");
+    }
+    if (get16(r, call, RPC_CALL_SEND_RESULTS_TO_WHICH) !=
+        RPC_CALL_SEND_RESULTS_TO_WHICH_CALLER) {
+        answer_exception(s, a, RPC_EXCEPTION_TYPE_UNIMPLEMENTED,
+                         "results can only be sent to the caller");
+        return 0;
+    }
+
+    uint32_t export_id = 0, waits_on = 0;
+    const char *reason = NULL;
+    int res = resolve_target(s, r, &target, &export_id, &waits_on, &reason);
+    if (res > 0) {
+        if (queue_call(s, a, waits_on, msg, len) != 0) {
+            answer_exception(s, a, RPC_EXCEPTION_TYPE_OVERLOADED,
+                             "too many pipelined calls");
+        }
+        return 0;
+    }
+    if (res < 0) {
+        answer_exception(s, a, RPC_EXCEPTION_TYPE_FAILED, reason);
+        return 0;
+    }
+
+    rpc_call_t c = {
+        .answer_id = answer_id,
+        .interface_id = get64(r, call, RPC_CALL_INTERFACE_ID),
+        .method_id = get16(r, call, RPC_CALL_METHOD_ID),
+        .reader = r,
+        .params = ptr_at(&payload, RPC_PAYLOAD_CONTENT_PTR),
+    };
+    ESP_LOGD(TAG, "call %" PRIu32 ": %016" PRIx64 "@%u on export %" PRIu32,
+             answer_id, c.interface_id, c.method_id, export_id);
+
+    a->state = ANSWER_PENDING;
+    s->stats.calls_in++;
+    export_t *e = &s->exports[export_id];
+    rpc_dispatch_t d = e->dispatch(s, &c, e->arg);
+
+    /* The table does not move, but the handler may have answered */
+    if (a->state != ANSWER_PENDING || a->id != answer_id) {
+        return 0;
+    }
+    if (d == RPC_DISPATCH_UNIMPLEMENTED) {
+        char text[64];
+        snprintf(text, sizeof(text), "method %016" PRIx64 "@%u not implemented",
+                 c.interface_id, c.method_id);
+        s->stats.unimplemented++;
+        answer_exception(s, a, RPC_EXCEPTION_TYPE_UNIMPLEMENTED, text);
+    } else if (d == RPC_DISPATCH_DONE) {
+        answer_exception(s, a, RPC_EXCEPTION_TYPE_FAILED, "call not answered");
+    }
+    return 0;
+}
+
+static int handle_bootstrap(rpc_session_t *s, const capnp_reader_t *r,
+                            const sref_t *boot)
+{
+    uint32_t answer_id = get32(r, boot, RPC_BOOTSTRAP_QUESTION_ID);
+    if (find_answer(s, answer_id)) {
+        return send_abort(s, "Bootstrap reuses a question ID in use");
+    }
+    answer_t *a = new_answer(s, answer_id, ANSWER_PENDING);
+    if (!a) {
+        send_exception(s, answer_id, RPC_EXCEPTION_TYPE_OVERLOADED,
+                       "too many calls in flight");
+        return 0;
+    }
+    if (s->bootstrap == RPC_NO_CAP) {
+        answer_exception(s, a, RPC_EXCEPTION_TYPE_FAILED,
+                         "no bootstrap interface");
+        return 0;
+    }
+
+    ESP_LOGD(TAG, "bootstrap %" PRIu32 " -> export %" PRIu32,
+             answer_id, s->bootstrap);
+    if (send_results(s, answer_id, NULL, NULL, s->bootstrap) != 0) {
+        free_answer(a);
+        return -1;
+    }
+    s->exports[s->bootstrap].refs++;
+    answer_done(s, a, false, s->bootstrap);
+    return 0;
+}
+
+static int handle_finish(rpc_session_t *s, const capnp_reader_t *r,
+                         const sref_t *fin)
+{
+    uint32_t id = get32(r, fin, RPC_FINISH_QUESTION_ID);
+    bool release = get_bit(r, fin, RPC_FINISH_RELEASE_RESULT_CAPS,
+                           RPC_FINISH_RELEASE_RESULT_CAPS_BIT) !=
+                   RPC_FINISH_RELEASE_RESULT_CAPS_DEFAULT;
+
+    answer_t *a = find_answer(s, id);
+    if (!a) {
+        ESP_LOGW(TAG, "Finish for unknown answer %" PRIu32, id);
+        return 0;
+    }
+    if (a->state != ANSWER_RETURNED) {
+        /* Canceled: the Return still goes out, as "canceled" */
+        ESP_LOGD(TAG, "call %" PRIu32 " canceled", id);
+        a->finished = true;
+        return 0;
+    }
+    if (release && a->cap != RPC_NO_CAP) {
+        unref_export(s, a->cap, 1);
+    }
+    free_answer(a);
+    return 0;
+}
+
+static int handle_release(rpc_session_t *s, const capnp_reader_t *r,
+                          const sref_t *rel)
+{
+    uint32_t id = get32(r, rel, RPC_RELEASE_ID);
+    uint32_t count = get32(r, rel, RPC_RELEASE_REFERENCE_COUNT);
+    export_t *e = find_export(s, id);
+    if (!e || e->refs < count) {
+        return send_abort(s, "Release of a capability not held");
+    }
+    e->refs -= count;
+    return 0;
+}
+
+/* ────────────────────────────────────────────────────────────────
+ *  Questions: calls to the edge
+ * ──────────────────────────────────────────────────────────────── */
+
+/* Import the capabilities in a Payload's cap table; *cap gets the one
+ * `content` points at, if any. */
+static int import_caps(rpc_session_t *s, const capnp_reader_t *r,
+                       const sref_t *payload, size_t content, uint32_t *cap)
+{
+    size_t first = 0, stride = 0;
+    uint32_t count = 0;
+    uint16_t dw = 0, pc = 0;
+    if (RPC_PAYLOAD_CAP_TABLE_PTR < payload->pc &&
+        capnp_read_struct_list(r, ptr_at(payload, RPC_PAYLOAD_CAP_TABLE_PTR),
+                               &first, &count, &stride, &dw, &pc) != 0) {
+        return -1;
+    }
+    uint32_t index = 0;
+    bool has_index = capnp_read_cap_ptr(r, content, &index) == 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        sref_t desc = { first + (size_t)i * stride, dw, pc };
+        uint16_t which = get16(r, &desc, RPC_CAP_DESCRIPTOR_WHICH);
+        if (which != RPC_CAP_DESCRIPTOR_WHICH_SENDER_HOSTED &&
+            which != RPC_CAP_DESCRIPTOR_WHICH_SENDER_PROMISE) {
+            continue;           /* Ours, or none: nothing to hold */
+        }
+        uint32_t id = get32(r, &desc, RPC_CAP_DESCRIPTOR_SENDER_HOSTED);
+        if (add_import(s, id) != 0) {
+            ESP_LOGE(TAG, "import table full");
+            return -1;
+        }
+        if (has_index && index == i) {
+            *cap = id;
+        }
+    }
+    return 0;
+}
+
+static int handle_return(rpc_session_t *s, const capnp_reader_t *r,
+                         const sref_t *body)
+{
+    uint32_t id = get32(r, body, RPC_RETURN_ANSWER_ID);
+    if (id >= RPC_MAX_QUESTIONS || !s->questions[id].in_use) {
+        return send_abort(s, "Return for an unknown question");
+    }
+    question_t q = s->questions[id];
+
+    rpc_return_t ret = {
+        .which = get16(r, body, RPC_RETURN_WHICH),
+        .reader = r,
+        .cap = RPC_NO_CAP,
+        .reason = { "", 0 },
+    };
+    ESP_LOGD(TAG, "return %" PRIu32 ": type %u", id, ret.which);
+
+    /* Caps in the results are ours to keep only if someone takes them */
+    bool keep = q.done != NULL;
+    sref_t sub;
+    if (ret.which == RPC_RETURN_WHICH_RESULTS) {
+        if (get_struct(r, body, RPC_RETURN_RESULTS_PTR, &sub) != 0 ||
+            sub.pc <= RPC_PAYLOAD_CONTENT_PTR) {
+            return send_abort(s, "malformed Return");
+        }
+        ret.content = ptr_at(&sub, RPC_PAYLOAD_CONTENT_PTR);
+        if (keep && import_caps(s, r, &sub, ret.content, &ret.cap) != 0) {
+            return send_abort(s, "bad capability table");
+        }
+    } else if (ret.which == RPC_RETURN_WHICH_EXCEPTION &&
+               get_struct(r, body, RPC_RETURN_EXCEPTION_PTR, &sub) == 0) {
+        ret.reason = get_text(r, &sub, RPC_EXCEPTION_REASON_PTR);
+    }
+
+    if (q.done) {
+        q.done(s, &ret, q.arg);
+    }
+    int rc = 0;
+    if (!get_bit(r, body, RPC_RETURN_NO_FINISH_NEEDED,
+                 RPC_RETURN_NO_FINISH_NEEDED_BIT)) {
+        rc = send_finish(s, id, !keep);
+    }
+    s->questions[id].in_use = false;
+    return rc;
+}
+
+/* The edge did not understand a message of ours: a Call or Bootstrap it
+ * never answered fails as if it had returned an exception. */
+static int handle_unimplemented(rpc_session_t *s, const capnp_reader_t *r,
+                                const sref_t *inner)
+{
+    uint16_t which = get16(r, inner, RPC_MESSAGE_WHICH);
+    sref_t body;
+    if ((which != RPC_MESSAGE_WHICH_CALL && which != RPC_MESSAGE_WHICH_BOOTSTRAP) ||
+        get_struct(r, inner, RPC_MESSAGE_CALL_PTR, &body) != 0) {
+        ESP_LOGW(TAG, "edge does not implement message type %u", which);
+        return 0;
+    }
+
+    /* Call and Bootstrap both start with their question ID */
+    uint32_t id = get32(r, &body, RPC_CALL_QUESTION_ID);
+    if (id >= RPC_MAX_QUESTIONS || !s->questions[id].in_use) {
+        return 0;
+    }
+    question_t q = s->questions[id];
+    s->questions[id].in_use = false;
+    ESP_LOGW(TAG, "question %" PRIu32 ": not implemented by the edge", id);
+    if (q.done) {
+        rpc_return_t ret = {
+            .which = RPC_RETURN_WHICH_EXCEPTION,
+            .reader = r,
+            .cap = RPC_NO_CAP,
+            .reason = { "unimplemented", 13 },
+        };
+        q.done(s, &ret, q.arg);
+    }
+    return 0;
+}
+
+/* ────────────────────────────────────────────────────────────────
+ *  Public API
+ * ──────────────────────────────────────────────────────────────── */
+
+rpc_session_t *rpc_session_create(const rpc_transport_t *transport,
+                                  mem_pool_t *mem)
+{
+    rpc_session_t *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    s->transport = *transport;
+    s->mem = mem;
+    s->bootstrap = RPC_NO_CAP;
+    return s;
+}
+
+void rpc_session_destroy(rpc_session_t *s)
+{
+    if (!s) return;
+    for (size_t i = 0; i < s->queued_count; i++) {
+        mem_pool_put(s->mem, s->queued[i].msg);
+    }
+    free(s);
+}
+
+int rpc_session_export(rpc_session_t *s, rpc_dispatch_fn dispatch, void *arg)
+{
+    for (int i = 0; i < RPC_MAX_EXPORTS; i++) {
+        if (!s->exports[i].dispatch) {
+            s->exports[i] = (export_t){ .dispatch = dispatch, .arg = arg };
+            return i;
+        }
+    }
+    ESP_LOGE(TAG, "export table full");
+    return -1;
+}
+
+void rpc_session_set_bootstrap(rpc_session_t *s, uint32_t export_id)
+{
+    s->bootstrap = export_id;
+}
+
+int rpc_session_receive(rpc_session_t *s, const uint8_t *msg, size_t len)
+{
+    if (s->aborted) {
+        return -1;
+    }
+    s->stats.msgs_in++;
+    s->stats.bytes_in += len;
+
+    capnp_reader_t r;
+    sref_t root, body;
+    if (capnp_read_message(msg, len, &r) != 0 ||
+        capnp_read_struct_ptr(&r, 0, &root.off, &root.dw, &root.pc) != 0) {
+        return send_abort(s, "malformed message");
+    }
+    uint16_t which = get16(&r, &root, RPC_MESSAGE_WHICH);
+    bool has_body = get_struct(&r, &root, RPC_MESSAGE_CALL_PTR, &body) == 0;
+
+    if (which == RPC_MESSAGE_WHICH_ABORT) {
+        capnp_text_t reason = { "", 0 };
+        if (has_body) {
+            reason = get_text(&r, &body, RPC_EXCEPTION_REASON_PTR);
+        }
+        ESP_LOGE(TAG, "edge aborted the session: %.*s",
+                 (int)reason.len, reason.ptr);
+        s->aborted = true;
+        return -1;
+    }
+    if (!has_body) {
+        return which <= RPC_MESSAGE_WHICH_DISEMBARGO
+                   ? send_abort(s, "message without a body")
+                   : send_unimplemented(s, &r, which, NULL);
+    }
+
+    switch (which) {
+    case RPC_MESSAGE_WHICH_CALL:
+        return handle_call(s, msg, len, &r, &body, NULL);
+    case RPC_MESSAGE_WHICH_RETURN:
+        return handle_return(s, &r, &body);
+    case RPC_MESSAGE_WHICH_FINISH:
+        return handle_finish(s, &r, &body);
+    case RPC_MESSAGE_WHICH_RELEASE:
+        return handle_release(s, &r, &body);
+    case RPC_MESSAGE_WHICH_BOOTSTRAP:
+        return handle_bootstrap(s, &r, &body);
+    case RPC_MESSAGE_WHICH_UNIMPLEMENTED:
+        return handle_unimplemented(s, &r, &body);
+    default:
+        /* Resolve and Disembargo only follow promises we never export;
+         * the rest are three-party or obsolete. */
+        return send_unimplemented(s, &r, which, &body);
+    }
+}
+
+/* The pending answer `answer_id`, or NULL (logged). */
+static answer_t *pending_answer(rpc_session_t *s, uint32_t answer_id)
+{
+    answer_t *a = find_answer(s, answer_id);
+    if (!a || a->state != ANSWER_PENDING) {
+        ESP_LOGE(TAG, "no pending call %" PRIu32, answer_id);
+        return NULL;
+    }
+    return a;
+}
+
+int rpc_session_return(rpc_session_t *s, uint32_t answer_id,
+                       rpc_build_fn build, void *arg)
+{
+    answer_t *a = pending_answer(s, answer_id);
+    if (!a) {
+        return -1;
+    }
+    int ret = a->finished ? send_canceled(s, answer_id)
+                          : send_results(s, answer_id, build, arg, RPC_NO_CAP);
+    answer_done(s, a, ret != 0 || a->finished, RPC_NO_CAP);
+    return ret;
+}
+
+int rpc_session_return_exception(rpc_session_t *s, uint32_t answer_id,
+                                 uint16_t type, const char *reason)
+{
+    answer_t *a = pending_answer(s, answer_id);
+    if (!a) {
+        return -1;
+    }
+    int ret = a->finished ? send_canceled(s, answer_id)
+                          : send_exception(s, answer_id, type, reason);
+    answer_done(s, a, true, RPC_NO_CAP);
+    return ret;
+}
+
+int rpc_session_bootstrap(rpc_session_t *s, rpc_return_fn done, void *arg)
+{
+    int qid = new_question(s, done, arg);
+    if (qid < 0) {
+        return -1;
+    }
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int boot = begin_message(&b, RPC_MESSAGE_WHICH_BOOTSTRAP,
+                             RPC_BOOTSTRAP_DATA_WORDS, RPC_BOOTSTRAP_PTR_COUNT);
+    if (boot >= 0) {
+        capnp_write_le32(capnp_at(&b, (size_t)boot + RPC_BOOTSTRAP_QUESTION_ID),
+               (uint32_t)qid);
+        ok = send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    if (ok != 0) {
+        s->questions[qid].in_use = false;
+        return -1;
+    }
+    return qid;
+}
+
+static int write_target(capnp_builder_t *b, size_t ptr,
+                        const rpc_target_t *target)
+{
+    int mt = capnp_new_struct(b, ptr, RPC_MESSAGE_TARGET_DATA_WORDS,
+                              RPC_MESSAGE_TARGET_PTR_COUNT);
+    if (mt < 0) return -1;
+    if (!target->promised) {
+        capnp_write_le32(capnp_at(b, (size_t)mt + RPC_MESSAGE_TARGET_IMPORTED_CAP),
+               target->id);
+        return 0;
+    }
+    capnp_write_le16(capnp_at(b, (size_t)mt + RPC_MESSAGE_TARGET_WHICH),
+           RPC_MESSAGE_TARGET_WHICH_PROMISED_ANSWER);
+
+    /* The question's result itself: transform left empty */
+    int pa = capnp_new_struct(b, (size_t)mt +
+                              CAPNP_PTR(RPC_MESSAGE_TARGET_DATA_WORDS,
+                                        RPC_MESSAGE_TARGET_PROMISED_ANSWER_PTR),
+                              RPC_PROMISED_ANSWER_DATA_WORDS,
+                              RPC_PROMISED_ANSWER_PTR_COUNT);
+    if (pa < 0) return -1;
+    capnp_write_le32(capnp_at(b, (size_t)pa + RPC_PROMISED_ANSWER_QUESTION_ID), target->id);
+    return 0;
+}
+
+int rpc_session_call(rpc_session_t *s, const rpc_target_t *target,
+                     uint64_t interface_id, uint16_t method_id,
+                     rpc_build_fn build, void *build_arg,
+                     rpc_return_fn done, void *arg)
+{
+    if (target->promised
+            ? target->id >= RPC_MAX_QUESTIONS || !s->questions[target->id].in_use
+            : !find_import(s, target->id)) {
+        ESP_LOGE(TAG, "call on unknown %s %" PRIu32,
+                 target->promised ? "question" : "import", target->id);
+        return -1;
+    }
+    int qid = new_question(s, done, arg);
+    if (qid < 0) {
+        return -1;
+    }
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int call = begin_message(&b, RPC_MESSAGE_WHICH_CALL,
+                             RPC_CALL_DATA_WORDS, RPC_CALL_PTR_COUNT);
+    if (call >= 0) {
+        uint8_t *p = capnp_at(&b, (size_t)call);
+        capnp_write_le32(p + RPC_CALL_QUESTION_ID, (uint32_t)qid);
+        capnp_write_le16(p + RPC_CALL_METHOD_ID, method_id);
+        capnp_write_le64(p + RPC_CALL_INTERFACE_ID, interface_id);
+        /* sendResultsTo = caller (discriminant 0, already zero) */
+
+        int payload = -1;
+        if (write_target(&b, (size_t)call + CAPNP_PTR(RPC_CALL_DATA_WORDS,
+                                                      RPC_CALL_TARGET_PTR),
+                         target) == 0) {
+            payload = capnp_new_struct(&b, (size_t)call +
+                                       CAPNP_PTR(RPC_CALL_DATA_WORDS,
+                                                 RPC_CALL_PARAMS_PTR),
+                                       RPC_PAYLOAD_DATA_WORDS,
+                                       RPC_PAYLOAD_PTR_COUNT);
+        }
+        if (payload >= 0 &&
+            (!build || build(&b, (size_t)payload +
+                             CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS,
+                                       RPC_PAYLOAD_CONTENT_PTR),
+                             build_arg) == 0)) {
+            ok = send_message(s, &b);
+        }
+    }
+    size_t segs = b.seg_count;
+    capnp_builder_free(&b);
+    if (ok != 0) {
+        s->questions[qid].in_use = false;
+        return -1;
+    }
+    ESP_LOGD(TAG, "call %d: %016" PRIx64 "@%u (%zu segments)",
+             qid, interface_id, method_id, segs);
+    s->stats.calls_out++;
+    return qid;
+}
+
+int rpc_session_release(rpc_session_t *s, uint32_t import_id)
+{
+    import_t *im = find_import(s, import_id);
+    if (!im) {
+        return -1;
+    }
+    uint8_t work[RPC_WORK_SIZE];
+    capnp_builder_t b;
+    builder_init(s, &b, work);
+
+    int ok = -1;
+    int rel = begin_message(&b, RPC_MESSAGE_WHICH_RELEASE,
+                            RPC_RELEASE_DATA_WORDS, RPC_RELEASE_PTR_COUNT);
+    if (rel >= 0) {
+        uint8_t *p = capnp_at(&b, (size_t)rel);
+        capnp_write_le32(p + RPC_RELEASE_ID, import_id);
+        capnp_write_le32(p + RPC_RELEASE_REFERENCE_COUNT, im->refs);
+        ok = send_message(s, &b);
+    }
+    capnp_builder_free(&b);
+    im->in_use = false;
+    return ok;
+}
+
+void rpc_session_get_stats(const rpc_session_t *s, rpc_session_stats_t *stats)
+{
+    *stats = s->stats;
+}
@@ -0,0 +1,164 @@
+#pragma once
+/*
+ * Phase 4: Cap'n Proto RPC session on the control stream.
+ *
+ * The control stream carries a two-party Cap'n Proto RPC connection
+ * (https://capnproto.org/rpc.html) that lives as long as the QUIC
+ * connection.  Either side may call the other, so the session keeps the
+ * four tables of the protocol, all fixed-size:
+ *
+ *   questions  calls we made; freed once the Return is in and we have
+ *              sent Finish
+ *   answers    calls the edge made; freed once we have sent the Return
+ *              and the edge has sent Finish
+ *   exports    capabilities we host, with the edge's reference count
+ *   imports    capabilities the edge hosts that we hold
+ *
+ * Incoming Calls go to the dispatch function of the export they target.
+ * A dispatcher answers at once with rpc_session_return*(), or reports the
+ * call pending and answers later by answer ID (e.g. from the loop tick once
+ * a worker is done); it must never block the packet loop.  Calls the edge
+ * pipelines on an answer that is still pending are queued and dispatched
+ * when it resolves.  Calls we make may likewise target a question that has
+ * not returned yet.
+ *
+ * Messages we do not handle (Resolve, Disembargo, the three-party ones)
+ * are sent back as Unimplemented, as the protocol asks.  A malformed
+ * message or an Abort from the edge ends the session: rpc_session_receive()
+ * fails and the caller closes the connection.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "capnp_minimal.h"
+
+#define RPC_MAX_QUESTIONS 8
+#define RPC_MAX_ANSWERS   16
+#define RPC_MAX_EXPORTS   4
+#define RPC_MAX_IMPORTS   4
+#define RPC_MAX_QUEUED    8     /* Calls pipelined on pending answers */
+
+#define RPC_NO_CAP UINT32_MAX
+
+struct mem_pool;
+
+typedef struct rpc_session rpc_session_t;
+
+/* Where outgoing messages go.  Each message is encoded in place into
+ * `reserve(arg, len)` and then handed to `commit(arg, len)`; both return
+ * NULL / -1 on error. */
+typedef struct {
+    uint8_t *(*reserve)(void *arg, size_t len);
+    int (*commit)(void *arg, size_t len);
+    void *arg;
+} rpc_transport_t;
+
+/* Fill in a Payload's content: write the root struct of the params or
+ * results at pointer `content` of `b`.  Returns 0, or -1 on error. */
+typedef int (*rpc_build_fn)(capnp_builder_t *b, size_t content, void *arg);
+
+/* ── Calls from the edge ─────────────────────────────────────────── */
+
+/* An incoming call.  The reader points into the receive buffer and is
+ * only valid during dispatch: a pending call copies what it needs. */
+typedef struct {
+    uint32_t answer_id;
+    uint64_t interface_id;
+    uint16_t method_id;
+    const capnp_reader_t *reader;
+    size_t params;              /* Pointer to the params struct */
+} rpc_call_t;
+
+typedef enum {
+    RPC_DISPATCH_DONE,          /* Answered with rpc_session_return*() */
+    RPC_DISPATCH_PENDING,       /* Will be answered later by answer_id */
+    RPC_DISPATCH_UNIMPLEMENTED, /* Unknown interface or method */
+} rpc_dispatch_t;
+
+typedef rpc_dispatch_t (*rpc_dispatch_fn)(rpc_session_t *s,
+                                          const rpc_call_t *call, void *arg);
+
+/* ── Calls to the edge ───────────────────────────────────────────── */
+
+/* What a call is made on: a capability we imported, or the result of a
+ * question of ours (promise pipelining). */
+typedef struct {
+    bool promised;
+    uint32_t id;                /* Import ID, or question ID if promised */
+} rpc_target_t;
+
+/* A Return from the edge, valid only during the callback. */
+typedef struct {
+    uint16_t which;             /* RPC_RETURN_WHICH_* */
+    const capnp_reader_t *reader;
+    size_t content;             /* RESULTS: pointer to the content */
+    uint32_t cap;               /* RESULTS: content capability as an
+                                 * import ID, or RPC_NO_CAP */
+    capnp_text_t reason;        /* EXCEPTION: reason (may be empty) */
+} rpc_return_t;
+
+typedef void (*rpc_return_fn)(rpc_session_t *s, const rpc_return_t *ret,
+                              void *arg);
+
+typedef struct {
+    uint64_t msgs_in;
+    uint64_t msgs_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t calls_in;          /* Calls dispatched */
+    uint64_t calls_queued;      /* ... of which waited on a pending answer */
+    uint64_t calls_out;
+    uint64_t unimplemented;     /* Messages or methods we sent back */
+} rpc_session_stats_t;
+
+/* Create a session sending through `transport`, with queued calls held in
+ * `mem` (NULL = heap).  Returns NULL on OOM. */
+rpc_session_t *rpc_session_create(const rpc_transport_t *transport,
+                                  struct mem_pool *mem);
+
+/* Free the session and everything queued on it (NULL is ignored). */
+void rpc_session_destroy(rpc_session_t *s);
+
+/* Export a capability served by `dispatch`; returns its export ID, or -1
+ * if the table is full. */
+int rpc_session_export(rpc_session_t *s, rpc_dispatch_fn dispatch, void *arg);
+
+/* Make an export the one the edge gets when it sends Bootstrap. */
+void rpc_session_set_bootstrap(rpc_session_t *s, uint32_t export_id);
+
+/* Handle one complete message from the edge.  Returns 0, or -1 if the
+ * session is over (Abort received or sent). */
+int rpc_session_receive(rpc_session_t *s, const uint8_t *msg, size_t len);
+
+/* Answer call `answer_id` with results built by `build` (NULL = no
+ * content).  If the edge has canceled the call meanwhile, a canceled
+ * Return is sent instead.  Returns 0, or -1 on error. */
+int rpc_session_return(rpc_session_t *s, uint32_t answer_id,
+                       rpc_build_fn build, void *arg);
+
+/* Answer call `answer_id` with an exception of type `type`
+ * (RPC_EXCEPTION_TYPE_*).  Returns 0, or -1 on error. */
+int rpc_session_return_exception(rpc_session_t *s, uint32_t answer_id,
+                                 uint16_t type, const char *reason);
+
+/* Ask for the edge's bootstrap capability.  Returns the question ID, for
+ * pipelining calls on it, or -1 on error.  `done` may be NULL. */
+int rpc_session_bootstrap(rpc_session_t *s, rpc_return_fn done, void *arg);
+
+/* Call method `method_id` of `interface_id` on `target`, with params built
+ * by `build`.  Returns the question ID, or -1 on error.
+ *
+ * With a `done` callback, capabilities in the results are imported and the
+ * callback owns them (rpc_session_release()); without one the Return is
+ * dropped and the edge told to release them. */
+int rpc_session_call(rpc_session_t *s, const rpc_target_t *target,
+                     uint64_t interface_id, uint16_t method_id,
+                     rpc_build_fn build, void *build_arg,
+                     rpc_return_fn done, void *arg);
+
+/* Drop our reference to an imported capability. */
+int rpc_session_release(rpc_session_t *s, uint32_t import_id);
+
+/* Snapshot of the session's counters. */
+void rpc_session_get_stats(const rpc_session_t *s, rpc_session_stats_t *stats);
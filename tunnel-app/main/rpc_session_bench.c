@@ -0,0 +1,536 @@
+/*
+ * Host check and benchmark for rpc_session.c; not part of the firmware
+ * build.
+ *
+ * Plays the edge against one session over a loopback transport: what the
+ * session sends is captured and read back, and the edge's messages are
+ * fed to rpc_session_receive() as they would arrive on the control
+ * stream.  After a Bootstrap each way, it runs two cycles:
+ *
+ *   inbound   the edge calls our bootstrap export, the dispatcher returns
+ *             results at once, the edge sends Finish
+ *   outbound  we call the edge's bootstrap capability, the edge returns
+ *             results, the session sends Finish
+ *
+ * The first cycles are checked message by message.  After the timed run
+ * every table must still hold its full complement (RPC_MAX_ANSWERS calls
+ * pending at once, RPC_MAX_QUESTIONS questions out at once), and the
+ * session's counters must match the cycles run.  capnp_schema.h is
+ * generated from schema/ first:
+ *
+ *   python3 schema/capnp_gen.py -o capnp_schema.h \
+ *       schema/rpc.capnp:RPC schema/tunnelrpc.capnp:TUNNEL \
+ *       schema/quic_metadata_protocol.capnp:STREAM
+ *   cc -O2 -I. -Ihost rpc_session_bench.c rpc_session.c capnp_minimal.c \
+ *       cf_metadata.c mem_pool.c -lpthread && ./a.out
+ *
+ * Exits with 1 at the first mismatch.
+ */
+
+#include "rpc_session.h"
+#include "capnp_minimal.h"
+#include "capnp_schema.h"
+#include "mem_pool.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Cycles timed per direction */
+#define BENCH_CYCLES (2u * 1024 * 1024)
+
+/* Question IDs the edge cycles through, so answers are found in a
+ * table that is not always at the same slot */
+#define EDGE_IDS 64
+
+#define MSG_CAP 256
+
+/* An interface and method of neither schema, as far as the session is
+ * concerned: it only routes them */
+#define BENCH_INTERFACE 0xa3c5e1f2b4d60789ull
+#define BENCH_METHOD    3
+
+/* Export ID the edge hosts its bootstrap capability under */
+#define EDGE_EXPORT 7
+
+/* ── Loopback transport ──────────────────────────────────────────── */
+
+/* Keeps the last message the session sent, and counts them. */
+typedef struct {
+    uint8_t buf[4096];
+    size_t len;
+    uint64_t count;
+} loopback_t;
+
+static uint8_t *loopback_reserve(void *arg, size_t len)
+{
+    loopback_t *lb = arg;
+    return len <= sizeof(lb->buf) ? lb->buf : NULL;
+}
+
+static int loopback_commit(void *arg, size_t len)
+{
+    loopback_t *lb = arg;
+    lb->len = len;
+    lb->count++;
+    return 0;
+}
+
+/* ── Edge messages ───────────────────────────────────────────────── */
+
+typedef struct {
+    uint8_t data[MSG_CAP];
+    size_t len;
+} msg_t;
+
+/* Start a Message whose union member `which` is a struct of the given
+ * shape; returns the member's position, or -1. */
+static int edge_begin(capnp_builder_t *b, uint8_t *seg, uint16_t which,
+                      uint16_t data_words, uint16_t ptr_count)
+{
+    capnp_builder_init(b, seg, MSG_CAP);
+    if (capnp_alloc(b, 1) < 0) {
+        return -1;
+    }
+    int m = capnp_new_struct(b, 0, RPC_MESSAGE_DATA_WORDS, RPC_MESSAGE_PTR_COUNT);
+    if (m < 0) {
+        return -1;
+    }
+    capnp_write_le16(capnp_at(b, (size_t)m + RPC_MESSAGE_WHICH), which);
+    return capnp_new_struct(b, (size_t)m + CAPNP_PTR(RPC_MESSAGE_DATA_WORDS,
+                                                     RPC_MESSAGE_CALL_PTR),
+                            data_words, ptr_count);
+}
+
+static int edge_end(capnp_builder_t *b, int ok, msg_t *out)
+{
+    out->len = ok >= 0 ? capnp_finalize(b, out->data, sizeof(out->data)) : 0;
+    return out->len > 0 ? 0 : -1;
+}
+
+/* A one-word struct holding `value`, at pointer `ptr`: the params or
+ * results content. */
+static int write_content(capnp_builder_t *b, size_t ptr, uint64_t value)
+{
+    int st = capnp_new_struct(b, ptr, 1, 0);
+    if (st < 0) {
+        return -1;
+    }
+    capnp_write_le64(capnp_at(b, (size_t)st), value);
+    return 0;
+}
+
+static int edge_bootstrap(uint32_t qid, msg_t *out)
+{
+    uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    int boot = edge_begin(&b, seg, RPC_MESSAGE_WHICH_BOOTSTRAP,
+                          RPC_BOOTSTRAP_DATA_WORDS, RPC_BOOTSTRAP_PTR_COUNT);
+    if (boot >= 0) {
+        capnp_write_le32(capnp_at(&b, (size_t)boot + RPC_BOOTSTRAP_QUESTION_ID), qid);
+    }
+    return edge_end(&b, boot, out);
+}
+
+/* A Call on our export `export_id` with params { qid * 3 }. */
+static int edge_call(uint32_t qid, uint32_t export_id, msg_t *out)
+{
+    uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    int call = edge_begin(&b, seg, RPC_MESSAGE_WHICH_CALL,
+                          RPC_CALL_DATA_WORDS, RPC_CALL_PTR_COUNT);
+    int ok = -1;
+    if (call >= 0) {
+        uint8_t *p = capnp_at(&b, (size_t)call);
+        capnp_write_le32(p + RPC_CALL_QUESTION_ID, qid);
+        capnp_write_le16(p + RPC_CALL_METHOD_ID, BENCH_METHOD);
+        capnp_write_le64(p + RPC_CALL_INTERFACE_ID, BENCH_INTERFACE);
+        int mt = capnp_new_struct(&b, (size_t)call + CAPNP_PTR(RPC_CALL_DATA_WORDS,
+                                                               RPC_CALL_TARGET_PTR),
+                                  RPC_MESSAGE_TARGET_DATA_WORDS,
+                                  RPC_MESSAGE_TARGET_PTR_COUNT);
+        int payload = capnp_new_struct(&b, (size_t)call + CAPNP_PTR(RPC_CALL_DATA_WORDS,
+                                                                    RPC_CALL_PARAMS_PTR),
+                                       RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_PTR_COUNT);
+        if (mt >= 0 && payload >= 0) {
+            capnp_write_le32(capnp_at(&b, (size_t)mt + RPC_MESSAGE_TARGET_IMPORTED_CAP),
+                             export_id);
+            ok = write_content(&b, (size_t)payload +
+                               CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_CONTENT_PTR),
+                               (uint64_t)qid * 3);
+        }
+    }
+    return edge_end(&b, ok, out);
+}
+
+static int edge_finish(uint32_t qid, msg_t *out)
+{
+    uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    int fin = edge_begin(&b, seg, RPC_MESSAGE_WHICH_FINISH,
+                         RPC_FINISH_DATA_WORDS, RPC_FINISH_PTR_COUNT);
+    if (fin >= 0) {
+        capnp_write_le32(capnp_at(&b, (size_t)fin + RPC_FINISH_QUESTION_ID), qid);
+    }
+    return edge_end(&b, fin, out);
+}
+
+/* Results for our question `qid`: the edge's capability `cap` at the
+ * root, or { qid + 1 } for RPC_NO_CAP. */
+static int edge_return(uint32_t qid, uint32_t cap, msg_t *out)
+{
+    uint8_t seg[MSG_CAP];
+    capnp_builder_t b;
+    int ret = edge_begin(&b, seg, RPC_MESSAGE_WHICH_RETURN,
+                         RPC_RETURN_DATA_WORDS, RPC_RETURN_PTR_COUNT);
+    int ok = -1;
+    if (ret >= 0) {
+        capnp_write_le32(capnp_at(&b, (size_t)ret + RPC_RETURN_ANSWER_ID), qid);
+        int payload = capnp_new_struct(&b, (size_t)ret + CAPNP_PTR(RPC_RETURN_DATA_WORDS,
+                                                                   RPC_RETURN_RESULTS_PTR),
+                                       RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_PTR_COUNT);
+        size_t content = (size_t)payload +
+            CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS, RPC_PAYLOAD_CONTENT_PTR);
+        if (payload >= 0 && cap == RPC_NO_CAP) {
+            ok = write_content(&b, content, (uint64_t)qid + 1);
+        } else if (payload >= 0) {
+            capnp_write_cap_ptr(&b, content, 0);
+            int desc = capnp_new_struct_list(&b, (size_t)payload +
+                                             CAPNP_PTR(RPC_PAYLOAD_DATA_WORDS,
+                                                       RPC_PAYLOAD_CAP_TABLE_PTR),
+                                             1, RPC_CAP_DESCRIPTOR_DATA_WORDS,
+                                             RPC_CAP_DESCRIPTOR_PTR_COUNT);
+            if (desc >= 0) {
+                uint8_t *d = capnp_at(&b, (size_t)desc);
+                capnp_write_le16(d + RPC_CAP_DESCRIPTOR_WHICH,
+                                 RPC_CAP_DESCRIPTOR_WHICH_SENDER_HOSTED);
+                capnp_write_le32(d + RPC_CAP_DESCRIPTOR_SENDER_HOSTED, cap);
+                ok = 0;
+            }
+        }
+    }
+    return edge_end(&b, ok, out);
+}
+
+/* ── Our side ────────────────────────────────────────────────────── */
+
+typedef struct {
+    bool pend;                  /* Leave calls pending */
+    uint64_t calls;
+    uint64_t params_sum;
+    uint64_t returns;
+    uint64_t results_sum;
+    uint32_t import;            /* The edge's bootstrap capability */
+} bench_ctx_t;
+
+static int build_results(capnp_builder_t *b, size_t content, void *arg)
+{
+    return write_content(b, content, *(const uint32_t *)arg + 1);
+}
+
+static rpc_dispatch_t dispatch(rpc_session_t *s, const rpc_call_t *call, void *arg)
+{
+    bench_ctx_t *ctx = arg;
+    if (call->interface_id != BENCH_INTERFACE || call->method_id != BENCH_METHOD) {
+        return RPC_DISPATCH_UNIMPLEMENTED;
+    }
+    size_t st;
+    uint16_t dw, pc;
+    if (capnp_read_struct_ptr(call->reader, call->params, &st, &dw, &pc) == 0) {
+        ctx->params_sum += capnp_read_uint64(call->reader, st, 0);
+    }
+    ctx->calls++;
+    if (ctx->pend) {
+        return RPC_DISPATCH_PENDING;
+    }
+    rpc_session_return(s, call->answer_id, build_results, (void *)&call->answer_id);
+    return RPC_DISPATCH_DONE;
+}
+
+static void bootstrap_done(rpc_session_t *s, const rpc_return_t *ret, void *arg)
+{
+    bench_ctx_t *ctx = arg;
+    if (ret->which == RPC_RETURN_WHICH_RESULTS) {
+        ctx->import = ret->cap;
+    }
+}
+
+static void call_done(rpc_session_t *s, const rpc_return_t *ret, void *arg)
+{
+    bench_ctx_t *ctx = arg;
+    size_t st;
+    uint16_t dw, pc;
+    if (ret->which == RPC_RETURN_WHICH_RESULTS &&
+        capnp_read_struct_ptr(ret->reader, ret->content, &st, &dw, &pc) == 0) {
+        ctx->results_sum += capnp_read_uint64(ret->reader, st, 0);
+    }
+    ctx->returns++;
+}
+
+/* ── Checks ──────────────────────────────────────────────────────── */
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "FAIL %s\n", what);
+    return -1;
+}
+
+/* Union member of the last message the session sent, and its body. */
+static uint16_t sent(const loopback_t *lb, capnp_reader_t *r, size_t *body,
+                     uint16_t *dw, uint16_t *pc)
+{
+    size_t m;
+    uint16_t mdw, mpc;
+    if (capnp_read_message(lb->buf, lb->len, r) != 0 ||
+        capnp_read_struct_ptr(r, 0, &m, &mdw, &mpc) != 0 ||
+        capnp_read_struct_ptr(r, m + CAPNP_PTR(mdw, RPC_MESSAGE_CALL_PTR),
+                              body, dw, pc) != 0) {
+        return UINT16_MAX;
+    }
+    return capnp_read_uint16(r, m, RPC_MESSAGE_WHICH);
+}
+
+/* Value of the one-word results struct in the Return last sent. */
+static bool sent_results(const loopback_t *lb, uint32_t answer_id,
+                         uint64_t value)
+{
+    capnp_reader_t r;
+    size_t ret, payload, content;
+    uint16_t dw, pc, pdw, ppc, cdw, cpc;
+    return sent(lb, &r, &ret, &dw, &pc) == RPC_MESSAGE_WHICH_RETURN &&
+           capnp_read_uint32(&r, ret, RPC_RETURN_ANSWER_ID) == answer_id &&
+           capnp_read_uint16(&r, ret, RPC_RETURN_WHICH) == RPC_RETURN_WHICH_RESULTS &&
+           capnp_read_struct_ptr(&r, ret + CAPNP_PTR(dw, RPC_RETURN_RESULTS_PTR),
+                                 &payload, &pdw, &ppc) == 0 &&
+           capnp_read_struct_ptr(&r, payload + CAPNP_PTR(pdw, RPC_PAYLOAD_CONTENT_PTR),
+                                 &content, &cdw, &cpc) == 0 &&
+           capnp_read_uint64(&r, content, 0) == value;
+}
+
+static bool sent_finish(const loopback_t *lb, uint32_t qid)
+{
+    capnp_reader_t r;
+    size_t fin;
+    uint16_t dw, pc;
+    return sent(lb, &r, &fin, &dw, &pc) == RPC_MESSAGE_WHICH_FINISH &&
+           capnp_read_uint32(&r, fin, RPC_FINISH_QUESTION_ID) == qid;
+}
+
+/* Bootstrap both ways: the edge gets our export, we import the edge's. */
+static int setup(rpc_session_t *s, loopback_t *lb, bench_ctx_t *ctx,
+                 uint32_t *export_id)
+{
+    int id = rpc_session_export(s, dispatch, ctx);
+    if (id < 0) {
+        return fail("export");
+    }
+    rpc_session_set_bootstrap(s, (uint32_t)id);
+    *export_id = (uint32_t)id;
+
+    msg_t m;
+    capnp_reader_t r;
+    size_t body;
+    uint16_t dw, pc;
+    uint64_t before = lb->count;
+    if (edge_bootstrap(1000, &m) != 0 || rpc_session_receive(s, m.data, m.len) != 0 ||
+        lb->count != before + 1 ||
+        sent(lb, &r, &body, &dw, &pc) != RPC_MESSAGE_WHICH_RETURN ||
+        edge_finish(1000, &m) != 0 || rpc_session_receive(s, m.data, m.len) != 0 ||
+        lb->count != before + 1) {
+        return fail("edge bootstrap");
+    }
+
+    ctx->import = RPC_NO_CAP;
+    int qid = rpc_session_bootstrap(s, bootstrap_done, ctx);
+    if (qid < 0 || edge_return((uint32_t)qid, EDGE_EXPORT, &m) != 0 ||
+        rpc_session_receive(s, m.data, m.len) != 0 ||
+        ctx->import != EDGE_EXPORT || !sent_finish(lb, (uint32_t)qid)) {
+        return fail("our bootstrap");
+    }
+    return 0;
+}
+
+static int check_cycles(rpc_session_t *s, loopback_t *lb, bench_ctx_t *ctx,
+                        const msg_t *calls, const msg_t *finishes,
+                        const msg_t *returns)
+{
+    for (uint32_t i = 0; i < 2 * EDGE_IDS; i++) {
+        uint32_t qid = i % EDGE_IDS + 1;
+        uint64_t before = lb->count;
+        if (rpc_session_receive(s, calls[qid - 1].data, calls[qid - 1].len) != 0 ||
+            lb->count != before + 1 || !sent_results(lb, qid, qid + 1)) {
+            return fail("inbound Return");
+        }
+        if (rpc_session_receive(s, finishes[qid - 1].data, finishes[qid - 1].len) != 0 ||
+            lb->count != before + 1) {
+            return fail("inbound Finish");
+        }
+    }
+
+    rpc_target_t target = { .promised = false, .id = ctx->import };
+    for (uint32_t i = 0; i < 2 * EDGE_IDS; i++) {
+        uint64_t returns_before = ctx->returns;
+        int qid = rpc_session_call(s, &target, BENCH_INTERFACE, BENCH_METHOD,
+                                   NULL, NULL, call_done, ctx);
+        capnp_reader_t r;
+        size_t body;
+        uint16_t dw, pc;
+        if (qid < 0 || qid >= RPC_MAX_QUESTIONS ||
+            sent(lb, &r, &body, &dw, &pc) != RPC_MESSAGE_WHICH_CALL ||
+            capnp_read_uint32(&r, body, RPC_CALL_QUESTION_ID) != (uint32_t)qid) {
+            return fail("outbound Call");
+        }
+        if (rpc_session_receive(s, returns[qid].data, returns[qid].len) != 0 ||
+            ctx->returns != returns_before + 1 || !sent_finish(lb, (uint32_t)qid)) {
+            return fail("outbound Return");
+        }
+    }
+    return 0;
+}
+
+/* Every table slot is free again: fill the answer and question tables to
+ * the brim, then drain them. */
+static int check_tables(rpc_session_t *s, loopback_t *lb, bench_ctx_t *ctx,
+                        const msg_t *calls, const msg_t *finishes,
+                        const msg_t *returns)
+{
+    ctx->pend = true;
+    uint64_t before = lb->count;
+    for (uint32_t qid = 1; qid <= RPC_MAX_ANSWERS; qid++) {
+        if (rpc_session_receive(s, calls[qid - 1].data, calls[qid - 1].len) != 0) {
+            return fail("pending call");
+        }
+    }
+    if (lb->count != before) {
+        return fail("answer table short of RPC_MAX_ANSWERS");
+    }
+    ctx->pend = false;
+    for (uint32_t qid = 1; qid <= RPC_MAX_ANSWERS; qid++) {
+        if (rpc_session_return(s, qid, build_results, &qid) != 0 ||
+            !sent_results(lb, qid, qid + 1) ||
+            rpc_session_receive(s, finishes[qid - 1].data, finishes[qid - 1].len) != 0) {
+            return fail("drain answers");
+        }
+    }
+
+    rpc_target_t target = { .promised = false, .id = ctx->import };
+    for (int i = 0; i < RPC_MAX_QUESTIONS; i++) {
+        if (rpc_session_call(s, &target, BENCH_INTERFACE, BENCH_METHOD,
+                             NULL, NULL, call_done, ctx) != i) {
+            return fail("question table short of RPC_MAX_QUESTIONS");
+        }
+    }
+    for (int i = 0; i < RPC_MAX_QUESTIONS; i++) {
+        if (rpc_session_receive(s, returns[i].data, returns[i].len) != 0 ||
+            !sent_finish(lb, (uint32_t)i)) {
+            return fail("drain questions");
+        }
+    }
+    return 0;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double ns_per_cycle(double seconds)
+{
+    return seconds * 1e9 / (double)BENCH_CYCLES;
+}
+
+int main(void)
+{
+    static msg_t calls[EDGE_IDS], finishes[EDGE_IDS], returns[RPC_MAX_QUESTIONS];
+    static loopback_t lb;
+    bench_ctx_t ctx = { 0 };
+    rpc_transport_t tr = { loopback_reserve, loopback_commit, &lb };
+    mem_pool_t *mem = mem_pool_create();
+    rpc_session_t *s = mem ? rpc_session_create(&tr, mem) : NULL;
+    if (!s) {
+        return 1;
+    }
+
+    uint32_t export_id = 0;
+    int rc = setup(s, &lb, &ctx, &export_id);
+    for (uint32_t i = 0; i < EDGE_IDS && rc == 0; i++) {
+        if (edge_call(i + 1, export_id, &calls[i]) != 0 ||
+            edge_finish(i + 1, &finishes[i]) != 0) {
+            rc = fail("encode");
+        }
+    }
+    for (uint32_t i = 0; i < RPC_MAX_QUESTIONS && rc == 0; i++) {
+        if (edge_return(i, RPC_NO_CAP, &returns[i]) != 0) {
+            rc = fail("encode");
+        }
+    }
+    if (rc == 0) {
+        rc = check_cycles(s, &lb, &ctx, calls, finishes, returns);
+    }
+    if (rc == 0) {
+        printf("checks passed\n\n");
+    }
+
+    rpc_session_stats_t st0, st1;
+    rpc_session_get_stats(s, &st0);
+    bench_ctx_t c0 = ctx;
+    double t_in = 0, t_out = 0;
+    if (rc == 0) {
+        double t0 = now_s();
+        for (uint32_t i = 0; i < BENCH_CYCLES; i++) {
+            const msg_t *c = &calls[i % EDGE_IDS], *f = &finishes[i % EDGE_IDS];
+            if (rpc_session_receive(s, c->data, c->len) != 0 ||
+                rpc_session_receive(s, f->data, f->len) != 0) {
+                rc = fail("inbound cycle");
+                break;
+            }
+        }
+        t_in = now_s() - t0;
+    }
+    if (rc == 0) {
+        rpc_target_t target = { .promised = false, .id = ctx.import };
+        double t0 = now_s();
+        for (uint32_t i = 0; i < BENCH_CYCLES; i++) {
+            int qid = rpc_session_call(s, &target, BENCH_INTERFACE, BENCH_METHOD,
+                                       NULL, NULL, call_done, &ctx);
+            if (qid < 0 ||
+                rpc_session_receive(s, returns[qid].data, returns[qid].len) != 0) {
+                rc = fail("outbound cycle");
+                break;
+            }
+        }
+        t_out = now_s() - t0;
+    }
+
+    /* Each inbound cycle is 2 messages in and a Return out; each outbound
+     * one a Call out, a Return in and a Finish out. */
+    rpc_session_get_stats(s, &st1);
+    if (rc == 0 &&
+        (st1.calls_in - st0.calls_in != BENCH_CYCLES ||
+         st1.calls_out - st0.calls_out != BENCH_CYCLES ||
+         st1.msgs_in - st0.msgs_in != 3ull * BENCH_CYCLES ||
+         st1.msgs_out - st0.msgs_out != 3ull * BENCH_CYCLES ||
+         ctx.calls - c0.calls != BENCH_CYCLES ||
+         ctx.returns - c0.returns != BENCH_CYCLES)) {
+        rc = fail("session counters");
+    }
+    if (rc == 0) {
+        rc = check_tables(s, &lb, &ctx, calls, finishes, returns);
+    }
+    if (rc == 0) {
+        printf("inbound  Call -> Return -> Finish   %6.1f ns/cycle\n", ns_per_cycle(t_in));
+        printf("outbound Call -> Return -> Finish   %6.1f ns/cycle\n", ns_per_cycle(t_out));
+        printf("%u cycles each way; tables back to %d answers and %d questions\n",
+               BENCH_CYCLES, RPC_MAX_ANSWERS, RPC_MAX_QUESTIONS);
+    }
+
+    rpc_session_destroy(s);
+    mem_pool_destroy(mem);
+    return rc == 0 ? 0 : 1;
+}
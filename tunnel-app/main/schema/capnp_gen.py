@@ -0,0 +1,768 @@
+#!/usr/bin/env python3
+"""Generate a C header of Cap'n Proto struct layouts from .capnp schemas.
+
+    capnp_gen.py -o capnp_schema.h rpc.capnp:RPC tunnelrpc.capnp:TUNNEL ...
+
+Each input is a schema file and the prefix for its macros.  Only the part
+of the schema language used by the files in this directory is parsed:
+structs, groups, named and unnamed unions, enums, interfaces (methods get
+implicit Params / Results structs), `using` aliases and List(T).  No
+imports, generics, constants or annotations.
+
+Layouts follow the reference compiler (capnp's node-translator.c++): fields
+are placed in ordinal order, each into the smallest hole that fits or a
+new word, union members share space and a union's discriminant is placed
+when its second member is.  Type IDs are derived from the file ID the same
+way, so interface IDs match those of capnp-generated code.
+
+For a struct Foo in a file with prefix P the header defines:
+
+    P_FOO_DATA_WORDS, P_FOO_PTR_COUNT   struct shape
+    P_FOO_FIELD                         data field: byte offset
+    P_FOO_FLAG, P_FOO_FLAG_BIT          Bool: byte offset, bit in that byte
+    P_FOO_NAME_PTR                      pointer field: pointer index
+    P_FOO_FIELD_DEFAULT                 non-zero default (XOR-encoded)
+    P_FOO_WHICH                         union discriminant: byte offset
+    P_FOO_WHICH_MEMBER                  discriminant value of a member
+
+Members of groups and named unions are prefixed with the group name
+(P_CALL_SEND_RESULTS_TO_WHICH_CALLER).  Enumerants are P_ENUM_VALUE,
+interfaces P_IFACE_ID and P_IFACE_METHOD (the method ordinal), and method
+parameters are the structs P_METHOD_PARAMS / P_METHOD_RESULTS.
+"""
+
+import argparse
+import hashlib
+import re
+import struct
+import sys
+import textwrap
+
+# ── Tokenizer ────────────────────────────────────────────────────
+
+TOKEN = re.compile(r"""
+    (?P<ws>\s+|\#[^\n]*)
+  | (?P<num>-?0x[0-9a-fA-F]+|-?[0-9]+)
+  | (?P<ident>[A-Za-z_][A-Za-z0-9_]*)
+  | (?P<arrow>->)
+  | (?P<punct>[@:;{}()=,.])
+""", re.VERBOSE)
+
+
+class SchemaError(Exception):
+    pass
+
+
+def tokenize(text, path):
+    toks, pos, line = [], 0, 1
+    while pos < len(text):
+        m = TOKEN.match(text, pos)
+        if not m:
+            raise SchemaError(f"{path}:{line}: unexpected {text[pos]!r}")
+        if m.lastgroup != "ws":
+            toks.append((m.group(), line))
+        line += m.group().count("\n")
+        pos = m.end()
+    return toks
+
+
+# ── Schema tree ──────────────────────────────────────────────────
+
+class Field:
+    def __init__(self, name, ordinal, type_, default):
+        self.name, self.ordinal, self.type = name, ordinal, type_
+        self.default = default
+
+
+class Union:
+    """A union's members are Fields and Groups."""
+    def __init__(self, name):
+        self.name, self.members = name, []
+
+
+class Group:
+    """Fields sharing their parent's layout under a name.  A named union
+    is a Group holding one unnamed Union."""
+    def __init__(self, name):
+        self.name, self.members = name, []
+
+
+class Struct:
+    def __init__(self, name, parent, id_=None):
+        self.name, self.parent, self.id = name, parent, id_
+        self.members, self.nested = [], {}
+
+
+class Enum:
+    def __init__(self, name, parent, id_=None):
+        self.name, self.parent, self.id = name, parent, id_
+        self.values, self.nested = [], {}
+
+
+class Interface:
+    def __init__(self, name, parent, id_=None):
+        self.name, self.parent, self.id = name, parent, id_
+        self.methods, self.nested = [], {}
+
+
+class Alias:
+    def __init__(self, name, parent, target):
+        self.name, self.parent, self.target = name, parent, target
+        self.nested = {}
+
+
+class File:
+    def __init__(self, path, prefix):
+        self.path, self.prefix = path, prefix
+        self.id, self.nested, self.parent, self.name = None, {}, None, ""
+
+
+class Parser:
+    def __init__(self, toks, path):
+        self.toks, self.i, self.path = toks, 0, path
+
+    def error(self, msg):
+        line = self.toks[min(self.i, len(self.toks) - 1)][1] if self.toks else 0
+        raise SchemaError(f"{self.path}:{line}: {msg}")
+
+    def peek(self, k=0):
+        j = self.i + k
+        return self.toks[j][0] if j < len(self.toks) else None
+
+    def take(self, want=None):
+        tok = self.peek()
+        if tok is None or (want is not None and tok != want):
+            self.error(f"expected {want or 'token'}, got {tok!r}")
+        self.i += 1
+        return tok
+
+    def ident(self):
+        tok = self.take()
+        if not re.match(r"[A-Za-z_]", tok):
+            self.error(f"expected a name, got {tok!r}")
+        return tok
+
+    def number(self):
+        tok = self.take()
+        try:
+            return int(tok, 0)
+        except ValueError:
+            self.error(f"expected a number, got {tok!r}")
+
+    def opt_id(self):
+        if self.peek() == "@":
+            self.take()
+            return self.number()
+        return None
+
+    def type_(self):
+        name = self.ident()
+        while self.peek() == ".":
+            self.take()
+            name += "." + self.ident()
+        if self.peek() == "(":
+            self.take()
+            arg = self.type_()
+            self.take(")")
+            if name != "List":
+                self.error(f"generic {name} is not supported")
+            return ("List", arg)
+        return name
+
+    def value(self):
+        tok = self.take()
+        if re.match(r"-?[0-9]", tok):
+            return int(tok, 0)
+        return tok                      # true / false / an enumerant
+
+    def file(self, f):
+        f.id = self.opt_id()
+        self.take(";")
+        if f.id is None:
+            self.error("missing file ID")
+        while self.peek() is not None:
+            self.decl(f)
+
+    def add(self, scope, node):
+        if node.name in scope.nested:
+            self.error(f"duplicate declaration {node.name}")
+        scope.nested[node.name] = node
+
+    def decl(self, scope):
+        kw = self.take()
+        if kw == "using":
+            name = self.ident()
+            self.take("=")
+            self.add(scope, Alias(name, scope, self.type_()))
+            self.take(";")
+        elif kw == "struct":
+            s = Struct(self.ident(), scope)
+            s.id = self.opt_id()
+            self.add(scope, s)
+            self.take("{")
+            self.members(s, s.members)
+        elif kw == "enum":
+            e = Enum(self.ident(), scope)
+            e.id = self.opt_id()
+            self.add(scope, e)
+            self.take("{")
+            while self.peek() != "}":
+                name = self.ident()
+                self.take("@")
+                e.values.append((name, self.number()))
+                self.take(";")
+            self.take("}")
+        elif kw == "interface":
+            it = Interface(self.ident(), scope)
+            it.id = self.opt_id()
+            if self.peek() == "extends":
+                self.error("interface inheritance is not supported")
+            self.add(scope, it)
+            self.take("{")
+            while self.peek() != "}":
+                if self.peek() in ("struct", "enum", "interface", "using"):
+                    self.decl(it)
+                else:
+                    self.method(it)
+            self.take("}")
+        else:
+            self.i -= 1
+            self.error(f"unexpected {kw!r}")
+
+    def params(self, owner, name):
+        s = Struct(name, owner)
+        self.take("(")
+        ordinal = 0
+        while self.peek() != ")":
+            fname = self.ident()
+            self.take(":")
+            ftype = self.type_()
+            default = None
+            if self.peek() == "=":
+                self.take()
+                default = self.value()
+            s.members.append(Field(fname, ordinal, ftype, default))
+            ordinal += 1
+            if self.peek() == ",":
+                self.take()
+        self.take(")")
+        return s
+
+    def method(self, it):
+        name = self.ident()
+        self.take("@")
+        ordinal = self.number()
+        cap = name[0].upper() + name[1:]
+        params = self.params(it, cap + "Params")
+        results = Struct(cap + "Results", it)
+        if self.peek() == "->":
+            self.take()
+            results = self.params(it, cap + "Results")
+        self.take(";")
+        it.methods.append((name, ordinal, params, results))
+
+    def members(self, s, out):
+        """Members of a struct, group or union body up to the closing '}'."""
+        while self.peek() != "}":
+            tok = self.peek()
+            if tok in ("struct", "enum", "interface", "using"):
+                self.decl(s)
+            elif tok == "union":
+                self.take()
+                u = Union(None)
+                self.take("{")
+                self.members(s, u.members)
+                out.append(u)
+            else:
+                name = self.ident()
+                if self.peek() == "@":
+                    self.take()
+                    ordinal = self.number()
+                    self.take(":")
+                    ftype = self.type_()
+                    default = None
+                    if self.peek() == "=":
+                        self.take()
+                        default = self.value()
+                    self.take(";")
+                    out.append(Field(name, ordinal, ftype, default))
+                else:
+                    self.take(":")
+                    kind = self.take()
+                    if kind not in ("union", "group"):
+                        self.error(f"field {name} has no ordinal")
+                    g = Group(name)
+                    self.take("{")
+                    if kind == "union":
+                        u = Union(None)
+                        self.members(s, u.members)
+                        g.members.append(u)
+                    else:
+                        self.members(s, g.members)
+                    out.append(g)
+        self.take("}")
+
+
+# ── Types ────────────────────────────────────────────────────────
+
+LG_SIZES = {
+    "Bool": 0, "Int8": 3, "UInt8": 3, "Int16": 4, "UInt16": 4,
+    "Int32": 5, "UInt32": 5, "Float32": 5,
+    "Int64": 6, "UInt64": 6, "Float64": 6,
+}
+POINTERS = {"Text", "Data", "AnyPointer"}
+
+
+def lookup(scope, name):
+    """Resolve a (possibly dotted) type name from `scope` outwards."""
+    head, *rest = name.split(".")
+    while scope is not None:
+        if head in scope.nested:
+            node = scope.nested[head]
+            for part in rest:
+                node = node.nested[part]
+            return node
+        scope = scope.parent
+    raise SchemaError(f"unknown type {name}")
+
+
+def resolve(scope, t):
+    """Returns ('void' | 'data' | 'ptr', lg size or None, Enum or None)."""
+    if isinstance(t, tuple) or t in POINTERS:
+        return "ptr", None, None
+    if t == "Void":
+        return "void", None, None
+    if t in LG_SIZES:
+        return "data", LG_SIZES[t], None
+    node = lookup(scope, t)
+    if isinstance(node, Alias):
+        return resolve(node.parent, node.target)
+    if isinstance(node, Enum):
+        return "data", 4, node
+    return "ptr", None, None
+
+
+# ── Layout (after capnp's node-translator.c++) ───────────────────
+
+class HoleSet:
+    """Free space in a word-aligned area: holes[lg] is the offset, in units
+    of 2^lg bits, of a free slot of that size (0 = none)."""
+    def __init__(self):
+        self.holes = [0] * 6
+
+    def try_allocate(self, lg):
+        if lg >= 6:
+            return None
+        if self.holes[lg]:
+            r, self.holes[lg] = self.holes[lg], 0
+            return r
+        nxt = self.try_allocate(lg + 1)
+        if nxt is None:
+            return None
+        self.holes[lg] = nxt * 2 + 1
+        return nxt * 2
+
+    def add_holes_at_end(self, lg, offset, limit=6):
+        while lg < limit:
+            self.holes[lg] = offset
+            lg += 1
+            offset = (offset + 1) // 2
+
+    def try_expand(self, lg, offset, factor):
+        if factor == 0:
+            return True
+        if lg >= 6 or self.holes[lg] != offset + 1:
+            return False
+        if self.try_expand(lg + 1, offset >> 1, factor - 1):
+            self.holes[lg] = 0
+            return True
+        return False
+
+    def smallest_at_least(self, lg):
+        for i in range(lg, 6):
+            if self.holes[i]:
+                return i
+        return None
+
+
+class Top:
+    def __init__(self):
+        self.data_words, self.ptr_count, self.holes = 0, 0, HoleSet()
+
+    def add_data(self, lg):
+        hole = self.holes.try_allocate(lg)
+        if hole is not None:
+            return hole
+        offset = self.data_words << (6 - lg)
+        self.data_words += 1
+        self.holes.add_holes_at_end(lg, offset + 1)
+        return offset
+
+    def add_pointer(self):
+        self.ptr_count += 1
+        return self.ptr_count - 1
+
+    def add_void(self):
+        pass
+
+    def try_expand_data(self, lg, offset, factor):
+        return self.holes.try_expand(lg, offset, factor)
+
+
+class DataLocation:
+    def __init__(self, lg, offset):
+        self.lg, self.offset = lg, offset
+
+    def try_expand_to(self, union, lg):
+        if lg <= self.lg:
+            return True
+        if union.parent.try_expand_data(self.lg, self.offset, lg - self.lg):
+            self.offset >>= lg - self.lg
+            self.lg = lg
+            return True
+        return False
+
+
+class UnionLayout:
+    def __init__(self, parent):
+        self.parent, self.groups, self.which = parent, 0, None
+        self.data, self.ptrs = [], []
+
+    def add_data_location(self, lg):
+        offset = self.parent.add_data(lg)
+        self.data.append(DataLocation(lg, offset))
+        return offset
+
+    def add_pointer_location(self):
+        self.ptrs.append(self.parent.add_pointer())
+        return self.ptrs[-1]
+
+    def new_group_member(self):
+        self.groups += 1
+        if self.groups == 2 and self.which is None:
+            self.which = self.parent.add_data(4)
+
+
+class Usage:
+    """How one union member uses one of the union's data locations."""
+    def __init__(self, lg=None):
+        self.used, self.lg_used, self.holes = lg is not None, lg, HoleSet()
+
+    def smallest_hole_at_least(self, loc, lg):
+        if not self.used:
+            return loc.lg if lg <= loc.lg else None
+        if lg >= self.lg_used:
+            return lg if lg < loc.lg else None
+        hole = self.holes.smallest_at_least(lg)
+        if hole is not None:
+            return hole
+        return self.lg_used if self.lg_used < loc.lg else None
+
+    def base(self, loc, lg):
+        return loc.offset << (loc.lg - lg)
+
+    def allocate_from_hole(self, group, loc, lg):
+        if not self.used:
+            self.used, self.lg_used = True, lg
+            return self.base(loc, lg)
+        if lg >= self.lg_used:
+            self.try_expand_usage(group, loc, lg + 1, True)
+        else:
+            hole = self.holes.try_allocate(lg)
+            if hole is not None:
+                return self.base(loc, lg) + hole
+            self.try_expand_usage(group, loc, self.lg_used + 1, True)
+        return self.base(loc, lg) + self.holes.try_allocate(lg)
+
+    def try_allocate_by_expanding(self, group, loc, lg):
+        if not self.used:
+            if not loc.try_expand_to(group.parent, lg):
+                return None
+            self.used, self.lg_used = True, lg
+            return self.base(loc, lg)
+        if not self.try_expand_usage(group, loc, max(self.lg_used, lg) + 1, True):
+            return None
+        return self.base(loc, lg) + self.holes.try_allocate(lg)
+
+    def try_expand_usage(self, group, loc, want, new_holes):
+        if want > loc.lg and not loc.try_expand_to(group.parent, want):
+            return False
+        if new_holes:
+            self.holes.add_holes_at_end(self.lg_used, 1, want)
+        self.lg_used = want
+        return True
+
+    def try_expand(self, group, loc, lg, offset, factor):
+        if offset == 0 and self.lg_used == lg:
+            return self.try_expand_usage(group, loc, lg + factor, False)
+        return self.holes.try_expand(lg, offset, factor)
+
+
+class GroupLayout:
+    """One member of a union (a single field or a group of fields)."""
+    def __init__(self, parent):
+        self.parent, self.has_members = parent, False
+        self.usage, self.ptrs_used = [], 0
+
+    def add_member(self):
+        if not self.has_members:
+            self.has_members = True
+            self.parent.new_group_member()
+
+    def add_void(self):
+        self.add_member()
+
+    def add_data(self, lg):
+        self.add_member()
+        locs = self.parent.data
+        while len(self.usage) < len(locs):
+            self.usage.append(Usage())
+        best, best_size = None, 99
+        for i, loc in enumerate(locs):
+            size = self.usage[i].smallest_hole_at_least(loc, lg)
+            if size is not None and size < best_size:
+                best, best_size = i, size
+        if best is not None:
+            return self.usage[best].allocate_from_hole(self, locs[best], lg)
+        for i, loc in enumerate(locs):
+            r = self.usage[i].try_allocate_by_expanding(self, loc, lg)
+            if r is not None:
+                return r
+        offset = self.parent.add_data_location(lg)
+        self.usage.append(Usage(lg))
+        return offset
+
+    def add_pointer(self):
+        self.add_member()
+        self.ptrs_used += 1
+        if self.ptrs_used <= len(self.parent.ptrs):
+            return self.parent.ptrs[self.ptrs_used - 1]
+        return self.parent.add_pointer_location()
+
+    def try_expand_data(self, lg, offset, factor):
+        for i, loc in enumerate(self.parent.data[:len(self.usage)]):
+            if loc.lg >= lg and offset >> (loc.lg - lg) == loc.offset:
+                local = offset - (loc.offset << (loc.lg - lg))
+                return self.usage[i].try_expand(self, loc, lg, local, factor)
+        raise SchemaError("expanding a field that was never allocated")
+
+
+def min_ordinal(member):
+    if isinstance(member, Field):
+        return member.ordinal
+    return min(min_ordinal(m) for m in member.members)
+
+
+class Layout:
+    """Computed layout of one struct."""
+    def __init__(self, s):
+        self.struct = s
+        self.top = Top()
+        self.fields = []     # (path, Field, kind, offset, lg, enum)
+        self.unions = []     # (path, UnionLayout, [(member path, value)])
+        pending = []         # (Field, layout, path)
+        self.collect(s.members, self.top, (), pending)
+        for f, lay, path in sorted(pending, key=lambda p: p[0].ordinal):
+            kind, lg, enum = resolve(s, f.type)
+            if kind == "void":
+                lay.add_void()
+                offset = None
+            elif kind == "data":
+                offset = lay.add_data(lg)
+            else:
+                offset = lay.add_pointer()
+            self.fields.append((path, f, kind, offset, lg, enum))
+        self.fields.sort(key=lambda x: x[1].ordinal)
+
+    def collect(self, members, lay, path, pending):
+        for m in members:
+            if isinstance(m, Field):
+                pending.append((m, lay, path + (m.name,)))
+            elif isinstance(m, Group):
+                self.collect(m.members, lay, path + (m.name,), pending)
+            else:
+                ul = UnionLayout(lay)
+                order = sorted(m.members, key=min_ordinal)
+                self.unions.append((path, ul, [(path + (x.name,), i)
+                                               for i, x in enumerate(order)]))
+                for x in m.members:
+                    sub = GroupLayout(ul)
+                    if isinstance(x, Field):
+                        pending.append((x, sub, path + (x.name,)))
+                    else:
+                        self.collect(x.members, sub, path + (x.name,), pending)
+
+
+# ── Type IDs ─────────────────────────────────────────────────────
+
+def child_id(parent_id, name):
+    """capnp's generateChildId(): MD5 of the parent ID and the name."""
+    digest = hashlib.md5(struct.pack("<Q", parent_id) + name.encode()).digest()
+    return int.from_bytes(digest[:8], "big") | (1 << 63)
+
+
+def node_id(node):
+    if node.id is not None:
+        return node.id
+    return child_id(node_id(node.parent), node.name)
+
+
+# ── Output ───────────────────────────────────────────────────────
+
+def upper(name):
+    name = re.sub(r"([a-z0-9])([A-Z])", r"\1_\2", name)
+    name = re.sub(r"([A-Z]+)([A-Z][a-z])", r"\1_\2", name)
+    return name.upper()
+
+
+def type_name(t):
+    return f"List({type_name(t[1])})" if isinstance(t, tuple) else t
+
+
+class Writer:
+    def __init__(self):
+        self.lines, self.names = [], {}
+
+    def define(self, name, value, comment=None):
+        if name in self.names:
+            raise SchemaError(f"{name} defined twice ({self.names[name]})")
+        self.names[name] = comment or value
+        line = f"#define {name:<48} {value}"
+        if comment:
+            line = f"{line:<64} /* {comment} */"
+        self.lines.append(line.rstrip())
+
+    def blank(self):
+        self.lines.append("")
+
+    def comment(self, text):
+        self.lines.append(f"/* {text} */")
+
+
+def default_value(f, enum):
+    d = f.default
+    if d is None or d == "false" or d == 0:
+        return None
+    if d == "true":
+        return 1
+    if isinstance(d, str):
+        if enum is None:
+            raise SchemaError(f"bad default {d} for {f.name}")
+        return dict(enum.values)[d]
+    return d
+
+
+def emit_struct(w, prefix, name, s, display):
+    lay = Layout(s)
+    p = f"{prefix}_{name}"
+    w.comment(f"struct {display}")
+    w.define(f"{p}_DATA_WORDS", lay.top.data_words)
+    w.define(f"{p}_PTR_COUNT", lay.top.ptr_count)
+    for path, f, kind, offset, lg, enum in lay.fields:
+        fp = "_".join([p] + [upper(x) for x in path])
+        desc = f"@{f.ordinal} {type_name(f.type)}"
+        if kind == "ptr":
+            w.define(f"{fp}_PTR", offset, desc)
+        elif kind == "data" and lg == 0:
+            w.define(fp, offset // 8, desc)
+            w.define(f"{fp}_BIT", offset % 8)
+        elif kind == "data":
+            w.define(fp, (offset << lg) // 8, desc)
+        if kind == "data":
+            d = default_value(f, enum)
+            if d is not None:
+                w.define(f"{fp}_DEFAULT", d)
+    for path, ul, members in lay.unions:
+        up = "_".join([p] + [upper(x) for x in path])
+        w.define(f"{up}_WHICH", ul.which * 2, "union discriminant, UInt16")
+        for mpath, value in members:
+            w.define(f"{up}_WHICH_{upper(mpath[-1])}", value)
+    w.blank()
+    for n in s.nested.values():
+        emit_node(w, prefix, f"{name}_{upper(n.name)}", n,
+                  f"{display}.{n.name}")
+
+
+def emit_node(w, prefix, name, node, display):
+    if isinstance(node, Struct):
+        emit_struct(w, prefix, name, node, display)
+    elif isinstance(node, Enum):
+        w.comment(f"enum {display}")
+        for v, ordinal in node.values:
+            w.define(f"{prefix}_{name}_{upper(v)}", ordinal)
+        w.blank()
+    elif isinstance(node, Interface):
+        w.comment(f"interface {display}")
+        w.define(f"{prefix}_{name}_ID", f"0x{node_id(node):016x}ULL")
+        for m, ordinal, _, _ in node.methods:
+            w.define(f"{prefix}_{name}_{upper(m)}", ordinal)
+        w.blank()
+        for m, _, params, results in node.methods:
+            emit_struct(w, prefix, upper(params.name), params,
+                        f"{display}.{m} params")
+            emit_struct(w, prefix, upper(results.name), results,
+                        f"{display}.{m} results")
+        for n in node.nested.values():
+            emit_node(w, prefix, f"{name}_{upper(n.name)}", n,
+                      f"{display}.{n.name}")
+
+
+def generate(files):
+    w = Writer()
+    for f in files:
+        w.lines.append(f"/* ── {f.path.rsplit('/', 1)[-1]} "
+                       + "─" * max(4, 60 - len(f.path.rsplit('/', 1)[-1])) + " */")
+        w.blank()
+        for n in f.nested.values():
+            if not isinstance(n, Alias):
+                emit_node(w, f.prefix, upper(n.name), n, n.name)
+    sources = ", ".join(f.path.rsplit("/", 1)[-1] for f in files)
+    head = ["#pragma once", "/*"]
+    head += [" * " + line for line in textwrap.wrap(
+        f"Generated by schema/capnp_gen.py from {sources}.", 68)]
+    head += [
+        " * Do not edit: change the schema and rebuild.",
+        " *",
+        " * Cap'n Proto struct layouts: see capnp_gen.py for the naming.  Data",
+        " * offsets are bytes from the start of the data section, pointer",
+        " * fields are indices into the pointer section.",
+        " */",
+        "",
+    ]
+    return "\n".join(head + w.lines).rstrip() + "\n"
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    ap.add_argument("-o", "--output", required=True)
+    ap.add_argument("schemas", nargs="+", metavar="FILE.capnp:PREFIX")
+    args = ap.parse_args()
+
+    files = []
+    try:
+        for arg in args.schemas:
+            path, _, prefix = arg.rpartition(":")
+            if not path or not re.match(r"[A-Z][A-Z0-9_]*$", prefix):
+                raise SchemaError(f"{arg}: expected FILE.capnp:PREFIX")
+            with open(path) as fh:
+                text = fh.read()
+            f = File(path, prefix)
+            Parser(tokenize(text, path), path).file(f)
+            files.append(f)
+        out = generate(files)
+    except (OSError, SchemaError) as e:
+        sys.exit(f"capnp_gen: {e}")
+
+    # Leave an unchanged header alone so that dependents do not rebuild
+    try:
+        with open(args.output) as fh:
+            if fh.read() == out:
+                return
+    except OSError:
+        pass
+    with open(args.output, "w") as fh:
+        fh.write(out)
+
+
+if __name__ == "__main__":
+    main()
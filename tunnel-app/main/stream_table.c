@@ -0,0 +1,157 @@
+/*
+ * Phase 3: Stream registry for quic_tunnel (see stream_table.h).
+ */
+
+#include "stream_table.h"
+#include "quic_tunnel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "stream_table";
+
+#define STREAM_TABLE_INIT_SLOTS 16
+#define STREAM_TABLE_INIT_LIVE  8
+
+static size_t slot_of(const stream_table_t *t, uint64_t stream_id)
+{
+    return (size_t)((stream_id * 0x9E3779B97F4A7C15ULL) >> 32) & (t->slot_cap - 1);
+}
+
+/* Insert into the hash slots only (no growth, no duplicates). */
+static void slots_put(stream_table_t *t, stream_ctx_t *sc)
+{
+    size_t i = slot_of(t, sc->stream_id);
+    while (t->slots[i] != NULL) {
+        i = (i + 1) & (t->slot_cap - 1);
+    }
+    t->slots[i] = sc;
+}
+
+static int grow_slots(stream_table_t *t)
+{
+    size_t new_cap = t->slot_cap * 2;
+    stream_ctx_t **slots = calloc(new_cap, sizeof(*slots));
+    if (slots == NULL) {
+        ESP_LOGE(TAG, "failed to grow table to %zu slots", new_cap);
+        return -1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->slot_cap = new_cap;
+    for (size_t i = 0; i < t->count; i++) {
+        slots_put(t, t->live[i]);
+    }
+    return 0;
+}
+
+int stream_table_init(stream_table_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->slots = calloc(STREAM_TABLE_INIT_SLOTS, sizeof(*t->slots));
+    t->live = malloc(STREAM_TABLE_INIT_LIVE * sizeof(*t->live));
+    if (t->slots == NULL || t->live == NULL) {
+        ESP_LOGE(TAG, "failed to allocate table");
+        stream_table_free(t);
+        return -1;
+    }
+    t->slot_cap = STREAM_TABLE_INIT_SLOTS;
+    t->live_cap = STREAM_TABLE_INIT_LIVE;
+    return 0;
+}
+
+void stream_table_free(stream_table_t *t)
+{
+    free(t->slots);
+    free(t->live);
+    memset(t, 0, sizeof(*t));
+}
+
+stream_ctx_t *stream_table_find(stream_table_t *t, uint64_t stream_id)
+{
+    if (t->slot_cap == 0) {
+        return NULL;
+    }
+    t->lookups++;
+    size_t i = slot_of(t, stream_id);
+    for (;;) {
+        t->probes++;
+        stream_ctx_t *sc = t->slots[i];
+        if (sc == NULL || sc->stream_id == stream_id) {
+            return sc;
+        }
+        i = (i + 1) & (t->slot_cap - 1);
+    }
+}
+
+int stream_table_insert(stream_table_t *t, stream_ctx_t *sc)
+{
+    if (t->slot_cap == 0) {
+        return -1;
+    }
+    /* Keep the load factor at or below 1/2. */
+    if ((t->count + 1) * 2 > t->slot_cap && grow_slots(t) != 0) {
+        return -1;
+    }
+    if (t->count == t->live_cap) {
+        size_t new_cap = t->live_cap * 2;
+        stream_ctx_t **live = realloc(t->live, new_cap * sizeof(*live));
+        if (live == NULL) {
+            ESP_LOGE(TAG, "failed to grow live array to %zu", new_cap);
+            return -1;
+        }
+        t->live = live;
+        t->live_cap = new_cap;
+    }
+
+    slots_put(t, sc);
+    sc->live_index = t->count;
+    t->live[t->count++] = sc;
+    return 0;
+}
+
+stream_ctx_t *stream_table_remove(stream_table_t *t, uint64_t stream_id)
+{
+    if (t->slot_cap == 0) {
+        return NULL;
+    }
+    size_t mask = t->slot_cap - 1;
+    size_t i = slot_of(t, stream_id);
+    while (t->slots[i] != NULL && t->slots[i]->stream_id != stream_id) {
+        i = (i + 1) & mask;
+    }
+    stream_ctx_t *sc = t->slots[i];
+    if (sc == NULL) {
+        return NULL;
+    }
+
+    /* Backward-shift deletion: pull later members of the probe run into
+     * the hole unless that would move them before their home slot. */
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; t->slots[j] != NULL; j = (j + 1) & mask) {
+        size_t home = slot_of(t, t->slots[j]->stream_id);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            t->slots[hole] = t->slots[j];
+            hole = j;
+        }
+    }
+    t->slots[hole] = NULL;
+
+    /* Swap-remove from the dense array. */
+    stream_ctx_t *last = t->live[--t->count];
+    t->live[sc->live_index] = last;
+    last->live_index = sc->live_index;
+    return sc;
+}
+
+size_t stream_table_count(const stream_table_t *t)
+{
+    return t->count;
+}
+
+stream_ctx_t *stream_table_at(const stream_table_t *t, size_t i)
+{
+    return t->live[i];
+}
@@ -0,0 +1,56 @@
+#pragma once
+/*
+ * Phase 3: Stream registry for quic_tunnel.
+ *
+ * Open-addressing hash table (linear probing, backward-shift deletion)
+ * keyed by QUIC stream ID, plus a dense array of the live entries so
+ * they can be walked without touching empty slots.
+ *
+ * Stream IDs are sequential per type (the low two bits), so the key is
+ * scrambled with a Fibonacci multiply before taking the top bits; the
+ * table is kept at most half full, which keeps probe sequences short.
+ *
+ * Lookup, insert and remove are O(1) on average.  Iteration is
+ * stream_table_at(t, 0 .. stream_table_count(t) - 1); removal swaps the
+ * last live entry into the hole, so walk backwards when removing while
+ * iterating.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct stream_ctx;
+
+typedef struct {
+    struct stream_ctx **slots;  /* Hash slots, NULL = empty */
+    size_t slot_cap;            /* Power of two */
+    struct stream_ctx **live;   /* Dense array of live entries */
+    size_t live_cap;
+    size_t count;
+
+    /* Statistics */
+    uint64_t lookups;
+    uint64_t probes;            /* Slots examined by lookups */
+} stream_table_t;
+
+/* Initialise an empty table.  Returns 0 on success, -1 on OOM. */
+int stream_table_init(stream_table_t *t);
+
+/* Free the table's arrays (not the stream contexts). */
+void stream_table_free(stream_table_t *t);
+
+/* Find the stream with `stream_id`, or NULL. */
+struct stream_ctx *stream_table_find(stream_table_t *t, uint64_t stream_id);
+
+/* Add `sc` (its stream_id must not be present yet).
+ * Returns 0 on success, -1 on OOM. */
+int stream_table_insert(stream_table_t *t, struct stream_ctx *sc);
+
+/* Remove and return the stream with `stream_id`, or NULL if absent. */
+struct stream_ctx *stream_table_remove(stream_table_t *t, uint64_t stream_id);
+
+/* Number of live streams. */
+size_t stream_table_count(const stream_table_t *t);
+
+/* The i-th live stream, 0 <= i < stream_table_count(t). */
+struct stream_ctx *stream_table_at(const stream_table_t *t, size_t i);
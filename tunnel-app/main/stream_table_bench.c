@@ -0,0 +1,299 @@
+/*
+ * Host check and benchmark for stream_table.c; not part of the firmware
+ * build.
+ *
+ * Fills a table with 1k and 10k streams, checks every entry can be found
+ * and removed again (in random order, so backward-shift deletion is
+ * exercised) and that the live array stays consistent, then times
+ * insert, find (hits and misses), remove, and a steady churn that
+ * retires the oldest stream for each new one, as an edge connection does.
+ * stream_ctx_t comes from quic_tunnel.h, so picoquic's headers must be on
+ * the include path:
+ *
+ *   cc -O2 -I. -Ihost -I$PICOQUIC/picoquic stream_table_bench.c stream_table.c && ./a.out
+ *
+ * Exits with 1 at the first mismatch.
+ */
+
+#include "stream_table.h"
+#include "quic_tunnel.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Table operations timed per phase and table size */
+#define BENCH_OPS (4u * 1024 * 1024)
+
+/* ── Streams ─────────────────────────────────────────────────────── */
+
+static uint64_t s_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return s_rng;
+}
+
+/* The n-th stream the edge opens: server-initiated bidirectional. */
+static uint64_t stream_id_of(size_t n)
+{
+    return (uint64_t)n * 4 + 1;
+}
+
+static void shuffle(size_t *order, size_t n)
+{
+    for (size_t i = n; i > 1; i--) {
+        size_t j = rng() % i;
+        size_t tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* ── Checks ──────────────────────────────────────────────────────── */
+
+static int fail(size_t n, const char *what)
+{
+    fprintf(stderr, "FAIL %zu streams: %s\n", n, what);
+    return -1;
+}
+
+static bool live_consistent(const stream_table_t *t)
+{
+    for (size_t i = 0; i < stream_table_count(t); i++) {
+        if (stream_table_at(t, i)->live_index != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int check_table(stream_ctx_t *streams, size_t *order, size_t n)
+{
+    stream_table_t t;
+    if (stream_table_init(&t) != 0) {
+        return fail(n, "init");
+    }
+    int rc = -1;
+
+    for (size_t i = 0; i < n; i++) {
+        if (stream_table_insert(&t, &streams[i]) != 0) {
+            fail(n, "insert");
+            goto done;
+        }
+    }
+    if (stream_table_count(&t) != n || !live_consistent(&t)) {
+        fail(n, "live array after inserts");
+        goto done;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (stream_table_find(&t, streams[i].stream_id) != &streams[i] ||
+            stream_table_find(&t, streams[i].stream_id + 2) != NULL) {
+            fail(n, "find after inserts");
+            goto done;
+        }
+    }
+
+    /* Remove half in random order; the rest must stay reachable. */
+    shuffle(order, n);
+    for (size_t k = 0; k < n / 2; k++) {
+        stream_ctx_t *sc = &streams[order[k]];
+        if (stream_table_remove(&t, sc->stream_id) != sc ||
+            stream_table_remove(&t, sc->stream_id) != NULL) {
+            fail(n, "remove");
+            goto done;
+        }
+    }
+    if (stream_table_count(&t) != n - n / 2 || !live_consistent(&t)) {
+        fail(n, "live array after removes");
+        goto done;
+    }
+    for (size_t k = 0; k < n; k++) {
+        stream_ctx_t *sc = &streams[order[k]];
+        if (stream_table_find(&t, sc->stream_id) != (k < n / 2 ? NULL : sc)) {
+            fail(n, "find after removes");
+            goto done;
+        }
+    }
+
+    /* Put them back, then empty the table. */
+    for (size_t k = 0; k < n / 2; k++) {
+        if (stream_table_insert(&t, &streams[order[k]]) != 0) {
+            fail(n, "reinsert");
+            goto done;
+        }
+    }
+    shuffle(order, n);
+    for (size_t k = 0; k < n; k++) {
+        if (stream_table_remove(&t, streams[order[k]].stream_id) != &streams[order[k]]) {
+            fail(n, "remove all");
+            goto done;
+        }
+    }
+    if (stream_table_count(&t) != 0) {
+        fail(n, "table not empty");
+        goto done;
+    }
+    rc = 0;
+
+done:
+    stream_table_free(&t);
+    return rc;
+}
+
+/* ── Timing ──────────────────────────────────────────────────────── */
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double ns_per_op(double seconds, size_t ops)
+{
+    return seconds * 1e9 / (double)ops;
+}
+
+static double probes_since(const stream_table_t *t, uint64_t lookups,
+                           uint64_t probes)
+{
+    return (double)(t->probes - probes) / (double)(t->lookups - lookups);
+}
+
+static void print_row(size_t n, const char *op, double ns, double probes)
+{
+    if (probes > 0) {
+        printf("%6zu  %-11s %7.1f ns/op  %5.2f probes/lookup\n", n, op, ns, probes);
+    } else {
+        printf("%6zu  %-11s %7.1f ns/op\n", n, op, ns);
+    }
+}
+
+static int bench_table(stream_ctx_t *streams, size_t *order, size_t n)
+{
+    stream_table_t t;
+    size_t rounds = BENCH_OPS / n;
+    double t_insert = 0, t_remove = 0;
+    volatile uintptr_t sink = 0;
+
+    /* Insert and remove: fill a fresh table, empty it in random order. */
+    for (size_t r = 0; r < rounds; r++) {
+        if (stream_table_init(&t) != 0) {
+            return fail(n, "init");
+        }
+        double t0 = now_s();
+        for (size_t i = 0; i < n; i++) {
+            stream_table_insert(&t, &streams[i]);
+        }
+        double t1 = now_s();
+        for (size_t k = 0; k < n; k++) {
+            sink ^= (uintptr_t)stream_table_remove(&t, streams[order[k]].stream_id);
+        }
+        double t2 = now_s();
+        t_insert += t1 - t0;
+        t_remove += t2 - t1;
+        stream_table_free(&t);
+    }
+
+    /* Find, on a full table: hits in random order, then misses. */
+    if (stream_table_init(&t) != 0) {
+        return fail(n, "init");
+    }
+    for (size_t i = 0; i < n; i++) {
+        stream_table_insert(&t, &streams[i]);
+    }
+    uint64_t lookups = t.lookups, probes = t.probes;
+    double t0 = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t k = 0; k < n; k++) {
+            sink ^= (uintptr_t)stream_table_find(&t, streams[order[k]].stream_id);
+        }
+    }
+    double t_hit = now_s() - t0;
+    double p_hit = probes_since(&t, lookups, probes);
+
+    lookups = t.lookups;
+    probes = t.probes;
+    t0 = now_s();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t k = 0; k < n; k++) {
+            sink ^= (uintptr_t)stream_table_find(&t, streams[order[k]].stream_id + 2);
+        }
+    }
+    double t_miss = now_s() - t0;
+    double p_miss = probes_since(&t, lookups, probes);
+
+    /* Churn: retire the oldest stream, open the next one and look it up,
+     * keeping n streams live.  The IDs keep climbing, as on a long-lived
+     * connection; the slots are recycled. */
+    lookups = t.lookups;
+    probes = t.probes;
+    size_t ops = rounds * n;
+    t0 = now_s();
+    for (size_t k = 0; k < ops; k++) {
+        stream_ctx_t *sc = &streams[k % n];
+        stream_table_remove(&t, sc->stream_id);
+        sc->stream_id = stream_id_of(n + k);
+        stream_table_insert(&t, sc);
+        sink ^= (uintptr_t)stream_table_find(&t, sc->stream_id);
+    }
+    double t_churn = now_s() - t0;
+    double p_churn = probes_since(&t, lookups, probes);
+    stream_table_free(&t);
+    for (size_t i = 0; i < n; i++) {
+        streams[i].stream_id = stream_id_of(i);
+    }
+    (void)sink;
+
+    print_row(n, "insert", ns_per_op(t_insert, ops), 0);
+    print_row(n, "find hit", ns_per_op(t_hit, ops), p_hit);
+    print_row(n, "find miss", ns_per_op(t_miss, ops), p_miss);
+    print_row(n, "remove", ns_per_op(t_remove, ops), 0);
+    print_row(n, "churn", ns_per_op(t_churn, ops), p_churn);
+    return 0;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = { 1000, 10000 };
+    size_t max_n = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    stream_ctx_t *streams = calloc(max_n, sizeof(*streams));
+    size_t *order = malloc(max_n * sizeof(*order));
+    if (!streams || !order) {
+        return 1;
+    }
+
+    int rc = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; s++) {
+        size_t n = sizes[s];
+        for (size_t i = 0; i < n; i++) {
+            streams[i].stream_id = stream_id_of(i);
+            order[i] = i;
+        }
+        for (int rep = 0; rep < 20 && rc == 0; rep++) {
+            rc = check_table(streams, order, n);
+        }
+    }
+    if (rc == 0) {
+        printf("checks passed\n");
+    }
+
+    /* Churn is a remove, an insert and a find per op. */
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && rc == 0; s++) {
+        size_t n = sizes[s];
+        for (size_t i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        shuffle(order, n);
+        rc = bench_table(streams, order, n);
+    }
+    free(streams);
+    free(order);
+    return rc == 0 ? 0 : 1;
+}
@@ -12,13 +12,27 @@
  *   - "full": Full tunnel with control stream registration and proxying
  *
  * On the ESP-IDF linux host target, mode/edge/port can be set via
- * environment variables CF_MODE, CF_EDGE, CF_PORT.
+ * environment variables CF_MODE, CF_EDGE, CF_PORT.  Without CF_EDGE the
+ * connections are spread over the two edge regions (edge_discovery).
  *
  * Full mode requires:
  *   CF_TUNNEL_ID       — Tunnel UUID (hex string, 32 chars or with dashes)
  *   CF_ACCOUNT_TAG     — Account tag
  *   CF_TUNNEL_SECRET   — Base64-encoded tunnel secret
  *   CF_ORIGIN_URL      — Local origin URL (e.g. http://localhost:8080)
+ *
+ * Optional:
+ *   CF_PROXY_WORKERS   — Origin worker threads (default 4 on linux, 2 on
+ *                        ESP32; 0 = proxy synchronously in the packet loop)
+ *   CF_PULL_BODIES     — 0 = read origin bodies on the workers instead of
+ *                        straight into QUIC frames (default 1)
+ *   CF_ORIGIN_MAX_IDLE — Idle keep-alive origin connections kept for reuse
+ *                        (default 8 on linux, 2 on ESP32; 0 = close each)
+ *   CF_ORIGIN_DNS_REFRESH — Seconds between origin host re-resolutions
+ *                        (default 60)
+ *   CF_HA_CONNECTIONS  — Edge connections kept up at once (default 4)
+ *   CF_EDGE_IP_VERSION — 4 or 6 to use only that IP version for the edge
+ *                        (default: IPv4 where a region has it)
  */
 
 #include <stdio.h>
@@ -36,16 +50,48 @@
 
 #include "tunnel_types.h"
 #include "quic_tunnel.h"
+#include "edge_discovery.h"
 #include "http_proxy.h"
 #include "control_stream.h"
+#include "rpc_session.h"
 #include "data_stream.h"
+#include "cf_metadata.h"
 #include "capnp_minimal.h"
+#include "proxy_worker.h"
 #include "quick_tunnel.h"
 #include "qrcode.h"
 
 
 static const char *TAG = "cf_tunnel";
 
+#if defined(CONFIG_IDF_TARGET_LINUX)
+#define DEFAULT_PROXY_WORKERS 4
+#define DEFAULT_ORIGIN_MAX_IDLE 8
+#else
+#define DEFAULT_PROXY_WORKERS 2
+#define DEFAULT_ORIGIN_MAX_IDLE 2
+#endif
+
+/* Packet-loop tick while origin requests are in flight on the workers.
+ * Workers wake the loop when they have something for it, so this is only
+ * a fallback. */
+#define PROXY_FALLBACK_INTERVAL_US 100000
+
+/* Edge connections, each registered with its own connIndex, as
+ * cloudflared's --ha-connections. */
+#define DEFAULT_HA_CONNECTIONS 4
+
+/* Reconnect backoff, as cloudflared's BackoffHandler: retry n of a
+ * connection waits a random time in [d/2, d) with d = base << n, n capped
+ * at CONN_BACKOFF_MAX_SHIFT (32 s), unless the edge asked for longer.
+ * The count resets once the connection registers. */
+#define CONN_BACKOFF_BASE_US   (1000 * 1000)
+#define CONN_BACKOFF_MAX_SHIFT 5
+
+/* Reconnect time histogram: bucket i counts recoveries under 2^i ms, the
+ * last one everything slower (about 4 minutes and up). */
+#define RECONNECT_HIST_BUCKETS 20
+
 /* ── Base64 decoder (minimal, for tunnel secret) ─────────────────── */
 
 static const uint8_t b64_table[256] = {
@@ -130,10 +176,11 @@ static int phase3_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
     switch (event) {
     case QT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "=== PHASE 3 SUCCESS: QUIC handshake completed! ===");
-        quic_tunnel_close(ctx);
+        quic_tunnel_stop(ctx->tunnel);
         return 0;
     case QT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "Disconnected from edge");
+        quic_tunnel_stop(ctx->tunnel);
         return 0;
     default:
         return 0;
@@ -142,37 +189,80 @@ static int phase3_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
 
 static int phase3_test(const char *edge_server, uint16_t port)
 {
-    ESP_LOGI(TAG, "=== Phase 3 Test: QUIC handshake to %s:%u ===", edge_server, port);
+    ESP_LOGI(TAG, "=== Phase 3 Test: QUIC handshake to %s:%u ===",
+             edge_server ? edge_server : EDGE_REGION1_HOST, port);
+
+    /* static: too big for the main task's stack */
+    static edge_addrs_t edges;
+    static quic_tunnel_t tunnel;
+
+    int ret = edge_discovery_resolve(&edges, edge_server, port, EDGE_IP_AUTO);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to resolve the edge");
+        return ret;
+    }
 
-    quic_tunnel_ctx_t ctx = {0};
     quic_tunnel_config_t config = {
-        .edge_server = edge_server,
-        .edge_port = port,
+        .max_connections = 1,
+        .local_af = edge_addrs_family(&edges),
         .event_cb = phase3_event_cb,
         .user_data = NULL,
     };
-
-    int ret = quic_tunnel_connect(&ctx, &config);
+    ret = quic_tunnel_init(&tunnel, &config);
     if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to initiate connection: %d", ret);
+        ESP_LOGE(TAG, "Failed to create the QUIC context: %d", ret);
         return ret;
     }
+    if (!quic_tunnel_add_connection(&tunnel, 0, edge_addr_for(&edges, 0, 0))) {
+        ESP_LOGE(TAG, "Failed to initiate connection");
+        quic_tunnel_free(&tunnel);
+        return -1;
+    }
 
-    ret = quic_tunnel_run(&ctx);
+    ret = quic_tunnel_run(&tunnel);
     ESP_LOGI(TAG, "Packet loop exited: %d", ret);
 
-    quic_tunnel_free(&ctx);
+    quic_tunnel_free(&tunnel);
     return 0;
 }
 
 /* ── Full tunnel mode ──────────────────────────────────────────────── */
 
+struct tunnel_state;
+
+/* Phase 4: One edge connection and its control stream */
 typedef struct {
-    /* Phase 4: Control stream */
+    struct tunnel_state *state;
+    uint8_t index;             /* connIndex, and slot in the tunnel */
+    quic_tunnel_ctx_t *ctx;    /* NULL until first dialled */
     bool registered;
     bool registration_sent;
     uint64_t control_stream_id;
-    size_t ctrl_parsed_offset; /* bytes consumed from control stream recv_buf */
+    rpc_session_t *rpc;        /* RPC session on the control stream */
+    uint32_t attempts;         /* Times dialled (walks the region's addresses) */
+    uint64_t redial_at;        /* When to dial a replacement (0 = not due) */
+
+    /* Reconnect supervisor */
+    uint32_t retries;          /* Failed attempts since last registered */
+    uint64_t retry_after_us;   /* Edge's requested delay for the next retry */
+    uint64_t down_since;       /* When it lost registration (0 = up) */
+} tunnel_conn_t;
+
+/* Time from losing a registered connection to registering it again. */
+typedef struct {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t buckets[RECONNECT_HIST_BUCKETS];
+} reconnect_stats_t;
+
+typedef struct tunnel_state {
+    /* Phase 3: Edge connections, all in one picoquic context */
+    quic_tunnel_t tunnel;
+    edge_addrs_t edges;
+    tunnel_conn_t conns[QT_MAX_CONNECTIONS];
+    size_t num_conns;
+    reconnect_stats_t reconnects;
 
     /* Phase 1: Credentials (pointers to static/env data) */
     cf_tunnel_auth_t auth;
@@ -184,69 +274,296 @@ typedef struct {
 
     /* Phase 6: Origin URL */
     const char *origin_url;
+
+    /* Phase 6: Origin worker pool (NULL = proxy inline in the loop) */
+    proxy_pool_t *workers;
+
+    /* Phase 6: Buffers recycled across requests (NULL = plain heap) */
+    mem_pool_t *mem;
 } tunnel_state_t;
 
 static void try_handle_data_stream(quic_tunnel_ctx_t *ctx,
                                    uint64_t stream_id,
                                    tunnel_state_t *state);
+static void drain_proxy_completions(tunnel_state_t *state);
+
+static tunnel_conn_t *conn_of(quic_tunnel_ctx_t *ctx)
+{
+    tunnel_state_t *state = (tunnel_state_t *)ctx->user_data;
+    return &state->conns[ctx->conn_index];
+}
+
+/* rpc_transport_t over a connection's control stream: messages are encoded
+ * straight into its send queue. */
+static uint8_t *ctrl_reserve(void *arg, size_t len)
+{
+    tunnel_conn_t *conn = (tunnel_conn_t *)arg;
+    return quic_tunnel_send_reserve(conn->ctx, conn->control_stream_id, len);
+}
+
+static int ctrl_commit(void *arg, size_t len)
+{
+    tunnel_conn_t *conn = (tunnel_conn_t *)arg;
+    return quic_tunnel_send_commit(conn->ctx, conn->control_stream_id,
+                                   len, false);
+}
+
+/* Log a connection's RPC counters and free its session. */
+static void conn_end_session(tunnel_conn_t *conn)
+{
+    if (!conn->rpc) {
+        return;
+    }
+    rpc_session_stats_t rs;
+    rpc_session_get_stats(conn->rpc, &rs);
+    ESP_LOGI(TAG, "[conn %u] Control stream RPC: %" PRIu64 " msgs in (%" PRIu64
+             " bytes), %" PRIu64 " out (%" PRIu64 " bytes), %" PRIu64
+             " calls served (%" PRIu64 " pipelined), %" PRIu64
+             " made, %" PRIu64 " unimplemented",
+             conn->index,
+             rs.msgs_in, rs.bytes_in, rs.msgs_out, rs.bytes_out,
+             rs.calls_in, rs.calls_queued, rs.calls_out, rs.unimplemented);
+    rpc_session_destroy(conn->rpc);
+    conn->rpc = NULL;
+}
+
+/* ── Reconnect supervisor ──────────────────────────────────────────── */
+
+/* Jittered exponential backoff for a connection's next retry. */
+static uint64_t conn_backoff_us(const tunnel_conn_t *conn)
+{
+    uint32_t shift = conn->retries < CONN_BACKOFF_MAX_SHIFT ?
+                     conn->retries : CONN_BACKOFF_MAX_SHIFT;
+    uint64_t max = (uint64_t)CONN_BACKOFF_BASE_US << shift;
+    return max / 2 + esp_random() % (max / 2);
+}
+
+/* Schedule the next dial of a connection that failed or dropped.  The
+ * edge's retry hint, if any, is a lower bound on the wait. */
+static void conn_schedule_redial(tunnel_conn_t *conn)
+{
+    uint64_t now = picoquic_current_time();
+    uint64_t delay = conn_backoff_us(conn);
+    if (conn->retry_after_us > delay) {
+        delay = conn->retry_after_us;
+    }
+    conn->retry_after_us = 0;
+    conn->retries++;
+    if (conn->down_since == 0) {
+        conn->down_since = now;
+    }
+    conn->redial_at = now + delay;
+    ESP_LOGI(TAG, "[conn %u] Reconnecting in %" PRIu64 " ms (retry %" PRIu32 ")",
+             conn->index, delay / 1000, conn->retries);
+}
+
+/* Record a recovery once a connection registers again. */
+static void conn_recovered(tunnel_conn_t *conn)
+{
+    if (conn->down_since != 0) {
+        uint64_t us = picoquic_current_time() - conn->down_since;
+        reconnect_stats_t *st = &conn->state->reconnects;
+        size_t b = 0;
+        while (b < RECONNECT_HIST_BUCKETS - 1 && us >= (1000ULL << b)) {
+            b++;
+        }
+        st->buckets[b]++;
+        st->count++;
+        st->total_us += us;
+        if (us > st->max_us) {
+            st->max_us = us;
+        }
+        ESP_LOGI(TAG, "[conn %u] Recovered after %" PRIu64 " ms (%" PRIu32
+                 " retries)", conn->index, us / 1000, conn->retries);
+    }
+    conn->down_since = 0;
+    conn->retries = 0;
+}
+
+static void log_reconnect_stats(const reconnect_stats_t *st)
+{
+    if (st->count == 0) {
+        ESP_LOGI(TAG, "Reconnects: none");
+        return;
+    }
+    ESP_LOGI(TAG, "Reconnects: %" PRIu64 ", mean %" PRIu64 " ms, max %" PRIu64
+             " ms", st->count, st->total_us / st->count / 1000,
+             st->max_us / 1000);
+    char line[256];
+    size_t n = 0;
+    for (size_t b = 0; b < RECONNECT_HIST_BUCKETS && n < sizeof(line); b++) {
+        if (st->buckets[b] == 0) {
+            continue;
+        }
+        if (b < RECONNECT_HIST_BUCKETS - 1) {
+            n += snprintf(line + n, sizeof(line) - n, " <%llums:%" PRIu32,
+                          1ULL << b, st->buckets[b]);
+        } else {
+            n += snprintf(line + n, sizeof(line) - n, " >=%llums:%" PRIu32,
+                          1ULL << (b - 1), st->buckets[b]);
+        }
+    }
+    ESP_LOGI(TAG, "Reconnect times:%s", line);
+}
+
+/* Dial connection `index` to the next edge address of its region, so a
+ * retry never reuses the address that just failed while the region has
+ * others.  On failure the dial is rescheduled with backoff. */
+static void conn_dial(tunnel_state_t *state, uint8_t index)
+{
+    tunnel_conn_t *conn = &state->conns[index];
+    const struct sockaddr *addr = edge_addr_for(&state->edges, index,
+                                                conn->attempts++);
+    char buf[64];
+    ESP_LOGI(TAG, "[conn %u] Dialling %s (attempt %" PRIu32 ")", index,
+             edge_addr_str(addr, buf, sizeof(buf)), conn->attempts);
+
+    conn_end_session(conn);
+    conn->registered = false;
+    conn->registration_sent = false;
+    conn->redial_at = 0;
+    conn->ctx = quic_tunnel_add_connection(&state->tunnel, index, addr);
+    if (!conn->ctx) {
+        ESP_LOGE(TAG, "[conn %u] Failed to initiate connection", index);
+        conn_schedule_redial(conn);
+    }
+}
+
+/* Dial the replacements that are due.  Runs on every loop tick. */
+static void redial_connections(tunnel_state_t *state)
+{
+    uint64_t now = picoquic_current_time();
+    for (size_t i = 0; i < state->num_conns; i++) {
+        tunnel_conn_t *conn = &state->conns[i];
+        if (conn->redial_at != 0 && now >= conn->redial_at &&
+            !quic_tunnel_connection(&state->tunnel, (uint8_t)i)) {
+            conn_dial(state, (uint8_t)i);
+        }
+    }
+}
+
+/* Keep a fallback tick while origin requests are in flight, otherwise
+ * wake for the earliest replacement due, or leave it to picoquic. */
+static void update_tick_interval(tunnel_state_t *state)
+{
+    uint64_t interval = 0;
+    if (proxy_pool_in_flight(state->workers) > 0) {
+        interval = PROXY_FALLBACK_INTERVAL_US;
+    } else {
+        uint64_t now = picoquic_current_time();
+        for (size_t i = 0; i < state->num_conns; i++) {
+            uint64_t at = state->conns[i].redial_at;
+            if (at == 0) {
+                continue;
+            }
+            uint64_t wait = at > now ? at - now : 1;
+            if (interval == 0 || wait < interval) {
+                interval = wait;
+            }
+        }
+    }
+    quic_tunnel_set_tick_interval(&state->tunnel, interval);
+}
+
+/* rpc_return_fn for the RegisterConnection call. */
+static void on_registered(rpc_session_t *s, const rpc_return_t *ret, void *arg)
+{
+    (void)s;
+    tunnel_conn_t *conn = (tunnel_conn_t *)arg;
+    unsigned index = conn->index;
+
+    cf_registration_result_t result;
+    int rc = control_stream_decode_response(ret, &result);
+
+    if (rc == 0 && result.success) {
+        conn->registered = true;
+        conn_recovered(conn);
+        ESP_LOGI(TAG, "=== REGISTRATION SUCCESS (conn %u) ===", index);
+        ESP_LOGI(TAG, "  Connection UUID: %s", result.uuid);
+        ESP_LOGI(TAG, "  Location: %s", result.location);
+        ESP_LOGI(TAG, "  Remote managed: %s",
+                 result.tunnel_is_remote ? "yes" : "no");
+        ESP_LOGI(TAG, "Connection %u is ready, waiting for requests...", index);
+        return;
+    }
+    ESP_LOGE(TAG, "=== REGISTRATION FAILED (conn %u) ===", index);
+    ESP_LOGE(TAG, "  Error: %s", result.error[0] ? result.error : "malformed response");
+    ESP_LOGE(TAG, "  Retry: %s (after %" PRId64 " ns)",
+             result.should_retry ? "yes" : "no", result.retry_after_ns);
+    if (rc == 0 && !result.should_retry) {
+        /* A ConnectionError with shouldRetry unset: the edge will refuse
+         * every connection the same way.  Anything else only redials
+         * this one, with backoff. */
+        quic_tunnel_stop(&conn->state->tunnel);
+        return;
+    }
+    if (rc == 0 && result.retry_after_ns > 0) {
+        conn->retry_after_us = (uint64_t)result.retry_after_ns / 1000;
+    }
+    quic_tunnel_close(conn->ctx);
+}
+
+/* Largest control message accepted, going by the size its segment table
+ * declares.  Bounds what a misbehaving edge can make us buffer without
+ * refusing large Returns (e.g. a remote configuration). */
+#if defined(CONFIG_IDF_TARGET_LINUX)
+#define CTRL_MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#else
+#define CTRL_MAX_MESSAGE_SIZE (512 * 1024)
+#endif
 
 /*
- * Try to parse Cap'n Proto RPC messages from the control stream's recv_buf.
- * The control stream stays open (no FIN), so we parse messages incrementally
- * as data arrives. We track how many bytes we've consumed in ctrl_parsed_offset.
+ * Feed complete Cap'n Proto RPC messages from the control stream's recv_buf
+ * to the RPC session.  The control stream stays open (no FIN), so we parse
+ * messages incrementally as data arrives.  Each message is handed to the
+ * session in place, then the whole batch is consumed at once: only a
+ * trailing partial message is moved to the front of the buffer, and the
+ * buffer never holds more than one incomplete message.
  *
- * Expected messages:
- *   1. Return for Bootstrap (questionId=0) — we skip this
- *   2. Return for Call (questionId=1)     — this has the registration result
+ * The session answers the Returns for our Bootstrap and RegisterConnection
+ * (the latter via on_registered) with Finish, and serves the edge's own
+ * calls; see control_stream_serve().
  */
 static void try_parse_control_messages(quic_tunnel_ctx_t *ctx,
-                                       tunnel_state_t *state)
+                                       tunnel_conn_t *conn)
 {
-    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, state->control_stream_id);
-    if (!sc || !sc->recv_buf) return;
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, conn->control_stream_id);
+    if (!sc || !sc->recv_buf || !conn->rpc) return;
 
-    while (state->ctrl_parsed_offset < sc->recv_len) {
-        const uint8_t *buf = sc->recv_buf + state->ctrl_parsed_offset;
-        size_t remaining = sc->recv_len - state->ctrl_parsed_offset;
+    size_t parsed = 0;
+    while (parsed < sc->recv_len) {
+        const uint8_t *buf = sc->recv_buf + parsed;
+        size_t remaining = sc->recv_len - parsed;
 
         /* Check if we have a complete capnp message */
         size_t msg_size = capnp_wire_message_size(buf, remaining);
         if (msg_size == 0) {
-            /* Not enough data yet */
+            /* Not enough data yet; refuse to wait for an oversized one */
+            size_t declared = capnp_wire_declared_size(buf, remaining);
+            if (declared > CTRL_MAX_MESSAGE_SIZE) {
+                ESP_LOGE(TAG, "Control stream: %zu-byte message exceeds %d",
+                         declared, CTRL_MAX_MESSAGE_SIZE);
+                quic_tunnel_close(ctx);
+            }
             break;
         }
-
-        ESP_LOGD(TAG, "Control stream: parsing message at offset %zu (%zu bytes)",
-                 state->ctrl_parsed_offset, msg_size);
-
-        /* Try to decode as registration response */
-        cf_registration_result_t result = {0};
-        int ret = control_stream_decode_response(buf, msg_size, &result);
-
-        if (ret == 0 && result.is_bootstrap) {
-            ESP_LOGD(TAG, "Control stream: Bootstrap Return (skipped)");
-        } else if (ret == 0 && result.success) {
-            state->registered = true;
-            ESP_LOGI(TAG, "=== REGISTRATION SUCCESS ===");
-            ESP_LOGI(TAG, "  Connection UUID: %s", result.uuid);
-            ESP_LOGI(TAG, "  Location: %s", result.location);
-            ESP_LOGI(TAG, "  Remote managed: %s",
-                     result.tunnel_is_remote ? "yes" : "no");
-            ESP_LOGI(TAG, "Tunnel is ready, waiting for requests...");
-        } else if (ret == 0 && result.error[0]) {
-            ESP_LOGE(TAG, "=== REGISTRATION FAILED ===");
-            ESP_LOGE(TAG, "  Error: %s", result.error);
-            ESP_LOGE(TAG, "  Retry: %s (after %" PRId64 " ns)",
-                     result.should_retry ? "yes" : "no",
-                     result.retry_after_ns);
+        if (msg_size == CAPNP_WIRE_INVALID) {
+            /* Nothing after this can be framed: give up on the connection */
+            ESP_LOGE(TAG, "Control stream: malformed message");
             quic_tunnel_close(ctx);
-        } else if (ret != 0) {
-            ESP_LOGW(TAG, "Control stream: failed to decode message at offset %zu",
-                     state->ctrl_parsed_offset);
+            break;
         }
 
-        state->ctrl_parsed_offset += msg_size;
+        ESP_LOGD(TAG, "Control stream: message (%zu bytes)", msg_size);
+
+        parsed += msg_size;
+        if (rpc_session_receive(conn->rpc, buf, msg_size) != 0) {
+            ESP_LOGE(TAG, "Control stream: RPC session ended");
+            quic_tunnel_close(ctx);
+            break;
+        }
     }
+    quic_tunnel_consume(ctx, conn->control_stream_id, parsed);
 }
 
 static int full_tunnel_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
@@ -255,63 +572,90 @@ static int full_tunnel_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
 {
     tunnel_state_t *state = (tunnel_state_t *)user_data;
 
+    if (event == QT_EVENT_LOOP_TICK) {
+        drain_proxy_completions(state);
+        redial_connections(state);
+        update_tick_interval(state);
+        return 0;
+    }
+
+    tunnel_conn_t *conn = conn_of(ctx);
+    unsigned index = ctx->conn_index;
+
     switch (event) {
     case QT_EVENT_CONNECTED: {
-        ESP_LOGI(TAG, "Connected to edge, opening control stream...");
+        ESP_LOGI(TAG, "[conn %u] Connected to edge, opening control stream...", index);
 
         /* Open bidi control stream (first client-initiated stream = 0) */
-        state->control_stream_id = quic_tunnel_open_stream(ctx, true);
-        if (state->control_stream_id == UINT64_MAX) {
-            ESP_LOGE(TAG, "Failed to open control stream");
+        conn->control_stream_id = quic_tunnel_open_stream(ctx, true);
+        if (conn->control_stream_id == UINT64_MAX) {
+            ESP_LOGE(TAG, "[conn %u] Failed to open control stream", index);
             quic_tunnel_close(ctx);
             return 0;
         }
-        ESP_LOGI(TAG, "Control stream opened: %" PRIu64, state->control_stream_id);
-
-        /* Phase 4: Encode and send RegisterConnection RPC */
-        uint8_t reg_buf[4096];
-        size_t reg_len = 0;
-
-        int ret = control_stream_encode_register(
-            &state->auth,
-            state->tunnel_id_bytes, 16,
-            0, /* connIndex = 0 */
-            &state->conn_options,
-            reg_buf, sizeof(reg_buf), &reg_len);
-
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to encode RegisterConnection");
+        ESP_LOGI(TAG, "[conn %u] Control stream opened: %" PRIu64, index,
+                 conn->control_stream_id);
+
+        /* Phase 4: RPC session, serving the edge's calls, then the
+         * RegisterConnection call */
+        rpc_transport_t transport = {
+            .reserve = ctrl_reserve,
+            .commit = ctrl_commit,
+            .arg = conn,
+        };
+        conn->rpc = rpc_session_create(&transport, state->mem);
+        if (!conn->rpc || control_stream_serve(conn->rpc) != 0) {
+            ESP_LOGE(TAG, "[conn %u] Failed to set up the control stream RPC session",
+                     index);
             quic_tunnel_close(ctx);
             return 0;
         }
 
-        ESP_LOGI(TAG, "Sending RegisterConnection (%zu bytes) on stream %" PRIu64,
-                 reg_len, state->control_stream_id);
+        ESP_LOGI(TAG, "[conn %u] Sending RegisterConnection on stream %" PRIu64,
+                 index, conn->control_stream_id);
 
-        ret = quic_tunnel_send(ctx, state->control_stream_id,
-                               reg_buf, reg_len, false);
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to send RegisterConnection");
+        /* numPreviousAttempts: the edge's view of how this connection
+         * has been retrying */
+        cf_conn_options_t options = state->conn_options;
+        options.num_previous_attempts =
+            conn->retries < UINT8_MAX ? (uint8_t)conn->retries : UINT8_MAX;
+
+        int ret = control_stream_register(
+            conn->rpc,
+            &state->auth,
+            state->tunnel_id_bytes, 16,
+            ctx->conn_index,
+            &options,
+            on_registered, conn);
+
+        if (ret < 0) {
+            ESP_LOGE(TAG, "[conn %u] Failed to send RegisterConnection", index);
             quic_tunnel_close(ctx);
             return 0;
         }
-        state->registration_sent = true;
+        conn->registration_sent = true;
         return 0;
     }
 
     case QT_EVENT_DISCONNECTED:
-        ESP_LOGI(TAG, "Disconnected from edge");
+        /* The other connections carry on; this one is replaced once the
+         * tunnel has released it. */
+        ESP_LOGW(TAG, "[conn %u] Disconnected from edge", index);
+        conn->registered = false;
+        if (!state->tunnel.stopping) {
+            conn_schedule_redial(conn);
+        }
         return 0;
 
     case QT_EVENT_STREAM_OPENED_REMOTE:
-        ESP_LOGI(TAG, "Edge opened data stream %" PRIu64, stream_id);
+        ESP_LOGI(TAG, "[conn %u] Edge opened data stream %" PRIu64, index, stream_id);
         return 0;
 
     case QT_EVENT_STREAM_DATA:
-        if (stream_id == state->control_stream_id) {
-            ESP_LOGI(TAG, "Control stream data: %zu new bytes", len);
+        if (stream_id == conn->control_stream_id) {
+            ESP_LOGI(TAG, "[conn %u] Control stream data: %zu new bytes", index, len);
             /* Try to parse complete messages from accumulated buffer */
-            try_parse_control_messages(ctx, state);
+            try_parse_control_messages(ctx, conn);
         } else {
             /* Phase 5+6: Try to handle data stream as soon as we have a
              * complete ConnectRequest. Don't wait for FIN — the edge keeps
@@ -321,9 +665,10 @@ static int full_tunnel_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
         return 0;
 
     case QT_EVENT_STREAM_FIN:
-        if (stream_id == state->control_stream_id) {
-            ESP_LOGI(TAG, "Control stream FIN (unexpected), parsing remaining...");
-            try_parse_control_messages(ctx, state);
+        if (stream_id == conn->control_stream_id) {
+            ESP_LOGI(TAG, "[conn %u] Control stream FIN (unexpected), parsing remaining...",
+                     index);
+            try_parse_control_messages(ctx, conn);
         } else {
             /* Data stream FIN: try to handle if not yet done */
             try_handle_data_stream(ctx, stream_id, state);
@@ -335,6 +680,284 @@ static int full_tunnel_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
     }
 }
 
+/* qt_release_cb_t for buffers handed to the send queue. */
+static void release_pool_buf(void *arg, uint8_t *data)
+{
+    mem_pool_put((mem_pool_t *)arg, data);
+}
+
+static void release_heap_buf(void *arg, uint8_t *data)
+{
+    (void)arg;
+    free(data);
+}
+
+/*
+ * Encode the ConnectResponse for an origin response head and queue it on
+ * the data stream, followed by the buffered body if the response has one.
+ * The response is encoded straight into the stream's send queue, sized
+ * exactly, and the body is handed over without copying; it is taken out of
+ * `http_resp` (a static body is only borrowed).  The stream is left open;
+ * the caller sends the streamed body and FIN.
+ */
+static int send_connect_response(quic_tunnel_ctx_t *ctx, uint64_t stream_id,
+                                 cf_http_response_t *http_resp)
+{
+    cf_connect_response_t connect_resp = { .error = "" };
+    cf_metadata_init(&connect_resp.metadata, ctx->mem);
+
+    ESP_LOGI(TAG, "  Origin response: %d (%zu bytes buffered body, %zu headers)",
+             http_resp->status_code, http_resp->body_len, http_resp->headers.count);
+
+    int ret = data_stream_build_http_metadata(http_resp->status_code,
+                                              &http_resp->headers,
+                                              &connect_resp);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to build ConnectResponse metadata");
+        goto cleanup;
+    }
+
+    size_t resp_len = data_stream_response_size(&connect_resp);
+    uint8_t *resp_buf = quic_tunnel_send_reserve(ctx, stream_id, resp_len);
+    if (!resp_buf) {
+        ESP_LOGE(TAG, "No room to queue a %zu-byte ConnectResponse", resp_len);
+        ret = -1;
+        goto cleanup;
+    }
+    ret = data_stream_build_response(&connect_resp, resp_buf, resp_len, &resp_len);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to build ConnectResponse");
+        goto cleanup;
+    }
+
+    ESP_LOGI(TAG, "  Sending ConnectResponse: %zu bytes", resp_len);
+    ret = quic_tunnel_send_commit(ctx, stream_id, resp_len, false);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to send ConnectResponse header");
+        goto cleanup;
+    }
+
+    if (http_resp->body && http_resp->body_len > 0) {
+        ESP_LOGI(TAG, "  Sending response body: %zu bytes", http_resp->body_len);
+        if (http_resp->body_static) {
+            ret = quic_tunnel_send_owned(ctx, stream_id, http_resp->body,
+                                         http_resp->body_len, NULL, NULL, false);
+        } else {
+            ret = quic_tunnel_send_owned(ctx, stream_id, http_resp->body,
+                                         http_resp->body_len,
+                                         release_heap_buf, NULL, false);
+        }
+        http_resp->body = NULL;
+        http_resp->body_len = 0;
+        http_resp->body_static = false;
+        if (ret != 0) {
+            ESP_LOGE(TAG, "Failed to send response body");
+        }
+    }
+
+cleanup:
+    cf_metadata_free(&connect_resp.metadata);
+    return ret;
+}
+
+/* ── Streaming to and from the origin (worker pool sink) ─────────── */
+
+/* Stop taking body chunks from a worker while this many bytes are
+ * already queued on the QUIC stream and not yet taken by picoquic. */
+#define STREAM_SEND_HIGH_WATER (64 * 1024)
+
+/* Body chunks at least this full are handed to the stream as they are;
+ * smaller ones are copied so that they share send segments instead of
+ * each pinning a whole chunk buffer. */
+#define STREAM_HANDOFF_MIN     (PROXY_CHUNK_SIZE / 4)
+
+/* Request body bytes buffered on a QUIC stream past which the upload is
+ * cancelled.  This is a memory limit, not backpressure.  picoquic extends
+ * MAX_STREAM_DATA as data reaches the callback rather than as we consume
+ * it, and has no hook to hold credit back, so while the origin is slow
+ * the edge keeps sending into recv_buf.  The cap sits well above the
+ * in-flight window a healthy upload reaches on each target (about one
+ * bandwidth-delay product), so only an origin that stops reading for
+ * that long gets its request cancelled.  Real flow control needs picoquic
+ * to grant credit from the consumed offset. */
+#if defined(CONFIG_IDF_TARGET_LINUX)
+#define STREAM_RECV_HIGH_WATER (64 * 1024 * 1024)
+#else
+#define STREAM_RECV_HIGH_WATER (1024 * 1024)
+#endif
+
+/* Connection carrying a job's stream, or NULL once it has dropped. */
+static quic_tunnel_ctx_t *job_conn(tunnel_state_t *state, const proxy_job_t *job)
+{
+    quic_tunnel_ctx_t *ctx = quic_tunnel_connection(&state->tunnel, job->conn_index);
+    if (!ctx || ctx->generation != job->conn_gen || ctx->disconnected) {
+        return NULL;
+    }
+    return ctx;
+}
+
+/* Move buffered request body bytes from the QUIC stream into the job's
+ * upload pipe.  Returns -1 when the stream is gone. */
+static int feed_upload(quic_tunnel_ctx_t *ctx, proxy_job_t *job)
+{
+    tunnel_state_t *state = (tunnel_state_t *)ctx->user_data;
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, job->stream_id);
+    if (sc == NULL) {
+        return -1;
+    }
+    size_t n = proxy_pool_upload(state->workers, job, sc->recv_buf,
+                                 sc->recv_len, sc->recv_fin);
+    quic_tunnel_consume(ctx, job->stream_id, n);
+    return 0;
+}
+
+static int proxy_sink_upload(void *arg, proxy_job_t *job)
+{
+    quic_tunnel_ctx_t *ctx = job_conn((tunnel_state_t *)arg, job);
+
+    if (!ctx || feed_upload(ctx, job) != 0) {
+        ESP_LOGW(TAG, "Stream %" PRIu64 " gone during upload", job->stream_id);
+        return -1;
+    }
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, job->stream_id);
+    if (sc->recv_len > STREAM_RECV_HIGH_WATER) {
+        ESP_LOGE(TAG, "Stream %" PRIu64 ": origin not taking the request body "
+                 "(%zu bytes buffered)", job->stream_id, sc->recv_len);
+        return -1;
+    }
+    return 0;
+}
+
+/* qt_stream_source_t over an origin response body in pull mode. */
+static int origin_source_ready(void *arg, size_t max, bool *fin)
+{
+    return http_proxy_pull_ready((http_proxy_stream_t *)arg, max, fin);
+}
+
+static int origin_source_read(void *arg, uint8_t *buf, size_t len)
+{
+    return http_proxy_pull_read((http_proxy_stream_t *)arg, buf, len);
+}
+
+static void origin_source_close(void *arg)
+{
+    http_proxy_close((http_proxy_stream_t *)arg);
+}
+
+static int origin_source_fd(void *arg)
+{
+    return http_proxy_pull_fd((http_proxy_stream_t *)arg);
+}
+
+static const qt_stream_source_t s_origin_source = {
+    .ready = origin_source_ready,
+    .read  = origin_source_read,
+    .close = origin_source_close,
+    .fd    = origin_source_fd,
+};
+
+static int proxy_sink_head(void *arg, proxy_job_t *job)
+{
+    quic_tunnel_ctx_t *ctx = job_conn((tunnel_state_t *)arg, job);
+
+    if (!ctx || quic_tunnel_find_stream(ctx, job->stream_id) == NULL) {
+        ESP_LOGW(TAG, "Stream %" PRIu64 " gone before origin responded",
+                 job->stream_id);
+        return -1;
+    }
+    ESP_LOGI(TAG, "Responding on data stream %" PRIu64, job->stream_id);
+    if (send_connect_response(ctx, job->stream_id, &job->resp) != 0) {
+        return -1;
+    }
+    if (job->body_stream) {
+        /* Pull mode: picoquic reads the body as it has room to send it. */
+        http_proxy_stream_t *body = job->body_stream;
+        job->body_stream = NULL;
+        return quic_tunnel_set_source(ctx, job->stream_id, &s_origin_source, body);
+    }
+    return 0;
+}
+
+static int proxy_sink_body(void *arg, proxy_job_t *job, proxy_chunk_t *chunk)
+{
+    quic_tunnel_ctx_t *ctx = job_conn((tunnel_state_t *)arg, job);
+
+    if (!ctx || quic_tunnel_find_stream(ctx, job->stream_id) == NULL) {
+        return -1;
+    }
+    if (quic_tunnel_send_pending(ctx, job->stream_id) >= STREAM_SEND_HIGH_WATER) {
+        return 1;
+    }
+    ESP_LOGD(TAG, "  Stream %" PRIu64 ": forwarding %zu body bytes",
+             job->stream_id, chunk->len);
+    int ret;
+    if (chunk->len >= STREAM_HANDOFF_MIN) {
+        /* Chunk buffers come from the same pool as ctx->mem. */
+        uint8_t *buf = chunk->buf;
+        chunk->buf = NULL;
+        ret = quic_tunnel_send_owned(ctx, job->stream_id, buf, chunk->len,
+                                     release_pool_buf, ctx->mem, false);
+    } else {
+        ret = quic_tunnel_send(ctx, job->stream_id, chunk->buf, chunk->len, false);
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+static void proxy_sink_end(void *arg, proxy_job_t *job, proxy_end_t how)
+{
+    quic_tunnel_ctx_t *ctx = job_conn((tunnel_state_t *)arg, job);
+    if (!ctx) {
+        return;
+    }
+
+    stream_ctx_t *sc = quic_tunnel_find_stream(ctx, job->stream_id);
+    if (sc == NULL) {
+        return;
+    }
+    sc->app_data = NULL;
+
+    /* Done with the request side, like cloudflared closing the stream
+     * after the response: refuse any body the origin did not take.
+     * No-op when the edge has already sent FIN. */
+    quic_tunnel_stop_sending(ctx, job->stream_id, 0);
+
+    if (how == PROXY_END_CANCELLED) {
+        quic_tunnel_reset_stream(ctx, job->stream_id, 0);
+        return;
+    }
+    if (how == PROXY_END_TRUNCATED) {
+        /* The edge already has the head; a FIN would look like a
+         * complete (truncated) body. */
+        ESP_LOGE(TAG, "Origin body cut short on stream %" PRIu64, job->stream_id);
+        quic_tunnel_reset_stream(ctx, job->stream_id, 0);
+        return;
+    }
+    sc = quic_tunnel_find_stream(ctx, job->stream_id);
+    if (sc == NULL || sc->source != NULL) {
+        /* Gone, or the body source sends the FIN once the origin is
+         * drained. */
+        return;
+    }
+    ESP_LOGI(TAG, "  Stream %" PRIu64 ": response complete, sending FIN",
+             job->stream_id);
+    quic_tunnel_send(ctx, job->stream_id, NULL, 0, true);
+}
+
+static const proxy_sink_t s_proxy_sink = {
+    .on_upload = proxy_sink_upload,
+    .on_head = proxy_sink_head,
+    .on_body = proxy_sink_body,
+    .on_end  = proxy_sink_end,
+};
+
+/* Refuse a request that cannot be proxied: close both halves of the
+ * stream so its context is freed now rather than when the edge gives up. */
+static void abort_data_stream(quic_tunnel_ctx_t *ctx, uint64_t stream_id)
+{
+    quic_tunnel_stop_sending(ctx, stream_id, 0);
+    quic_tunnel_reset_stream(ctx, stream_id, 0);
+}
+
 /*
  * Try to process a data stream from the edge.
  *
@@ -345,17 +968,28 @@ static int full_tunnel_event_cb(quic_tunnel_ctx_t *ctx, qt_event_t event,
  * The accumulated buffer contains:
  *   [6-byte signature][2-byte version][Cap'n Proto ConnectRequest][HTTP body...]
  *
- * We parse the ConnectRequest, proxy to the local origin, build a
- * ConnectResponse, and send it back on the same stream with FIN.
+ * We parse the ConnectRequest and hand it to the origin worker pool; the
+ * ConnectResponse is sent as soon as the origin's response head is in,
+ * and the body is streamed behind it (see s_proxy_sink).  A request body
+ * is moved from recv_buf into the job's upload pipe as it arrives, here
+ * and on every pump.  Without workers the origin is called inline with
+ * whatever body bytes are already buffered, and the whole response is
+ * buffered.
  */
 static void try_handle_data_stream(quic_tunnel_ctx_t *ctx,
                                    uint64_t stream_id,
                                    tunnel_state_t *state)
 {
-    (void)state;
-
     stream_ctx_t *sc = quic_tunnel_find_stream(ctx, stream_id);
-    if (!sc || sc->request_handled) {
+    if (!sc) {
+        return;
+    }
+    if (sc->request_handled) {
+        if (sc->app_data) {
+            feed_upload(ctx, (proxy_job_t *)sc->app_data);
+        } else {
+            quic_tunnel_consume(ctx, stream_id, sc->recv_len);
+        }
         return;
     }
 
@@ -365,36 +999,69 @@ static void try_handle_data_stream(quic_tunnel_ctx_t *ctx,
     }
 
     sc->request_handled = true;
+    if (req_hdr_size == CAPNP_WIRE_INVALID) {
+        ESP_LOGE(TAG, "Malformed ConnectRequest framing on stream %" PRIu64,
+                 stream_id);
+        abort_data_stream(ctx, stream_id);
+        return;
+    }
 
     ESP_LOGI(TAG, "Processing data stream %" PRIu64 " (%zu bytes received, hdr=%zu)",
              stream_id, sc->recv_len, req_hdr_size);
 
-    /* Heap-allocate to avoid blowing the ESP32 task stack.
-     * Each struct contains CF_MAX_METADATA * sizeof(cf_metadata_t) ≈ 5 KB. */
-    cf_connect_request_t *req = calloc(1, sizeof(*req));
-    cf_http_response_t *http_resp = calloc(1, sizeof(*http_resp));
-    cf_connect_response_t *connect_resp = calloc(1, sizeof(*connect_resp));
-    uint8_t *resp_buf = malloc(4096);
-    if (!req || !http_resp || !connect_resp || !resp_buf) {
+    /* Validate in place first: a malformed request costs no job. */
+    capnp_connect_request_view_t view;
+    if (data_stream_view_request(sc->recv_buf, req_hdr_size, &view) != 0) {
+        ESP_LOGE(TAG, "Failed to parse ConnectRequest on stream %" PRIu64, stream_id);
+        abort_data_stream(ctx, stream_id);
+        return;
+    }
+
+    proxy_job_t *job = proxy_pool_job_alloc(state->workers);
+    if (!job) {
         ESP_LOGE(TAG, "Out of memory handling data stream");
-        free(req); free(http_resp); free(connect_resp); free(resp_buf);
+        abort_data_stream(ctx, stream_id);
         return;
     }
+    job->stream_id = stream_id;
+    job->conn_index = ctx->conn_index;
+    job->conn_gen = ctx->generation;
 
-    int ret = data_stream_parse_request(sc->recv_buf, sc->recv_len, req);
+    int ret = capnp_connect_request_copy(&view, &job->req);
     if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to parse ConnectRequest on stream %" PRIu64, stream_id);
-        goto cleanup;
+        ESP_LOGE(TAG, "Out of memory copying ConnectRequest on stream %" PRIu64,
+                 stream_id);
+        proxy_pool_release(state->workers, job);
+        abort_data_stream(ctx, stream_id);
+        return;
     }
 
-    const char *method = data_stream_get_method(req);
-    const char *host = data_stream_get_host(req);
+    const char *method = data_stream_get_method(&job->req);
+    const char *host = data_stream_get_host(&job->req);
     ESP_LOGI(TAG, "  Request: %s %s (host=%s, type=%d, %zu metadata)",
              method ? method : "?",
-             req->dest,
+             cf_metadata_str(&job->req.metadata, job->req.dest),
              host ? host : "?",
-             (int)req->type,
-             req->metadata_count);
+             (int)job->req.type,
+             job->req.metadata.count);
+
+    if (state->workers) {
+        quic_tunnel_consume(ctx, stream_id, req_hdr_size);
+        bool upload = http_proxy_request_framing(&job->req, NULL) != HTTP_BODY_NONE;
+        if (proxy_pool_submit(state->workers, job, upload) != 0) {
+            /* The job is released */
+            abort_data_stream(ctx, stream_id);
+            return;
+        }
+        if (upload) {
+            sc->app_data = job;
+            feed_upload(ctx, job);
+        } else {
+            quic_tunnel_consume(ctx, stream_id, sc->recv_len);
+        }
+        update_tick_interval(state);
+        return;
+    }
 
     const uint8_t *body = NULL;
     size_t body_len = 0;
@@ -404,58 +1071,46 @@ static void try_handle_data_stream(quic_tunnel_ctx_t *ctx,
         ESP_LOGI(TAG, "  Request body: %zu bytes", body_len);
     }
 
-    ret = http_proxy_forward(req, body, body_len, http_resp);
+    ret = http_proxy_forward(&job->req, body, body_len, &job->resp);
     if (ret != 0) {
         ESP_LOGE(TAG, "HTTP proxy forward failed");
-        http_resp->status_code = 502;
+        job->resp.status_code = 502;
     }
-
-    ESP_LOGI(TAG, "  Origin response: %d (%zu bytes body, %zu headers)",
-             http_resp->status_code, http_resp->body_len, http_resp->header_count);
-
-    data_stream_build_http_metadata(http_resp->status_code,
-                                    http_resp->headers,
-                                    http_resp->header_count,
-                                    connect_resp);
-
-    size_t resp_len = 0;
-    ret = data_stream_build_response(connect_resp, resp_buf, 4096, &resp_len);
-    if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to build ConnectResponse");
-        goto cleanup;
-    }
-
-    ESP_LOGI(TAG, "  Sending ConnectResponse: %zu bytes", resp_len);
-    ret = quic_tunnel_send(ctx, stream_id, resp_buf, resp_len, false);
-    if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to send ConnectResponse header");
-        goto cleanup;
-    }
-
-    if (http_resp->body && http_resp->body_len > 0) {
-        ESP_LOGI(TAG, "  Sending response body: %zu bytes + FIN", http_resp->body_len);
-        ret = quic_tunnel_send(ctx, stream_id,
-                               http_resp->body, http_resp->body_len, true);
+    quic_tunnel_stop_sending(ctx, stream_id, 0);
+    if (send_connect_response(ctx, stream_id, &job->resp) == 0) {
+        ESP_LOGI(TAG, "  Sending FIN");
+        quic_tunnel_send(ctx, stream_id, NULL, 0, true);
     } else {
-        ESP_LOGI(TAG, "  Sending FIN (no body)");
-        ret = quic_tunnel_send(ctx, stream_id, NULL, 0, true);
+        quic_tunnel_reset_stream(ctx, stream_id, 0);
     }
+    proxy_pool_release(state->workers, job);
+}
 
-    if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to send response body/FIN");
+/* proxy_pool_set_wake() hook, on worker threads. */
+static void wake_loop(void *arg)
+{
+    quic_tunnel_wake((quic_tunnel_t *)arg);
+}
+
+/*
+ * Forward whatever the origin workers have produced (response heads and
+ * body chunks) to the QUIC streams of whichever connection carries each.
+ * Runs on every packet-loop tick; workers wake the loop when they have
+ * something (see proxy_pool_set_wake).
+ */
+static void drain_proxy_completions(tunnel_state_t *state)
+{
+    if (!state->workers) {
+        return;
     }
 
-cleanup:
-    http_proxy_free_response(http_resp);
-    free(req);
-    free(http_resp);
-    free(connect_resp);
-    free(resp_buf);
+    proxy_pool_pump(state->workers, &s_proxy_sink, state);
 }
 
 static int full_tunnel(const char *edge_server, uint16_t port)
 {
-    ESP_LOGI(TAG, "=== Full Tunnel: %s:%u ===", edge_server, port);
+    ESP_LOGI(TAG, "=== Full Tunnel: %s:%u ===",
+             edge_server ? edge_server : "edge regions", port);
 
     /* Read credentials from environment variables or auto-provision */
     const char *tunnel_id_str = getenv("CF_TUNNEL_ID");
@@ -463,8 +1118,9 @@ static int full_tunnel(const char *edge_server, uint16_t port)
     const char *secret_b64 = getenv("CF_TUNNEL_SECRET");
     const char *origin_url = getenv("CF_ORIGIN_URL");
 
-    /* Initialize state */
-    tunnel_state_t state = {0};
+    /* Initialize state (static: too big for the main task's stack) */
+    static tunnel_state_t state;
+    memset(&state, 0, sizeof(state));
 
     static quick_tunnel_result_t qt; /* static: strings used as pointers later */
 
@@ -534,41 +1190,121 @@ static int full_tunnel(const char *edge_server, uint16_t port)
     state.conn_options.compression_quality = 0;
     state.conn_options.num_previous_attempts = 0;
 
+    /* Phase 6: Buffer pool shared by the connection, proxy and workers */
+    state.mem = mem_pool_create();
+    if (!state.mem) {
+        ESP_LOGW(TAG, "Buffer pool unavailable, using the heap directly");
+    }
+
     /* Phase 6: Initialize HTTP proxy */
     ESP_LOGI(TAG, "Origin: %s", origin_url);
+    int max_idle = DEFAULT_ORIGIN_MAX_IDLE;
+    const char *idle_env = getenv("CF_ORIGIN_MAX_IDLE");
+    if (idle_env && idle_env[0]) {
+        max_idle = atoi(idle_env);
+    }
+    int dns_refresh_s = 60;
+    const char *dns_env = getenv("CF_ORIGIN_DNS_REFRESH");
+    if (dns_env && dns_env[0] && atoi(dns_env) > 0) {
+        dns_refresh_s = atoi(dns_env);
+    }
     http_proxy_config_t proxy_cfg = {
         .origin_url = origin_url,
         .connect_timeout_ms = 5000,
         .read_timeout_ms = 30000,
+        .mem_pool = state.mem,
+        .max_idle_conns = max_idle,
+        .idle_timeout_ms = 30000,
+        .dns_refresh_ms = dns_refresh_s * 1000,
     };
     if (http_proxy_init(&proxy_cfg) != 0) {
         ESP_LOGE(TAG, "Failed to initialize HTTP proxy");
+        mem_pool_destroy(state.mem);
         return -1;
     }
 
+    /* Phase 6: Origin worker pool */
+    int num_workers = DEFAULT_PROXY_WORKERS;
+    const char *workers_env = getenv("CF_PROXY_WORKERS");
+    if (workers_env && workers_env[0]) {
+        num_workers = atoi(workers_env);
+    }
+    if (num_workers > 0) {
+        state.workers = proxy_pool_create(num_workers, state.mem);
+        if (!state.workers) {
+            ESP_LOGW(TAG, "Worker pool unavailable, proxying inline");
+        }
+    }
+    const char *pull_env = getenv("CF_PULL_BODIES");
+    if (state.workers && !(pull_env && strcmp(pull_env, "0") == 0)) {
+        proxy_pool_set_pull(state.workers, true);
+    }
+
+    /* Phase 3: Edge regions and HA connections */
+    state.num_conns = DEFAULT_HA_CONNECTIONS;
+    const char *ha_env = getenv("CF_HA_CONNECTIONS");
+    if (ha_env && ha_env[0] && atoi(ha_env) > 0) {
+        state.num_conns = (size_t)atoi(ha_env);
+    }
+    if (state.num_conns > QT_MAX_CONNECTIONS) {
+        state.num_conns = QT_MAX_CONNECTIONS;
+    }
+    edge_ip_version_t ip_version = EDGE_IP_AUTO;
+    const char *ipv_env = getenv("CF_EDGE_IP_VERSION");
+    if (ipv_env && (strcmp(ipv_env, "4") == 0 || strcmp(ipv_env, "6") == 0)) {
+        ip_version = (edge_ip_version_t)atoi(ipv_env);
+    }
+
+    int ret = edge_discovery_resolve(&state.edges, edge_server, port, ip_version);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to resolve the edge");
+        goto cleanup;
+    }
+    ESP_LOGI(TAG, "HA: %zu connection(s) over %zu region(s)",
+             state.num_conns, state.edges.num_regions);
+
     /* Phase 3: Connect QUIC */
-    quic_tunnel_ctx_t ctx = {0};
     quic_tunnel_config_t config = {
-        .edge_server = edge_server,
-        .edge_port = port,
+        .max_connections = state.num_conns,
+        .local_af = edge_addrs_family(&state.edges),
         .event_cb = full_tunnel_event_cb,
         .user_data = &state,
+        .mem_pool = state.mem,
     };
-
-    int ret = quic_tunnel_connect(&ctx, &config);
+    ret = quic_tunnel_init(&state.tunnel, &config);
     if (ret != 0) {
-        ESP_LOGE(TAG, "Failed to initiate connection: %d", ret);
-        http_proxy_cleanup();
-        return ret;
+        ESP_LOGE(TAG, "Failed to create the QUIC context: %d", ret);
+        goto cleanup;
+    }
+    if (state.workers) {
+        proxy_pool_set_wake(state.workers, wake_loop, &state.tunnel);
+    }
+    for (size_t i = 0; i < state.num_conns; i++) {
+        state.conns[i].state = &state;
+        state.conns[i].index = (uint8_t)i;
+        conn_dial(&state, (uint8_t)i);
     }
+    update_tick_interval(&state);
 
-    /* Run the packet loop (blocks until disconnect) */
-    ret = quic_tunnel_run(&ctx);
+    /* Run the packet loop (blocks until the tunnel is stopped) */
+    ret = quic_tunnel_run(&state.tunnel);
     ESP_LOGI(TAG, "Tunnel exited: %d", ret);
 
-    quic_tunnel_free(&ctx);
+    for (size_t i = 0; i < state.num_conns; i++) {
+        conn_end_session(&state.conns[i]);
+    }
+    log_reconnect_stats(&state.reconnects);
+    proxy_pool_destroy(state.workers);
+    quic_tunnel_free(&state.tunnel);
     http_proxy_cleanup();
+    mem_pool_destroy(state.mem);
     return 0;
+
+cleanup:
+    proxy_pool_destroy(state.workers);
+    http_proxy_cleanup();
+    mem_pool_destroy(state.mem);
+    return ret;
 }
 
 /* ── Entry point ───────────────────────────────────────────────────── */
@@ -582,7 +1318,7 @@ void app_main(void)
     ESP_ERROR_CHECK(example_connect());
     #endif
 
-    const char *edge = CF_EDGE_SRV_HOST;
+    const char *edge = NULL;    /* Both edge regions */
     uint16_t port = CF_EDGE_PORT;
 
     const char *mode_env = "full";
@@ -597,7 +1333,8 @@ void app_main(void)
         port = (uint16_t)atoi(port_env);
     }
 
-    ESP_LOGI(TAG, "Cloudflare Tunnel starting (edge=%s, port=%u)", edge, port);
+    ESP_LOGI(TAG, "Cloudflare Tunnel starting (edge=%s, port=%u)",
+             edge ? edge : EDGE_REGION1_HOST "," EDGE_REGION2_HOST, port);
 
     if (mode_env && strcmp(mode_env, "full") == 0) {
         full_tunnel(edge, port);
@@ -11,7 +11,6 @@
 /* ── Cloudflare edge constants ─────────────────────────────────── */
 #define CF_EDGE_SNI       "quic.cftunnel.com"
 #define CF_EDGE_ALPN      "argotunnel"
-#define CF_EDGE_SRV_HOST  "region1.v2.argotunnel.com"
 #define CF_EDGE_PORT      7844
 
 /* ── Data stream protocol constants ─────────────────────────────── */
@@ -63,11 +62,10 @@ typedef struct {
     char uuid[64];               /* Connection UUID as hex string */
     char location[32];           /* Airport code e.g. "SJC" */
     bool tunnel_is_remote;
-    bool is_bootstrap;            /* True if this is the Bootstrap Return (skip) */
     /* Error fields (if !success) */
     char error[256];
     int64_t retry_after_ns;
-    bool should_retry;
+    bool should_retry;           /* False only when the edge's ConnectionError says so */
 } cf_registration_result_t;
 
 /* ── ConnectRequest (incoming from edge, Phase 5) ───────────────── */
@@ -77,25 +75,42 @@ typedef enum {
     CF_CONN_TYPE_TCP       = 2,
 } cf_connection_type_t;
 
+/* A string in a metadata arena: `len` bytes at offset `off`, followed
+ * by a NUL so that it can also be used as a C string. */
 typedef struct {
-    char key[64];
-    char val[256];
+    uint32_t off;
+    uint32_t len;
+} cf_span_t;
+
+typedef struct {
+    cf_span_t key;
+    cf_span_t val;
 } cf_metadata_t;
 
-#define CF_MAX_METADATA 16
+/* Metadata entries of one message, with every string in a per-list bump
+ * arena, so neither the number of entries nor their lengths are limited
+ * (see cf_metadata.h).  A zero-initialised list is empty and allocates
+ * from the heap; cf_metadata_init() points it at a buffer pool. */
+typedef struct {
+    struct mem_pool *mem;       /* Backing buffers (NULL = heap) */
+    char *arena;                /* Strings, each NUL-terminated */
+    size_t arena_len;
+    size_t arena_cap;
+    cf_metadata_t *items;
+    size_t count;
+    size_t cap;
+} cf_metadata_list_t;
 
 typedef struct {
-    char dest[256];
+    cf_span_t dest;             /* In metadata's arena */
     cf_connection_type_t type;
-    cf_metadata_t metadata[CF_MAX_METADATA];
-    size_t metadata_count;
+    cf_metadata_list_t metadata;
 } cf_connect_request_t;
 
 /* ── ConnectResponse (outgoing to edge, Phase 5) ────────────────── */
 typedef struct {
     char error[128];
-    cf_metadata_t metadata[CF_MAX_METADATA];
-    size_t metadata_count;
+    cf_metadata_list_t metadata;
 } cf_connect_response_t;
 
 /* ── HTTP proxy response (Phase 6) ──────────────────────────────── */
@@ -103,6 +118,6 @@ typedef struct {
     int status_code;
     uint8_t *body;
     size_t body_len;
-    cf_metadata_t headers[CF_MAX_METADATA];
-    size_t header_count;
+    bool body_static;           /* body is long-lived: borrow it, never free */
+    cf_metadata_list_t headers; /* Origin response headers */
 } cf_http_response_t;